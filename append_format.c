@@ -10,17 +10,5764 @@ See LICENSE.txt for full license text.
 #define _CRT_NONSTDC_NO_DEPRECATE
 #define _CRT_SECURE_NO_WARNINGS
 
+/* mremap for af_mmap */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #ifdef _CRTDBG_MAP_ALLOC
 #include <crtdbg.h>
 #endif
 
-#include "append_format.h"
+#include "append_format.h"
+
+#include <float.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+/* SSE2 is always available on x86-64 and can be enabled on x86. AVX2 is
+   detected at runtime. Define AF_NO_SIMD to use only the scalar code. */
+#if !defined(AF_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define AF_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define AF_HAVE_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#elif (defined(__GNUC__) && \
+       (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) || \
+      defined(__clang__)
+#define AF_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+/* Atomic operations for af_shared and af_defer. GCC and clang have atomic
+   builtins, and MSVC has the Interlocked intrinsics. Plain loads and stores
+   wouldn't be thread safe so other compilers aren't supported. */
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#ifdef _WIN64
+#define AF_INTERLOCKED_SIZE(name) name##64
+typedef __int64 af_interlocked_size;
+#else
+#define AF_INTERLOCKED_SIZE(name) name
+typedef long af_interlocked_size;
+#endif
+#elif (defined(__GNUC__) && \
+       (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))) || \
+      defined(__clang__)
+#define AF_HAVE_ATOMIC_BUILTINS
+#else
+#error "append_format needs the atomic builtins of GCC 4.7+ or clang, or MSVC"
+#endif
+
+/* Threads for af_shared and af_thread_buf */
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(_POSIX_VERSION) || defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#include <sched.h>
+#define AF_HAVE_PTHREAD
+#endif
+
+/* File descriptors for af_sink */
+#ifdef _WIN32
+#include <io.h>
+#elif defined(AF_HAVE_PTHREAD)
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define AF_HAVE_WRITEV
+#endif
+
+/* Memory mappings for af_mmap */
+#if defined(__linux__) && !defined(AF_NO_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
+#define AF_HAVE_MREMAP
+#endif
+
+/* The usable size of a C runtime allocation, for AF_USE_USABLE_SIZE */
+#ifndef AF_NO_USABLE_SIZE
+#if defined(_WIN32)
+#include <malloc.h>
+#define af_usable_size(ptr) _msize(ptr)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define af_usable_size(ptr) malloc_size(ptr)
+#elif defined(__GLIBC__) || defined(__linux__) || defined(__FreeBSD__)
+#include <malloc.h>
+#define af_usable_size(ptr) malloc_usable_size(ptr)
+#endif
+#endif
+
+/* C89 compilers may not have va_copy */
+#ifndef va_copy
+#ifdef __va_copy
+#define va_copy(dst, src) __va_copy(dst, src)
+#else
+#define va_copy(dst, src) ((dst) = (src))
+#endif
+#endif
+
+/* Instrumentation counters. See af_stats_snapshot. */
+#ifdef AF_ENABLE_STATS
+static void af_stats_add(size_t offset, size_t n);
+static void af_stats_fragment(size_t len);
+#define AF_STAT_ADD(field, n) af_stats_add(offsetof(af_stats, field), (n))
+#define AF_STAT_FRAGMENT(len) af_stats_fragment(len)
+#else
+#define AF_STAT_ADD(field, n) ((void)0)
+#define AF_STAT_FRAGMENT(len) ((void)0)
+#endif
+
+/* The growth policy for af_buf. See af_set_growth_policy. */
+static unsigned growth_percent = AF_GROWTH_DEFAULT_PERCENT;
+static size_t growth_min_step = AF_GROWTH_DEFAULT_MIN_STEP;
+static size_t growth_max_step = AF_GROWTH_DEFAULT_MAX_STEP;
+
+/* set the growth policy used when an af_buf has to be reallocated
+
+When an af_buf needs more space its capacity is grown by a step of percent% of
+the current capacity minus 100%, so 200 doubles it and 150 grows it by half.
+The step is then clamped to at least min_step and, if max_step is not 0, to at
+most max_step. If that's still not enough for the append then the capacity is
+grown to exactly the size needed. percent 100 and min_step 0 disable geometric
+growth so every append reallocates to exactly the size needed.
+
+The policy is process-wide and isn't synchronized, so it should be set before
+any af_buf is used by multiple threads.
+
+success: 0
+failure: -1: percent < 100 or max_step != 0 and max_step < min_step
+*/
+int af_set_growth_policy(unsigned percent, size_t min_step, size_t max_step)
+{
+  if(percent < 100 || (max_step && max_step < min_step))
+    return -1;
+
+  growth_percent = percent;
+  growth_min_step = min_step;
+  growth_max_step = max_step;
+  return 0;
+}
+
+/* return the capacity an af_buf of capacity cap should grow to so that it can
+   hold at least needed bytes */
+static size_t af_grow_capacity(size_t cap, size_t needed)
+{
+  size_t step, newcap;
+  unsigned extra = growth_percent - 100;
+
+  /* cap * extra / 100 without overflow */
+  if(extra && cap / 100 > (size_t)-1 / extra)
+    step = (size_t)-1;
+  else
+    step = (cap / 100) * extra + (cap % 100) * extra / 100;
+
+  if(step < growth_min_step)
+    step = growth_min_step;
+  if(growth_max_step && step > growth_max_step)
+    step = growth_max_step;
+
+  newcap = cap + step;
+  if(newcap < cap || newcap < needed)
+    newcap = needed;
+
+  return newcap;
+}
+
+/* The size of the stack buffer used for the first formatting pass when the
+   spare capacity of the string is smaller. Most appends are shorter than this
+   so they are formatted only once. */
+#ifndef AF_SCRATCH_SIZE
+#define AF_SCRATCH_SIZE 256
+#endif
+
+/* format into dest like vsnprintf
+
+success: the length of the formatted output. if that is >= destsize then the
+         output was truncated.
+failure: -1
+*/
+static int af_vsnprintf(char *dest, size_t destsize, const char *format,
+                        va_list args)
+{
+  int count;
+#ifdef _WIN32
+  /* _vsnprintf returns -1 if the output was truncated */
+  va_list args_copy;
+  va_copy(args_copy, args);
+  count = _vsnprintf(dest, destsize, format, args);
+  if(count < 0 || (size_t)count == destsize)
+    count = _vscprintf(format, args_copy);
+  va_end(args_copy);
+#else
+  count = vsnprintf(dest, destsize, format, args);
+#endif
+  return count;
+}
+
+#ifndef AF_NO_FAST_FORMAT
+/* format into dest like snprintf. see af_vsnprintf. */
+static int af_snprintf(char *dest, size_t destsize, const char *format, ...)
+{
+  int count;
+  va_list args;
+
+  va_start(args, format);
+  count = af_vsnprintf(dest, destsize, format, args);
+  va_end(args);
+
+  return count;
+}
+
+/* The built-in formatter.
+
+vsnprintf has a lot of overhead: locale lookups, a FILE setup and a general
+purpose parser. Most format strings only use simple conversions like %s and %d,
+so those are formatted here directly. Conversions that aren't handled here,
+like floating point, are formatted one at a time by the C library. Format
+strings that can't be split into single conversions (for example, %n and
+positional arguments) are formatted entirely by the C library.
+
+The output is byte-identical to vsnprintf. Define AF_NO_FAST_FORMAT to always
+use the C library.
+*/
+
+/* conversion flags */
+#define AF_SPEC_MINUS   (1<<0)
+#define AF_SPEC_PLUS    (1<<1)
+#define AF_SPEC_SPACE   (1<<2)
+#define AF_SPEC_HASH    (1<<3)
+#define AF_SPEC_ZERO    (1<<4)
+
+/* width or precision is given by an int argument */
+#define AF_SPEC_STAR    -2
+
+/* the type of the argument of a conversion */
+enum af_argtype {
+  AF_ARG_NONE,      /* %% */
+  AF_ARG_SIGNED,    /* d i */
+  AF_ARG_UNSIGNED,  /* u o x X */
+  AF_ARG_CHAR,      /* c */
+  AF_ARG_WINT,      /* lc */
+  AF_ARG_STR,       /* s */
+  AF_ARG_WSTR,      /* ls */
+  AF_ARG_PTR,       /* p */
+  AF_ARG_DOUBLE,    /* f F e E g G a A */
+  AF_ARG_LDOUBLE    /* Lf LF Le LE Lg LG La LA */
+};
+
+/* a conversion specification parsed from a format string */
+struct af_spec {
+  unsigned flags;       /* AF_SPEC_ flags */
+  int width;            /* -1 if none, or AF_SPEC_STAR */
+  int precision;        /* -1 if none, or AF_SPEC_STAR */
+  char length;          /* 0 or one of H(hh) h l q(ll) j z t L */
+  char conv;            /* conversion specifier */
+  enum af_argtype argtype;
+  size_t len;           /* length of the specification including the % */
+};
+
+/* the argument of a conversion */
+union af_arg {
+  intmax_t i;
+  uintmax_t u;
+  double d;
+  long double ld;
+  const char *s;
+  const wchar_t *ws;
+  wint_t wc;
+  const void *p;
+};
+
+/* parse the conversion specification that p points to, which starts with %
+
+success: 0
+failure: -1: the specification isn't supported and the whole format should be
+             formatted by the C library
+*/
+static int af_parse_spec(const char *p, struct af_spec *spec)
+{
+  const char *start = p;
+
+  spec->flags = 0;
+  spec->width = -1;
+  spec->precision = -1;
+  spec->length = 0;
+
+  for(++p; ; ++p) {
+    if(*p == '-')
+      spec->flags |= AF_SPEC_MINUS;
+    else if(*p == '+')
+      spec->flags |= AF_SPEC_PLUS;
+    else if(*p == ' ')
+      spec->flags |= AF_SPEC_SPACE;
+    else if(*p == '#')
+      spec->flags |= AF_SPEC_HASH;
+    else if(*p == '0')
+      spec->flags |= AF_SPEC_ZERO;
+    else
+      break;
+  }
+
+  if(*p == '*') {
+    spec->width = AF_SPEC_STAR;
+    ++p;
+  }
+  else if('1' <= *p && *p <= '9') {
+    spec->width = 0;
+    for(; '0' <= *p && *p <= '9'; ++p) {
+      if(spec->width > (INT_MAX / 2 - 9) / 10)
+        return -1;
+      spec->width = spec->width * 10 + (*p - '0');
+    }
+    /* a positional argument */
+    if(*p == '$')
+      return -1;
+  }
+
+  if(*p == '.') {
+    ++p;
+    if(*p == '*') {
+      spec->precision = AF_SPEC_STAR;
+      ++p;
+    }
+    else {
+      spec->precision = 0;
+      for(; '0' <= *p && *p <= '9'; ++p) {
+        if(spec->precision > (INT_MAX / 2 - 9) / 10)
+          return -1;
+        spec->precision = spec->precision * 10 + (*p - '0');
+      }
+    }
+  }
+
+  switch(*p) {
+  case 'h':
+    if(p[1] == 'h') {
+      spec->length = 'H';
+      ++p;
+    }
+    else
+      spec->length = 'h';
+    ++p;
+    break;
+  case 'l':
+    if(p[1] == 'l') {
+      spec->length = 'q';
+      ++p;
+    }
+    else
+      spec->length = 'l';
+    ++p;
+    break;
+  case 'j':
+  case 'z':
+  case 't':
+  case 'L':
+    spec->length = *p++;
+    break;
+  }
+
+  spec->conv = *p;
+
+  switch(*p) {
+  case 'd':
+  case 'i':
+    spec->argtype = AF_ARG_SIGNED;
+    if(spec->length == 'L')
+      return -1;
+    break;
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+    spec->argtype = AF_ARG_UNSIGNED;
+    if(spec->length == 'L')
+      return -1;
+    break;
+  case 'c':
+  case 's':
+    if(spec->length == 'l')
+      spec->argtype = (*p == 'c') ? AF_ARG_WINT : AF_ARG_WSTR;
+    else if(!spec->length)
+      spec->argtype = (*p == 'c') ? AF_ARG_CHAR : AF_ARG_STR;
+    else
+      return -1;
+    break;
+  case 'p':
+    spec->argtype = AF_ARG_PTR;
+    if(spec->length)
+      return -1;
+    break;
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    if(spec->length == 'L')
+      spec->argtype = AF_ARG_LDOUBLE;
+    else if(!spec->length || spec->length == 'l')
+      spec->argtype = AF_ARG_DOUBLE;
+    else
+      return -1;
+    break;
+  case '%':
+    spec->argtype = AF_ARG_NONE;
+    if(p != start + 1)
+      return -1;
+    break;
+  default:
+    /* %n, nonstandard conversions and the end of the format */
+    return -1;
+  }
+
+  spec->len = (size_t)(p - start) + 1;
+  return 0;
+}
+
+/* fetch the argument of a conversion and the arguments of any * width or
+   precision. spec is updated with the width and precision. */
+static void af_fetch_arg(struct af_spec *spec, union af_arg *arg,
+                         va_list *args)
+{
+  if(spec->width == AF_SPEC_STAR) {
+    spec->width = va_arg(*args, int);
+    if(spec->width < 0) {
+      spec->flags |= AF_SPEC_MINUS;
+      spec->width = (spec->width == INT_MIN) ? INT_MAX : -spec->width;
+    }
+  }
+
+  if(spec->precision == AF_SPEC_STAR) {
+    spec->precision = va_arg(*args, int);
+    if(spec->precision < 0)
+      spec->precision = -1;
+  }
+
+  switch(spec->argtype) {
+  case AF_ARG_NONE:
+    break;
+  case AF_ARG_SIGNED:
+    switch(spec->length) {
+    case 'H': arg->i = (signed char)va_arg(*args, int); break;
+    case 'h': arg->i = (short)va_arg(*args, int); break;
+    case 'l': arg->i = va_arg(*args, long); break;
+    case 'q': arg->i = va_arg(*args, long long); break;
+    case 'j': arg->i = va_arg(*args, intmax_t); break;
+    case 'z': arg->i = va_arg(*args, ptrdiff_t); break;
+    case 't': arg->i = va_arg(*args, ptrdiff_t); break;
+    default:  arg->i = va_arg(*args, int); break;
+    }
+    break;
+  case AF_ARG_UNSIGNED:
+    switch(spec->length) {
+    case 'H': arg->u = (unsigned char)va_arg(*args, unsigned); break;
+    case 'h': arg->u = (unsigned short)va_arg(*args, unsigned); break;
+    case 'l': arg->u = va_arg(*args, unsigned long); break;
+    case 'q': arg->u = va_arg(*args, unsigned long long); break;
+    case 'j': arg->u = va_arg(*args, uintmax_t); break;
+    case 'z': arg->u = va_arg(*args, size_t); break;
+    case 't': arg->u = (size_t)va_arg(*args, ptrdiff_t); break;
+    default:  arg->u = va_arg(*args, unsigned); break;
+    }
+    break;
+  case AF_ARG_CHAR:
+    arg->i = va_arg(*args, int);
+    break;
+  case AF_ARG_WINT:
+    arg->wc = va_arg(*args, wint_t);
+    break;
+  case AF_ARG_STR:
+    arg->s = va_arg(*args, const char *);
+    break;
+  case AF_ARG_WSTR:
+    arg->ws = va_arg(*args, const wchar_t *);
+    break;
+  case AF_ARG_PTR:
+    arg->p = va_arg(*args, const void *);
+    break;
+  case AF_ARG_DOUBLE:
+    arg->d = va_arg(*args, double);
+    break;
+  case AF_ARG_LDOUBLE:
+    arg->ld = va_arg(*args, long double);
+    break;
+  }
+}
+
+/* Formatted output is written to an af_out. Like snprintf the output is
+   truncated to fit the destination but its full length is counted. */
+struct af_out {
+  char *dest;
+  size_t size;    /* size of dest */
+  size_t len;     /* length of the output, which may be more than fits */
+  int error;      /* the C library failed to format a conversion */
+  int escape;     /* AF_ESCAPE_JSON or AF_ESCAPE_C to escape %s %c %ls %lc */
+  int shortest;   /* AF_SHORTEST_FLOAT was given, see af_render_shortest */
+};
+
+static void af_out_write(struct af_out *out, const char *data, size_t n)
+{
+  if(out->len < out->size) {
+    size_t avail = out->size - out->len - 1;
+    memcpy(&out->dest[out->len], data, n < avail ? n : avail);
+  }
+  out->len += n;
+}
+
+static void af_out_fill(struct af_out *out, char c, size_t n)
+{
+  if(out->len < out->size) {
+    size_t avail = out->size - out->len - 1;
+    memset(&out->dest[out->len], c, n < avail ? n : avail);
+  }
+  out->len += n;
+}
+
+static const char af_digit_pairs[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/* write the digits of v in base 10 backwards from end. return the number of
+   digits. */
+static size_t af_utoa_dec(char *end, uintmax_t v)
+{
+  char *p = end;
+  uint32_t v32;
+
+  while(v > 0xFFFFFFFFu) {
+    unsigned i = (unsigned)(v % 100) * 2;
+    v /= 100;
+    *--p = af_digit_pairs[i + 1];
+    *--p = af_digit_pairs[i];
+  }
+
+  /* the rest of the digits with cheaper 32-bit arithmetic */
+  v32 = (uint32_t)v;
+
+  while(v32 >= 100) {
+    unsigned i = (unsigned)(v32 % 100) * 2;
+    v32 /= 100;
+    *--p = af_digit_pairs[i + 1];
+    *--p = af_digit_pairs[i];
+  }
+
+  if(v32 >= 10) {
+    unsigned i = (unsigned)v32 * 2;
+    *--p = af_digit_pairs[i + 1];
+    *--p = af_digit_pairs[i];
+  }
+  else
+    *--p = (char)('0' + v32);
+
+  return (size_t)(end - p);
+}
+
+/* write the digits of v in base 8 or 16 backwards from end. return the number
+   of digits. */
+static size_t af_utoa_pow2(char *end, uintmax_t v, unsigned shift,
+                           const char *digits)
+{
+  char *p = end;
+  unsigned mask = (1u << shift) - 1;
+
+  do {
+    *--p = digits[v & mask];
+    v >>= shift;
+  } while(v);
+
+  return (size_t)(end - p);
+}
+
+/* format an integer conversion */
+static void af_render_int(struct af_out *out, const struct af_spec *spec,
+                          const union af_arg *arg)
+{
+  /* enough for the octal digits of a 128-bit integer */
+  char digits[48];
+  char *end = digits + sizeof(digits);
+  const char *prefix = "";
+  size_t prefixlen = 0, ndigits = 0, zeros = 0, total, padding = 0;
+  uintmax_t v;
+
+  if(spec->argtype == AF_ARG_SIGNED) {
+    if(arg->i < 0) {
+      v = (uintmax_t)0 - (uintmax_t)arg->i;
+      prefix = "-";
+      prefixlen = 1;
+    }
+    else {
+      v = (uintmax_t)arg->i;
+      if((spec->flags & AF_SPEC_PLUS)) {
+        prefix = "+";
+        prefixlen = 1;
+      }
+      else if((spec->flags & AF_SPEC_SPACE)) {
+        prefix = " ";
+        prefixlen = 1;
+      }
+    }
+  }
+  else
+    v = arg->u;
+
+  if(v || spec->precision) {
+    switch(spec->conv) {
+    case 'o':
+      ndigits = af_utoa_pow2(end, v, 3, "01234567");
+      break;
+    case 'x':
+      ndigits = af_utoa_pow2(end, v, 4, "0123456789abcdef");
+      break;
+    case 'X':
+      ndigits = af_utoa_pow2(end, v, 4, "0123456789ABCDEF");
+      break;
+    default:
+      ndigits = af_utoa_dec(end, v);
+      break;
+    }
+  }
+
+  if(spec->precision > 0 && (size_t)spec->precision > ndigits)
+    zeros = (size_t)spec->precision - ndigits;
+
+  if((spec->flags & AF_SPEC_HASH)) {
+    if(spec->conv == 'o') {
+      /* the first digit must be 0 */
+      if(!zeros && (!ndigits || *(end - ndigits) != '0'))
+        zeros = 1;
+    }
+    else if(v && (spec->conv == 'x' || spec->conv == 'X')) {
+      prefix = (spec->conv == 'x') ? "0x" : "0X";
+      prefixlen = 2;
+    }
+  }
+
+  total = prefixlen + zeros + ndigits;
+  if(spec->width > 0 && (size_t)spec->width > total)
+    padding = (size_t)spec->width - total;
+
+  if((spec->flags & AF_SPEC_MINUS)) {
+    af_out_write(out, prefix, prefixlen);
+    af_out_fill(out, '0', zeros);
+    af_out_write(out, end - ndigits, ndigits);
+    af_out_fill(out, ' ', padding);
+  }
+  else if((spec->flags & AF_SPEC_ZERO) && spec->precision < 0) {
+    af_out_write(out, prefix, prefixlen);
+    af_out_fill(out, '0', zeros + padding);
+    af_out_write(out, end - ndigits, ndigits);
+  }
+  else {
+    af_out_fill(out, ' ', padding);
+    af_out_write(out, prefix, prefixlen);
+    af_out_fill(out, '0', zeros);
+    af_out_write(out, end - ndigits, ndigits);
+  }
+}
+
+/* format %s or %c */
+static void af_render_chars(struct af_out *out, const struct af_spec *spec,
+                            const char *s, size_t n)
+{
+  size_t padding = 0;
+
+  if(spec->width > 0 && (size_t)spec->width > n)
+    padding = (size_t)spec->width - n;
+
+  if(!(spec->flags & AF_SPEC_MINUS))
+    af_out_fill(out, ' ', padding);
+  af_out_write(out, s, n);
+  if((spec->flags & AF_SPEC_MINUS))
+    af_out_fill(out, ' ', padding);
+}
+
+/* format a single conversion with the C library */
+static void af_render_libc(struct af_out *out, const struct af_spec *spec,
+                           const union af_arg *arg)
+{
+  /* % flags width . precision length conversion */
+  char format[1 + 5 + 12 + 1 + 12 + 1 + 1 + 1];
+  char number[12];
+  char *f = format;
+  char *dest = NULL;
+  size_t destsize = 0;
+  int count = -1;
+
+  *f++ = '%';
+  if((spec->flags & AF_SPEC_MINUS))
+    *f++ = '-';
+  if((spec->flags & AF_SPEC_PLUS))
+    *f++ = '+';
+  if((spec->flags & AF_SPEC_SPACE))
+    *f++ = ' ';
+  if((spec->flags & AF_SPEC_HASH))
+    *f++ = '#';
+  if((spec->flags & AF_SPEC_ZERO))
+    *f++ = '0';
+  if(spec->width >= 0) {
+    size_t n = af_utoa_dec(number + sizeof(number), (uintmax_t)spec->width);
+    memcpy(f, number + sizeof(number) - n, n);
+    f += n;
+  }
+  if(spec->precision >= 0) {
+    size_t n = af_utoa_dec(number + sizeof(number),
+                           (uintmax_t)spec->precision);
+    *f++ = '.';
+    memcpy(f, number + sizeof(number) - n, n);
+    f += n;
+  }
+  if(spec->argtype == AF_ARG_LDOUBLE)
+    *f++ = 'L';
+  else if(spec->argtype == AF_ARG_WINT || spec->argtype == AF_ARG_WSTR)
+    *f++ = 'l';
+  *f++ = spec->conv;
+  *f = '\0';
+
+  /* the output is written directly to the destination and truncated to fit,
+     or only measured if the destination is already full */
+  if(out->len < out->size) {
+    dest = &out->dest[out->len];
+    destsize = out->size - out->len;
+  }
+
+  switch(spec->argtype) {
+  case AF_ARG_NONE:
+    count = af_snprintf(dest, destsize, format);
+    break;
+  case AF_ARG_SIGNED:
+  case AF_ARG_UNSIGNED:
+    /* not reached, integers are always formatted by af_render_int */
+    break;
+  case AF_ARG_CHAR:
+    count = af_snprintf(dest, destsize, format, (int)arg->i);
+    break;
+  case AF_ARG_WINT:
+    count = af_snprintf(dest, destsize, format, arg->wc);
+    break;
+  case AF_ARG_STR:
+    count = af_snprintf(dest, destsize, format, arg->s);
+    break;
+  case AF_ARG_WSTR:
+    count = af_snprintf(dest, destsize, format, arg->ws);
+    break;
+  case AF_ARG_PTR:
+    count = af_snprintf(dest, destsize, format, arg->p);
+    break;
+  case AF_ARG_DOUBLE:
+    count = af_snprintf(dest, destsize, format, arg->d);
+    break;
+  case AF_ARG_LDOUBLE:
+    count = af_snprintf(dest, destsize, format, arg->ld);
+    break;
+  }
+
+  if(count < 0)
+    out->error = 1;
+  else
+    out->len += (size_t)count;
+}
+
+/* return the length of the part of s that %s formats */
+static size_t af_render_strlen(const struct af_spec *spec, const char *s)
+{
+  if(spec->precision >= 0) {
+    const char *nul = (const char *)memchr(s, '\0', (size_t)spec->precision);
+    return nul ? (size_t)(nul - s) : (size_t)spec->precision;
+  }
+
+  return strlen(s);
+}
+
+/* Strings shorter than this are scanned for bytes to escape by the scalar
+   loop */
+#define AF_ESCAPE_SIMD_MIN 16
+
+/* return nonzero if c is escaped as escape (AF_ESCAPE_JSON or AF_ESCAPE_C) */
+#define AF_ESCAPE_NEEDED(c, escape) \
+  ((unsigned char)(c) < 0x20 || (c) == '"' || (c) == '\\' || \
+   ((c) == 0x7F && (escape) == AF_ESCAPE_C))
+
+#ifdef AF_HAVE_SSE2
+/* return the index of the lowest set bit of x, which must not be 0 */
+static unsigned af_lowest_bit(unsigned x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return (unsigned)index;
+#elif defined(__GNUC__) || defined(__clang__)
+  return (unsigned)__builtin_ctz(x);
+#else
+  unsigned n = 0;
+  while(!(x & 1)) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+#endif
+
+/* return the length of the run of bytes at the start of the n bytes of s that
+   aren't escaped as escape. Usually that's all of them, so the run is scanned
+   16 bytes at a time with SSE2 unless AF_NO_SIMD is defined. */
+static size_t af_escape_span(const char *s, size_t n, int escape)
+{
+  size_t i = 0;
+
+#ifdef AF_HAVE_SSE2
+  if(n >= AF_ESCAPE_SIMD_MIN) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    /* DEL is only escaped in C, for JSON the quote is compared again */
+    const __m128i del = _mm_set1_epi8(escape == AF_ESCAPE_C ? 0x7F : '"');
+
+    for(; n - i >= 16; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(s + i));
+      /* the bytes <= 0x1F are those that are unchanged by an unsigned max */
+      __m128i hit = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+        _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, control), control),
+                     _mm_cmpeq_epi8(v, del)));
+      unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+      if(mask)
+        return i + af_lowest_bit(mask);
+    }
+  }
+#endif
+
+  while(i != n && !AF_ESCAPE_NEEDED(s[i], escape))
+    ++i;
+
+  return i;
+}
+
+/* write the escape sequence of c to seq, which must have room for 6 bytes, and
+   return its length. JSON escapes control characters without a short escape as
+   \u00XX and C escapes them as 3 octal digits, which unlike a hex escape can't
+   run into the text after it. */
+static size_t af_escape_char(unsigned char c, int escape, char *seq)
+{
+  static const char hex[] = "0123456789abcdef";
+  char e;
+
+  switch(c) {
+  case '"':  e = '"'; break;
+  case '\\': e = '\\'; break;
+  case '\b': e = 'b'; break;
+  case '\f': e = 'f'; break;
+  case '\n': e = 'n'; break;
+  case '\r': e = 'r'; break;
+  case '\t': e = 't'; break;
+  case '\a': e = (escape == AF_ESCAPE_C) ? 'a' : 0; break;
+  case '\v': e = (escape == AF_ESCAPE_C) ? 'v' : 0; break;
+  default:   e = 0; break;
+  }
+
+  seq[0] = '\\';
+
+  if(e) {
+    seq[1] = e;
+    return 2;
+  }
+
+  if(escape == AF_ESCAPE_JSON) {
+    memcpy(&seq[1], "u00", 3);
+    seq[4] = hex[c >> 4];
+    seq[5] = hex[c & 15];
+    return 6;
+  }
+
+  seq[1] = (char)('0' + (c >> 6));
+  seq[2] = (char)('0' + ((c >> 3) & 7));
+  seq[3] = (char)('0' + (c & 7));
+  return 4;
+}
+
+/* return the length of the n bytes of s escaped as escape */
+static size_t af_escaped_len(const char *s, size_t n, int escape)
+{
+  size_t len = n;
+  char seq[6];
+
+  for(;;) {
+    size_t run = af_escape_span(s, n, escape);
+    if(run == n)
+      return len;
+    len += af_escape_char((unsigned char)s[run], escape, seq) - 1;
+    s += run + 1;
+    n -= run + 1;
+  }
+}
+
+/* format %s or %c with the n bytes of s escaped as out->escape. The width is of
+   the escaped output and the 0 flag is ignored. */
+static void af_render_escaped(struct af_out *out, const struct af_spec *spec,
+                              const char *s, size_t n)
+{
+  size_t padding = 0;
+  char seq[6];
+
+  if(spec->width > 0) {
+    size_t len = af_escaped_len(s, n, out->escape);
+    if((size_t)spec->width > len)
+      padding = (size_t)spec->width - len;
+  }
+
+  if(!(spec->flags & AF_SPEC_MINUS))
+    af_out_fill(out, ' ', padding);
+
+  for(;;) {
+    size_t run = af_escape_span(s, n, out->escape);
+    af_out_write(out, s, run);
+    if(run == n)
+      break;
+    af_out_write(out, seq,
+                 af_escape_char((unsigned char)s[run], out->escape, seq));
+    s += run + 1;
+    n -= run + 1;
+  }
+
+  if((spec->flags & AF_SPEC_MINUS))
+    af_out_fill(out, ' ', padding);
+}
+
+/* format %lc or %ls with the output escaped as out->escape. The C library
+   converts the wide argument to multibyte, into the stack or if that's too
+   small the heap, and that is escaped like %s. */
+static void af_render_wide_escaped(struct af_out *out,
+                                   const struct af_spec *spec,
+                                   const union af_arg *arg)
+{
+  char stack[AF_SCRATCH_SIZE];
+  struct af_spec unpadded = *spec;
+  struct af_out mb;
+
+  /* the width is of the escaped output */
+  unpadded.width = -1;
+  unpadded.flags &= ~(AF_SPEC_MINUS | AF_SPEC_ZERO);
+
+  mb.dest = stack;
+  mb.size = sizeof(stack);
+  mb.len = 0;
+  mb.error = 0;
+  mb.escape = 0;
+  mb.shortest = 0;
+  af_render_libc(&mb, &unpadded, arg);
+
+  if(!mb.error && mb.len >= sizeof(stack)) {
+    mb.dest = (char *)malloc(mb.len + 1);
+    if(!mb.dest) {
+      out->error = 1;
+      return;
+    }
+    mb.size = mb.len + 1;
+    mb.len = 0;
+    af_render_libc(&mb, &unpadded, arg);
+  }
+
+  if(mb.error || mb.len >= mb.size)
+    out->error = 1;
+  else
+    af_render_escaped(out, spec, mb.dest, mb.len);
+
+  if(mb.dest != stack)
+    free(mb.dest);
+}
+
+/* AF_SHORTEST_FLOAT: %g and %G without a precision are formatted with the
+   shortest digits that convert back to the same double, and %f and %F are
+   formatted exactly, both without the C library so the radix character is
+   always '.'. The shortest digits are found with 64-bit integer arithmetic by
+   Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+   with Integers", 2010). It can't decide for about 0.5% of doubles, and those
+   are found with the C library by af_shortest_libc instead. */
+
+/* the largest precision of %f that is formatted by af_render_fixed */
+#define AF_FIXED_MAX_PRECISION 17
+
+/* the largest number of digits of a shortest double */
+#define AF_SHORTEST_DIGITS 17
+
+/* a floating point number f * 2^e */
+struct af_diy_fp {
+  uint64_t f;
+  int e;
+};
+
+/* 10^k for k = -348, -340, ..., 340, normalized and rounded to 64 bits. A
+   binary exponent range of 28 always has one of them. */
+static const struct {
+  uint64_t f;
+  short e;
+  short k;
+} af_cached_powers[] = {
+  { UINT64_C(0xfa8fd5a0081c0288), -1220, -348 },
+  { UINT64_C(0xbaaee17fa23ebf76), -1193, -340 },
+  { UINT64_C(0x8b16fb203055ac76), -1166, -332 },
+  { UINT64_C(0xcf42894a5dce35ea), -1140, -324 },
+  { UINT64_C(0x9a6bb0aa55653b2d), -1113, -316 },
+  { UINT64_C(0xe61acf033d1a45df), -1087, -308 },
+  { UINT64_C(0xab70fe17c79ac6ca), -1060, -300 },
+  { UINT64_C(0xff77b1fcbebcdc4f), -1034, -292 },
+  { UINT64_C(0xbe5691ef416bd60c), -1007, -284 },
+  { UINT64_C(0x8dd01fad907ffc3c), -980, -276 },
+  { UINT64_C(0xd3515c2831559a83), -954, -268 },
+  { UINT64_C(0x9d71ac8fada6c9b5), -927, -260 },
+  { UINT64_C(0xea9c227723ee8bcb), -901, -252 },
+  { UINT64_C(0xaecc49914078536d), -874, -244 },
+  { UINT64_C(0x823c12795db6ce57), -847, -236 },
+  { UINT64_C(0xc21094364dfb5637), -821, -228 },
+  { UINT64_C(0x9096ea6f3848984f), -794, -220 },
+  { UINT64_C(0xd77485cb25823ac7), -768, -212 },
+  { UINT64_C(0xa086cfcd97bf97f4), -741, -204 },
+  { UINT64_C(0xef340a98172aace5), -715, -196 },
+  { UINT64_C(0xb23867fb2a35b28e), -688, -188 },
+  { UINT64_C(0x84c8d4dfd2c63f3b), -661, -180 },
+  { UINT64_C(0xc5dd44271ad3cdba), -635, -172 },
+  { UINT64_C(0x936b9fcebb25c996), -608, -164 },
+  { UINT64_C(0xdbac6c247d62a584), -582, -156 },
+  { UINT64_C(0xa3ab66580d5fdaf6), -555, -148 },
+  { UINT64_C(0xf3e2f893dec3f126), -529, -140 },
+  { UINT64_C(0xb5b5ada8aaff80b8), -502, -132 },
+  { UINT64_C(0x87625f056c7c4a8b), -475, -124 },
+  { UINT64_C(0xc9bcff6034c13053), -449, -116 },
+  { UINT64_C(0x964e858c91ba2655), -422, -108 },
+  { UINT64_C(0xdff9772470297ebd), -396, -100 },
+  { UINT64_C(0xa6dfbd9fb8e5b88f), -369, -92 },
+  { UINT64_C(0xf8a95fcf88747d94), -343, -84 },
+  { UINT64_C(0xb94470938fa89bcf), -316, -76 },
+  { UINT64_C(0x8a08f0f8bf0f156b), -289, -68 },
+  { UINT64_C(0xcdb02555653131b6), -263, -60 },
+  { UINT64_C(0x993fe2c6d07b7fac), -236, -52 },
+  { UINT64_C(0xe45c10c42a2b3b06), -210, -44 },
+  { UINT64_C(0xaa242499697392d3), -183, -36 },
+  { UINT64_C(0xfd87b5f28300ca0e), -157, -28 },
+  { UINT64_C(0xbce5086492111aeb), -130, -20 },
+  { UINT64_C(0x8cbccc096f5088cc), -103, -12 },
+  { UINT64_C(0xd1b71758e219652c), -77, -4 },
+  { UINT64_C(0x9c40000000000000), -50, 4 },
+  { UINT64_C(0xe8d4a51000000000), -24, 12 },
+  { UINT64_C(0xad78ebc5ac620000), 3, 20 },
+  { UINT64_C(0x813f3978f8940984), 30, 28 },
+  { UINT64_C(0xc097ce7bc90715b3), 56, 36 },
+  { UINT64_C(0x8f7e32ce7bea5c70), 83, 44 },
+  { UINT64_C(0xd5d238a4abe98068), 109, 52 },
+  { UINT64_C(0x9f4f2726179a2245), 136, 60 },
+  { UINT64_C(0xed63a231d4c4fb27), 162, 68 },
+  { UINT64_C(0xb0de65388cc8ada8), 189, 76 },
+  { UINT64_C(0x83c7088e1aab65db), 216, 84 },
+  { UINT64_C(0xc45d1df942711d9a), 242, 92 },
+  { UINT64_C(0x924d692ca61be758), 269, 100 },
+  { UINT64_C(0xda01ee641a708dea), 295, 108 },
+  { UINT64_C(0xa26da3999aef774a), 322, 116 },
+  { UINT64_C(0xf209787bb47d6b85), 348, 124 },
+  { UINT64_C(0xb454e4a179dd1877), 375, 132 },
+  { UINT64_C(0x865b86925b9bc5c2), 402, 140 },
+  { UINT64_C(0xc83553c5c8965d3d), 428, 148 },
+  { UINT64_C(0x952ab45cfa97a0b3), 455, 156 },
+  { UINT64_C(0xde469fbd99a05fe3), 481, 164 },
+  { UINT64_C(0xa59bc234db398c25), 508, 172 },
+  { UINT64_C(0xf6c69a72a3989f5c), 534, 180 },
+  { UINT64_C(0xb7dcbf5354e9bece), 561, 188 },
+  { UINT64_C(0x88fcf317f22241e2), 588, 196 },
+  { UINT64_C(0xcc20ce9bd35c78a5), 614, 204 },
+  { UINT64_C(0x98165af37b2153df), 641, 212 },
+  { UINT64_C(0xe2a0b5dc971f303a), 667, 220 },
+  { UINT64_C(0xa8d9d1535ce3b396), 694, 228 },
+  { UINT64_C(0xfb9b7cd9a4a7443c), 720, 236 },
+  { UINT64_C(0xbb764c4ca7a44410), 747, 244 },
+  { UINT64_C(0x8bab8eefb6409c1a), 774, 252 },
+  { UINT64_C(0xd01fef10a657842c), 800, 260 },
+  { UINT64_C(0x9b10a4e5e9913129), 827, 268 },
+  { UINT64_C(0xe7109bfba19c0c9d), 853, 276 },
+  { UINT64_C(0xac2820d9623bf429), 880, 284 },
+  { UINT64_C(0x80444b5e7aa7cf85), 907, 292 },
+  { UINT64_C(0xbf21e44003acdd2d), 933, 300 },
+  { UINT64_C(0x8e679c2f5e44ff8f), 960, 308 },
+  { UINT64_C(0xd433179d9c8cb841), 986, 316 },
+  { UINT64_C(0x9e19db92b4e31ba9), 1013, 324 },
+  { UINT64_C(0xeb96bf6ebadf77d9), 1039, 332 },
+  { UINT64_C(0xaf87023b9bf0ee6b), 1066, 340 }
+};
+
+#define AF_CACHED_POWERS_MIN_K -348
+
+/* the 128-bit product of a and b */
+static void af_mul_64(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo)
+{
+  uint64_t a0 = a & 0xFFFFFFFFu, a1 = a >> 32;
+  uint64_t b0 = b & 0xFFFFFFFFu, b1 = b >> 32;
+  uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+  uint64_t mid = (p00 >> 32) + (p01 & 0xFFFFFFFFu) + (p10 & 0xFFFFFFFFu);
+
+  *lo = (mid << 32) | (p00 & 0xFFFFFFFFu);
+  *hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+
+/* return x * y rounded to 64 bits */
+static struct af_diy_fp af_diy_fp_mul(struct af_diy_fp x, struct af_diy_fp y)
+{
+  struct af_diy_fp r;
+  uint64_t lo;
+
+  af_mul_64(x.f, y.f, &r.f, &lo);
+  r.f += lo >> 63;
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+/* return x shifted so that the highest bit of x.f is set. x.f must not be 0. */
+static struct af_diy_fp af_diy_fp_normalize(struct af_diy_fp x)
+{
+  while(!(x.f & UINT64_C(0xFFC0000000000000))) {
+    x.f <<= 10;
+    x.e -= 10;
+  }
+  while(!(x.f & UINT64_C(0x8000000000000000))) {
+    x.f <<= 1;
+    --x.e;
+  }
+  return x;
+}
+
+/* Move the last of the len digits down while that's certainly closer to the
+   scaled double, whose distance from the top of the unsafe interval is
+   dist_high_w. rest is the distance of the digits from the top and ten_kappa
+   is the unit of the last digit, all in the same scale.
+
+   return nonzero if the digits are certainly the closest shortest ones in the
+   interval, or 0 if Grisu3 can't decide */
+static int af_grisu_round_weed(char *digits, int len, uint64_t dist_high_w,
+                               uint64_t unsafe, uint64_t rest,
+                               uint64_t ten_kappa, uint64_t unit)
+{
+  uint64_t small_dist = dist_high_w - unit;
+  uint64_t big_dist = dist_high_w + unit;
+
+  while(rest < small_dist && unsafe - rest >= ten_kappa &&
+        (rest + ten_kappa < small_dist ||
+         small_dist - rest >= rest + ten_kappa - small_dist)) {
+    --digits[len - 1];
+    rest += ten_kappa;
+  }
+
+  if(rest < big_dist && unsafe - rest >= ten_kappa &&
+     (rest + ten_kappa < big_dist ||
+      big_dist - rest > rest + ten_kappa - big_dist))
+    return 0;
+
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+/* find the shortest digits of v, which must be finite and > 0, so that v is
+   the *len digits times 10^*exp10
+
+success: nonzero
+failure: 0: Grisu3 can't decide the digits
+*/
+static int af_grisu3(double v, char *digits, int *len, int *exp10)
+{
+  struct af_diy_fp w, high, low, c;
+  uint64_t bits, frac, one, unit = 1, unsafe, rest, fractionals, dist_high_w;
+  uint32_t integrals, divisor = 1;
+  int bexp, min_e, k, i, kappa = 0, shift;
+
+  memcpy(&bits, &v, sizeof(bits));
+  frac = bits & ((UINT64_C(1) << 52) - 1);
+  bexp = (int)((bits >> 52) & 0x7FF);
+
+  if(bexp) {
+    w.f = frac | (UINT64_C(1) << 52);
+    w.e = bexp - 1075;
+  }
+  else {
+    w.f = frac;
+    w.e = -1074;
+  }
+
+  /* the boundaries halfway to the neighboring doubles. the one below is closer
+     if v is a power of 2, except the smallest normal */
+  high.f = (w.f << 1) + 1;
+  high.e = w.e - 1;
+  high = af_diy_fp_normalize(high);
+  if(!frac && bexp > 1) {
+    low.f = (w.f << 2) - 1;
+    low.e = w.e - 2;
+  }
+  else {
+    low.f = (w.f << 1) - 1;
+    low.e = w.e - 1;
+  }
+  low.f <<= low.e - high.e;
+  low.e = high.e;
+  w = af_diy_fp_normalize(w);
+
+  /* scale by a cached power of ten so that the exponent is in [-60, -32].
+     k = ceil((min_e + 63) * log10(2)) is only a guess of the index. */
+  min_e = -60 - (w.e + 64);
+  k = min_e + 63;
+  k = (k >= 0) ? ((k * 78913 + 262143) >> 18) : -((-k * 78913) >> 18);
+  i = (-AF_CACHED_POWERS_MIN_K + k - 1) / 8 + 1;
+  while(af_cached_powers[i].e < min_e)
+    ++i;
+  while(af_cached_powers[i].e > min_e + 28)
+    --i;
+
+  c.f = af_cached_powers[i].f;
+  c.e = af_cached_powers[i].e;
+  w = af_diy_fp_mul(w, c);
+  high = af_diy_fp_mul(high, c);
+  low = af_diy_fp_mul(low, c);
+
+  /* the scaled boundaries are off by at most 1 unit, so the digits are
+     generated from the top of the interval widened by that */
+  low.f -= unit;
+  high.f += unit;
+  unsafe = high.f - low.f;
+  dist_high_w = high.f - w.f;
+  shift = -w.e;
+  one = UINT64_C(1) << shift;
+  integrals = (uint32_t)(high.f >> shift);
+  fractionals = high.f & (one - 1);
+
+  if(integrals) {
+    kappa = 1;
+    while(integrals / divisor >= 10) {
+      divisor *= 10;
+      ++kappa;
+    }
+  }
+
+  *len = 0;
+
+  while(kappa > 0) {
+    digits[(*len)++] = (char)('0' + integrals / divisor);
+    integrals %= divisor;
+    --kappa;
+    rest = ((uint64_t)integrals << shift) + fractionals;
+    if(rest < unsafe) {
+      *exp10 = kappa - af_cached_powers[i].k;
+      return af_grisu_round_weed(digits, *len, dist_high_w, unsafe, rest,
+                                 (uint64_t)divisor << shift, unit);
+    }
+    divisor /= 10;
+  }
+
+  for(;;) {
+    if(*len == AF_SHORTEST_DIGITS)
+      return 0;
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    digits[(*len)++] = (char)('0' + (fractionals >> shift));
+    fractionals &= one - 1;
+    --kappa;
+    if(fractionals < unsafe) {
+      *exp10 = kappa - af_cached_powers[i].k;
+      return af_grisu_round_weed(digits, *len, dist_high_w * unit, unsafe,
+                                 fractionals, one, unit);
+    }
+  }
+}
+
+/* find the digits like af_grisu3, by formatting v with %e from the C library
+   at each precision until the digits convert back to v. They're read without
+   the radix character, so this doesn't depend on the locale either. */
+static void af_shortest_libc(double v, char *digits, int *len, int *exp10)
+{
+  char s[48];
+  int p;
+
+  for(p = 1; ; ++p) {
+    const char *q;
+    int n = 0;
+
+    af_snprintf(s, sizeof(s), "%.*e", p - 1, v);
+    for(q = s; *q && *q != 'e' && n < AF_SHORTEST_DIGITS; ++q) {
+      if('0' <= *q && *q <= '9')
+        digits[n++] = *q;
+    }
+    while(*q && *q != 'e')
+      ++q;
+
+    *len = n;
+    *exp10 = (*q ? atoi(q + 1) : 0) - (n - 1);
+
+    if(p >= AF_SHORTEST_DIGITS)
+      return;
+
+    memcpy(s, digits, (size_t)n);
+    af_snprintf(&s[n], sizeof(s) - (size_t)n, "e%d", *exp10);
+    if(strtod(s, NULL) == v)
+      return;
+  }
+}
+
+/* write the output of a floating point conversion, the sign of a negative
+   number or the one asked for and then body, padded to the width. like the C
+   library the 0 flag pads with zeros only if the number is finite. */
+static void af_render_float_body(struct af_out *out,
+                                 const struct af_spec *spec, int negative,
+                                 const char *body, size_t n, int finite)
+{
+  const char *prefix = "";
+  size_t prefixlen = 0, padding = 0;
+
+  if(negative)
+    prefix = "-";
+  else if((spec->flags & AF_SPEC_PLUS))
+    prefix = "+";
+  else if((spec->flags & AF_SPEC_SPACE))
+    prefix = " ";
+  prefixlen = strlen(prefix);
+
+  if(spec->width > 0 && (size_t)spec->width > prefixlen + n)
+    padding = (size_t)spec->width - prefixlen - n;
+
+  if((spec->flags & AF_SPEC_MINUS)) {
+    af_out_write(out, prefix, prefixlen);
+    af_out_write(out, body, n);
+    af_out_fill(out, ' ', padding);
+  }
+  else if((spec->flags & AF_SPEC_ZERO) && finite) {
+    af_out_write(out, prefix, prefixlen);
+    af_out_fill(out, '0', padding);
+    af_out_write(out, body, n);
+  }
+  else {
+    af_out_fill(out, ' ', padding);
+    af_out_write(out, prefix, prefixlen);
+    af_out_write(out, body, n);
+  }
+}
+
+/* format %g or %G without a precision, with AF_SHORTEST_FLOAT
+
+The digits are the fewest that convert back to v, and the closest to v of
+those. Like %.17g the number is written in exponential notation if its decimal
+exponent is less than -4 or at least 17, otherwise in fixed notation, and
+trailing zeros are removed: 0.1, 100, 1e+17, 1.5e-05.
+*/
+static void af_render_shortest(struct af_out *out, const struct af_spec *spec,
+                               double v)
+{
+  /* "0.0000" and the digits, or a digit, '.', the digits and e-324 */
+  char body[8 + AF_SHORTEST_DIGITS + 8];
+  char digits[AF_SHORTEST_DIGITS + 1];
+  char *p = body;
+  uint64_t bits;
+  int len, exp10, e, i;
+  int upper = (spec->conv == 'G');
+
+  memcpy(&bits, &v, sizeof(bits));
+
+  if(((bits >> 52) & 0x7FF) == 0x7FF) {
+    const char *s = (bits & ((UINT64_C(1) << 52) - 1)) ?
+                    (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+    af_render_float_body(out, spec, (int)(bits >> 63), s, 3, 0);
+    return;
+  }
+
+  if(!(bits << 1)) {
+    digits[0] = '0';
+    len = 1;
+    exp10 = 0;
+  }
+  else {
+    double a;
+    uint64_t abits = bits & ~(UINT64_C(1) << 63);
+    memcpy(&a, &abits, sizeof(a));
+    if(!af_grisu3(a, digits, &len, &exp10))
+      af_shortest_libc(a, digits, &len, &exp10);
+    while(len > 1 && digits[len - 1] == '0') {
+      --len;
+      ++exp10;
+    }
+  }
+
+  e = len - 1 + exp10;
+
+  if(e < -4 || e >= 17) {
+    *p++ = digits[0];
+    if(len > 1) {
+      *p++ = '.';
+      memcpy(p, &digits[1], (size_t)(len - 1));
+      p += len - 1;
+    }
+    *p++ = upper ? 'E' : 'e';
+    *p++ = (e < 0) ? '-' : '+';
+    if(e < 0)
+      e = -e;
+    if(e >= 100)
+      *p++ = (char)('0' + e / 100);
+    *p++ = (char)('0' + e / 10 % 10);
+    *p++ = (char)('0' + e % 10);
+  }
+  else if(exp10 >= 0) {
+    memcpy(p, digits, (size_t)len);
+    p += len;
+    for(i = 0; i < exp10; ++i)
+      *p++ = '0';
+  }
+  else if(e >= 0) {
+    memcpy(p, digits, (size_t)e + 1);
+    p += e + 1;
+    *p++ = '.';
+    memcpy(p, &digits[e + 1], (size_t)(len - e - 1));
+    p += len - e - 1;
+  }
+  else {
+    *p++ = '0';
+    *p++ = '.';
+    for(i = -1; i > e; --i)
+      *p++ = '0';
+    memcpy(p, digits, (size_t)len);
+    p += len;
+  }
+
+  af_render_float_body(out, spec, (int)(bits >> 63), body,
+                       (size_t)(p - body), 1);
+}
+
+/* format %f or %F with AF_SHORTEST_FLOAT
+
+v is m * 2^e, so v * 10^precision is the 128-bit integer m * 10^precision
+shifted by e, and that is rounded to nearest with ties to even like the C
+library.
+
+success: 0
+failure: -1: the precision is more than AF_FIXED_MAX_PRECISION or v * 10^p is
+             too large for 64 bits, format with the C library instead
+*/
+static int af_render_fixed(struct af_out *out, const struct af_spec *spec,
+                           double v)
+{
+  static const uint64_t pow10[AF_FIXED_MAX_PRECISION + 1] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+    UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+    UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000),
+    UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000)
+  };
+  /* the digits of a 64-bit integer, '.' and the digits of the precision */
+  char body[20 + 1 + AF_FIXED_MAX_PRECISION];
+  char *end = body + sizeof(body), *p;
+  uint64_t bits, m, hi, lo, r;
+  int bexp, e, cmp;
+  int precision = (spec->precision < 0) ? 6 : spec->precision;
+
+  if(precision > AF_FIXED_MAX_PRECISION)
+    return -1;
+
+  memcpy(&bits, &v, sizeof(bits));
+  m = bits & ((UINT64_C(1) << 52) - 1);
+  bexp = (int)((bits >> 52) & 0x7FF);
+
+  if(bexp == 0x7FF) {
+    const char *s = m ? ((spec->conv == 'F') ? "NAN" : "nan") :
+                    ((spec->conv == 'F') ? "INF" : "inf");
+    af_render_float_body(out, spec, (int)(bits >> 63), s, 3, 0);
+    return 0;
+  }
+
+  if(bexp) {
+    m |= UINT64_C(1) << 52;
+    e = bexp - 1075;
+  }
+  else
+    e = -1074;
+
+  /* m < 2^53 and 10^17 < 2^57 */
+  af_mul_64(m, pow10[precision], &hi, &lo);
+
+  if(e >= 0) {
+    if(hi || e >= 64 || (e && (lo >> (64 - e))))
+      return -1;
+    r = lo << e;
+  }
+  else if(-e > 111) {
+    /* the product is less than 2^110 so it rounds to 0 */
+    r = 0;
+  }
+  else {
+    /* cmp is the sign of the shifted out bits compared to half */
+    int s = -e;
+    if(s < 64) {
+      uint64_t rem = lo & ((UINT64_C(1) << s) - 1);
+      uint64_t half = UINT64_C(1) << (s - 1);
+      if(hi >> s)
+        return -1;
+      r = (lo >> s) | (hi << (64 - s));
+      cmp = (rem > half) - (rem < half);
+    }
+    else if(s == 64) {
+      uint64_t half = UINT64_C(1) << 63;
+      r = hi;
+      cmp = (lo > half) - (lo < half);
+    }
+    else {
+      uint64_t rem = hi & ((UINT64_C(1) << (s - 64)) - 1);
+      uint64_t half = UINT64_C(1) << (s - 65);
+      r = hi >> (s - 64);
+      cmp = (rem != half) ? (rem > half) - (rem < half) : (lo != 0);
+    }
+    if(cmp > 0 || (!cmp && (r & 1))) {
+      if(r == UINT64_C(0xFFFFFFFFFFFFFFFF))
+        return -1;
+      ++r;
+    }
+  }
+
+  p = end;
+  if(precision) {
+    p -= af_utoa_dec(p, r % pow10[precision]);
+    while(end - p < precision)
+      *--p = '0';
+    *--p = '.';
+  }
+  else if((spec->flags & AF_SPEC_HASH))
+    *--p = '.';
+  p -= af_utoa_dec(p, r / pow10[precision]);
+
+  af_render_float_body(out, spec, (int)(bits >> 63), p, (size_t)(end - p), 1);
+  return 0;
+}
+
+/* format a single conversion */
+static void af_render(struct af_out *out, const struct af_spec *spec,
+                      const union af_arg *arg)
+{
+  switch(spec->argtype) {
+  case AF_ARG_NONE:
+    af_out_write(out, "%", 1);
+    break;
+  case AF_ARG_SIGNED:
+  case AF_ARG_UNSIGNED:
+    af_render_int(out, spec, arg);
+    break;
+  case AF_ARG_CHAR:
+    if(out->escape) {
+      char c = (char)(unsigned char)arg->i;
+      af_render_escaped(out, spec, &c, 1);
+    }
+    else if(!(spec->flags & AF_SPEC_ZERO)) {
+      char c = (char)(unsigned char)arg->i;
+      af_render_chars(out, spec, &c, 1);
+    }
+    else
+      af_render_libc(out, spec, arg);
+    break;
+  case AF_ARG_STR:
+    /* how a NULL string is formatted is up to the C library */
+    if(arg->s && out->escape)
+      af_render_escaped(out, spec, arg->s, af_render_strlen(spec, arg->s));
+    else if(arg->s && !(spec->flags & AF_SPEC_ZERO))
+      af_render_chars(out, spec, arg->s, af_render_strlen(spec, arg->s));
+    else
+      af_render_libc(out, spec, arg);
+    break;
+  case AF_ARG_WINT:
+  case AF_ARG_WSTR:
+    if(out->escape)
+      af_render_wide_escaped(out, spec, arg);
+    else
+      af_render_libc(out, spec, arg);
+    break;
+  case AF_ARG_DOUBLE:
+    if(out->shortest) {
+      if((spec->conv == 'g' || spec->conv == 'G') && spec->precision < 0 &&
+         !(spec->flags & AF_SPEC_HASH)) {
+        af_render_shortest(out, spec, arg->d);
+        break;
+      }
+      if((spec->conv == 'f' || spec->conv == 'F') &&
+         !af_render_fixed(out, spec, arg->d))
+        break;
+    }
+    af_render_libc(out, spec, arg);
+    break;
+  default:
+    af_render_libc(out, spec, arg);
+    break;
+  }
+}
+
+/* the built-in formatter returns this if the format has to be formatted by
+   the C library */
+#define AF_FAST_UNSUPPORTED -2
+
+/* format into dest like af_vsnprintf with the built-in formatter. flags are
+   the AF_ESCAPE_ and AF_SHORTEST_FLOAT flags of the append.
+
+success: the length of the formatted output. if that is >= destsize then the
+         output was truncated.
+failure: -1
+failure: AF_FAST_UNSUPPORTED: the format has to be formatted by the C library
+*/
+static int af_fast_vsnprintf(char *dest, size_t destsize, const char *format,
+                             va_list *args, int flags)
+{
+  struct af_out out;
+  struct af_spec spec;
+  union af_arg arg;
+  const char *p = format;
+
+  out.dest = dest;
+  out.size = destsize;
+  out.len = 0;
+  out.error = 0;
+  out.escape = flags & (AF_ESCAPE_JSON | AF_ESCAPE_C);
+  out.shortest = !!(flags & AF_SHORTEST_FLOAT);
+
+  for(;;) {
+    const char *pct = p;
+
+    while(*pct && *pct != '%')
+      ++pct;
+
+    af_out_write(&out, p, (size_t)(pct - p));
+
+    if(!*pct)
+      break;
+
+    if(af_parse_spec(pct, &spec))
+      return AF_FAST_UNSUPPORTED;
+
+    af_fetch_arg(&spec, &arg, args);
+    af_render(&out, &spec, &arg);
+    if(out.error)
+      return -1;
+
+    p = pct + spec.len;
+  }
+
+  if(out.size)
+    out.dest[out.len < out.size ? out.len : out.size - 1] = '\0';
+
+  if(out.len > (unsigned)INT_MAX)
+    return -1;
+
+  return (int)out.len;
+}
+#endif /* AF_NO_FAST_FORMAT */
+
+/* format into dest like af_vsnprintf, with the built-in formatter if possible
+
+success: the length of the formatted output. if that is >= destsize then the
+         output was truncated.
+failure: -1
+*/
+static int af_format(char *dest, size_t destsize, const char *format,
+                     va_list args)
+{
+#ifndef AF_NO_FAST_FORMAT
+  int count;
+  va_list args_copy;
+
+  va_copy(args_copy, args);
+  count = af_fast_vsnprintf(dest, destsize, format, &args_copy, 0);
+  va_end(args_copy);
+
+  if(count != AF_FAST_UNSUPPORTED)
+    return count;
+#endif
+
+  return af_vsnprintf(dest, destsize, format, args);
+}
+
+/* format into dest like af_format, with the AF_ESCAPE_ and AF_SHORTEST_FLOAT
+   flags of the append if there are any. The C library can't escape so an
+   escaped format that the built-in formatter doesn't support fails.
+
+success: the length of the formatted output. if that is >= destsize then the
+         output was truncated.
+failure: -1
+*/
+static int af_format_flags(char *dest, size_t destsize, const char *format,
+                           va_list args, int flags)
+{
+#ifndef AF_NO_FAST_FORMAT
+  if(flags) {
+    int count;
+    va_list args_copy;
+
+    va_copy(args_copy, args);
+    count = af_fast_vsnprintf(dest, destsize, format, &args_copy, flags);
+    va_end(args_copy);
+
+    if(count != AF_FAST_UNSUPPORTED)
+      return count;
+    if((flags & (AF_ESCAPE_JSON | AF_ESCAPE_C)))
+      return -1;
+  }
+#else
+  (void)flags;
+#endif
+
+  return af_format(dest, destsize, format, args);
+}
+
+/* format into dest like af_format, and if the output doesn't fit its destsize
+   bytes then format it again into *heap, which is reallocated if *heapsize is
+   too small and otherwise reused. This is for strings that the output can't
+   always be formatted into, like a string that isn't contiguous. *data is
+   set to the null terminated output.
+
+success: the length of the output
+failure: -1: vsnprintf/memory error
+*/
+static int af_format_spill(char **data, char *dest, size_t destsize,
+                           char **heap, size_t *heapsize, const char *format,
+                           va_list args)
+{
+  int count;
+  size_t size;
+  va_list args_copy;
+
+  va_copy(args_copy, args);
+  count = af_format(dest, destsize, format, args_copy);
+  va_end(args_copy);
+
+  if(count < 0)
+    return -1;
+
+  size = (size_t)count + 1;
+  if(size <= destsize) {
+    *data = dest;
+    return count;
+  }
+
+  if(*heapsize < size) {
+    /* the old content isn't needed so it's not realloc'd */
+    free(*heap);
+    *heapsize = 0;
+    *heap = (char *)malloc(size);
+    if(!*heap)
+      return -1;
+    *heapsize = size;
+  }
+  *data = *heap;
+
+  if(af_format(*data, size, format, args) != count)
+    return -1;
+
+  return count;
+}
+
+/* reallocate buf->str to newcap bytes with the allocator of buf
+
+success: the new location of buf->str
+failure: NULL; buf->str is unchanged
+*/
+static char *af_buf_realloc(af_buf *buf, size_t newcap)
+{
+  if(buf->alloc)
+    return (char *)buf->alloc->resize(buf->alloc->ctx, buf->str, buf->cap,
+                                      newcap);
+  return (char *)realloc(buf->str, newcap);
+}
+
+/* grow buf so that its capacity is at least needed
+
+If exact_fit then buf->str is reallocated to exactly the size needed.
+Otherwise the capacity grows according to the growth policy.
+
+success: 0
+failure: -1: memory error; buf is unchanged
+*/
+static int af_buf_grow(af_buf *buf, size_t needed, int exact_fit)
+{
+  char *s;
+  size_t newcap = needed;
+
+  if(needed <= buf->cap)
+    return 0;
+
+  /* The capacity isn't grown past INT_MAX by the policy unless the string is
+     already that long, which only the _ex functions allow */
+  if(!exact_fit) {
+    newcap = af_grow_capacity(buf->cap, needed);
+    if(newcap > (unsigned)INT_MAX && needed <= (unsigned)INT_MAX)
+      newcap = (unsigned)INT_MAX;
+  }
+
+  s = af_buf_realloc(buf, newcap);
+  if(!s && newcap != needed) {
+    newcap = needed;
+    s = af_buf_realloc(buf, newcap);
+  }
+  if(!s)
+    return -1;
+
+  AF_STAT_ADD(reallocs, 1);
+  if(buf->str && s != buf->str)
+    AF_STAT_ADD(realloc_bytes, buf->cap);
+
+  buf->str = s;
+  buf->cap = newcap;
+  return 0;
+}
+
+/* Runs of trailing CR and LF shorter than this are counted by the scalar
+   loop. Usually there are only one or two, or none at all. */
+#define AF_CRLF_SIMD_MIN 16
+
+/* return the number of trailing CR and LF in [s, p) using the scalar loop,
+   plus (s + len - p) that were already counted */
+static size_t af_count_trailing_crlf_scalar(const char *s, const char *p,
+                                            size_t len)
+{
+  while(p != s && (p[-1] == '\r' || p[-1] == '\n'))
+    --p;
+
+  return (size_t)(s + len - p);
+}
+
+#ifdef AF_HAVE_SSE2
+/* return the index of the highest set bit of x, which must not be 0 */
+static unsigned af_highest_bit(unsigned x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long index;
+  _BitScanReverse(&index, x);
+  return (unsigned)index;
+#elif defined(__GNUC__) || defined(__clang__)
+  return 31 - (unsigned)__builtin_clz(x);
+#else
+  unsigned n = 0;
+  while(x >>= 1)
+    ++n;
+  return n;
+#endif
+}
+
+/* af_count_trailing_crlf with 16 bytes compared at a time, backwards from p.
+   p must be 16 byte aligned. */
+static size_t af_count_trailing_crlf_sse2(const char *s, const char *p,
+                                          size_t len)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+
+  while(p - s >= 16) {
+    __m128i v = _mm_load_si128((const __m128i *)(const void *)(p - 16));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+    if(mask != 0xFFFF)
+      return (size_t)(s + len - (p - 15 + af_highest_bit(~mask & 0xFFFF)));
+    p -= 16;
+  }
+
+  return af_count_trailing_crlf_scalar(s, p, len);
+}
+#endif
+
+#ifdef AF_HAVE_AVX2
+/* af_count_trailing_crlf with 32 bytes compared at a time, backwards from p.
+   p must be 32 byte aligned. */
+#if !defined(_MSC_VER) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+static size_t af_count_trailing_crlf_avx2(const char *s, const char *p,
+                                          size_t len)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+
+  while(p - s >= 32) {
+    __m256i v = _mm256_load_si256((const __m256i *)(const void *)(p - 32));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+    if(mask != 0xFFFFFFFF)
+      return (size_t)(s + len - (p - 31 + af_highest_bit(~mask)));
+    p -= 32;
+  }
+
+  return af_count_trailing_crlf_scalar(s, p, len);
+}
+
+/* return nonzero if the cpu and the OS support AVX2 */
+static int af_cpu_has_avx2(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  /* -1 until the cpu is checked. Threads that race to check it store the same
+     value. */
+  static volatile int has_avx2 = -1;
+  if(has_avx2 == -1) {
+    int info[4];
+    int result = 0;
+    __cpuid(info, 0);
+    if(info[0] >= 7) {
+      __cpuid(info, 1);
+      /* OSXSAVE and AVX, and the OS saves the YMM registers */
+      if((info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+         (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        result = !!(info[1] & (1 << 5));
+      }
+    }
+    has_avx2 = result;
+  }
+  return has_avx2;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/* return the number of trailing CR and LF in the first len bytes of s
+
+This is what the AF_REMOVE_CR_LF_* flags remove, and it can be used the same
+way to trim other strings, like captured output that ends in many blank lines:
+
+s[len - af_count_trailing_crlf(s, len)] = '\0';
+
+Usually there are few or no trailing CR and LF so they are counted one at a
+time. A longer run is counted 16 bytes at a time with SSE2, or 32 bytes at a
+time with AVX2 if the cpu supports it, unless AF_NO_SIMD is defined.
+*/
+size_t af_count_trailing_crlf(const char *s, size_t len)
+{
+  const char *p, *stop;
+
+  /* s may be NULL if it's empty, like the string of an unallocated af_buf */
+  if(!len)
+    return 0;
+
+  p = s + len;
+  stop = (len > AF_CRLF_SIMD_MIN) ? p - AF_CRLF_SIMD_MIN : s;
+
+  while(p != stop && (p[-1] == '\r' || p[-1] == '\n'))
+    --p;
+
+  if(p != stop || p == s)
+    return (size_t)(s + len - p);
+
+#ifdef AF_HAVE_SSE2
+  /* The vector loads must be aligned so they can't cross into an unmapped
+     page past the start of s. Count the bytes up to the alignment first. */
+#ifdef AF_HAVE_AVX2
+  if(af_cpu_has_avx2()) {
+    while(((uintptr_t)p & 31) && p != s && (p[-1] == '\r' || p[-1] == '\n'))
+      --p;
+    if(((uintptr_t)p & 31))
+      return (size_t)(s + len - p);
+    return af_count_trailing_crlf_avx2(s, p, len);
+  }
+#endif
+  while(((uintptr_t)p & 15) && p != s && (p[-1] == '\r' || p[-1] == '\n'))
+    --p;
+  if(((uintptr_t)p & 15))
+    return (size_t)(s + len - p);
+  return af_count_trailing_crlf_sse2(s, p, len);
+#else
+  return af_count_trailing_crlf_scalar(s, p, len);
+#endif
+}
+
+/* the flags that are only accepted by the af_buf functions */
+#define AF_BUF_FLAGS (AF_EXACT_FIT)
+
+/* the flags that are only accepted by the functions that append to *str or an
+   af_buf with a format string or a compiled format. they need the built-in
+   formatter so without it they're unrecognized. */
+#ifndef AF_NO_FAST_FORMAT
+#define AF_FORMAT_FLAGS (AF_ESCAPE_JSON | AF_ESCAPE_C | AF_SHORTEST_FLOAT)
+#else
+#define AF_FORMAT_FLAGS 0
+#endif
+
+/* return nonzero if flags has a flag that isn't in accepted, or both of the
+   escape flags */
+static int af_bad_flags(int flags, int accepted)
+{
+  return (flags & ~accepted) ||
+         ((flags & AF_ESCAPE_JSON) && (flags & AF_ESCAPE_C));
+}
+
+/* append a separator (sep) and formatted data to buf.
+
+This is the engine behind every append function. buf must not be NULL and
+flags must already have been checked. The length of the string is taken from
+buf->len instead of strlen so the cost of an append is proportional to the
+size of the data appended and not to the size of the accumulated string.
+
+The data is formatted optimistically into the spare capacity of buf->str, or
+into a stack scratch buffer if that is larger. Only if the output doesn't fit
+is buf->str grown to the now known size and the data formatted again.
+
+If exact_fit then buf->str is reallocated to exactly the size needed, because
+the caller can't keep track of the capacity. Otherwise the capacity grows
+according to the growth policy.
+
+maxsize is the largest size buf->str is allowed to grow to including the null
+terminator, INT_MAX for the functions that return an int.
+
+If flags has AF_ESCAPE_JSON or AF_ESCAPE_C then %s, %c, %ls and %lc are
+escaped while they're formatted. The escaped length is counted like any other
+output, so that doesn't need another pass over the data. If flags has
+AF_SHORTEST_FLOAT then %g and %f are formatted by af_render_shortest and
+af_render_fixed.
+
+success: the new length of buf->str
+failure: AF_ERR_FORMAT, AF_ERR_MEMORY or AF_ERR_LENGTH; the content of
+         buf->str is unchanged but if the realloc was successful then the
+         location may have changed
+*/
+static ptrdiff_t af_vappend(af_buf *buf, int flags, const char *sep,
+                            const char *format, va_list args, int exact_fit,
+                            size_t maxsize)
+{
+  int count;
+  ptrdiff_t retcode = AF_ERR_FORMAT;
+  va_list args_copy;
+  char scratch[AF_SCRATCH_SIZE];
+  char *s, *dest;
+  size_t destsize, bufsize, newlen;
+  size_t oldlen, seplen, crlflen;
+
+  oldlen = buf->len;
+
+  AF_STAT_ADD(calls, 1);
+
+  /* Whether the separator is used also depends on the format outcome, which
+     isn't known yet. Make room for it in case it is. */
+  if(sep && (oldlen || (flags & AF_APPEND_SEP_IF_STR_EMPTY)))
+    seplen = strlen(sep);
+  else
+    seplen = 0;
+
+  if(buf->str && buf->cap - oldlen - 1 > seplen &&
+     buf->cap - oldlen - 1 - seplen > sizeof(scratch)) {
+    dest = &buf->str[oldlen + seplen];
+    destsize = buf->cap - oldlen - seplen;
+  }
+  else {
+    dest = scratch;
+    destsize = sizeof(scratch);
+  }
+
+  va_copy(args_copy, args);
+  count = af_format_flags(dest, destsize, format, args_copy,
+                          flags & AF_FORMAT_FLAGS);
+  va_end(args_copy);
+
+  if(count < 0 || (unsigned)count != (size_t)count)
+    goto fail;
+
+  AF_STAT_ADD(bytes_formatted, (size_t)count);
+  AF_STAT_FRAGMENT((size_t)count);
+
+  if(!count && !(flags & AF_APPEND_SEP_IF_FORMAT_EMPTY))
+    seplen = 0;
+
+  if(!seplen)
+    sep = "";
+
+  retcode = AF_ERR_LENGTH;
+
+  bufsize = 1;
+
+  bufsize += oldlen;
+  if(bufsize < oldlen)
+    goto fail;
+
+  bufsize += seplen;
+  if(bufsize < seplen)
+    goto fail;
+
+  bufsize += (size_t)count;
+  if(bufsize < (size_t)count)
+    goto fail;
+
+  if(bufsize > maxsize)
+    goto fail;
+
+  crlflen = 0;
+
+  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    crlflen = af_count_trailing_crlf(buf->str, oldlen);
+
+  if((size_t)count < destsize) {
+    /* The first pass formatted all of the data. Nothing can fail anymore after
+       the buffer is grown so the CR and LF don't have to be kept. */
+    if(dest == scratch) {
+      if(af_buf_grow(buf, bufsize - crlflen, exact_fit)) {
+        AF_STAT_ADD(errors, 1);
+        return AF_ERR_MEMORY;
+      }
+      memcpy(&buf->str[oldlen - crlflen + seplen], scratch, (size_t)count);
+    }
+    else if(crlflen && count)
+      memmove(&buf->str[oldlen - crlflen + seplen], dest, (size_t)count);
+
+    s = buf->str;
+    memcpy(&s[oldlen - crlflen], sep, seplen);
+    s[bufsize - crlflen - 1] = '\0';
+  }
+  else {
+    /* The first pass was truncated so now the size is known. Grow the buffer
+       and format again. */
+    if(dest != scratch)
+      buf->str[oldlen] = '\0';
+
+    if(af_buf_grow(buf, bufsize, exact_fit)) {
+      AF_STAT_ADD(errors, 1);
+      return AF_ERR_MEMORY;
+    }
+
+    AF_STAT_ADD(double_formats, 1);
+
+    s = buf->str;
+
+    /* Move to slack space, if vsnprintf fails we will need to restore them */
+    memmove(&s[bufsize - crlflen], &s[oldlen - crlflen], crlflen);
+
+    strcpy(&s[oldlen - crlflen], sep);
+
+    count = af_format_flags(&s[oldlen - crlflen + seplen],
+                            (size_t)count + 1, format, args,
+                            flags & AF_FORMAT_FLAGS);
+
+    if(count != (int)(bufsize - oldlen - seplen - 1)) {
+      memmove(&s[oldlen - crlflen], &s[bufsize - crlflen], crlflen);
+      s[oldlen] = '\0';
+      AF_STAT_ADD(errors, 1);
+      return AF_ERR_FORMAT;
+    }
+  }
+
+  newlen = bufsize - crlflen - 1;
+
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND)) {
+    size_t n = af_count_trailing_crlf(s, newlen);
+    newlen -= n;
+    crlflen += n;
+    s[newlen] = '\0';
+  }
+
+  AF_STAT_ADD(crlf_trimmed, crlflen);
+
+  buf->len = newlen;
+  return (ptrdiff_t)newlen;
+
+fail:
+  /* vsnprintf may have overwritten the terminator if it wrote to the spare
+     capacity */
+  if(dest != scratch)
+    buf->str[oldlen] = '\0';
+  AF_STAT_ADD(errors, 1);
+  return retcode;
+}
+
+/* append a separator (sep) and data written by writer to buf.
+
+This is the same as af_vappend except that instead of formatting, writer is
+called to write at most maxlen bytes directly into the spare capacity of
+buf->str. Since maxlen is an upper bound buf->str is grown only once and the
+data is written only once.
+
+If exact_fit then a short bound is written to the stack first and copied, so
+that buf->str isn't grown to the bound and then shrunk again.
+
+success: the new length of buf->str
+failure: -1: writer/memory error; the content of buf->str is unchanged but if
+             the realloc was successful then the location may have changed
+*/
+static int af_append_writer(af_buf *buf, int flags, const char *sep,
+                            size_t maxlen, af_writer writer, void *ctx,
+                            int exact_fit)
+{
+  char scratch[AF_SCRATCH_SIZE];
+  char *s;
+  size_t count = 0, bufsize, newlen;
+  size_t oldlen, seplen, destoff, crlflen;
+  int scratched = 0;
+
+  oldlen = buf->len;
+
+  AF_STAT_ADD(calls, 1);
+
+  if(exact_fit && maxlen < sizeof(scratch)) {
+    count = writer(scratch, maxlen, ctx);
+    if(count > maxlen)
+      goto fail;
+    maxlen = count;
+    scratched = 1;
+  }
+
+  /* Whether the separator is used also depends on the data written, which
+     isn't known yet. Make room for it in case it is. */
+  if(sep && (oldlen || (flags & AF_APPEND_SEP_IF_STR_EMPTY)))
+    seplen = strlen(sep);
+  else
+    seplen = 0;
+
+  bufsize = 1;
+
+  bufsize += oldlen;
+  if(bufsize < oldlen)
+    goto fail;
+
+  bufsize += seplen;
+  if(bufsize < seplen)
+    goto fail;
+
+  bufsize += maxlen;
+  if(bufsize < maxlen)
+    goto fail;
+
+  if(bufsize > (unsigned)INT_MAX)
+    goto fail;
+
+  if(af_buf_grow(buf, bufsize, exact_fit))
+    goto fail;
+
+  s = buf->str;
+  destoff = oldlen + seplen;
+
+  if(scratched)
+    memcpy(&s[destoff], scratch, count);
+  else {
+    count = writer(&s[destoff], maxlen, ctx);
+    if(count > maxlen) {
+      /* writer may have overwritten the terminator */
+      s[oldlen] = '\0';
+      goto fail;
+    }
+  }
+
+  AF_STAT_ADD(bytes_formatted, count);
+  AF_STAT_FRAGMENT(count);
+
+  if(!count && !(flags & AF_APPEND_SEP_IF_FORMAT_EMPTY))
+    seplen = 0;
+
+  crlflen = 0;
+
+  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    crlflen = af_count_trailing_crlf(s, oldlen);
+
+  if(count && oldlen - crlflen + seplen != destoff)
+    memmove(&s[oldlen - crlflen + seplen], &s[destoff], count);
+
+  memcpy(&s[oldlen - crlflen], sep ? sep : "", seplen);
+
+  newlen = oldlen - crlflen + seplen + count;
+
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND)) {
+    size_t n = af_count_trailing_crlf(s, newlen);
+    newlen -= n;
+    crlflen += n;
+  }
+
+  AF_STAT_ADD(crlf_trimmed, crlflen);
+
+  s[newlen] = '\0';
+  buf->len = newlen;
+
+  /* the caller can't keep track of the unused capacity */
+  if(exact_fit && buf->cap != newlen + 1)
+    af_buf_shrink_to_fit(buf);
+
+  return (int)newlen;
+
+fail:
+  AF_STAT_ADD(errors, 1);
+  return -1;
+}
+
+/* append a separator (sep) and data written by a callback to buf
+
+af_buf_append_flags_sep_writer(&buf, 0, "; ", maxlen, writer, ctx);
+
+This is the same as af_buf_append_flags_sep_format except that the data isn't
+formatted, instead writer is called to write it. It's meant for formatters
+that can compute an upper bound of the size of their output, like the C++
+layer in append_format.hpp, so the data is written only once directly into
+buf->str.
+
+writer is called once with a destination with room for maxlen bytes and a
+null terminator and must return the number of bytes it wrote, or (size_t)-1
+on failure. It doesn't have to write a null terminator. The separator rules
+and flags are the same as af_buf_append_flags_sep_format, and the data written
+is treated the same as the format outcome. The data isn't formatted so the
+AF_ESCAPE_ flags and AF_SHORTEST_FLOAT aren't accepted. With AF_EXACT_FIT a
+maxlen shorter than the stack scratch is written there first, so that buf->str
+is grown only to the size needed.
+
+success: the new length of buf->str (or if !buf then the length it would've
+         been)
+failure: -1: writer/memory error; the content of buf->str is unchanged but
+             if the realloc was successful then the location may have changed
+failure: -2: unrecognized flag, or an AF_ESCAPE_ flag or AF_SHORTEST_FLOAT;
+             the content and location of buf->str is unchanged
+*/
+int af_buf_append_flags_sep_writer(af_buf *buf, int flags, const char *sep,
+                                   size_t maxlen, af_writer writer, void *ctx)
+{
+  int retcode;
+  af_buf placeholder = AF_BUF_INIT;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~(AF_ALL_FLAGS | AF_BUF_FLAGS))) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
+  }
+
+  if(!buf)
+    buf = &placeholder;
+
+  retcode = af_append_writer(buf, flags & AF_ALL_FLAGS, sep, maxlen, writer,
+                             ctx, !!(flags & AF_EXACT_FIT));
+
+  af_buf_free(&placeholder);
+  return retcode;
+}
+
+/* same as af_buf_append_flags_sep_writer but appends to *str like
+   append_flags_sep_format */
+int append_flags_sep_writer(char **str, int flags, const char *sep,
+                            size_t maxlen, af_writer writer, void *ctx)
+{
+  int retcode;
+  af_buf buf;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
+  }
+
+  af_buf_init(&buf);
+  if(str && *str) {
+    buf.str = *str;
+    buf.len = strlen(*str);
+    buf.cap = buf.len + 1;
+  }
+
+  retcode = af_append_writer(&buf, flags, sep, maxlen, writer, ctx, 1);
+
+  if(str)
+    *str = buf.str;
+  else
+    free(buf.str);
+
+  return retcode;
+}
+
+/* append a separator (sep) and formatted data to an af_buf string handle
+
+af_buf buf = AF_BUF_INIT;
+af_buf_append_format(&buf, "%s", "foo");
+af_buf_append_sep_format(&buf, "; ", "%s", "foo");
+af_buf_free(&buf);
+
+This is the same as append_flags_sep_format except that the string is held in
+an af_buf which tracks its length and the capacity of its allocation. Because
+the length is known the string is never rescanned, so building a large string
+from many small appends costs time proportional to the data appended.
+
+buf must be a pointer to an af_buf or NULL.
+buf->alloc must be a pointer to an af_allocator or NULL for the C runtime.
+buf->str must be a string allocated by buf->alloc or NULL. If it is not NULL
+then buf->len must be its length and buf->cap the size of its allocation.
+An af_buf can be initialized with AF_BUF_INIT, af_buf_init or
+af_buf_init_allocator, and a string allocated elsewhere can be adopted by
+setting the members directly.
+
+The separator rules and flags are the same as append_flags_sep_format. The
+separator is ignored if buf->len is 0 unless AF_APPEND_SEP_IF_STR_EMPTY.
+AF_RESERVED_CAPACITY and AF_USE_USABLE_SIZE aren't accepted, and instead
+AF_EXACT_FIT is: buf->str is grown to exactly the size needed rather than by
+the growth policy, for an allocator that grows its storage by its own policy.
+The adapter for std::string in append_format.hpp uses it.
+
+buf->str is reallocated by this function and the address it points to may
+change. buf->len and buf->cap are updated accordingly. When buf->str has to
+grow its capacity is grown geometrically (see af_set_growth_policy) so that
+most appends don't need a reallocation. af_buf_shrink_to_fit can be used to
+release the unused capacity.
+
+success: the new length of buf->str (or if !buf then the length it would've
+         been)
+failure: -1: vsnprintf/memory error; the content of buf->str is unchanged but
+             if the realloc was successful then the location may have changed
+failure: -2: unrecognized flag; the content and location of buf->str is
+             unchanged
+*/
+int af_buf_vappend_flags_sep_format(af_buf *buf, int flags, const char *sep,
+                                    const char *format, va_list args)
+{
+  int retcode;
+  af_buf placeholder = AF_BUF_INIT;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_BUF_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
+  }
+
+  if(!buf)
+    buf = &placeholder;
+
+  retcode = (af_vappend(buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS), sep,
+                        format, args,
+                        !!(flags & AF_EXACT_FIT), (unsigned)INT_MAX) < 0) ?
+            -1 : (int)buf->len;
+
+  af_buf_free(&placeholder);
+  return retcode;
+}
+
+int af_buf_append_flags_sep_format(af_buf *buf, int flags, const char *sep,
+                                   const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_buf_vappend_flags_sep_format(buf, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* append a separator (sep) and formatted data to buf, for strings longer than
+   INT_MAX
+
+af_buf_append_flags_sep_format_ex(&buf, 0, "\n", "%s", line);
+
+This is the same as af_buf_append_flags_sep_format except that the length of
+buf->str is limited only by memory (and PTRDIFF_MAX) and the errors are
+distinguished. The data formatted by one append is still limited to INT_MAX
+bytes by vsnprintf.
+
+On Linux glibc, realloc of a large block (served by mmap) grows it with
+mremap, so a long string is moved by remapping its pages, not by copying it.
+
+success: the new length of buf->str (or if !buf then the length it would've
+         been)
+failure: AF_ERR_FORMAT: vsnprintf/formatter error
+failure: AF_ERR_MEMORY: memory error
+failure: AF_ERR_LENGTH: the new length would overflow
+         For those the content of buf->str is unchanged but if the realloc was
+         successful then the location may have changed
+failure: AF_ERR_FLAGS: unrecognized flag; the content and location of buf->str
+         is unchanged
+*/
+ptrdiff_t af_buf_vappend_flags_sep_format_ex(af_buf *buf, int flags,
+                                             const char *sep,
+                                             const char *format, va_list args)
+{
+  ptrdiff_t retcode;
+  af_buf placeholder = AF_BUF_INIT;
+
+  /* Unrecognized flags should be checked before anything else */
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_BUF_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return AF_ERR_FLAGS;
+  }
+
+  if(!buf)
+    buf = &placeholder;
+
+  retcode = af_vappend(buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS), sep,
+                       format, args,
+                       !!(flags & AF_EXACT_FIT), (size_t)PTRDIFF_MAX);
+
+  af_buf_free(&placeholder);
+  return retcode;
+}
+
+ptrdiff_t af_buf_append_flags_sep_format_ex(af_buf *buf, int flags,
+                                            const char *sep,
+                                            const char *format, ...)
+{
+  ptrdiff_t retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_buf_vappend_flags_sep_format_ex(buf, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+void af_buf_init(af_buf *buf)
+{
+  buf->str = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+  buf->alloc = NULL;
+}
+
+void af_buf_init_allocator(af_buf *buf, const af_allocator *alloc)
+{
+  af_buf_init(buf);
+  buf->alloc = alloc;
+}
+
+void af_buf_free(af_buf *buf)
+{
+  if(!buf)
+    return;
+  if(buf->str) {
+    if(buf->alloc)
+      buf->alloc->release(buf->alloc->ctx, buf->str, buf->cap);
+    else
+      free(buf->str);
+  }
+  buf->str = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+/* reallocate buf->str so that its capacity is exactly the size of the string
+
+success: 0
+failure: -1: memory error; buf is unchanged
+*/
+int af_buf_shrink_to_fit(af_buf *buf)
+{
+  char *s;
+
+  if(!buf || !buf->str || buf->cap == buf->len + 1)
+    return 0;
+
+  s = af_buf_realloc(buf, buf->len + 1);
+  if(!s)
+    return -1;
+
+  buf->str = s;
+  buf->cap = buf->len + 1;
+  return 0;
+}
+
+/* begin a batch of appends to buf that succeed or fail together
+
+af_batch batch;
+af_batch_begin(&batch, &buf, 256);
+for(i = 0; i < n; ++i)
+  af_batch_append_sep_format(&batch, "; ", "%s=%d", keys[i], values[i]);
+if(af_batch_commit(&batch) < 0)
+  ... buf is the same as it was before the batch began
+
+Appending in a batch has the same outcome as calling
+af_buf_append_flags_sep_format for each fragment, except that if any of the
+appends fails then all of them are rolled back by af_batch_commit. That is the
+same all-or-nothing guarantee a single append has.
+
+size_hint is the expected total size of the fragments, or 0 if unknown. If it
+is not 0 then the capacity of buf is grown up front so that it can hold the
+whole batch with one allocation. Otherwise the capacity grows geometrically as
+needed. Each fragment is usually formatted only once, see af_vappend.
+
+Once an append fails the remaining appends in the batch are skipped and they
+return the same error. The batch must be finished by af_batch_commit or
+af_batch_abort, and buf must not be used in the meantime.
+
+success: 0
+failure: -1: memory error growing buf to size_hint; the batch has begun anyway
+             and it can be used without the hint
+*/
+int af_batch_begin(af_batch *batch, af_buf *buf, size_t size_hint)
+{
+  if(buf != &batch->strbuf)
+    batch->str = NULL;
+  batch->buf = buf;
+  batch->oldlen = buf->len;
+  batch->crlf = NULL;
+  batch->crlflen = (size_t)-1;
+  batch->retcode = 0;
+
+  if(size_hint) {
+    size_t needed = buf->len + 1 + size_hint;
+    if(needed < size_hint || af_buf_grow(buf, needed, 0))
+      return -1;
+  }
+
+  return 0;
+}
+
+/* begin a batch of appends to *str that succeed or fail together
+
+This is the same as af_batch_begin except that the string is a C-runtime
+heap-allocated *str, as it is for append_flags_sep_format. *str is scanned for
+its length only once, and its capacity is tracked until the batch is finished.
+af_batch_commit updates *str.
+
+str must be a pointer to a pointer or NULL.
+*/
+int af_batch_begin_str(af_batch *batch, char **str, size_t size_hint)
+{
+  af_buf_init(&batch->strbuf);
+  if(str && *str) {
+    batch->strbuf.str = *str;
+    batch->strbuf.len = strlen(*str);
+    batch->strbuf.cap = batch->strbuf.len + 1;
+  }
+
+  batch->str = str;
+  return af_batch_begin(batch, &batch->strbuf, size_hint);
+}
+
+/* save the trailing CR and LF of the string as it was when the batch began,
+   before any append can remove them */
+static int af_batch_save_crlf(af_batch *batch)
+{
+  af_buf *buf = batch->buf;
+  size_t crlflen = af_count_trailing_crlf(buf->str, batch->oldlen);
+
+  if(crlflen) {
+    batch->crlf = (char *)malloc(crlflen);
+    if(!batch->crlf)
+      return -1;
+    memcpy(batch->crlf, &buf->str[batch->oldlen - crlflen], crlflen);
+  }
+
+  batch->crlflen = crlflen;
+  return 0;
+}
+
+/* append a separator (sep) and formatted data as part of a batch
+
+This is the same as af_buf_append_flags_sep_format except that the append is
+part of a batch begun by af_batch_begin.
+
+success: the new length of the string
+failure: -1: vsnprintf/memory error; the batch will be rolled back
+failure: -2: unrecognized flag; the batch will be rolled back
+*/
+int af_batch_vappend_flags_sep_format(af_batch *batch, int flags,
+                                      const char *sep, const char *format,
+                                      va_list args)
+{
+  if(batch->retcode)
+    return batch->retcode;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    batch->retcode = -2;
+    return -2;
+  }
+
+  /* Trailing CR and LF from before the batch could be removed and then
+     overwritten by this append, so they're saved in case of rollback */
+  if((flags & AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND) &&
+     batch->crlflen == (size_t)-1 && af_batch_save_crlf(batch)) {
+    batch->retcode = -1;
+    return -1;
+  }
+
+  if(af_vappend(batch->buf, flags, sep, format, args, 0,
+                (unsigned)INT_MAX) < 0) {
+    batch->retcode = -1;
+    return -1;
+  }
+
+  return (int)batch->buf->len;
+}
+
+int af_batch_append_flags_sep_format(af_batch *batch, int flags,
+                                     const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_batch_vappend_flags_sep_format(batch, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* finish a batch begun by af_batch_begin_str */
+static void af_batch_finish_str(af_batch *batch)
+{
+  if(batch->buf != &batch->strbuf)
+    return;
+
+  if(batch->str) {
+    /* the capacity of *str can't be tracked after this */
+    af_buf_shrink_to_fit(&batch->strbuf);
+    *batch->str = batch->strbuf.str;
+  }
+  else
+    af_buf_free(&batch->strbuf);
+}
+
+/* roll back all appends in the batch and finish it
+
+The content of the string is the same as it was when the batch began but if
+it was reallocated then the location may have changed.
+*/
+void af_batch_abort(af_batch *batch)
+{
+  af_buf *buf = batch->buf;
+
+  if(buf->str) {
+    if(batch->crlflen != (size_t)-1 && batch->crlflen)
+      memcpy(&buf->str[batch->oldlen - batch->crlflen], batch->crlf,
+             batch->crlflen);
+    buf->str[batch->oldlen] = '\0';
+  }
+  buf->len = batch->oldlen;
+
+  free(batch->crlf);
+  batch->crlf = NULL;
+  af_batch_finish_str(batch);
+}
+
+/* finish a batch
+
+success: the new length of the string
+failure: -1: an append in the batch failed due to vsnprintf/memory error, and
+             all appends in the batch have been rolled back. the content of
+             the string is unchanged but if it was reallocated then the
+             location may have changed.
+failure: -2: an append in the batch failed due to an unrecognized flag, and
+             all appends in the batch have been rolled back as above.
+*/
+int af_batch_commit(af_batch *batch)
+{
+  int retcode = batch->retcode;
+
+  if(retcode) {
+    af_batch_abort(batch);
+    return retcode;
+  }
+
+  retcode = (int)batch->buf->len;
+
+  free(batch->crlf);
+  batch->crlf = NULL;
+  af_batch_finish_str(batch);
+  return retcode;
+}
+
+/* Each arena block starts with a struct af_arena_block header and its data
+   begins at the next aligned offset. */
+#define AF_ARENA_ALIGN 16
+
+#define AF_ARENA_ROUND_UP(x) \
+  (((x) + (AF_ARENA_ALIGN - 1)) & ~(size_t)(AF_ARENA_ALIGN - 1))
+
+#define AF_ARENA_HEADER_SIZE AF_ARENA_ROUND_UP(sizeof(struct af_arena_block))
+
+#define AF_ARENA_DATA(block) ((char *)(block) + AF_ARENA_HEADER_SIZE)
+
+/* allocate size bytes from the arena
+
+success: the allocation
+failure: NULL
+*/
+static void *af_arena_alloc(af_arena *arena, size_t size)
+{
+  struct af_arena_block *block = arena->head;
+  size_t rounded = AF_ARENA_ROUND_UP(size);
+
+  if(rounded < size)
+    return NULL;
+
+  if(!block || block->size - block->used < rounded) {
+    size_t blocksize = rounded > arena->block_size ? rounded :
+                       arena->block_size;
+    if(blocksize + AF_ARENA_HEADER_SIZE < blocksize)
+      return NULL;
+    block = (struct af_arena_block *)malloc(AF_ARENA_HEADER_SIZE + blocksize);
+    if(!block)
+      return NULL;
+    block->next = arena->head;
+    block->size = blocksize;
+    block->used = 0;
+    block->last = 0;
+    arena->head = block;
+  }
+
+  block->last = block->used;
+  block->used += rounded;
+  return AF_ARENA_DATA(block) + block->last;
+}
+
+/* the af_allocator resize function of an arena */
+static void *af_arena_resize(void *ctx, void *ptr, size_t oldsize,
+                             size_t newsize)
+{
+  af_arena *arena = (af_arena *)ctx;
+  struct af_arena_block *block = arena->head;
+  void *p;
+
+  if(!ptr)
+    return af_arena_alloc(arena, newsize);
+
+  /* The most recent allocation can be resized in place if it fits */
+  if(block && ptr == AF_ARENA_DATA(block) + block->last) {
+    size_t rounded = AF_ARENA_ROUND_UP(newsize);
+    if(rounded >= newsize && block->size - block->last >= rounded) {
+      block->used = block->last + rounded;
+      return ptr;
+    }
+  }
+
+  if(newsize <= oldsize)
+    return ptr;
+
+  p = af_arena_alloc(arena, newsize);
+  if(p)
+    memcpy(p, ptr, oldsize);
+  return p;
+}
+
+/* the af_allocator release function of an arena */
+static void af_arena_release(void *ctx, void *ptr, size_t size)
+{
+  af_arena *arena = (af_arena *)ctx;
+  struct af_arena_block *block = arena->head;
+
+  (void)size;
+
+  /* Only the most recent allocation is given back. Everything else is
+     released by af_arena_reset. */
+  if(block && ptr == AF_ARENA_DATA(block) + block->last)
+    block->used = block->last;
+}
+
+/* initialize an arena allocator
+
+af_arena arena;
+af_arena_init(&arena, 0);
+
+af_buf msg;
+af_buf_init_allocator(&msg, &arena.allocator);
+af_buf_append_format(&msg, "%s", "foo");
+
+af_arena_reset(&arena);  // msg.str and all other allocations are released
+...
+af_arena_free(&arena);
+
+An arena is a bump allocator. It allocates from large blocks of memory by
+advancing a pointer, and all of its allocations are released at once by
+af_arena_reset. That makes it a good fit for building short-lived messages
+that are thrown away together, for example at the end of a request.
+
+arena->allocator is the af_allocator to use with an af_buf. The most recent
+allocation from an arena is grown in place when there's room in its block,
+which is usually the case when a single af_buf is being appended to.
+
+block_size is the size of the blocks that are allocated from the C runtime,
+or 0 for AF_ARENA_DEFAULT_BLOCK_SIZE. Allocations larger than that get a block
+of their own.
+
+An arena isn't thread safe.
+*/
+void af_arena_init(af_arena *arena, size_t block_size)
+{
+  arena->head = NULL;
+  arena->block_size = block_size ? block_size : AF_ARENA_DEFAULT_BLOCK_SIZE;
+  arena->allocator.resize = af_arena_resize;
+  arena->allocator.release = af_arena_release;
+  arena->allocator.ctx = arena;
+}
+
+/* release all allocations from the arena. the most recently allocated block
+   is kept so an arena that is reset regularly doesn't have to allocate again
+   from the C runtime. */
+void af_arena_reset(af_arena *arena)
+{
+  struct af_arena_block *block;
+
+  if(!arena->head)
+    return;
+
+  block = arena->head->next;
+  while(block) {
+    struct af_arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  arena->head->next = NULL;
+  arena->head->used = 0;
+  arena->head->last = 0;
+}
+
+/* release all allocations from the arena and all of its memory */
+void af_arena_free(af_arena *arena)
+{
+  af_arena_reset(arena);
+  free(arena->head);
+  arena->head = NULL;
+}
+
+#ifdef AF_HAVE_MREMAP
+/* round size up to a multiple of the page size. return 0 on overflow. */
+static size_t af_mmap_round(const af_mmap *mm, size_t size)
+{
+  size_t rounded = (size + mm->page_size - 1) & ~(mm->page_size - 1);
+  return (rounded < size) ? 0 : rounded;
+}
+
+static void af_mmap_advise(const af_mmap *mm, void *ptr, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+  if((mm->flags & AF_MMAP_HUGEPAGE))
+    (void)madvise(ptr, size, MADV_HUGEPAGE);
+#else
+  (void)mm;
+  (void)ptr;
+  (void)size;
+#endif
+}
+#endif
+
+/* the resize function of an af_mmap allocator. allocations of at least the
+   threshold are mappings, the rest are from the C runtime. */
+static void *af_mmap_resize(void *ctx, void *ptr, size_t oldsize,
+                            size_t newsize)
+{
+  af_mmap *mm = (af_mmap *)ctx;
+#ifdef AF_HAVE_MREMAP
+  int mapped = ptr && oldsize >= mm->threshold;
+  void *p;
+
+  if(newsize < mm->threshold) {
+    if(!mapped)
+      return realloc(ptr, newsize);
+    p = malloc(newsize);
+    if(!p)
+      return NULL;
+    memcpy(p, ptr, newsize);
+    munmap(ptr, af_mmap_round(mm, oldsize));
+    return p;
+  }
+
+  newsize = af_mmap_round(mm, newsize);
+  if(!newsize)
+    return NULL;
+
+  /* Crossing the threshold is the only time the data is copied */
+  if(!mapped) {
+    p = mmap(NULL, newsize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+      return NULL;
+    af_mmap_advise(mm, p, newsize);
+    if(ptr) {
+      memcpy(p, ptr, oldsize);
+      free(ptr);
+    }
+    return p;
+  }
+
+  oldsize = af_mmap_round(mm, oldsize);
+  if(newsize == oldsize)
+    return ptr;
+
+  /* The kernel moves the pages of the mapping if it can't be grown in place,
+     without copying them */
+  p = mremap(ptr, oldsize, newsize, MREMAP_MAYMOVE);
+  if(p == MAP_FAILED)
+    return NULL;
+  if(newsize > oldsize)
+    af_mmap_advise(mm, p, newsize);
+  return p;
+#else
+  (void)mm;
+  (void)oldsize;
+  return realloc(ptr, newsize);
+#endif
+}
+
+static void af_mmap_release(void *ctx, void *ptr, size_t size)
+{
+  af_mmap *mm = (af_mmap *)ctx;
+#ifdef AF_HAVE_MREMAP
+  if(ptr && size >= mm->threshold) {
+    munmap(ptr, af_mmap_round(mm, size));
+    return;
+  }
+#else
+  (void)mm;
+  (void)size;
+#endif
+  free(ptr);
+}
+
+/* initialize an allocator that backs large allocations with memory mappings
+
+af_mmap mm;
+af_mmap_init(&mm, 0, AF_MMAP_HUGEPAGE);
+
+af_buf log;
+af_buf_init_allocator(&log, &mm.allocator);
+af_buf_append_sep_format(&log, "\n", "%s", line);
+...
+af_buf_free(&log);
+
+When realloc can't grow a block in place it copies it to a new one, so a
+string that grows to many megabytes is copied over and over. An af_mmap
+allocator maps allocations of at least threshold bytes (0 for
+AF_MMAP_DEFAULT_THRESHOLD) directly from the OS instead, and grows them with
+mremap(MREMAP_MAYMOVE), which moves the pages of a mapping without copying
+them. Smaller allocations are from the C runtime. The data is copied only
+once, when an allocation crosses the threshold.
+
+flags is 0 or AF_MMAP_HUGEPAGE, to advise the kernel to back the mappings with
+transparent huge pages (MADV_HUGEPAGE). That reduces TLB misses when a large
+string is scanned, for example for trailing CR and LF, at the cost of memory
+rounded up to 2 MB.
+
+mm->allocator is the af_allocator to use with an af_buf. An af_mmap has no
+state other than its settings, so it can be shared by threads and it must
+outlive the af_bufs that use it.
+
+Mappings are only used on Linux (and not if AF_NO_MMAP is defined). Elsewhere
+all allocations are from the C runtime.
+*/
+void af_mmap_init(af_mmap *mm, size_t threshold, int flags)
+{
+  mm->threshold = threshold ? threshold : AF_MMAP_DEFAULT_THRESHOLD;
+  mm->flags = flags;
+#ifdef AF_HAVE_MREMAP
+  {
+    long page_size = sysconf(_SC_PAGESIZE);
+    mm->page_size = (page_size > 0) ? (size_t)page_size : 4096;
+  }
+#else
+  mm->page_size = 4096;
+#endif
+  mm->allocator.resize = af_mmap_resize;
+  mm->allocator.release = af_mmap_release;
+  mm->allocator.ctx = mm;
+}
+
+static size_t af_atomic_load(size_t *p)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  return (size_t)AF_INTERLOCKED_SIZE(_InterlockedCompareExchange)(
+    (volatile af_interlocked_size *)p, 0, 0);
+#else
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* if *p is expected then replace it with desired and return nonzero */
+static int af_atomic_cas(size_t *p, size_t expected, size_t desired)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  return (size_t)AF_INTERLOCKED_SIZE(_InterlockedCompareExchange)(
+    (volatile af_interlocked_size *)p, (af_interlocked_size)desired,
+    (af_interlocked_size)expected) == expected;
+#else
+  return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* add n to *p */
+static void af_atomic_add(size_t *p, size_t n)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  AF_INTERLOCKED_SIZE(_InterlockedExchangeAdd)(
+    (volatile af_interlocked_size *)p, (af_interlocked_size)n);
+#else
+  __atomic_add_fetch(p, n, __ATOMIC_ACQ_REL);
+#endif
+}
+
+/* set *p to n, after every write before it */
+static void af_atomic_store(size_t *p, size_t n)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  AF_INTERLOCKED_SIZE(_InterlockedExchange)(
+    (volatile af_interlocked_size *)p, (af_interlocked_size)n);
+#else
+  __atomic_store_n(p, n, __ATOMIC_RELEASE);
+#endif
+}
+
+/* the pointer *p, where p is the address of any object pointer like
+   (void **)&chunks[k] */
+static void *af_atomic_load_ptr(void **p)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  return _InterlockedCompareExchangePointer((void *volatile *)p, NULL, NULL);
+#else
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* if the pointer *p is expected then replace it with desired and return
+   nonzero */
+static int af_atomic_cas_ptr(void **p, void *expected, void *desired)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  return _InterlockedCompareExchangePointer((void *volatile *)p, desired,
+                                            expected) == expected;
+#else
+  return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+/* let another thread run while waiting for it */
+static void af_yield(void)
+{
+#ifdef _WIN32
+  SwitchToThread();
+#elif defined(AF_HAVE_PTHREAD)
+  sched_yield();
+#endif
+}
+
+/* The sealed bit of af_shared.len */
+#define AF_SHARED_SEALED (((size_t)-1 >> 1) + 1)
+
+/* initialize a shared buffer that threads can append to concurrently
+
+af_shared shared;
+af_shared_init(&shared, 0);
+... any number of threads:
+    af_shared_append_sep_format(&shared, "; ", "%s=%d", key, value);
+af_shared_seal(&shared, &buf);  // buf is the whole string
+af_shared_free(&shared);
+
+The string is stored in chunks that are never moved, so an append never waits
+for another append to finish. The first chunk is chunk_size bytes, or
+AF_SHARED_DEFAULT_CHUNK_SIZE if chunk_size is 0, and each chunk after it is
+twice the size of the one before. A chunk is allocated by the first thread that
+needs it, which avoids a lock because the thread that loses the race frees its
+allocation and uses the other one.
+
+af_shared_free must not be called while threads are appending.
+*/
+void af_shared_init(af_shared *shared, size_t chunk_size)
+{
+  size_t i;
+
+  shared->len = 0;
+  shared->committed = 0;
+  shared->failed = 0;
+  if(!chunk_size)
+    chunk_size = AF_SHARED_DEFAULT_CHUNK_SIZE;
+  shared->chunk_size = (chunk_size > (unsigned)INT_MAX) ?
+                       (unsigned)INT_MAX : chunk_size;
+  for(i = 0; i < AF_SHARED_MAX_CHUNKS; ++i)
+    shared->chunks[i] = NULL;
+}
+
+/* return the chunk that contains offset, allocating it if necessary, and set
+   *start to the offset of the chunk and *size to its size.
+   failure: NULL; memory error */
+static char *af_shared_chunk(af_shared *shared, size_t offset, size_t *start,
+                             size_t *size)
+{
+  char *chunk, *newchunk;
+  size_t k = 0, q = offset / shared->chunk_size + 1;
+
+  /* chunk k starts at chunk_size * (2^k - 1) */
+  while(q >>= 1)
+    ++k;
+
+  *start = shared->chunk_size * (((size_t)1 << k) - 1);
+  *size = shared->chunk_size << k;
+
+  chunk = (char *)af_atomic_load_ptr((void **)&shared->chunks[k]);
+  if(chunk)
+    return chunk;
+
+  newchunk = (char *)malloc(*size);
+  if(!newchunk)
+    return NULL;
+
+  if(af_atomic_cas_ptr((void **)&shared->chunks[k], NULL, newchunk))
+    return newchunk;
+
+  /* another thread allocated the chunk first */
+  free(newchunk);
+  return (char *)af_atomic_load_ptr((void **)&shared->chunks[k]);
+}
+
+/* copy data to [offset, offset + n) of the shared buffer.
+   success: 0. failure: -1; memory error */
+static int af_shared_write(af_shared *shared, size_t offset, const char *data,
+                           size_t n)
+{
+  while(n) {
+    size_t start, size, count;
+    char *chunk = af_shared_chunk(shared, offset, &start, &size);
+    if(!chunk)
+      return -1;
+    count = start + size - offset;
+    if(count > n)
+      count = n;
+    memcpy(&chunk[offset - start], data, count);
+    offset += count;
+    data += count;
+    n -= count;
+  }
+
+  return 0;
+}
+
+/* append a separator (sep) and formatted data to a shared buffer
+
+af_shared_append_flags_sep_format(&shared, 0, "; ", "%s=%d", key, value);
+
+This can be called by any number of threads at the same time. The data is
+formatted by each thread on its own, then space for the separator and the data
+is reserved at the end of the string by an atomic compare-and-swap on its
+length, and then the thread copies them into the reserved space. Appends from
+different threads don't wait for each other and they're ordered by when their
+space was reserved.
+
+The separator rules are the same as af_buf_append_flags_sep_format, where *str
+is the string of all appends reserved before this one. The CR and LF flags
+apply only to the data of this append since the end of the string may be
+another thread's append that hasn't been copied yet:
+AF_REMOVE_CR_LF_AFTER_APPEND removes all trailing CR and LF from the data, and
+AF_REMOVE_CR_LF_BEFORE_APPEND isn't supported.
+
+success: the length of the string after this append (appends by other threads
+         may have been reserved after it)
+failure: -1: vsnprintf/memory error, or the buffer is sealed; the string is
+             unchanged, unless a memory error happened while copying to
+             space that was already reserved, in which case af_shared_seal
+             fails
+failure: -2: unrecognized flag or AF_REMOVE_CR_LF_BEFORE_APPEND; the string is
+             unchanged
+*/
+int af_shared_vappend_flags_sep_format(af_shared *shared, int flags,
+                                       const char *sep, const char *format,
+                                       va_list args)
+{
+  int count, retcode;
+  char scratch[AF_SCRATCH_SIZE];
+  char *data, *heap = NULL;
+  size_t n, len, seplen, newlen, heapsize = 0;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS) || (flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    return -2;
+
+  count = af_format_spill(&data, scratch, sizeof(scratch), &heap, &heapsize,
+                          format, args);
+  if(count < 0) {
+    retcode = -1;
+    goto done;
+  }
+
+  n = (size_t)count;
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND))
+    n -= af_count_trailing_crlf(data, n);
+
+  /* The separator depends on whether the string is empty so the length is
+     reserved by compare-and-swap instead of a plain atomic add */
+  for(;;) {
+    len = af_atomic_load(&shared->len);
+    if((len & AF_SHARED_SEALED)) {
+      retcode = -1;
+      goto done;
+    }
+
+    /* like af_vappend the separator depends on the data before CR and LF
+       are removed */
+    if(sep && (len || (flags & AF_APPEND_SEP_IF_STR_EMPTY)) &&
+       (count || (flags & AF_APPEND_SEP_IF_FORMAT_EMPTY)))
+      seplen = strlen(sep);
+    else
+      seplen = 0;
+
+    newlen = len + seplen + n;
+    if(newlen < n || newlen > (unsigned)INT_MAX) {
+      retcode = -1;
+      goto done;
+    }
+
+    if(af_atomic_cas(&shared->len, len, newlen))
+      break;
+  }
+
+  retcode = (int)newlen;
+
+  if(af_shared_write(shared, len, sep, seplen) ||
+     af_shared_write(shared, len + seplen, data, n)) {
+    /* the space is already reserved so the string can only be failed */
+    af_atomic_add(&shared->failed, 1);
+    retcode = -1;
+  }
+
+  /* publish the writes to af_shared_seal */
+  af_atomic_add(&shared->committed, seplen + n);
+
+done:
+  free(heap);
+  return retcode;
+}
+
+int af_shared_append_flags_sep_format(af_shared *shared, int flags,
+                                      const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_shared_vappend_flags_sep_format(shared, flags, sep, format,
+                                               args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* seal a shared buffer and append its string to buf
+
+After the buffer is sealed any append to it fails. Appends that have already
+reserved space are waited for, and then the whole string is copied to the end
+of buf as one contiguous null terminated string. This can be called again to
+get another copy.
+
+success: the new length of buf->str
+failure: -1: memory error, or a memory error in one of the appends; the
+             content of buf->str is unchanged but if the realloc was
+             successful then the location may have changed
+*/
+int af_shared_seal(af_shared *shared, af_buf *buf)
+{
+  size_t len, offset, needed;
+
+  do {
+    len = af_atomic_load(&shared->len);
+  } while(!(len & AF_SHARED_SEALED) &&
+          !af_atomic_cas(&shared->len, len, len | AF_SHARED_SEALED));
+
+  len &= ~AF_SHARED_SEALED;
+
+  while(af_atomic_load(&shared->committed) != len)
+    af_yield();
+
+  if(af_atomic_load(&shared->failed))
+    return -1;
+
+  needed = buf->len + len + 1;
+  if(needed < len || needed - 1 > (unsigned)INT_MAX ||
+     af_buf_grow(buf, needed, 0))
+    return -1;
+
+  for(offset = 0; offset < len;) {
+    size_t start, size, count;
+    char *chunk = af_shared_chunk(shared, offset, &start, &size);
+    count = (start + size < len ? start + size : len) - offset;
+    memcpy(&buf->str[buf->len], &chunk[offset - start], count);
+    buf->len += count;
+    offset += count;
+  }
+
+  buf->str[buf->len] = '\0';
+  return (int)buf->len;
+}
+
+/* free the chunks of a shared buffer and make it empty and unsealed */
+void af_shared_free(af_shared *shared)
+{
+  size_t i;
+
+  for(i = 0; i < AF_SHARED_MAX_CHUNKS; ++i)
+    free(shared->chunks[i]);
+
+  af_shared_init(shared, shared->chunk_size);
+}
+
+/* The largest capacity an af_thread_buf keeps. See af_thread_buf_set_max. */
+static size_t thread_buf_max = AF_THREAD_BUF_DEFAULT_MAX;
+
+/* free an af_thread_buf and its string. this is called when a thread exits. */
+#ifdef _WIN32
+static void NTAPI af_thread_buf_destroy(void *ptr)
+#else
+static void af_thread_buf_destroy(void *ptr)
+#endif
+{
+  if(ptr) {
+    af_buf_free((af_buf *)ptr);
+    free(ptr);
+  }
+}
+
+#ifdef _WIN32
+static DWORD thread_buf_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE thread_buf_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK af_thread_buf_key_init(PINIT_ONCE once, PVOID param,
+                                            PVOID *context)
+{
+  (void)once;
+  (void)param;
+  (void)context;
+  thread_buf_key = FlsAlloc(af_thread_buf_destroy);
+  return TRUE;
+}
+
+/* return the af_buf of the calling thread, or NULL if it has none yet.
+   set *ok to 0 if the thread can't have one. */
+static af_buf *af_thread_buf_get(int *ok)
+{
+  InitOnceExecuteOnce(&thread_buf_once, af_thread_buf_key_init, NULL, NULL);
+  *ok = (thread_buf_key != FLS_OUT_OF_INDEXES);
+  return *ok ? (af_buf *)FlsGetValue(thread_buf_key) : NULL;
+}
+
+static int af_thread_buf_set(af_buf *buf)
+{
+  return FlsSetValue(thread_buf_key, buf) ? 0 : -1;
+}
+#elif defined(AF_HAVE_PTHREAD)
+static pthread_key_t thread_buf_key;
+static int thread_buf_key_ok;
+static pthread_once_t thread_buf_once = PTHREAD_ONCE_INIT;
+
+static void af_thread_buf_key_init(void)
+{
+  thread_buf_key_ok = !pthread_key_create(&thread_buf_key,
+                                          af_thread_buf_destroy);
+}
+
+static af_buf *af_thread_buf_get(int *ok)
+{
+  pthread_once(&thread_buf_once, af_thread_buf_key_init);
+  *ok = thread_buf_key_ok;
+  return *ok ? (af_buf *)pthread_getspecific(thread_buf_key) : NULL;
+}
+
+static int af_thread_buf_set(af_buf *buf)
+{
+  return pthread_setspecific(thread_buf_key, buf) ? -1 : 0;
+}
+#else
+/* no threads */
+static af_buf *thread_buf;
+
+static af_buf *af_thread_buf_get(int *ok)
+{
+  *ok = 1;
+  return thread_buf;
+}
+
+static int af_thread_buf_set(af_buf *buf)
+{
+  thread_buf = buf;
+  return 0;
+}
+#endif
+
+/* return the calling thread's reusable buffer, emptied
+
+af_buf *msg = af_thread_buf();
+if(msg) {
+  af_buf_append_format(msg, "%s", "foo");
+  af_buf_append_sep_format(msg, "; ", "%d", 123);
+  log_message(msg->str, msg->len);
+}
+
+This is for transient messages that are built, handed off and then thrown
+away. Each thread has one af_buf that's reused for every message, so once it's
+grown to the size of the largest message building a message doesn't allocate.
+The buffer is emptied by each call, so msg->str is only valid until the next
+call in the same thread. The buffer must not be freed by the caller, and its
+string can't be taken over; copy it to keep it.
+
+The capacity grows as needed and is kept between messages, up to a maximum set
+by af_thread_buf_set_max. A buffer that has grown past the maximum is released
+by the next call so a thread doesn't hold on to the memory of an unusually
+large message. af_thread_buf_trim releases the buffer of the calling thread
+right away, for example before a thread goes idle. The buffer is also released
+when its thread exits.
+
+success: the thread's af_buf, empty
+failure: NULL: memory error or the thread can't have a buffer
+*/
+af_buf *af_thread_buf(void)
+{
+  int ok;
+  af_buf *buf = af_thread_buf_get(&ok);
+
+  if(!buf) {
+    if(!ok)
+      return NULL;
+    buf = (af_buf *)malloc(sizeof(*buf));
+    if(!buf)
+      return NULL;
+    af_buf_init(buf);
+    if(af_thread_buf_set(buf)) {
+      free(buf);
+      return NULL;
+    }
+  }
+
+  if(buf->cap > thread_buf_max)
+    af_buf_free(buf);
+
+  buf->len = 0;
+  if(buf->str)
+    buf->str[0] = '\0';
+
+  return buf;
+}
+
+/* set the largest capacity an af_thread_buf keeps between messages
+
+The default is AF_THREAD_BUF_DEFAULT_MAX. This is process-wide and isn't
+synchronized, so it should be set before any thread uses af_thread_buf.
+*/
+void af_thread_buf_set_max(size_t max_cap)
+{
+  thread_buf_max = max_cap;
+}
+
+/* release the memory of the calling thread's af_thread_buf */
+void af_thread_buf_trim(void)
+{
+  int ok;
+  af_buf *buf = af_thread_buf_get(&ok);
+
+  if(buf)
+    af_buf_free(buf);
+}
+
+#ifdef AF_ENABLE_STATS
+/* The counters of a thread. They're kept after the thread exits, so the
+   totals don't go down, and reused by a later thread. */
+struct af_stats_block {
+  af_stats stats;
+  size_t in_use;
+  struct af_stats_block *next;
+};
+
+/* the list of all the blocks, newest first */
+static struct af_stats_block *stats_blocks;
+
+/* the totals at the last reset, and the lock for them */
+static af_stats stats_baseline;
+static size_t stats_lock;
+
+/* the newest block of the list */
+static struct af_stats_block *af_stats_blocks(void)
+{
+  return (struct af_stats_block *)af_atomic_load_ptr((void **)&stats_blocks);
+}
+
+#ifdef _WIN32
+static void NTAPI af_stats_block_destroy(void *ptr)
+#else
+static void af_stats_block_destroy(void *ptr)
+#endif
+{
+  if(ptr)
+    af_atomic_cas(&((struct af_stats_block *)ptr)->in_use, 1, 0);
+}
+
+#ifdef _WIN32
+static DWORD stats_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE stats_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK af_stats_key_init(PINIT_ONCE once, PVOID param,
+                                       PVOID *context)
+{
+  (void)once;
+  (void)param;
+  (void)context;
+  stats_key = FlsAlloc(af_stats_block_destroy);
+  return TRUE;
+}
+
+static struct af_stats_block *af_stats_block_get(int *ok)
+{
+  InitOnceExecuteOnce(&stats_once, af_stats_key_init, NULL, NULL);
+  *ok = (stats_key != FLS_OUT_OF_INDEXES);
+  return *ok ? (struct af_stats_block *)FlsGetValue(stats_key) : NULL;
+}
+
+static int af_stats_block_set(struct af_stats_block *block)
+{
+  return FlsSetValue(stats_key, block) ? 0 : -1;
+}
+#elif defined(AF_HAVE_PTHREAD)
+static pthread_key_t stats_key;
+static int stats_key_ok;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void af_stats_key_init(void)
+{
+  stats_key_ok = !pthread_key_create(&stats_key, af_stats_block_destroy);
+}
+
+static struct af_stats_block *af_stats_block_get(int *ok)
+{
+  pthread_once(&stats_once, af_stats_key_init);
+  *ok = stats_key_ok;
+  return *ok ? (struct af_stats_block *)pthread_getspecific(stats_key) : NULL;
+}
+
+static int af_stats_block_set(struct af_stats_block *block)
+{
+  return pthread_setspecific(stats_key, block) ? -1 : 0;
+}
+#else
+/* no threads */
+static struct af_stats_block *stats_block;
+
+static struct af_stats_block *af_stats_block_get(int *ok)
+{
+  *ok = 1;
+  return stats_block;
+}
+
+static int af_stats_block_set(struct af_stats_block *block)
+{
+  stats_block = block;
+  return 0;
+}
+#endif
+
+/* return the counters of the calling thread, or NULL if it can't have any.
+   a block left by a thread that exited is reused before a new one is
+   allocated. */
+static af_stats *af_stats_local(void)
+{
+  int ok;
+  struct af_stats_block *block = af_stats_block_get(&ok);
+
+  if(block)
+    return &block->stats;
+
+  if(!ok)
+    return NULL;
+
+  for(block = af_stats_blocks(); block; block = block->next) {
+    if(af_atomic_cas(&block->in_use, 0, 1))
+      break;
+  }
+
+  if(!block) {
+    struct af_stats_block *head;
+    block = (struct af_stats_block *)calloc(1, sizeof(*block));
+    if(!block)
+      return NULL;
+    block->in_use = 1;
+    do {
+      head = af_stats_blocks();
+      block->next = head;
+    } while(!af_atomic_cas_ptr((void **)&stats_blocks, head, block));
+  }
+
+  if(af_stats_block_set(block)) {
+    af_stats_block_destroy(block);
+    return NULL;
+  }
+
+  return &block->stats;
+}
+
+/* add n to a counter of the calling thread. only the thread itself writes to
+   its counters so this doesn't need a locked instruction, the store only has
+   to be atomic for af_stats_snapshot. */
+static void af_stats_add(size_t offset, size_t n)
+{
+  af_stats *stats = af_stats_local();
+  size_t *p;
+
+  if(!stats)
+    return;
+
+  p = (size_t *)((char *)stats + offset);
+#if defined(AF_HAVE_ATOMIC_BUILTINS)
+  __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+#else
+  *(volatile size_t *)p = *p + n;
+#endif
+}
+
+/* count an append of len bytes in the fragment size histogram */
+static void af_stats_fragment(size_t len)
+{
+  size_t bucket = 0;
+
+  while(len && bucket < AF_STATS_BUCKETS - 1) {
+    len >>= 1;
+    ++bucket;
+  }
+
+  af_stats_add(offsetof(af_stats, fragment_sizes) + bucket * sizeof(size_t),
+               1);
+}
+#endif /* AF_ENABLE_STATS */
+
+/* get the instrumentation counters, totaled over all threads
+
+af_stats stats;
+if(!af_stats_snapshot(&stats, 0))
+  printf("%lu appends, %lu formatted twice\n",
+         (unsigned long)stats.calls, (unsigned long)stats.double_formats);
+
+The counters are only kept if append_format.c is compiled with
+AF_ENABLE_STATS defined. Each thread updates its own counters, without locked
+instructions or contention, and they're totaled on demand by this function.
+They count the appends to af_buf and char * strings (including batches and
+the _ex and writer functions):
+
+calls: appends
+bytes_formatted: bytes formatted (or written by a writer), not including
+                 separators
+reallocs: reallocations of the string, including allocations and those by
+          af_buf functions that aren't appends
+realloc_bytes: the capacity of the string before each reallocation that moved
+               it, an upper bound of the bytes copied
+double_formats: appends that were formatted twice because the output didn't
+                fit in the first pass
+crlf_trimmed: CR and LF removed by the AF_REMOVE_CR_LF_* flags
+errors: appends that failed with -1 (or an AF_ERR_ code other than
+        AF_ERR_FLAGS)
+flag_errors: appends that failed with -2 (AF_ERR_FLAGS)
+fragment_sizes: appends by the length of the formatted data. [0] is the empty
+                ones, [i] is the ones at least 2^(i-1) and less than 2^i
+                bytes long and [AF_STATS_BUCKETS - 1] is everything longer.
+
+If reset is nonzero then the counters are reset after they're read, so the
+next snapshot is what happened in between. Counts from threads that are
+appending while the snapshot is taken may or may not be included.
+
+success: 0
+failure: -1: the counters aren't compiled in; *stats is zeroed
+*/
+int af_stats_snapshot(af_stats *stats, int reset)
+{
+#ifdef AF_ENABLE_STATS
+  struct af_stats_block *block;
+  size_t i, count = sizeof(af_stats) / sizeof(size_t);
+  size_t *total = (size_t *)stats;
+  size_t *baseline = (size_t *)&stats_baseline;
+
+  memset(stats, 0, sizeof(*stats));
+
+  for(block = af_stats_blocks(); block; block = block->next) {
+    size_t *counters = (size_t *)&block->stats;
+    for(i = 0; i < count; ++i)
+      total[i] += af_atomic_load(&counters[i]);
+  }
+
+  while(!af_atomic_cas(&stats_lock, 0, 1))
+    af_yield();
+
+  for(i = 0; i < count; ++i) {
+    size_t n = total[i];
+    total[i] -= baseline[i];
+    if(reset)
+      baseline[i] = n;
+  }
+
+  af_atomic_cas(&stats_lock, 1, 0);
+  return 0;
+#else
+  (void)reset;
+  memset(stats, 0, sizeof(*stats));
+  return -1;
+#endif
+}
+
+/* initialize an empty rope
+
+af_rope rope;
+af_rope_init(&rope, 0);
+af_rope_append_sep_format(&rope, "; ", "%s=%d", key, value);
+...
+af_rope_flatten(&rope, &buf);  // buf is the whole string
+af_rope_free(&rope);
+
+A rope is a string stored in segments of seg_size bytes, or
+AF_ROPE_DEFAULT_SEGMENT_SIZE if seg_size is 0. Appending to a rope only
+allocates a new segment when the last one is full, and the string already in
+the rope is never copied, so the cost of an append is proportional to the size
+of the data appended no matter how long the string is. That avoids the large
+copies and the address space fragmentation of reallocating a contiguous string
+of many megabytes.
+
+The string is flattened to a contiguous string only when af_rope_flatten is
+called, or it can be read a segment at a time with af_rope_segment.
+*/
+void af_rope_init(af_rope *rope, size_t seg_size)
+{
+  rope->segs = NULL;
+  rope->nsegs = 0;
+  rope->segs_cap = 0;
+  rope->seg_size = seg_size ? seg_size : AF_ROPE_DEFAULT_SEGMENT_SIZE;
+  rope->len = 0;
+}
+
+/* free the segments of a rope and make it empty */
+void af_rope_free(af_rope *rope)
+{
+  size_t i;
+
+  for(i = 0; i < rope->nsegs; ++i)
+    free(rope->segs[i]);
+  free(rope->segs);
+
+  af_rope_init(rope, rope->seg_size);
+}
+
+/* allocate the segments for the first len bytes of a rope
+
+success: 0
+failure: -1: memory error; the segments that were allocated are kept
+*/
+static int af_rope_reserve(af_rope *rope, size_t len)
+{
+  size_t needed = len / rope->seg_size + !!(len % rope->seg_size);
+
+  if(needed > rope->segs_cap) {
+    char **segs;
+    size_t cap = rope->segs_cap ? rope->segs_cap : 16;
+    while(cap < needed)
+      cap *= 2;
+    segs = (char **)realloc(rope->segs, cap * sizeof(*segs));
+    if(!segs)
+      return -1;
+    rope->segs = segs;
+    rope->segs_cap = cap;
+  }
+
+  while(rope->nsegs < needed) {
+    char *seg = (char *)malloc(rope->seg_size);
+    if(!seg)
+      return -1;
+    rope->segs[rope->nsegs++] = seg;
+  }
+
+  return 0;
+}
+
+/* copy data to [offset, offset + n) of a rope. the segments must be
+   reserved. */
+static void af_rope_write(af_rope *rope, size_t offset, const char *data,
+                          size_t n)
+{
+  while(n) {
+    size_t i = offset / rope->seg_size;
+    size_t segoff = offset % rope->seg_size;
+    size_t count = rope->seg_size - segoff;
+    if(count > n)
+      count = n;
+    memcpy(&rope->segs[i][segoff], data, count);
+    offset += count;
+    data += count;
+    n -= count;
+  }
+}
+
+/* return the number of trailing CR and LF in the first len bytes of a rope */
+static size_t af_rope_count_trailing_crlf(const af_rope *rope, size_t len)
+{
+  size_t crlflen = 0;
+
+  while(len) {
+    size_t i = (len - 1) / rope->seg_size;
+    size_t seglen = len - i * rope->seg_size;
+    size_t n = af_count_trailing_crlf(rope->segs[i], seglen);
+    crlflen += n;
+    if(n != seglen)
+      break;
+    len -= n;
+  }
+
+  return crlflen;
+}
+
+/* append a separator (sep) and formatted data to a rope
+
+af_rope_append_flags_sep_format(&rope, 0, "; ", "%s=%d", key, value);
+
+This is the same as af_buf_append_flags_sep_format except that the string is
+a rope. The separator rules and flags are the same, and trailing CR and LF are
+removed across segment boundaries. The segments needed are allocated before
+the rope is modified, so a failed append leaves the string unchanged.
+
+success: the new length of the string
+failure: -1: vsnprintf/memory error; the string is unchanged
+failure: -2: unrecognized flag; the string is unchanged
+*/
+int af_rope_vappend_flags_sep_format(af_rope *rope, int flags,
+                                     const char *sep, const char *format,
+                                     va_list args)
+{
+  int count, retcode;
+  char scratch[AF_SCRATCH_SIZE];
+  char *dest, *data, *heap = NULL;
+  size_t oldlen, seplen, crlflen, pos, destsize, newlen, heapsize = 0;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS))
+    return -2;
+
+  oldlen = rope->len;
+  crlflen = 0;
+
+  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    crlflen = af_rope_count_trailing_crlf(rope, oldlen);
+
+  /* The data is formatted straight into the segment at the position it goes
+     if it isn't empty, and it's formatted again into a temporary buffer only
+     if it crosses into the next segment. Near the end of a segment, or if
+     the data would overwrite CR and LF that may not be removed if the append
+     fails, the data is formatted into the scratch buffer instead. */
+  seplen = (sep && (oldlen || (flags & AF_APPEND_SEP_IF_STR_EMPTY))) ?
+           strlen(sep) : 0;
+  pos = oldlen - crlflen + seplen;
+  destsize = rope->seg_size - pos % rope->seg_size;
+  if(pos >= oldlen && pos < (unsigned)INT_MAX &&
+     destsize >= sizeof(scratch) && !af_rope_reserve(rope, pos + 1))
+    dest = &rope->segs[pos / rope->seg_size][pos % rope->seg_size];
+  else {
+    dest = scratch;
+    destsize = sizeof(scratch);
+  }
+
+  count = af_format_spill(&data, dest, destsize, &heap, &heapsize, format,
+                          args);
+  if(count < 0) {
+    retcode = -1;
+    goto done;
+  }
+
+  if(!count && !(flags & AF_APPEND_SEP_IF_FORMAT_EMPTY))
+    seplen = 0;
+
+  newlen = oldlen - crlflen + seplen;
+  if(newlen < seplen || newlen + (size_t)count < newlen ||
+     newlen + (size_t)count > (unsigned)INT_MAX ||
+     af_rope_reserve(rope, newlen + (size_t)count)) {
+    retcode = -1;
+    goto done;
+  }
+
+  af_rope_write(rope, oldlen - crlflen, sep, seplen);
+  /* unless the data was formatted in place */
+  if(data != dest || dest == scratch)
+    af_rope_write(rope, newlen, data, (size_t)count);
+  newlen += (size_t)count;
+
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND))
+    newlen -= af_rope_count_trailing_crlf(rope, newlen);
+
+  rope->len = newlen;
+  retcode = (int)newlen;
+
+done:
+  free(heap);
+  return retcode;
+}
+
+int af_rope_append_flags_sep_format(af_rope *rope, int flags,
+                                    const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_rope_vappend_flags_sep_format(rope, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* return segment i of a rope and set *len to the length of the string in it
+
+for(i = 0; (seg = af_rope_segment(&rope, i, &len)); ++i)
+  fwrite(seg, 1, len, fp);
+
+The segment isn't null terminated.
+
+success: the segment
+failure: NULL: i is past the end of the string
+*/
+const char *af_rope_segment(const af_rope *rope, size_t i, size_t *len)
+{
+  size_t offset;
+
+  if(i >= rope->len / rope->seg_size + !!(rope->len % rope->seg_size))
+    return NULL;
+
+  offset = i * rope->seg_size;
+  *len = (rope->len - offset < rope->seg_size) ?
+         rope->len - offset : rope->seg_size;
+  return rope->segs[i];
+}
+
+/* append the string of a rope to buf as one contiguous string
+
+success: the new length of buf->str
+failure: -1: memory error; the content of buf->str is unchanged but if the
+             realloc was successful then the location may have changed
+*/
+int af_rope_flatten(const af_rope *rope, af_buf *buf)
+{
+  size_t i, len, needed;
+  const char *seg;
+
+  needed = buf->len + rope->len + 1;
+  if(needed <= rope->len || needed - 1 > (unsigned)INT_MAX ||
+     af_buf_grow(buf, needed, 0))
+    return -1;
+
+  for(i = 0; (seg = af_rope_segment(rope, i, &len)); ++i) {
+    memcpy(&buf->str[buf->len], seg, len);
+    buf->len += len;
+  }
+
+  buf->str[buf->len] = '\0';
+  return (int)buf->len;
+}
+
+/* af_sink destinations */
+#define AF_SINK_CALLBACK 0
+#define AF_SINK_FILE 1
+#define AF_SINK_FD 2
+
+static void af_sink_init(af_sink *sink, int type)
+{
+  sink->type = type;
+  sink->writer = NULL;
+  sink->ctx = NULL;
+  sink->fp = NULL;
+  sink->fd = -1;
+  sink->len = 0;
+  sink->buflen = 0;
+  sink->crlf = NULL;
+  sink->crlflen = 0;
+  sink->crlfcap = 0;
+  sink->spill = NULL;
+  sink->spillcap = 0;
+  sink->error = 0;
+}
+
+/* initialize a sink that writes to a callback
+
+af_sink sink;
+af_sink_init_callback(&sink, writer, ctx);  // or af_sink_init_file/_fd
+af_sink_append_sep_format(&sink, "; ", "%s=%d", key, value);
+...
+af_sink_finish(&sink);
+
+A sink is a string that's written to a destination as it's appended to,
+instead of being kept in memory. The separator rules and flags are the same
+as append_flags_sep_format, as if the string were everything written to the
+sink so far. The output is buffered in the sink so small appends are written
+in batches.
+
+Trailing CR and LF can still be removed by a later append, so they're held
+back by the sink until data that isn't CR or LF is appended after them, or
+until the sink is finished. Other than that only the buffer of
+AF_SINK_BUFFER_SIZE bytes is in memory, and the largest append that didn't
+fit the free space of the buffer, which is kept for the next one.
+
+writer is called with ctx and the data to write, and it must return 0 if all
+of the data was written or -1 on failure.
+
+af_sink_finish must be called to write the held back and buffered output.
+*/
+void af_sink_init_callback(af_sink *sink, af_sink_writer writer, void *ctx)
+{
+  af_sink_init(sink, AF_SINK_CALLBACK);
+  sink->writer = writer;
+  sink->ctx = ctx;
+}
+
+/* initialize a sink that writes to fp. fp isn't closed by the sink. */
+void af_sink_init_file(af_sink *sink, FILE *fp)
+{
+  af_sink_init(sink, AF_SINK_FILE);
+  sink->fp = fp;
+}
+
+/* initialize a sink that writes to the file descriptor fd, with writev if
+   the OS has it. fd isn't closed by the sink. */
+void af_sink_init_fd(af_sink *sink, int fd)
+{
+  af_sink_init(sink, AF_SINK_FD);
+  sink->fd = fd;
+}
+
+struct af_piece {
+  const char *data;
+  size_t len;
+};
+
+/* write all of data to the file descriptor of sink.
+   success: 0. failure: -1 */
+static int af_sink_write_fd(af_sink *sink, const char *data, size_t len)
+{
+  while(len) {
+#ifdef _WIN32
+    int n = _write(sink->fd, data, (len > INT_MAX) ? INT_MAX : (unsigned)len);
+#else
+    ssize_t n = write(sink->fd, data, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+#endif
+    if(n <= 0)
+      return -1;
+    data += n;
+    len -= (size_t)n;
+  }
+
+  return 0;
+}
+
+/* write the buffered output of sink and then pieces to the destination, and
+   empty the buffer.
+   success: 0. failure: -1 */
+static int af_sink_write_out(af_sink *sink, struct af_piece *pieces,
+                             int npieces)
+{
+  int i;
+  struct af_piece all[4];
+  int nall = 0;
+
+  if(sink->buflen) {
+    all[nall].data = sink->buf;
+    all[nall].len = sink->buflen;
+    ++nall;
+  }
+  for(i = 0; i < npieces; ++i) {
+    if(pieces[i].len)
+      all[nall++] = pieces[i];
+  }
+
+  sink->buflen = 0;
+
+#ifdef AF_HAVE_WRITEV
+  if(sink->type == AF_SINK_FD) {
+    /* one system call for all the pieces, unless the write is partial */
+    struct iovec iov[4];
+    int first = 0;
+
+    for(i = 0; i < nall; ++i) {
+      iov[i].iov_base = (void *)all[i].data;
+      iov[i].iov_len = all[i].len;
+    }
+
+    while(first < nall) {
+      ssize_t n = writev(sink->fd, &iov[first], nall - first);
+      if(n < 0 && errno == EINTR)
+        continue;
+      if(n <= 0)
+        return -1;
+      while(first < nall && (size_t)n >= iov[first].iov_len) {
+        n -= (ssize_t)iov[first].iov_len;
+        ++first;
+      }
+      if(first < nall) {
+        iov[first].iov_base = (char *)iov[first].iov_base + n;
+        iov[first].iov_len -= (size_t)n;
+      }
+    }
+
+    return 0;
+  }
+#endif
+
+  for(i = 0; i < nall; ++i) {
+    if(sink->type == AF_SINK_CALLBACK) {
+      if(sink->writer(sink->ctx, all[i].data, all[i].len))
+        return -1;
+    }
+    else if(sink->type == AF_SINK_FILE) {
+      if(fwrite(all[i].data, 1, all[i].len, sink->fp) != all[i].len)
+        return -1;
+    }
+    else if(af_sink_write_fd(sink, all[i].data, all[i].len))
+      return -1;
+  }
+
+  return 0;
+}
+
+/* write pieces to the sink, through the buffer if they fit in it.
+   success: 0. failure: -1 */
+static int af_sink_put(af_sink *sink, struct af_piece *pieces, int npieces)
+{
+  int i;
+  size_t total = 0;
+
+  for(i = 0; i < npieces; ++i)
+    total += pieces[i].len;
+
+  if(total > sizeof(sink->buf) - sink->buflen)
+    return af_sink_write_out(sink, pieces, npieces);
+
+  for(i = 0; i < npieces; ++i) {
+    if(pieces[i].len) {
+      memcpy(&sink->buf[sink->buflen], pieces[i].data, pieces[i].len);
+      sink->buflen += pieces[i].len;
+    }
+  }
+
+  return 0;
+}
+
+/* append a separator (sep) and formatted data to a sink
+
+af_sink_append_flags_sep_format(&sink, 0, "; ", "%s=%d", key, value);
+
+This is the same as append_flags_sep_format except that the string is written
+to the destination of the sink. See af_sink_init_callback.
+
+success: 0. The length of the string so far is sink->len.
+failure: -1: vsnprintf/memory error; the string is unchanged
+failure: -1: write error; the sink is failed and every append after this
+             fails
+failure: -2: unrecognized flag; the string is unchanged
+*/
+int af_sink_vappend_flags_sep_format(af_sink *sink, int flags,
+                                     const char *sep, const char *format,
+                                     va_list args)
+{
+  int count;
+  char scratch[AF_SCRATCH_SIZE];
+  char *dest, *data;
+  size_t n, seplen, datacrlf, sepcrlf, oldlen, crlflen, needed, pos, destsize;
+  struct af_piece pieces[3];
+
+  if(sink->error)
+    return -1;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS))
+    return -2;
+
+  oldlen = sink->len;
+  crlflen = sink->crlflen;
+
+  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND)) {
+    oldlen -= crlflen;
+    crlflen = 0;
+  }
+
+  seplen = (sep && (sink->len || (flags & AF_APPEND_SEP_IF_STR_EMPTY))) ?
+           strlen(sep) : 0;
+
+  /* The data is formatted into the buffer after the held back CR and LF and
+     the separator, which is where it's written if it isn't empty and doesn't
+     end in CR or LF. It's formatted into the scratch buffer instead if the
+     free space of the buffer isn't any larger, and it's formatted again into
+     the spill buffer of the sink if it doesn't fit either one. */
+  pos = sink->buflen + crlflen + seplen;
+  if(pos >= seplen && pos < sizeof(sink->buf) &&
+     sizeof(sink->buf) - pos > sizeof(scratch)) {
+    dest = &sink->buf[pos];
+    destsize = sizeof(sink->buf) - pos;
+  }
+  else {
+    dest = scratch;
+    destsize = sizeof(scratch);
+  }
+
+  count = af_format_spill(&data, dest, destsize, &sink->spill,
+                          &sink->spillcap, format, args);
+  if(count < 0)
+    return -1;
+
+  n = (size_t)count;
+
+  if(!n && !(flags & AF_APPEND_SEP_IF_FORMAT_EMPTY))
+    seplen = 0;
+
+  if(!seplen)
+    sep = "";
+
+  /* The trailing CR and LF of sep and the data are held back */
+  datacrlf = af_count_trailing_crlf(data, n);
+  sepcrlf = (datacrlf == n) ? af_count_trailing_crlf(sep, seplen) : 0;
+
+  needed = sepcrlf + datacrlf;
+  if(datacrlf == n && sepcrlf == seplen)
+    needed += crlflen;
+  if(needed > sink->crlfcap) {
+    size_t cap = sink->crlfcap ? sink->crlfcap : 16;
+    char *crlf;
+    while(cap < needed)
+      cap *= 2;
+    crlf = (char *)realloc(sink->crlf, cap);
+    if(!crlf)
+      return -1;
+    sink->crlf = crlf;
+    sink->crlfcap = cap;
+  }
+
+  if(datacrlf == n && sepcrlf == seplen) {
+    /* only CR and LF were appended, if anything */
+    if(seplen + n) {
+      memcpy(&sink->crlf[crlflen], sep, seplen);
+      memcpy(&sink->crlf[crlflen + seplen], data, n);
+      crlflen += seplen + n;
+    }
+  }
+  else if(data == dest && dest != scratch) {
+    /* the data was formatted in place so only what goes before it is
+       copied. if part of sep is held back then the data is only CR and LF,
+       so none of it is written and it doesn't have to be moved. */
+    if(crlflen)
+      memcpy(&sink->buf[sink->buflen], sink->crlf, crlflen);
+    memcpy(&sink->buf[sink->buflen + crlflen], sep, seplen - sepcrlf);
+    sink->buflen += crlflen + seplen - sepcrlf + n - datacrlf;
+    if(sepcrlf + datacrlf) {
+      memcpy(sink->crlf, &sep[seplen - sepcrlf], sepcrlf);
+      memcpy(&sink->crlf[sepcrlf], &data[n - datacrlf], datacrlf);
+    }
+    crlflen = sepcrlf + datacrlf;
+  }
+  else {
+    pieces[0].data = sink->crlf;
+    pieces[0].len = crlflen;
+    pieces[1].data = sep;
+    pieces[1].len = seplen - sepcrlf;
+    pieces[2].data = data;
+    pieces[2].len = n - datacrlf;
+    if(af_sink_put(sink, pieces, 3)) {
+      sink->error = -1;
+      return -1;
+    }
+    /* sink->crlf isn't allocated if nothing is held back */
+    if(sepcrlf + datacrlf) {
+      memcpy(sink->crlf, &sep[seplen - sepcrlf], sepcrlf);
+      memcpy(&sink->crlf[sepcrlf], &data[n - datacrlf], datacrlf);
+    }
+    crlflen = sepcrlf + datacrlf;
+  }
+
+  sink->len = oldlen + seplen + n;
+
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND)) {
+    sink->len -= crlflen;
+    crlflen = 0;
+  }
+
+  sink->crlflen = crlflen;
+  return 0;
+}
+
+int af_sink_append_flags_sep_format(af_sink *sink, int flags,
+                                    const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_sink_vappend_flags_sep_format(sink, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* write the output buffered by a sink to its destination. CR and LF that are
+   held back aren't written.
+
+success: 0
+failure: -1: write error; the sink is failed
+*/
+int af_sink_flush(af_sink *sink)
+{
+  if(sink->error)
+    return -1;
+
+  if(af_sink_write_out(sink, NULL, 0) ||
+     (sink->type == AF_SINK_FILE && fflush(sink->fp)))
+    sink->error = -1;
+
+  return sink->error;
+}
+
+/* write all output of a sink, including the CR and LF that are held back, and
+   free its memory. The sink must be initialized again to be used again.
+
+success: 0
+failure: -1: write error, or a previous append failed due to a write error
+*/
+int af_sink_finish(af_sink *sink)
+{
+  int retcode = sink->error;
+
+  if(!retcode) {
+    struct af_piece crlf;
+    crlf.data = sink->crlf;
+    crlf.len = sink->crlflen;
+    if(af_sink_write_out(sink, &crlf, 1) ||
+       (sink->type == AF_SINK_FILE && fflush(sink->fp)))
+      retcode = -1;
+  }
+
+  free(sink->crlf);
+  sink->crlf = NULL;
+  sink->crlflen = 0;
+  sink->crlfcap = 0;
+  free(sink->spill);
+  sink->spill = NULL;
+  sink->spillcap = 0;
+  sink->error = retcode;
+  return retcode;
+}
+
+/* The maximum number of entries an append to an af_iov can add. %s arguments
+   after that are copied. */
+#define AF_IOV_STAGE_MAX 16
+
+/* initialize an empty iovec builder
+
+af_iov iov;
+af_iov_init(&iov, 0);
+af_iov_append_sep_format(&iov, "\r\n", "%s: %s", name, large_value);
+...
+af_iov_writev(&iov, fd);  // or af_iov_vec for sendmsg
+af_iov_free(&iov);
+
+An af_iov is a string stored as an array of iovecs, ready for writev or
+sendmsg. Data that's formatted is copied into memory owned by the af_iov, as
+usual, but a separator or a %s argument that's at least min_ref bytes long
+(AF_IOV_DEFAULT_MIN_REF if min_ref is 0) is stored by reference instead, so
+large payloads are never copied. Consecutive small appends share an iovec.
+
+A %s argument is referenced only if the conversion is exactly "%s", with no
+flags, width or precision. A referenced separator or argument must not be
+modified or freed until the af_iov is no longer used.
+
+The memory the af_iov owns is allocated from an arena and is released by
+af_iov_free.
+*/
+void af_iov_init(af_iov *iov, size_t min_ref)
+{
+  iov->vec = NULL;
+  iov->count = 0;
+  iov->cap = 0;
+  iov->len = 0;
+  iov->min_ref = min_ref ? min_ref : AF_IOV_DEFAULT_MIN_REF;
+  iov->tail_cap = 0;
+  af_arena_init(&iov->arena, 0);
+}
+
+/* free the memory of an af_iov and make it empty */
+void af_iov_free(af_iov *iov)
+{
+  free(iov->vec);
+  af_arena_free(&iov->arena);
+  af_iov_init(iov, iov->min_ref);
+}
+
+/* The entries an append is staged in before it's added to the af_iov */
+struct af_iov_stage {
+  af_iovec vec[AF_IOV_STAGE_MAX];
+  size_t cap[AF_IOV_STAGE_MAX];   /* allocation size of a copy, 0 if a ref */
+  size_t count;
+  size_t len;
+  af_buf run;   /* the copy that's being appended to */
+};
+
+/* end the copy that's being appended to */
+static int af_iov_stage_end_run(af_iov *iov, struct af_iov_stage *stage)
+{
+  if(stage->run.len) {
+    stage->vec[stage->count].iov_base = stage->run.str;
+    stage->vec[stage->count].iov_len = stage->run.len;
+    stage->cap[stage->count] = stage->run.cap;
+    ++stage->count;
+    stage->len += stage->run.len;
+  }
+  af_buf_init_allocator(&stage->run, &iov->arena.allocator);
+  return 0;
+}
+
+/* stage data to be copied, or referenced if it's long enough and ref.
+   success: 0. failure: -1 */
+static int af_iov_stage_data(af_iov *iov, struct af_iov_stage *stage,
+                             const char *data, size_t n, int ref)
+{
+  /* two entries for the current copy and the reference, and one for any copy
+     after it */
+  if(ref && n >= iov->min_ref && stage->count + 3 <= AF_IOV_STAGE_MAX) {
+    af_iov_stage_end_run(iov, stage);
+    stage->vec[stage->count].iov_base = (void *)data;
+    stage->vec[stage->count].iov_len = n;
+    stage->cap[stage->count] = 0;
+    ++stage->count;
+    stage->len += n;
+    return 0;
+  }
+
+  if(!n)
+    return 0;
+
+  if(af_buf_grow(&stage->run, stage->run.len + n + 1, 0))
+    return -1;
+  memcpy(&stage->run.str[stage->run.len], data, n);
+  stage->run.len += n;
+  return 0;
+}
+
+/* stage the formatted data of format and args.
+   success: 0. failure: -1 */
+static int af_iov_stage_format(af_iov *iov, struct af_iov_stage *stage,
+                               const char *format, va_list args)
+{
+  int count;
+  va_list args_copy;
+
+#ifndef AF_NO_FAST_FORMAT
+  struct af_spec spec;
+  union af_arg arg;
+  const char *p;
+
+  /* The arguments are fetched one at a time, so make sure the whole format is
+     supported by the built-in formatter before the first one is fetched */
+  for(p = format; (p = strchr(p, '%')); p += spec.len) {
+    if(af_parse_spec(p, &spec))
+      break;
+  }
+
+  if(!p) {
+    va_copy(args_copy, args);
+    for(p = format; ; p += spec.len) {
+      const char *pct = p;
+      struct af_out out;
+
+      while(*pct && *pct != '%')
+        ++pct;
+
+      if(af_iov_stage_data(iov, stage, p, (size_t)(pct - p), 0))
+        break;
+
+      if(!*pct) {
+        va_end(args_copy);
+        return 0;
+      }
+
+      p = pct;
+      af_parse_spec(p, &spec);
+      af_fetch_arg(&spec, &arg, &args_copy);
+
+      if(spec.argtype == AF_ARG_STR && !spec.length && !spec.flags &&
+         spec.width == -1 && spec.precision == -1 && arg.s) {
+        if(af_iov_stage_data(iov, stage, arg.s, strlen(arg.s), 1))
+          break;
+        continue;
+      }
+
+      /* render into the copy, growing it if the output doesn't fit */
+      for(;;) {
+        out.dest = stage->run.str ? &stage->run.str[stage->run.len] : NULL;
+        out.size = stage->run.str ? stage->run.cap - stage->run.len : 0;
+        out.len = 0;
+        out.error = 0;
+        out.escape = 0;
+        out.shortest = 0;
+        af_render(&out, &spec, &arg);
+        if(out.error || out.len < out.size ||
+           af_buf_grow(&stage->run, stage->run.len + out.len + 1, 0))
+          break;
+      }
+      if(out.error || out.len >= out.size)
+        break;
+      stage->run.len += out.len;
+    }
+    va_end(args_copy);
+    return -1;
+  }
+#else
+  (void)iov;
+#endif
+
+  /* format the whole data into the copy */
+  va_copy(args_copy, args);
+  count = af_format(stage->run.str ? &stage->run.str[stage->run.len] : NULL,
+                    stage->run.str ? stage->run.cap - stage->run.len : 0,
+                    format, args_copy);
+  va_end(args_copy);
+
+  if(count < 0)
+    return -1;
+
+  if(!stage->run.str || (size_t)count >= stage->run.cap - stage->run.len) {
+    if(af_buf_grow(&stage->run, stage->run.len + (size_t)count + 1, 0))
+      return -1;
+    va_copy(args_copy, args);
+    count = af_format(&stage->run.str[stage->run.len],
+                      stage->run.cap - stage->run.len, format, args_copy);
+    va_end(args_copy);
+    if(count < 0 || (size_t)count >= stage->run.cap - stage->run.len)
+      return -1;
+  }
+
+  stage->run.len += (size_t)count;
+  return 0;
+}
+
+/* remove all trailing CR and LF from an af_iov. references are shortened,
+   they aren't modified. */
+static void af_iov_remove_crlf(af_iov *iov)
+{
+  while(iov->count) {
+    af_iovec *v = &iov->vec[iov->count - 1];
+    size_t n = af_count_trailing_crlf((const char *)v->iov_base, v->iov_len);
+    v->iov_len -= n;
+    iov->len -= n;
+    if(v->iov_len)
+      break;
+    --iov->count;
+    iov->tail_cap = 0;
+  }
+}
+
+/* append a separator (sep) and formatted data to an af_iov
+
+af_iov_append_flags_sep_format(&iov, 0, "\r\n", "%s: %s", name, value);
+
+This is the same as af_buf_append_flags_sep_format except that the string is
+an af_iov, and a long separator or %s argument is referenced instead of
+copied. See af_iov_init. The separator rules and flags are the same, and
+trailing CR and LF are removed from references by shortening them.
+
+success: the new length of the string
+failure: -1: vsnprintf/memory error; the string is unchanged
+failure: -2: unrecognized flag; the string is unchanged
+*/
+int af_iov_vappend_flags_sep_format(af_iov *iov, int flags, const char *sep,
+                                    const char *format, va_list args)
+{
+  struct af_iov_stage stage;
+  size_t seplen = 0, first = 0, i;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS))
+    return -2;
+
+  stage.count = 0;
+  stage.len = 0;
+  af_buf_init_allocator(&stage.run, &iov->arena.allocator);
+
+  /* The separator is staged first and dropped if the data is empty */
+  if(sep && (iov->len || (flags & AF_APPEND_SEP_IF_STR_EMPTY))) {
+    seplen = strlen(sep);
+    if(af_iov_stage_data(iov, &stage, sep, seplen, 1))
+      return -1;
+  }
+
+  if(af_iov_stage_format(iov, &stage, format, args))
+    return -1;
+
+  af_iov_stage_end_run(iov, &stage);
+
+  if(stage.len == seplen && !(flags & AF_APPEND_SEP_IF_FORMAT_EMPTY)) {
+    stage.count = 0;
+    stage.len = 0;
+  }
+
+  if(iov->len + stage.len < stage.len ||
+     iov->len + stage.len > (unsigned)INT_MAX)
+    return -1;
+
+  if(iov->count + stage.count > iov->cap) {
+    size_t cap = iov->cap ? iov->cap : 16;
+    af_iovec *vec;
+    while(cap < iov->count + stage.count)
+      cap *= 2;
+    vec = (af_iovec *)realloc(iov->vec, cap * sizeof(*vec));
+    if(!vec)
+      return -1;
+    iov->vec = vec;
+    iov->cap = cap;
+  }
+
+  /* Nothing can fail after this */
+
+  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    af_iov_remove_crlf(iov);
+
+  /* A copy that fits in the unused capacity of the last copy is merged into it
+     so that small appends share an iovec */
+  if(stage.count && stage.cap[0] && iov->count && iov->tail_cap &&
+     iov->tail_cap - iov->vec[iov->count - 1].iov_len > stage.vec[0].iov_len) {
+    af_iovec *tail = &iov->vec[iov->count - 1];
+    memcpy((char *)tail->iov_base + tail->iov_len, stage.vec[0].iov_base,
+           stage.vec[0].iov_len);
+    tail->iov_len += stage.vec[0].iov_len;
+    first = 1;
+  }
+
+  for(i = first; i < stage.count; ++i)
+    iov->vec[iov->count++] = stage.vec[i];
+
+  if(stage.count > first)
+    iov->tail_cap = stage.cap[stage.count - 1];
+
+  iov->len += stage.len;
+
+  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND))
+    af_iov_remove_crlf(iov);
+
+  return (int)iov->len;
+}
+
+int af_iov_append_flags_sep_format(af_iov *iov, int flags, const char *sep,
+                                   const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_iov_vappend_flags_sep_format(iov, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* return the iovecs of an af_iov and set *count to the number of them. the
+   iovecs are valid until the next append. */
+const af_iovec *af_iov_vec(const af_iov *iov, size_t *count)
+{
+  *count = iov->count;
+  return iov->vec;
+}
+
+/* write the string of an af_iov to the file descriptor fd with writev, as many
+   iovecs at a time as the OS allows
+
+success: 0
+failure: -1: write error; some of the string may have been written
+*/
+int af_iov_writev(const af_iov *iov, int fd)
+{
+  size_t i;
+
+#ifdef AF_HAVE_WRITEV
+  af_iovec *vec;
+  size_t count = iov->count;
+  long iov_max = sysconf(_SC_IOV_MAX);
+
+  if(iov_max <= 0)
+    iov_max = 16;
+
+  /* partial writes modify the iovecs so write a copy */
+  vec = (af_iovec *)malloc((count ? count : 1) * sizeof(*vec));
+  if(!vec)
+    return -1;
+  memcpy(vec, iov->vec, count * sizeof(*vec));
+
+  for(i = 0; i < count;) {
+    int n = (count - i > (size_t)iov_max) ? (int)iov_max : (int)(count - i);
+    ssize_t written = writev(fd, &vec[i], n);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written < 0 || (!written && vec[i].iov_len)) {
+      free(vec);
+      return -1;
+    }
+    while(i < count && (size_t)written >= vec[i].iov_len) {
+      written -= (ssize_t)vec[i].iov_len;
+      ++i;
+    }
+    if(i < count) {
+      vec[i].iov_base = (char *)vec[i].iov_base + written;
+      vec[i].iov_len -= (size_t)written;
+    }
+  }
+
+  free(vec);
+  return 0;
+#else
+  af_sink sink;
+  af_sink_init_fd(&sink, fd);
+  for(i = 0; i < iov->count; ++i) {
+    if(af_sink_write_fd(&sink, (const char *)iov->vec[i].iov_base,
+                        iov->vec[i].iov_len))
+      return -1;
+  }
+  return 0;
+#endif
+}
+
+/* append the string of an af_iov to buf as one contiguous string
+
+success: the new length of buf->str
+failure: -1: memory error; the content of buf->str is unchanged but if the
+             realloc was successful then the location may have changed
+*/
+int af_iov_flatten(const af_iov *iov, af_buf *buf)
+{
+  size_t i, needed;
+
+  needed = buf->len + iov->len + 1;
+  if(needed <= iov->len || needed - 1 > (unsigned)INT_MAX ||
+     af_buf_grow(buf, needed, 0))
+    return -1;
+
+  for(i = 0; i < iov->count; ++i) {
+    memcpy(&buf->str[buf->len], iov->vec[i].iov_base, iov->vec[i].iov_len);
+    buf->len += iov->vec[i].iov_len;
+  }
+
+  buf->str[buf->len] = '\0';
+  return (int)buf->len;
+}
+
+/* the type of a record */
+#define AF_DEFER_PAD    0   /* skipped, it fills the end of the ring */
+#define AF_DEFER_ARGS   1   /* the arguments of the conversions of format */
+#define AF_DEFER_TEXT   2   /* data that was formatted when it was recorded */
+
+/* The header of a record, which is followed by its arguments or text. Records
+   are aligned to AF_ARENA_ALIGN. */
+struct af_defer_rec {
+  size_t size;          /* the size of the record including the header */
+  int type;
+  int flags;
+  const char *sep;
+  const char *format;   /* AF_DEFER_ARGS */
+  size_t len;           /* AF_DEFER_TEXT: the length of the text */
+};
+
+#define AF_DEFER_HEADER_SIZE AF_ARENA_ROUND_UP(sizeof(struct af_defer_rec))
+
+/* the end of the ring is skipped if it's too small for a header */
+#define AF_DEFER_MIN_RING_SIZE 1024
+
+#ifndef AF_NO_FAST_FORMAT
+/* The arguments of an AF_DEFER_ARGS record are stored one after another in the
+   order of the conversions, each in a whole number of slots. An int for a *
+   width or precision comes before the argument it's for. A %s or %ls string is
+   a size_t length, or (size_t)-1 for NULL, followed by a copy with a
+   terminator. */
+#define AF_DEFER_SLOT 8
+
+#define AF_DEFER_SLOTS(n) \
+  (((n) + (AF_DEFER_SLOT - 1)) & ~(size_t)(AF_DEFER_SLOT - 1))
+
+/* the conversions of a format are cached if it's shorter than this */
+#define AF_DEFER_FORMAT_MAX 64
+
+/* a format with more conversions than this is formatted when it's recorded */
+#define AF_DEFER_CONV_MAX 16
+
+/* the number of formats a ring caches, a power of 2 */
+#define AF_DEFER_CACHE_SIZE 8
+
+/* a conversion that takes an argument */
+struct af_defer_conv {
+  unsigned char argtype;          /* enum af_argtype */
+  unsigned char length;           /* af_spec.length */
+  unsigned char star_width;
+  unsigned char star_precision;
+};
+
+/* The conversions of a format, cached by the producer so that the format isn't
+   parsed by every append. The text of the format is kept to check that the
+   format at that address hasn't changed. */
+struct af_defer_format {
+  const char *format;   /* NULL if the entry is empty */
+  int nconv;            /* -1 if the format is formatted when it's recorded */
+  struct af_defer_conv conv[AF_DEFER_CONV_MAX];
+  char text[AF_DEFER_FORMAT_MAX];
+};
+#endif
+
+/* The ring of a producer of an af_defer. It's a single producer, single
+   consumer queue of records. head and tail count every byte ever written and
+   drained, and the offset in data is their remainder by the size of data. */
+struct af_defer_ring {
+  /* written by the producer */
+  size_t head;          /* the end of the published records */
+  size_t tail_cache;    /* the tail when the producer last loaded it */
+  char pad1[64 - 2 * sizeof(size_t)];
+  /* written by the consumer */
+  size_t tail;          /* the end of the drained records */
+  char pad2[64 - sizeof(size_t)];
+  size_t attached;      /* nonzero while a producer uses the ring */
+  size_t mask;          /* the size of data, a power of 2, minus 1 */
+  char *data;
+  af_defer_ring *next;
+#ifndef AF_NO_FAST_FORMAT
+  struct af_defer_format cache[AF_DEFER_CACHE_SIZE];
+#endif
+};
+
+/* initialize a queue of appends whose formatting is deferred
+
+af_defer defer;
+af_defer_init(&defer, 0);
+... each producer thread:
+    af_defer_ring *ring = af_defer_attach(&defer);
+    af_defer_append_sep_format(ring, "; ", "%s=%d", key, value);
+    af_defer_detach(ring);
+... the consumer thread:
+    af_defer_drain(&defer, &buf);
+af_defer_free(&defer);
+
+An append to an af_defer only records what to format: the format and separator
+pointers, the flags, and the arguments in binary. The consumer formats the
+records later and appends them to a string, so the cost of formatting isn't
+paid by the producer. Each producer thread has a ring of its own, of ring_size
+bytes (rounded up to a power of 2) or AF_DEFER_DEFAULT_RING_SIZE if ring_size
+is 0, that it writes to without a lock and the consumer reads from without a
+lock.
+
+The appends of a producer are drained in the order they were recorded, but the
+appends of different producers aren't ordered relative to each other.
+
+af_defer_free must not be called while threads are appending or draining.
+*/
+void af_defer_init(af_defer *defer, size_t ring_size)
+{
+  size_t size = AF_DEFER_MIN_RING_SIZE;
+
+  if(!ring_size)
+    ring_size = AF_DEFER_DEFAULT_RING_SIZE;
+  while(size < ring_size && size <= (unsigned)INT_MAX / 2)
+    size *= 2;
+
+  defer->rings = NULL;
+  defer->ring_size = size;
+  defer->failed = 0;
+  af_buf_init(&defer->scratch);
+}
+
+/* free the rings of an af_defer and make it empty */
+void af_defer_free(af_defer *defer)
+{
+  af_defer_ring *ring = defer->rings;
+
+  while(ring) {
+    af_defer_ring *next = ring->next;
+    free(ring->data);
+    free(ring);
+    ring = next;
+  }
+
+  af_buf_free(&defer->scratch);
+  af_defer_init(defer, defer->ring_size);
+}
+
+/* return a ring for the calling producer thread
+
+A ring must be used by only one thread at a time. A thread usually attaches a
+ring once when it starts and detaches it when it's done. A ring that was
+detached is reused by the next attach, and any appends it still holds are
+drained as usual.
+
+success: the ring
+failure: NULL: memory error
+*/
+af_defer_ring *af_defer_attach(af_defer *defer)
+{
+  af_defer_ring *ring, *head;
+#ifndef AF_NO_FAST_FORMAT
+  int i;
+#endif
+
+  for(ring = (af_defer_ring *)af_atomic_load_ptr((void **)&defer->rings);
+      ring; ring = ring->next) {
+    if(!af_atomic_load(&ring->attached) &&
+       af_atomic_cas(&ring->attached, 0, 1))
+      return ring;
+  }
+
+  ring = (af_defer_ring *)malloc(sizeof(*ring));
+  if(!ring)
+    return NULL;
+
+  ring->data = (char *)malloc(defer->ring_size);
+  if(!ring->data) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->head = 0;
+  ring->tail_cache = 0;
+  ring->tail = 0;
+  ring->attached = 1;
+  ring->mask = defer->ring_size - 1;
+#ifndef AF_NO_FAST_FORMAT
+  for(i = 0; i < AF_DEFER_CACHE_SIZE; ++i)
+    ring->cache[i].format = NULL;
+#endif
+
+  do {
+    head = (af_defer_ring *)af_atomic_load_ptr((void **)&defer->rings);
+    ring->next = head;
+  } while(!af_atomic_cas_ptr((void **)&defer->rings, head, ring));
+
+  return ring;
+}
+
+/* give up a ring so that another producer thread can attach it */
+void af_defer_detach(af_defer_ring *ring)
+{
+  af_atomic_store(&ring->attached, 0);
+}
+
+#ifndef AF_NO_FAST_FORMAT
+/* return the conversions of a format, from the cache of a ring if possible.
+   uncached is used for a format that's too long to cache.
+   failure: NULL: the format has to be formatted by the C library */
+static const struct af_defer_format *af_defer_parse(
+  af_defer_ring *ring, const char *format, struct af_defer_format *uncached)
+{
+  struct af_defer_format *f = &ring->cache[((uintptr_t)format / sizeof(void *))
+                                           & (AF_DEFER_CACHE_SIZE - 1)];
+  struct af_spec spec;
+  const char *p = format;
+  size_t len;
+
+  if(f->format == format && !strncmp(f->text, format, AF_DEFER_FORMAT_MAX))
+    return (f->nconv < 0) ? NULL : f;
+
+  len = strlen(format);
+  if(len >= AF_DEFER_FORMAT_MAX)
+    f = uncached;
+
+  f->format = NULL;
+  f->nconv = 0;
+
+  while((p = strchr(p, '%'))) {
+    struct af_defer_conv *conv;
+
+    if(af_parse_spec(p, &spec)) {
+      f->nconv = -1;
+      break;
+    }
+
+    p += spec.len;
+
+    if(spec.argtype == AF_ARG_NONE)
+      continue;
+
+    if(f->nconv == AF_DEFER_CONV_MAX) {
+      f->nconv = -1;
+      break;
+    }
+
+    conv = &f->conv[f->nconv++];
+    conv->argtype = (unsigned char)spec.argtype;
+    conv->length = (unsigned char)spec.length;
+    conv->star_width = (spec.width == AF_SPEC_STAR);
+    conv->star_precision = (spec.precision == AF_SPEC_STAR);
+  }
+
+  if(f != uncached) {
+    memcpy(f->text, format, len + 1);
+    f->format = format;
+  }
+
+  return (f->nconv < 0) ? NULL : f;
+}
+
+/* copy n bytes of data to rec at offset, if they fit in avail, and pad them
+   with zeros to a whole number of slots that has room for term more zeros.
+   return the offset after the slots. */
+static size_t af_defer_put(char *rec, size_t avail, size_t offset,
+                           const void *data, size_t n, size_t term)
+{
+  size_t size = AF_DEFER_SLOTS(n + term);
+
+  if(offset <= avail && size <= avail - offset) {
+    memcpy(&rec[offset], data, n);
+    memset(&rec[offset + n], 0, size - n);
+  }
+
+  return offset + size;
+}
+
+/* copy the arguments of the conversions f of a format to rec, after the
+   header. rec has room for avail bytes, and nothing is written past that.
+   return the size of the record. if that is > avail then the record was only
+   partly written. */
+static size_t af_defer_capture(char *rec, size_t avail,
+                               const struct af_defer_format *f,
+                               va_list *args)
+{
+  size_t size = AF_DEFER_HEADER_SIZE;
+  int i;
+
+  for(i = 0; i < f->nconv; ++i) {
+    const struct af_defer_conv *conv = &f->conv[i];
+    struct af_spec spec;
+    union af_arg arg;
+
+    spec.flags = 0;
+    spec.width = conv->star_width ? AF_SPEC_STAR : -1;
+    spec.precision = conv->star_precision ? AF_SPEC_STAR : -1;
+    spec.length = (char)conv->length;
+    spec.argtype = (enum af_argtype)conv->argtype;
+    af_fetch_arg(&spec, &arg, args);
+
+    /* a negative * width is stored as is, it's a - flag */
+    if(conv->star_width) {
+      int width = (spec.flags & AF_SPEC_MINUS) ? -spec.width : spec.width;
+      size = af_defer_put(rec, avail, size, &width, sizeof(width), 0);
+    }
+
+    if(conv->star_precision)
+      size = af_defer_put(rec, avail, size, &spec.precision,
+                          sizeof(spec.precision), 0);
+
+    switch(spec.argtype) {
+    case AF_ARG_NONE:
+      break;
+    case AF_ARG_SIGNED:
+    case AF_ARG_CHAR:
+      size = af_defer_put(rec, avail, size, &arg.i, sizeof(arg.i), 0);
+      break;
+    case AF_ARG_UNSIGNED:
+      size = af_defer_put(rec, avail, size, &arg.u, sizeof(arg.u), 0);
+      break;
+    case AF_ARG_WINT:
+      size = af_defer_put(rec, avail, size, &arg.wc, sizeof(arg.wc), 0);
+      break;
+    case AF_ARG_PTR:
+      size = af_defer_put(rec, avail, size, &arg.p, sizeof(arg.p), 0);
+      break;
+    case AF_ARG_DOUBLE:
+      size = af_defer_put(rec, avail, size, &arg.d, sizeof(arg.d), 0);
+      break;
+    case AF_ARG_LDOUBLE:
+      size = af_defer_put(rec, avail, size, &arg.ld, sizeof(arg.ld), 0);
+      break;
+    case AF_ARG_STR:
+    case AF_ARG_WSTR:
+      /* A string is copied up to its terminator or precision. The precision
+         of %ls limits the bytes of output, which are at least as many as the
+         wide characters. */
+      if(spec.argtype == AF_ARG_STR ? !arg.s : !arg.ws) {
+        size_t n = (size_t)-1;
+        size = af_defer_put(rec, avail, size, &n, sizeof(n), 0);
+      }
+      else if(spec.argtype == AF_ARG_STR) {
+        const char *nul;
+        size_t n;
+        if(spec.precision >= 0)
+          nul = (const char *)memchr(arg.s, '\0', (size_t)spec.precision);
+        else
+          nul = arg.s + strlen(arg.s);
+        n = nul ? (size_t)(nul - arg.s) : (size_t)spec.precision;
+        size = af_defer_put(rec, avail, size, &n, sizeof(n), 0);
+        size = af_defer_put(rec, avail, size, arg.s, n, 1);
+      }
+      else {
+        size_t n = 0;
+        while((spec.precision < 0 || n < (size_t)spec.precision) &&
+              arg.ws[n])
+          ++n;
+        size = af_defer_put(rec, avail, size, &n, sizeof(n), 0);
+        size = af_defer_put(rec, avail, size, arg.ws, n * sizeof(wchar_t),
+                            sizeof(wchar_t));
+      }
+      break;
+    }
+  }
+
+  return AF_ARENA_ROUND_UP(size);
+}
+
+/* read n bytes of the slots at *p to dest and move *p past them */
+static void af_defer_get(const char **p, void *dest, size_t n)
+{
+  memcpy(dest, *p, n);
+  *p += AF_DEFER_SLOTS(n);
+}
+
+/* format the arguments of an AF_DEFER_ARGS record into out */
+static void af_defer_render(struct af_out *out,
+                            const struct af_defer_rec *rec)
+{
+  struct af_spec spec;
+  union af_arg arg;
+  const char *p = rec->format;
+  const char *slot = (const char *)rec + AF_DEFER_HEADER_SIZE;
+
+  for(;;) {
+    const char *pct = p;
+    size_t n;
+
+    while(*pct && *pct != '%')
+      ++pct;
+
+    af_out_write(out, p, (size_t)(pct - p));
+
+    if(!*pct)
+      break;
+
+    /* the format was already parsed when the record was made */
+    af_parse_spec(pct, &spec);
+
+    if(spec.width == AF_SPEC_STAR) {
+      af_defer_get(&slot, &spec.width, sizeof(spec.width));
+      if(spec.width < 0) {
+        spec.flags |= AF_SPEC_MINUS;
+        spec.width = -spec.width;
+      }
+    }
+
+    if(spec.precision == AF_SPEC_STAR)
+      af_defer_get(&slot, &spec.precision, sizeof(spec.precision));
+
+    switch(spec.argtype) {
+    case AF_ARG_NONE:
+      break;
+    case AF_ARG_SIGNED:
+    case AF_ARG_CHAR:
+      af_defer_get(&slot, &arg.i, sizeof(arg.i));
+      break;
+    case AF_ARG_UNSIGNED:
+      af_defer_get(&slot, &arg.u, sizeof(arg.u));
+      break;
+    case AF_ARG_WINT:
+      af_defer_get(&slot, &arg.wc, sizeof(arg.wc));
+      break;
+    case AF_ARG_PTR:
+      af_defer_get(&slot, &arg.p, sizeof(arg.p));
+      break;
+    case AF_ARG_DOUBLE:
+      af_defer_get(&slot, &arg.d, sizeof(arg.d));
+      break;
+    case AF_ARG_LDOUBLE:
+      af_defer_get(&slot, &arg.ld, sizeof(arg.ld));
+      break;
+    case AF_ARG_STR:
+      af_defer_get(&slot, &n, sizeof(n));
+      arg.s = (n == (size_t)-1) ? NULL : slot;
+      if(arg.s)
+        slot += AF_DEFER_SLOTS(n + 1);
+      break;
+    case AF_ARG_WSTR:
+      af_defer_get(&slot, &n, sizeof(n));
+      arg.ws = (n == (size_t)-1) ? NULL : (const wchar_t *)slot;
+      if(arg.ws)
+        slot += AF_DEFER_SLOTS((n + 1) * sizeof(wchar_t));
+      break;
+    }
+
+    af_render(out, &spec, &arg);
+    if(out->error)
+      return;
+
+    p = pct + spec.len;
+  }
+}
+#endif /* AF_NO_FAST_FORMAT */
+
+/* find room in a ring for a record of size bytes.
+   success: the position of the record. if the record doesn't fit at the end
+            of the ring then the end is padded and the record is at the start.
+   failure: (size_t)-1: the ring is full */
+static size_t af_defer_reserve(af_defer_ring *ring, size_t size)
+{
+  size_t ringsize = ring->mask + 1;
+  size_t head = ring->head;
+  size_t end = ringsize - (head & ring->mask);
+  int loaded = 0;
+
+  for(;;) {
+    size_t avail = ringsize - (head - ring->tail_cache);
+
+    if(size <= end && size <= avail)
+      return head;
+
+    if(end < size && end + size <= avail) {
+      if(end >= AF_DEFER_HEADER_SIZE) {
+        struct af_defer_rec *pad =
+          (struct af_defer_rec *)&ring->data[head & ring->mask];
+        pad->size = end;
+        pad->type = AF_DEFER_PAD;
+      }
+      return head + end;
+    }
+
+    if(loaded)
+      return (size_t)-1;
+
+    ring->tail_cache = af_atomic_load(&ring->tail);
+    loaded = 1;
+  }
+}
+
+/* the space that can be written at the head of a ring without waiting for
+   the consumer, as far as the producer knows */
+static size_t af_defer_room(const af_defer_ring *ring)
+{
+  size_t ringsize = ring->mask + 1;
+  size_t avail = ringsize - (ring->head - ring->tail_cache);
+  size_t end = ringsize - (ring->head & ring->mask);
+  return avail < end ? avail : end;
+}
+
+/* record a separator (sep) and formatted data to append later
+
+af_defer_append_flags_sep_format(ring, 0, "; ", "%s=%d", key, value);
+
+The append is recorded in the ring of the calling producer thread and is
+formatted and appended to a string when the consumer calls af_defer_drain. The
+separator rules and flags are the same as af_buf_append_flags_sep_format,
+applied to the string drained to.
+
+Only the pointers to format and sep are recorded, so they must stay valid until
+the append is drained. They're usually string literals. The arguments are
+copied, including the strings of %s and %ls.
+
+The conversions of a format are parsed once and cached in the ring by the
+address of the format, so a format used again only costs a comparison with its
+cached copy. A format that the built-in formatter can't split into single
+conversions, like one with %n or positional arguments, or one with more than 16
+conversions, is formatted by the caller when it's recorded, and so is every
+format if append_format.c is compiled with AF_NO_FAST_FORMAT. Floating point
+conversions are formatted by the consumer, so they use its locale.
+
+A record takes the size of its arguments and copies plus a few dozen bytes. It
+waits in the ring until it's drained, and if there isn't room for it the append
+fails. A record larger than half the ring may not fit even in an empty ring,
+because a record doesn't wrap around the end of the ring.
+
+success: 0
+failure: -1: the ring is full, or a vsnprintf error; nothing is recorded
+failure: -2: unrecognized flag; nothing is recorded
+*/
+int af_defer_vappend_flags_sep_format(af_defer_ring *ring, int flags,
+                                      const char *sep, const char *format,
+                                      va_list args)
+{
+  struct af_defer_rec rec;
+#ifndef AF_NO_FAST_FORMAT
+  struct af_defer_format uncached;
+  const struct af_defer_format *f;
+#endif
+  va_list args_copy;
+  size_t pos, size, room;
+  char *dest;
+  int count;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if((flags & ~AF_ALL_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
+  }
+
+  rec.flags = flags;
+  rec.sep = sep;
+  rec.format = format;
+  rec.len = 0;
+
+  /* The record is written at the head of the ring if it fits, and written
+     again where there's room if it doesn't */
+  room = af_defer_room(ring);
+  dest = &ring->data[ring->head & ring->mask];
+
+#ifndef AF_NO_FAST_FORMAT
+  f = af_defer_parse(ring, format, &uncached);
+  if(f) {
+    rec.type = AF_DEFER_ARGS;
+
+    va_copy(args_copy, args);
+    size = af_defer_capture(dest, room, f, &args_copy);
+    va_end(args_copy);
+  }
+  else
+#endif
+  {
+    rec.type = AF_DEFER_TEXT;
+
+    va_copy(args_copy, args);
+    count = af_vsnprintf(room > AF_DEFER_HEADER_SIZE ?
+                         &dest[AF_DEFER_HEADER_SIZE] : NULL,
+                         room > AF_DEFER_HEADER_SIZE ?
+                         room - AF_DEFER_HEADER_SIZE : 0,
+                         format, args_copy);
+    va_end(args_copy);
+
+    if(count < 0)
+      goto fail;
+
+    rec.len = (size_t)count;
+    size = AF_DEFER_HEADER_SIZE + AF_ARENA_ROUND_UP(rec.len + 1);
+  }
+
+  if(size > ring->mask + 1)
+    goto fail;
+
+  if(size > room) {
+    pos = af_defer_reserve(ring, size);
+    if(pos == (size_t)-1)
+      goto fail;
+
+    dest = &ring->data[pos & ring->mask];
+
+    va_copy(args_copy, args);
+#ifndef AF_NO_FAST_FORMAT
+    if(rec.type == AF_DEFER_ARGS)
+      af_defer_capture(dest, size, f, &args_copy);
+    else
+#endif
+      af_vsnprintf(&dest[AF_DEFER_HEADER_SIZE], rec.len + 1, format,
+                   args_copy);
+    va_end(args_copy);
+  }
+  else
+    pos = ring->head;
+
+  rec.size = size;
+  memcpy(dest, &rec, sizeof(rec));
+
+  /* publish the record to the consumer */
+  af_atomic_store(&ring->head, pos + size);
+  return 0;
+
+fail:
+  AF_STAT_ADD(errors, 1);
+  return -1;
+}
+
+int af_defer_append_flags_sep_format(af_defer_ring *ring, int flags,
+                                     const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_defer_vappend_flags_sep_format(ring, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* an af_writer that copies data that's already formatted, an af_piece */
+static size_t af_piece_copy(char *dest, size_t maxlen, void *ctx)
+{
+  const struct af_piece *piece = (const struct af_piece *)ctx;
+  if(maxlen)
+    memcpy(dest, piece->data, maxlen);
+  return maxlen;
+}
+
+/* format a record and append it to buf.
+   success: 0. failure: -1; buf->str is unchanged */
+static int af_defer_append(af_defer *defer, const struct af_defer_rec *rec,
+                           af_buf *buf)
+{
+  struct af_piece piece;
+
+  if(rec->type == AF_DEFER_TEXT) {
+    piece.data = (const char *)rec + AF_DEFER_HEADER_SIZE;
+    piece.len = rec->len;
+  }
+#ifndef AF_NO_FAST_FORMAT
+  else {
+    struct af_out out;
+
+    out.dest = defer->scratch.str;
+    out.size = defer->scratch.cap;
+    out.len = 0;
+    out.error = 0;
+    out.escape = 0;
+    out.shortest = 0;
+    af_defer_render(&out, rec);
+
+    if(!out.error && out.len >= out.size) {
+      if(out.len >= (unsigned)INT_MAX ||
+         af_buf_grow(&defer->scratch, out.len + 1, 0))
+        return -1;
+      out.dest = defer->scratch.str;
+      out.size = defer->scratch.cap;
+      out.len = 0;
+      af_defer_render(&out, rec);
+    }
+
+    if(out.error)
+      return -1;
+
+    piece.data = defer->scratch.str;
+    piece.len = out.len;
+  }
+#else
+  (void)defer;
+#endif
+
+  return af_append_writer(buf, rec->flags, rec->sep, piece.len, af_piece_copy,
+                          &piece, 0) < 0 ? -1 : 0;
+}
 
-#include <limits.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+/* format the recorded appends and append them to buf
+
+af_defer_drain(&defer, &buf);
+
+This is called by the consumer, which is one thread at a time. The appends of
+each ring are formatted in the order they were recorded and appended to buf
+with the same separator rules and flags as af_buf_append_flags_sep_format.
+Appends recorded while it runs may or may not be drained. Their space in the
+ring is released as they're drained.
+
+An append that fails to format, or that fails to be appended because of a
+memory error, is dropped and counted, and the rest are still drained.
+
+success: the number of appends drained
+failure: -1: at least one append was dropped
+*/
+int af_defer_drain(af_defer *defer, af_buf *buf)
+{
+  af_defer_ring *ring;
+  int count = 0, failed = 0;
+
+  for(ring = (af_defer_ring *)af_atomic_load_ptr((void **)&defer->rings);
+      ring; ring = ring->next) {
+    size_t head = af_atomic_load(&ring->head);
+    size_t tail = ring->tail;
+
+    while(tail != head) {
+      size_t end = ring->mask + 1 - (tail & ring->mask);
+      const struct af_defer_rec *rec;
+
+      if(end < AF_DEFER_HEADER_SIZE) {
+        tail += end;
+        continue;
+      }
+
+      rec = (const struct af_defer_rec *)&ring->data[tail & ring->mask];
+
+      if(rec->type != AF_DEFER_PAD) {
+        if(af_defer_append(defer, rec, buf)) {
+          af_atomic_add(&defer->failed, 1);
+          failed = 1;
+        }
+        else if(count < INT_MAX)
+          ++count;
+      }
+
+      tail += rec->size;
+      af_atomic_store(&ring->tail, tail);
+    }
+  }
+
+  return failed ? -1 : count;
+}
+
+/* wait until the appends recorded so far have been drained
+
+This is for a producer to wait for the consumer thread. It waits for the
+appends of every ring that were recorded before it was called. It must not be
+called by the consumer.
+
+success: 0
+failure: -1: an append has been dropped by af_defer_drain since the af_defer
+             was initialized
+*/
+int af_defer_flush(af_defer *defer)
+{
+  af_defer_ring *ring;
+
+  for(ring = (af_defer_ring *)af_atomic_load_ptr((void **)&defer->rings);
+      ring; ring = ring->next) {
+    size_t head = af_atomic_load(&ring->head);
+    size_t pending;
+
+    /* the tail can pass head if more is recorded and drained meanwhile */
+    while((pending = head - af_atomic_load(&ring->tail)) != 0 &&
+          pending <= ring->mask + 1)
+      af_yield();
+  }
+
+  return af_atomic_load(&defer->failed) ? -1 : 0;
+}
+
+/* The flags that are only accepted by the functions that append to a char *
+   string */
+#define AF_STR_FLAGS (AF_RESERVED_CAPACITY | AF_USE_USABLE_SIZE)
+
+/* The trailer after the null terminator of a string with reserved capacity.
+   cap is the capacity of the string, not including the trailer. */
+struct af_reserve_trailer {
+  size_t cap;
+  size_t check;   /* cap ^ AF_RESERVE_MAGIC */
+};
+
+#define AF_RESERVE_MAGIC ((size_t)0xA5F0C3E1UL)
+
+/* the resize function of the allocator of a string with reserved capacity.
+   the allocation has room for the trailer after the capacity. */
+static void *af_reserve_resize(void *ctx, void *ptr, size_t oldsize,
+                               size_t newsize)
+{
+  (void)ctx;
+  (void)oldsize;
+  if(newsize > (size_t)-1 - sizeof(struct af_reserve_trailer))
+    return NULL;
+  return realloc(ptr, newsize + sizeof(struct af_reserve_trailer));
+}
+
+static void af_reserve_release(void *ctx, void *ptr, size_t size)
+{
+  (void)ctx;
+  (void)size;
+  free(ptr);
+}
+
+static const af_allocator af_reserve_allocator = {
+  af_reserve_resize, af_reserve_release, NULL
+};
+
+/* return the capacity in the trailer of str, or 0 if it isn't valid */
+static size_t af_reserve_read(const char *str, size_t len)
+{
+  struct af_reserve_trailer trailer;
+  memcpy(&trailer, &str[len + 1], sizeof(trailer));
+  if((trailer.cap ^ AF_RESERVE_MAGIC) != trailer.check || trailer.cap <= len)
+    return 0;
+  return trailer.cap;
+}
+
+/* write the trailer of buf->str, which must have been allocated by
+   af_reserve_allocator */
+static void af_reserve_write(const af_buf *buf)
+{
+  struct af_reserve_trailer trailer;
+  trailer.cap = buf->cap;
+  trailer.check = buf->cap ^ AF_RESERVE_MAGIC;
+  memcpy(&buf->str[buf->len + 1], &trailer, sizeof(trailer));
+}
+
+/* adopt *str as an af_buf. if AF_RESERVED_CAPACITY is set the capacity is read
+   from its trailer, if AF_USE_USABLE_SIZE is set it's the usable size of the
+   allocation, otherwise it's assumed to be exactly the size of the string. */
+static void af_str_adopt(af_buf *buf, char **str, int flags)
+{
+  buf->str = str ? *str : NULL;
+  buf->len = buf->str ? strlen(buf->str) : 0;
+  buf->cap = buf->str ? buf->len + 1 : 0;
+  buf->alloc = NULL;
+
+#ifdef AF_ALWAYS_USE_USABLE_SIZE
+  flags |= AF_USE_USABLE_SIZE;
+#endif
+
+  if((flags & AF_RESERVED_CAPACITY)) {
+    buf->alloc = &af_reserve_allocator;
+    if(buf->str) {
+      size_t cap = af_reserve_read(buf->str, buf->len);
+      if(cap)
+        buf->cap = cap;
+    }
+  }
+#ifdef af_usable_size
+  else if((flags & AF_USE_USABLE_SIZE) && buf->str) {
+    size_t cap = (size_t)af_usable_size(buf->str);
+    if(cap > buf->cap)
+      buf->cap = cap;
+  }
+#endif
+}
+
+/* give buf back to *str, or free it if !str */
+static void af_str_release(af_buf *buf, char **str)
+{
+  if(buf->alloc && buf->str)
+    af_reserve_write(buf);
+
+  if(str)
+    *str = buf->str;
+  else
+    free(buf->str);
+}
+
+/* reserve capacity in *str for at least n more bytes
+
+char *msg = NULL;
+af_reserve(&msg, 4096);
+append_flags_sep_format(&msg, AF_RESERVED_CAPACITY, "; ", "%s", a);
+append_flags_sep_format(&msg, AF_RESERVED_CAPACITY, "; ", "%s", b);
+...
+free(msg);
+
+append_flags_sep_format can't know the capacity of a plain char * string, so
+it reallocates it to exactly the size needed by every append. af_reserve
+allocates *str with room for n more bytes and records the capacity in a small
+trailer after the null terminator. An append with the AF_RESERVED_CAPACITY
+flag reads the capacity from there, so the whole message fits in the one
+allocation. When it doesn't, the capacity grows according to the growth policy
+and the trailer is kept up to date.
+
+*str must be a C-runtime heap-allocated string or NULL, and it's still freed
+with free(). It doesn't have to have been reserved before; if it was, the
+reservation is replaced. An append to it without AF_RESERVED_CAPACITY
+reallocates it to the exact size and drops the reservation, so after that it
+must be reserved again before the flag is used. Don't use the flag with a
+string that wasn't returned by af_reserve or by an append with the flag, its
+trailer would be read past the end of the allocation. The flag is allowed
+with *str NULL, which reserves no more than the append needs.
+
+success: 0
+failure: -1: memory error or overflow; the content of *str is unchanged but if
+             the realloc was successful then the location may have changed
+*/
+int af_reserve(char **str, size_t n)
+{
+  af_buf buf;
+  size_t needed;
+
+  af_str_adopt(&buf, str, 0);
+  buf.alloc = &af_reserve_allocator;
+
+  /* The allocation isn't known to have room for the trailer so it's always
+     reallocated */
+  buf.cap = 0;
+
+  needed = buf.len + 1 + n;
+  if(needed < n || af_buf_grow(&buf, needed, 1))
+    return -1;
+
+  if(!buf.len)
+    buf.str[0] = '\0';
+
+  af_str_release(&buf, str);
+  return 0;
+}
+
+/* return the capacity of a string reserved by af_reserve, including the null
+   terminator, or 0 if str is NULL. the string must have been returned by
+   af_reserve or an append with AF_RESERVED_CAPACITY. */
+size_t af_reserved_capacity(const char *str)
+{
+  return str ? af_reserve_read(str, strlen(str)) : 0;
+}
 
 /* append a separator (sep) and formatted data to *str
 
@@ -39,6 +5786,9 @@ empty "". flags can alter this behavior.
 
 *str is reallocated by this function and the address it points to may change.
 
+Each call scans *str to find its length. To build a large string from many
+appends use an af_buf instead, see af_buf_append_flags_sep_format.
+
 Flags
 -----
 AF_REMOVE_CR_LF_BEFORE_APPEND:     Remove all trailing CR and LF from *str
@@ -61,6 +5811,60 @@ AF_APPEND_SEP_ALWAYS:              Both of the above.
 AF_ALL_FLAGS:                      All flags. This value will change as flags
                                    are added.
 
+AF_RESERVED_CAPACITY:              *str has capacity reserved by af_reserve.
+                                   Only this function and
+                                   append_flags_sep_format_ex accept this flag
+                                   and it isn't in AF_ALL_FLAGS.
+
+AF_USE_USABLE_SIZE:                Append in place if the data fits in the
+                                   usable size of the allocation of *str
+                                   (malloc_usable_size, _msize, malloc_size),
+                                   which is usually rounded up to the size
+                                   class of the C runtime allocator. This is
+                                   a no-op where there's no such function.
+                                   Define AF_ALWAYS_USE_USABLE_SIZE to always
+                                   use it. Not with a malloc replacement that
+                                   doesn't allow the slack to be used. Only
+                                   accepted by the same functions as
+                                   AF_RESERVED_CAPACITY.
+
+AF_ESCAPE_JSON:                    Escape the output of %s and %c as the
+                                   content of a JSON string: " \ and the
+                                   control characters, for example a
+                                   newline as \n and ESC as \u001b.
+
+AF_ESCAPE_C:                       Escape the output of %s and %c as the
+                                   content of a C string literal: " \ and
+                                   the control characters and DEL, for
+                                   example a newline as \n and ESC as \033.
+
+AF_SHORTEST_FLOAT:                 Format %g and %G without a precision as the
+                                   shortest number that converts back to the
+                                   same double (0.1 instead of
+                                   0.100000000000000006), in exponential
+                                   notation only if the decimal exponent is
+                                   less than -4 or at least 17 like %.17g
+                                   (1e16 is 10000000000000000 and 1e-5 is
+                                   1e-05), and %f and %F with a precision up
+                                   to 17 exactly. Both are done without the C
+                                   library so the radix character is always
+                                   '.'. The other floating point conversions
+                                   are formatted by the C library.
+
+The escape flags aren't in AF_ALL_FLAGS and they can't be combined. They're
+accepted by the functions that append to *str or an af_buf with a format
+string or a compiled format. Other bytes, like UTF-8 sequences, are written
+as is. %ls and %lc are escaped too, after the C library converts them to
+multibyte. A precision limits the bytes read from the argument and a width is
+of the escaped output. Escaping is done by the built-in formatter in the same
+pass that formats the data, so a format that it doesn't support (like %n and
+positional arguments) fails, and if append_format.c is compiled with
+AF_NO_FAST_FORMAT the flags are unrecognized. AF_SHORTEST_FLOAT is accepted
+by the same functions and can be combined with an escape flag. A format the
+built-in formatter doesn't support is formatted by the C library instead, and
+if append_format.c is compiled with AF_NO_FAST_FORMAT the flag is
+unrecognized.
+
 success: the new length of *str (or if !str then the length *str would've been)
 failure: -1: vsnprintf/memory error; the content of *str is unchanged but if
              the realloc was successful then the location may have changed
@@ -69,113 +5873,601 @@ failure: -2: unrecognized flag; the content and location of *str is unchanged
 int append_flags_sep_format(char **str, int flags, const char *sep,
                             const char *format, ...)
 {
-  int count;
+  int retcode;
   va_list args;
-  char *buf;
-  size_t bufsize;
-  size_t oldlen, seplen, crlflen;
-  int retcode = -1;
-  char *placeholder = NULL;
+  af_buf buf;
 
   /* Unrecognized flags should be checked before anything else and return -2 */
-  if((flags & ~AF_ALL_FLAGS)) {
-    retcode = -2;
-    goto cleanup;
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_STR_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
   }
 
-  if(!str)
-    str = &placeholder;
+  /* *str is adopted as an af_buf. Unless it has reserved capacity its capacity
+     is unknown so it is assumed to be exactly the size of the string. */
+  af_str_adopt(&buf, str, flags);
 
   va_start(args, format);
-#ifdef _WIN32
-  count = _vscprintf(format, args);
-#else
-  count = vsnprintf(NULL, 0, format, args);
-#endif
+  retcode = (af_vappend(&buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS), sep,
+                        format, args,
+                        !buf.alloc, (unsigned)INT_MAX) < 0) ?
+            -1 : (int)buf.len;
   va_end(args);
 
-  if(count < 0 || (unsigned)count != (size_t)count)
-    goto cleanup;
+  af_str_release(&buf, str);
+  return retcode;
+}
 
-  if(sep &&
-     ((*str && **str) || (flags & AF_APPEND_SEP_IF_STR_EMPTY)) &&
-     (count || (flags & AF_APPEND_SEP_IF_FORMAT_EMPTY))) {
-    seplen = strlen(sep);
+/* append a separator (sep) and formatted data to *str, for strings longer than
+   INT_MAX
+
+append_flags_sep_format_ex(&msg, 0, "\n", "%s", line);
+
+This is the same as append_flags_sep_format except that the length of *str is
+limited only by memory (and PTRDIFF_MAX) and the errors are distinguished. See
+af_buf_append_flags_sep_format_ex.
+
+success: the new length of *str (or if !str then the length it would've been)
+failure: AF_ERR_FORMAT, AF_ERR_MEMORY or AF_ERR_LENGTH: the content of *str is
+         unchanged but if the realloc was successful then the location may
+         have changed
+failure: AF_ERR_FLAGS: unrecognized flag; the content and location of *str is
+         unchanged
+*/
+ptrdiff_t append_flags_sep_format_ex(char **str, int flags, const char *sep,
+                                     const char *format, ...)
+{
+  ptrdiff_t retcode;
+  va_list args;
+  af_buf buf;
+
+  /* Unrecognized flags should be checked before anything else */
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_STR_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return AF_ERR_FLAGS;
   }
-  else {
-    sep = "";
-    seplen = 0;
+
+  af_str_adopt(&buf, str, flags);
+
+  va_start(args, format);
+  retcode = af_vappend(&buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS), sep,
+                       format, args,
+                       !buf.alloc, (size_t)PTRDIFF_MAX);
+  va_end(args);
+
+  af_str_release(&buf, str);
+  return retcode;
+}
+
+/* An af_program is a format string compiled into a list of ops, each a run of
+   literal text followed by a conversion. The ops, and a copy of the format,
+   are in the same allocation as the af_program. */
+struct af_program_op {
+  const char *lit;      /* the literal text before the conversion */
+  size_t lit_len;
+#ifndef AF_NO_FAST_FORMAT
+  struct af_spec spec;  /* argtype is AF_ARG_NONE if there's no conversion */
+#endif
+};
+
+struct af_program {
+  const char *format;   /* the copy of the format */
+  struct af_program_op *ops;
+  size_t nops;
+  size_t nconv;         /* the number of ops with a conversion */
+  size_t lit_len;       /* the total length of the literal text */
+  size_t max_len;       /* see af_program_max_length */
+  int fallback;         /* the format is formatted by af_vappend */
+};
+
+#ifndef AF_NO_FAST_FORMAT
+/* the length of the output of a conversion is bounded by its precision and
+   this much. it's enough for the sign, the decimal point in any locale, the
+   exponent and the 0x of %a. */
+#define AF_PROGRAM_FLOAT_EXTRA 32
+
+/* the longest a NULL string or pointer is formatted as by the C library, like
+   (null) or (nil) */
+#define AF_PROGRAM_NULL_MAX 16
+
+/* the arguments of up to this many conversions are fetched to the stack */
+#define AF_PROGRAM_STACK_ARGS 16
+
+/* return an upper bound of the length of a conversion with argument arg, or if
+   !arg of the conversion with any argument. in that case (size_t)-1 is
+   returned if there's no bound. */
+static size_t af_program_bound(const struct af_spec *spec,
+                               const union af_arg *arg)
+{
+  size_t n = 0, p;
+  size_t width = (spec->width > 0) ? (size_t)spec->width : 0;
+
+  if(!arg && (spec->width == AF_SPEC_STAR ||
+              spec->precision == AF_SPEC_STAR))
+    return (size_t)-1;
+
+  p = (spec->precision >= 0) ? (size_t)spec->precision : 0;
+
+  switch(spec->argtype) {
+  case AF_ARG_NONE:
+    break;
+  case AF_ARG_SIGNED:
+  case AF_ARG_UNSIGNED:
+    /* the digits of the largest octal number, a sign or 0x */
+    n = ((p > sizeof(uintmax_t) * 3) ? p : sizeof(uintmax_t) * 3) + 3;
+    break;
+  case AF_ARG_CHAR:
+    n = 1;
+    break;
+  case AF_ARG_WINT:
+    n = arg ? (size_t)MB_CUR_MAX : MB_LEN_MAX;
+    break;
+  case AF_ARG_STR:
+    if(!arg || !arg->s) {
+      if(!arg && spec->precision < 0)
+        return (size_t)-1;
+      n = (p > AF_PROGRAM_NULL_MAX) ? p : AF_PROGRAM_NULL_MAX;
+    }
+    else
+      n = af_render_strlen(spec, arg->s);
+    break;
+  case AF_ARG_WSTR:
+    /* the precision is in bytes, so without it the length of the multibyte
+       output of a wide string is bounded only by its length */
+    if(spec->precision >= 0)
+      n = (p > AF_PROGRAM_NULL_MAX) ? p : AF_PROGRAM_NULL_MAX;
+    else if(!arg)
+      return (size_t)-1;
+    else if(!arg->ws)
+      n = AF_PROGRAM_NULL_MAX;
+    else
+      n = wcslen(arg->ws) * (size_t)MB_CUR_MAX;
+    break;
+  case AF_ARG_PTR:
+    n = sizeof(void *) * 2 + AF_PROGRAM_NULL_MAX;
+    break;
+  case AF_ARG_DOUBLE:
+  case AF_ARG_LDOUBLE:
+    if(spec->precision < 0)
+      p = (spec->conv == 'a' || spec->conv == 'A') ? 32 : 6;
+    n = p + AF_PROGRAM_FLOAT_EXTRA;
+    /* %f has all of the digits of the integer part, which are only a few
+       unless the number is huge */
+    if(spec->conv == 'f' || spec->conv == 'F') {
+      int small;
+      if(!arg)
+        small = 0;
+      else if(spec->argtype == AF_ARG_DOUBLE)
+        small = (-1e16 < arg->d && arg->d < 1e16);
+      else
+        small = (-1e16L < arg->ld && arg->ld < 1e16L);
+      if(small)
+        n += 17;
+      else if(spec->argtype == AF_ARG_DOUBLE)
+        n += DBL_MAX_10_EXP + 1;
+      else
+        n += LDBL_MAX_10_EXP + 1;
+    }
+    break;
   }
 
-  oldlen = *str ? strlen(*str) : 0;
+  return (n > width) ? n : width;
+}
+#endif /* AF_NO_FAST_FORMAT */
+
+/* compile a format string into a reusable program
 
-  bufsize = 1;
+af_program *prog = af_compile("%s=%d");
+...
+af_append_compiled(&msg, 0, "; ", prog, key, value);
+...
+af_program_free(prog);
 
-  bufsize += oldlen;
-  if(bufsize < oldlen)
-    goto cleanup;
+Each append with a format string parses the format again, and the output is
+formatted into the spare capacity first and formatted again if it didn't fit.
+That's a waste when the same format is used over and over, for example a log
+line format loaded from a configuration file at startup. af_compile parses
+format once into literal runs and conversions, and an append with the
+resulting program only fetches the arguments, computes an upper bound of the
+length of the output from them and formats the output once directly into the
+string.
 
-  bufsize += seplen;
-  if(bufsize < seplen)
-    goto cleanup;
+The output is the same as an append with format. A format that the built-in
+formatter can't split into single conversions (for example, %n and positional
+arguments) or any format if append_format.c is compiled with
+AF_NO_FAST_FORMAT is compiled into a program that appends with the format the
+usual way.
 
-  bufsize += (size_t)count;
-  if(bufsize < (size_t)count)
-    goto cleanup;
+format is copied so it doesn't have to outlive the program. A program isn't
+changed by the appends so it can be used by multiple threads at once.
 
-  if(bufsize > (unsigned)INT_MAX)
-    goto cleanup;
+success: the program, free it with af_program_free
+failure: NULL: format is NULL or memory error
+*/
+af_program *af_compile(const char *format)
+{
+  af_program *prog;
+  struct af_program_op *op;
+  size_t fmtlen, maxops, opsoff, fmtoff, i;
+  const char *p;
+  char *copy;
 
-  buf = (char *)realloc(*str, bufsize);
-  if(!buf)
-    goto cleanup;
+  if(!format)
+    return NULL;
 
-  *str = buf;
+  /* every op but the last ends with a % */
+  fmtlen = strlen(format);
+  maxops = 1;
+  for(p = format; (p = strchr(p, '%')); ++p)
+    ++maxops;
 
-  crlflen = 0;
+  opsoff = AF_ARENA_ROUND_UP(sizeof(*prog));
+  if(maxops > ((size_t)-1 - opsoff - fmtlen - 1) / sizeof(*op))
+    return NULL;
+  fmtoff = opsoff + maxops * sizeof(*op);
 
-  if((flags & AF_REMOVE_CR_LF_BEFORE_APPEND) && oldlen) {
-    char *p = &buf[oldlen];
-    do {
-      --p;
-      if(*p != '\r' && *p != '\n')
-        break;
-      ++crlflen;
-    } while(p != buf);
-    /* Move to slack space, if vsnprintf fails we will need to restore them */
-    memmove(&buf[bufsize - crlflen], &buf[oldlen - crlflen], crlflen);
+  prog = (af_program *)malloc(fmtoff + fmtlen + 1);
+  if(!prog)
+    return NULL;
+
+  copy = (char *)prog + fmtoff;
+  memcpy(copy, format, fmtlen + 1);
+
+  prog->format = copy;
+  prog->ops = (struct af_program_op *)((char *)prog + opsoff);
+  prog->nops = 0;
+  prog->nconv = 0;
+  prog->lit_len = 0;
+  prog->max_len = (size_t)-1;
+  prog->fallback = 1;
+
+#ifndef AF_NO_FAST_FORMAT
+  op = prog->ops;
+  op->lit = copy;
+  op->lit_len = 0;
+
+  for(p = copy; ; ) {
+    const char *pct = strchr(p, '%');
+
+    if(!pct)
+      pct = p + strlen(p);
+
+    op->lit_len += (size_t)(pct - p);
+
+    if(!*pct) {
+      op->spec.argtype = AF_ARG_NONE;
+      ++prog->nops;
+      break;
+    }
+
+    if(af_parse_spec(pct, &op->spec))
+      return prog;
+
+    /* the first % of %% is the end of the literal text and the text after the
+       second one is the literal text of the next op */
+    if(op->spec.argtype == AF_ARG_NONE)
+      ++op->lit_len;
+    else
+      ++prog->nconv;
+
+    p = pct + op->spec.len;
+
+    ++op;
+    ++prog->nops;
+    op->lit = p;
+    op->lit_len = 0;
   }
 
-  strcpy(&buf[oldlen - crlflen], sep);
+  prog->fallback = 0;
+  prog->max_len = 0;
 
-  va_start(args, format);
-#ifdef _WIN32
-  count = _vsnprintf(
+  for(i = 0; i < prog->nops; ++i) {
+    size_t n;
+
+    prog->lit_len += prog->ops[i].lit_len;
+
+    if(prog->ops[i].spec.argtype == AF_ARG_NONE)
+      continue;
+
+    n = af_program_bound(&prog->ops[i].spec, NULL);
+    if(n == (size_t)-1 || prog->max_len + n < n)
+      prog->max_len = (size_t)-1;
+    if(prog->max_len != (size_t)-1)
+      prog->max_len += n;
+  }
+
+  if(prog->max_len + prog->lit_len < prog->lit_len)
+    prog->max_len = (size_t)-1;
+  if(prog->max_len != (size_t)-1)
+    prog->max_len += prog->lit_len;
 #else
-  count = vsnprintf(
+  (void)op;
+  (void)i;
 #endif
-    &buf[oldlen - crlflen + seplen], (size_t)(count + 1), format, args);
-  va_end(args);
 
-  if(count != (int)(bufsize - oldlen - seplen - 1)) {
-    memmove(&buf[oldlen - crlflen], &buf[bufsize - crlflen], crlflen);
-    buf[oldlen] = '\0';
-    goto cleanup;
+  return prog;
+}
+
+/* free a program compiled by af_compile */
+void af_program_free(af_program *prog)
+{
+  free(prog);
+}
+
+/* return an upper bound of the length of the output of a program
+
+The bound is of the output of the conversions and literal text of the format
+for any arguments, not including the separator or escaping. It's (size_t)-1
+if there's no such bound because the length depends on the arguments, for
+example a %s without a precision or a * width.
+*/
+size_t af_program_max_length(const af_program *prog)
+{
+  return prog ? prog->max_len : (size_t)-1;
+}
+
+#ifndef AF_NO_FAST_FORMAT
+/* the fetched argument of a conversion of a program */
+struct af_program_arg {
+  struct af_spec spec;  /* the spec of the conversion with any * resolved */
+  union af_arg arg;
+  size_t len;           /* the length of a string that's formatted by
+                           af_render_chars */
+};
+
+struct af_program_run {
+  const af_program *prog;
+  const struct af_program_arg *args;
+  int flags;            /* the AF_ESCAPE_ and AF_SHORTEST_FLOAT flags */
+};
+
+/* an af_writer that formats a program with its fetched arguments */
+static size_t af_program_write(char *dest, size_t maxlen, void *ctx)
+{
+  const struct af_program_run *run = (const struct af_program_run *)ctx;
+  const struct af_program_arg *arg = run->args;
+  struct af_out out;
+  size_t i;
+
+  out.dest = dest;
+  out.size = maxlen + 1;
+  out.len = 0;
+  out.error = 0;
+  out.escape = run->flags & (AF_ESCAPE_JSON | AF_ESCAPE_C);
+  out.shortest = !!(run->flags & AF_SHORTEST_FLOAT);
+
+  for(i = 0; i < run->prog->nops; ++i) {
+    const struct af_program_op *op = &run->prog->ops[i];
+    af_out_write(&out, op->lit, op->lit_len);
+    if(op->spec.argtype == AF_ARG_NONE)
+      continue;
+    /* the length of a string was already found for the bound */
+    if(arg->spec.argtype == AF_ARG_STR && arg->arg.s && out.escape)
+      af_render_escaped(&out, &arg->spec, arg->arg.s, arg->len);
+    else if(arg->spec.argtype == AF_ARG_STR && arg->arg.s &&
+            !(arg->spec.flags & AF_SPEC_ZERO))
+      af_render_chars(&out, &arg->spec, arg->arg.s, arg->len);
+    else
+      af_render(&out, &arg->spec, &arg->arg);
+    ++arg;
   }
 
-  if((flags & AF_REMOVE_CR_LF_AFTER_APPEND) && (bufsize - crlflen - 1)) {
-    char *p = &buf[bufsize - crlflen - 1];
-    do {
-      --p;
-      if(*p != '\r' && *p != '\n')
-        break;
-      ++crlflen;
-    } while(p != buf);
-    buf[bufsize - crlflen - 1] = '\0';
+  if(out.error || out.len > maxlen)
+    return (size_t)-1;
+
+  return out.len;
+}
+#endif
+
+/* append a separator (sep) and the output of prog to buf. this is the engine
+   behind the compiled append functions. buf must not be NULL and flags must
+   already have been checked. see af_vappend for exact_fit.
+
+success: the new length of buf->str
+failure: -1
+*/
+static int af_vappend_program(af_buf *buf, int flags, const char *sep,
+                              const af_program *prog, va_list args,
+                              int exact_fit)
+{
+#ifndef AF_NO_FAST_FORMAT
+  struct af_program_arg stack_args[AF_PROGRAM_STACK_ARGS];
+  struct af_program_arg *fetched = stack_args;
+  struct af_program_run run;
+  va_list args_copy;
+  size_t i, j, maxlen;
+  int retcode, escape = flags & (AF_ESCAPE_JSON | AF_ESCAPE_C);
+#endif
+
+  if(!prog) {
+    AF_STAT_ADD(errors, 1);
+    return -1;
+  }
+
+#ifndef AF_NO_FAST_FORMAT
+  if(prog->fallback)
+    goto fallback;
+
+  if(prog->nconv > AF_PROGRAM_STACK_ARGS) {
+    fetched = (struct af_program_arg *)malloc(prog->nconv * sizeof(*fetched));
+    if(!fetched) {
+      AF_STAT_ADD(errors, 1);
+      return -1;
+    }
+  }
+
+  /* The arguments are fetched first so that the upper bound of the length of
+     the output is known before anything is formatted */
+  maxlen = prog->lit_len;
+  va_copy(args_copy, args);
+  for(i = 0, j = 0; i < prog->nops; ++i) {
+    struct af_program_arg *a = &fetched[j];
+    size_t n;
+
+    if(prog->ops[i].spec.argtype == AF_ARG_NONE)
+      continue;
+
+    a->spec = prog->ops[i].spec;
+    af_fetch_arg(&a->spec, &a->arg, &args_copy);
+
+    if(a->spec.argtype == AF_ARG_STR && a->arg.s &&
+       (escape || !(a->spec.flags & AF_SPEC_ZERO))) {
+      a->len = af_render_strlen(&a->spec, a->arg.s);
+      /* the bound of an escaped string is exact so that the string is still
+         grown only once */
+      n = escape ? af_escaped_len(a->arg.s, a->len, escape) : a->len;
+      if(a->spec.width > 0 && (size_t)a->spec.width > n)
+        n = (size_t)a->spec.width;
+    }
+    else if(a->spec.argtype == AF_ARG_CHAR && escape) {
+      /* the longest escape sequence */
+      n = (a->spec.width > 6) ? (size_t)a->spec.width : 6;
+    }
+    else if((a->spec.argtype == AF_ARG_WINT ||
+             a->spec.argtype == AF_ARG_WSTR) && escape) {
+      /* each byte of the multibyte output is escaped to at most the longest
+         escape sequence */
+      struct af_spec unpadded = a->spec;
+      unpadded.width = -1;
+      n = af_program_bound(&unpadded, &a->arg);
+      n = (n > (size_t)-1 / 6) ? (size_t)-1 : n * 6;
+      if(a->spec.width > 0 && (size_t)a->spec.width > n)
+        n = (size_t)a->spec.width;
+    }
+    else
+      n = af_program_bound(&a->spec, &a->arg);
+
+    maxlen = (maxlen + n < n) ? (size_t)-1 : maxlen + n;
+    ++j;
+  }
+  va_end(args_copy);
+
+  run.prog = prog;
+  run.args = fetched;
+  run.flags = flags & AF_FORMAT_FLAGS;
+
+  /* af_append_writer formats a short bound to the stack first if exact_fit */
+  retcode = af_append_writer(buf, flags, sep, maxlen, af_program_write, &run,
+                             exact_fit);
+
+  if(fetched != stack_args)
+    free(fetched);
+
+  return retcode;
+
+fallback:
+#endif
+  return (af_vappend(buf, flags, sep, prog->format, args, exact_fit,
+                     (unsigned)INT_MAX) < 0) ? -1 : (int)buf->len;
+}
+
+/* append a separator (sep) and the output of a compiled program to buf
+
+af_buf_append_compiled(&buf, 0, "; ", prog, key, value);
+
+This is the same as af_buf_append_flags_sep_format except that the format is
+a program compiled by af_compile. See af_compile.
+
+success: the new length of buf->str (or if !buf then the length it would've
+         been)
+failure: -1: prog is NULL or vsnprintf/memory error; the content of buf->str
+             is unchanged but if the realloc was successful then the location
+             may have changed
+failure: -2: unrecognized flag; the content and location of buf->str is
+             unchanged
+*/
+int af_buf_vappend_compiled(af_buf *buf, int flags, const char *sep,
+                            const af_program *prog, va_list args)
+{
+  int retcode;
+  af_buf placeholder = AF_BUF_INIT;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_BUF_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
+  }
+
+  if(!buf)
+    buf = &placeholder;
+
+  retcode = af_vappend_program(buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS),
+                               sep, prog, args,
+                               !!(flags & AF_EXACT_FIT));
+
+  af_buf_free(&placeholder);
+  return retcode;
+}
+
+int af_buf_append_compiled(af_buf *buf, int flags, const char *sep,
+                           const af_program *prog, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, prog);
+  retcode = af_buf_vappend_compiled(buf, flags, sep, prog, args);
+  va_end(args);
+
+  return retcode;
+}
+
+/* append a separator (sep) and the output of a compiled program to *str
+
+af_append_compiled(&msg, 0, "; ", prog, key, value);
+
+This is the same as append_flags_sep_format except that the format is a
+program compiled by af_compile. See af_compile. AF_RESERVED_CAPACITY and
+AF_USE_USABLE_SIZE are accepted.
+
+success: the new length of *str (or if !str then the length *str would've been)
+failure: -1: prog is NULL or vsnprintf/memory error; the content of *str is
+             unchanged but if the realloc was successful then the location may
+             have changed
+failure: -2: unrecognized flag; the content and location of *str is unchanged
+*/
+int af_vappend_compiled(char **str, int flags, const char *sep,
+                        const af_program *prog, va_list args)
+{
+  int retcode, exact_fit;
+  af_buf buf;
+
+  /* Unrecognized flags should be checked before anything else and return -2 */
+  if(af_bad_flags(flags, AF_ALL_FLAGS | AF_STR_FLAGS | AF_FORMAT_FLAGS)) {
+    AF_STAT_ADD(flag_errors, 1);
+    return -2;
   }
 
-  retcode = (int)(bufsize - crlflen - 1);
-cleanup:
-  free(placeholder);
+  af_str_adopt(&buf, str, flags);
+
+  /* The string is grown to fit the upper bound of the output and then shrunk
+     to fit the output, unless the slack can be found again by af_str_adopt */
+  exact_fit = !buf.alloc;
+#ifdef af_usable_size
+#ifdef AF_ALWAYS_USE_USABLE_SIZE
+  exact_fit = 0;
+#else
+  if((flags & AF_USE_USABLE_SIZE))
+    exact_fit = 0;
+#endif
+#endif
+
+  retcode = af_vappend_program(&buf, flags & (AF_ALL_FLAGS | AF_FORMAT_FLAGS),
+                               sep, prog, args, exact_fit);
+
+  af_str_release(&buf, str);
+  return retcode;
+}
+
+int af_append_compiled(char **str, int flags, const char *sep,
+                       const af_program *prog, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, prog);
+  retcode = af_vappend_compiled(str, flags, sep, prog, args);
+  va_end(args);
+
   return retcode;
 }
@@ -10,6 +10,14 @@ See LICENSE.txt for full license text.
 #ifndef APPEND_FORMAT_H
 #define APPEND_FORMAT_H
 
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -48,6 +56,42 @@ int append_flags_sep_format(char **str, int flags, const char *sep,
    AF_APPEND_SEP_IF_STR_EMPTY | \
    AF_APPEND_SEP_IF_FORMAT_EMPTY)
 
+/* *str has capacity reserved by af_reserve. This isn't in AF_ALL_FLAGS, it's
+   only accepted by append_flags_sep_format and append_flags_sep_format_ex. */
+#define AF_RESERVED_CAPACITY            (1<<4)
+
+/* Append in place if the data fits in the usable size of the allocation of
+   *str, as reported by the C runtime. Like AF_RESERVED_CAPACITY this isn't in
+   AF_ALL_FLAGS and it's only accepted by the same functions. */
+#define AF_USE_USABLE_SIZE              (1<<5)
+
+/* Grow buf->str to exactly the size needed instead of by the growth policy.
+   This isn't in AF_ALL_FLAGS, it's only accepted by the af_buf functions. */
+#define AF_EXACT_FIT                    (1<<6)
+
+/* Escape the output of %s and %c as the content of a JSON string. This isn't in
+   AF_ALL_FLAGS, it's only accepted by the functions that append to *str or an
+   af_buf with a format string or a compiled format. */
+#define AF_ESCAPE_JSON                  (1<<7)
+
+/* Escape the output of %s and %c as the content of a C string literal. Like
+   AF_ESCAPE_JSON this isn't in AF_ALL_FLAGS and it's only accepted by the same
+   functions. The two can't be combined. */
+#define AF_ESCAPE_C                     (1<<8)
+
+/* Format %g and %G without a precision with the shortest digits that convert
+   back to the same double, in the notation of %.17g, and %f and %F exactly
+   without the C library, so both don't depend on the locale. This isn't in
+   AF_ALL_FLAGS, it's accepted by the same functions as AF_ESCAPE_JSON. */
+#define AF_SHORTEST_FLOAT               (1<<9)
+
+/* reserve capacity in *str for at least n more bytes.
+   Documented in the comment block above the function definition. */
+int af_reserve(char **str, size_t n);
+
+/* return the capacity of a string reserved by af_reserve */
+size_t af_reserved_capacity(const char *str);
+
 /* same as append_flags_sep_format but no flags */
 #define append_sep_format(str, sep, format, ...) \
   append_flags_sep_format(str, 0, sep, format, __VA_ARGS__)
@@ -68,6 +112,565 @@ int append_flags_sep_format(char **str, int flags, const char *sep,
   append_flags_sep_format(str, AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND, \
                           NULL, format, __VA_ARGS__)
 
+/* return the number of trailing CR and LF in the first len bytes of s.
+   Documented in the comment block above the function definition. */
+size_t af_count_trailing_crlf(const char *s, size_t len);
+
+/* A memory allocator for af_buf. */
+typedef struct af_allocator {
+  /* Resize ptr from oldsize to newsize bytes, or allocate newsize bytes if ptr
+     is NULL. Return the new location, or NULL on failure in which case ptr
+     must be unchanged. */
+  void *(*resize)(void *ctx, void *ptr, size_t oldsize, size_t newsize);
+  /* Release ptr which is size bytes. */
+  void (*release)(void *ctx, void *ptr, size_t size);
+  /* passed to resize and release */
+  void *ctx;
+} af_allocator;
+
+/* A string handle that tracks the length of the string and the capacity of its
+   allocation so that appending to it doesn't rescan the string.
+   str is allocated by alloc, or by the C runtime if alloc is NULL. */
+typedef struct af_buf {
+  char *str;    /* the string, or NULL */
+  size_t len;   /* length of str, not including the null terminator */
+  size_t cap;   /* size of the allocation str points to, or 0 if str is NULL */
+  const af_allocator *alloc;  /* the allocator of str, or NULL */
+} af_buf;
+
+/* initializer for an empty af_buf that uses the C runtime */
+#define AF_BUF_INIT { NULL, 0, 0, NULL }
+
+/* initialize buf to be empty and use the C runtime. this does not free
+   buf->str. */
+void af_buf_init(af_buf *buf);
+
+/* initialize buf to be empty and use alloc. this does not free buf->str. */
+void af_buf_init_allocator(af_buf *buf, const af_allocator *alloc);
+
+/* free buf->str and make buf empty. buf->alloc is kept. */
+void af_buf_free(af_buf *buf);
+
+/* append a separator (sep) and formatted data to buf.
+   Documented in the comment block above the function definition. */
+int af_buf_append_flags_sep_format(af_buf *buf, int flags, const char *sep,
+                                   const char *format, ...);
+
+/* same as af_buf_append_flags_sep_format but takes a va_list */
+int af_buf_vappend_flags_sep_format(af_buf *buf, int flags, const char *sep,
+                                    const char *format, va_list args);
+
+/* Writes at most maxlen bytes to dest and returns the number of bytes written,
+   or (size_t)-1 on failure. */
+typedef size_t (*af_writer)(char *dest, size_t maxlen, void *ctx);
+
+/* append a separator (sep) and data written by a callback to buf.
+   Documented in the comment block above the function definition. */
+int af_buf_append_flags_sep_writer(af_buf *buf, int flags, const char *sep,
+                                   size_t maxlen, af_writer writer, void *ctx);
+
+/* same as af_buf_append_flags_sep_writer but appends to *str like
+   append_flags_sep_format */
+int append_flags_sep_writer(char **str, int flags, const char *sep,
+                            size_t maxlen, af_writer writer, void *ctx);
+
+/* reallocate buf->str so its capacity is exactly the size of the string */
+int af_buf_shrink_to_fit(af_buf *buf);
+
+/* set the growth policy used when an af_buf has to be reallocated.
+   Documented in the comment block above the function definition. */
+int af_set_growth_policy(unsigned percent, size_t min_step, size_t max_step);
+
+/* default growth policy: double the capacity, growing by at least 64 bytes */
+#define AF_GROWTH_DEFAULT_PERCENT   200
+#define AF_GROWTH_DEFAULT_MIN_STEP  64
+#define AF_GROWTH_DEFAULT_MAX_STEP  0
+
+/* A batch of appends that succeed or fail together.
+   Documented in the comment block above af_batch_begin. */
+typedef struct af_batch {
+  af_buf *buf;        /* the string appended to */
+  af_buf strbuf;      /* holds *str if begun by af_batch_begin_str */
+  char **str;         /* str if begun by af_batch_begin_str */
+  size_t oldlen;      /* length of the string when the batch began */
+  char *crlf;         /* trailing CR and LF of the string when it began */
+  size_t crlflen;     /* length of crlf, or (size_t)-1 if not saved yet */
+  int retcode;        /* 0, or the error of the append that failed */
+} af_batch;
+
+/* begin a batch of appends to buf */
+int af_batch_begin(af_batch *batch, af_buf *buf, size_t size_hint);
+
+/* begin a batch of appends to *str */
+int af_batch_begin_str(af_batch *batch, char **str, size_t size_hint);
+
+/* append a separator (sep) and formatted data as part of a batch */
+int af_batch_append_flags_sep_format(af_batch *batch, int flags,
+                                     const char *sep, const char *format, ...);
+
+/* same as af_batch_append_flags_sep_format but takes a va_list */
+int af_batch_vappend_flags_sep_format(af_batch *batch, int flags,
+                                      const char *sep, const char *format,
+                                      va_list args);
+
+/* finish a batch. if any append failed then all of them are rolled back. */
+int af_batch_commit(af_batch *batch);
+
+/* roll back all appends in the batch and finish it */
+void af_batch_abort(af_batch *batch);
+
+/* same as af_batch_append_flags_sep_format but no flags */
+#define af_batch_append_sep_format(batch, sep, format, ...) \
+  af_batch_append_flags_sep_format(batch, 0, sep, format, __VA_ARGS__)
+
+/* same as af_batch_append_flags_sep_format but no flags or separator */
+#define af_batch_append_format(batch, format, ...) \
+  af_batch_append_flags_sep_format(batch, 0, NULL, format, __VA_ARGS__)
+
+/* A block of memory an arena allocates from. */
+struct af_arena_block {
+  struct af_arena_block *next;  /* the previously allocated block */
+  size_t size;    /* size of the data */
+  size_t used;    /* number of bytes of the data that are allocated */
+  size_t last;    /* offset of the most recent allocation */
+};
+
+/* A bump allocator whose allocations are all released at once.
+   Documented in the comment block above af_arena_init. */
+typedef struct af_arena {
+  struct af_arena_block *head;  /* the block that is allocated from */
+  size_t block_size;
+  af_allocator allocator;       /* the allocator to use with an af_buf */
+} af_arena;
+
+/* the size of the blocks an arena allocates if 0 is passed to af_arena_init */
+#define AF_ARENA_DEFAULT_BLOCK_SIZE 65536
+
+/* initialize an arena that allocates blocks of block_size bytes */
+void af_arena_init(af_arena *arena, size_t block_size);
+
+/* release all allocations from the arena */
+void af_arena_reset(af_arena *arena);
+
+/* release all allocations from the arena and all of its memory */
+void af_arena_free(af_arena *arena);
+
+/* An allocator that backs large allocations with memory mappings that grow
+   without copying. Documented in the comment block above af_mmap_init. */
+typedef struct af_mmap {
+  size_t threshold;   /* allocations at least this large are mapped */
+  size_t page_size;
+  int flags;
+  af_allocator allocator;   /* the allocator to use with an af_buf */
+} af_mmap;
+
+/* the threshold if 0 is passed to af_mmap_init */
+#define AF_MMAP_DEFAULT_THRESHOLD (1024 * 1024)
+
+/* Advise the kernel to back the mappings with transparent huge pages */
+#define AF_MMAP_HUGEPAGE (1<<0)
+
+/* initialize an allocator that maps allocations of at least threshold bytes */
+void af_mmap_init(af_mmap *mm, size_t threshold, int flags);
+
+/* same as af_buf_append_flags_sep_format but no flags */
+#define af_buf_append_sep_format(buf, sep, format, ...) \
+  af_buf_append_flags_sep_format(buf, 0, sep, format, __VA_ARGS__)
+
+/* same as af_buf_append_sep_format but remove all trailing CR and LF from
+   buf->str before and after appending to it */
+#define af_buf_append_rmCRLFs_sep_format(buf, sep, format, ...) \
+  af_buf_append_flags_sep_format(buf, \
+                                 AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND, \
+                                 sep, format, __VA_ARGS__)
+
+/* same as af_buf_append_flags_sep_format but no flags or separator */
+#define af_buf_append_format(buf, format, ...) \
+  af_buf_append_flags_sep_format(buf, 0, NULL, format, __VA_ARGS__)
+
+/* same as af_buf_append_format but remove all trailing CR and LF from
+   buf->str before and after appending to it */
+#define af_buf_append_rmCRLFs_format(buf, format, ...) \
+  af_buf_append_flags_sep_format(buf, \
+                                 AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND, \
+                                 NULL, format, __VA_ARGS__)
+
+/* The _ex functions return the new length as a ptrdiff_t, without the INT_MAX
+   limit of the functions that return an int, or one of these errors */
+
+/* vsnprintf/formatter error */
+#define AF_ERR_FORMAT   -1
+
+/* unrecognized flag */
+#define AF_ERR_FLAGS    -2
+
+/* memory allocation failed */
+#define AF_ERR_MEMORY   -3
+
+/* the new length would overflow */
+#define AF_ERR_LENGTH   -4
+
+/* same as append_flags_sep_format but for strings longer than INT_MAX.
+   Documented in the comment block above the function definition. */
+ptrdiff_t append_flags_sep_format_ex(char **str, int flags, const char *sep,
+                                     const char *format, ...);
+
+/* same as af_buf_append_flags_sep_format but for strings longer than INT_MAX.
+   Documented in the comment block above the function definition. */
+ptrdiff_t af_buf_append_flags_sep_format_ex(af_buf *buf, int flags,
+                                            const char *sep,
+                                            const char *format, ...);
+
+/* same as af_buf_append_flags_sep_format_ex but takes a va_list */
+ptrdiff_t af_buf_vappend_flags_sep_format_ex(af_buf *buf, int flags,
+                                             const char *sep,
+                                             const char *format, va_list args);
+
+/* same as append_flags_sep_format_ex but no flags */
+#define append_sep_format_ex(str, sep, format, ...) \
+  append_flags_sep_format_ex(str, 0, sep, format, __VA_ARGS__)
+
+/* same as append_flags_sep_format_ex but no flags or separator */
+#define append_format_ex(str, format, ...) \
+  append_flags_sep_format_ex(str, 0, NULL, format, __VA_ARGS__)
+
+/* same as af_buf_append_flags_sep_format_ex but no flags */
+#define af_buf_append_sep_format_ex(buf, sep, format, ...) \
+  af_buf_append_flags_sep_format_ex(buf, 0, sep, format, __VA_ARGS__)
+
+/* same as af_buf_append_flags_sep_format_ex but no flags or separator */
+#define af_buf_append_format_ex(buf, format, ...) \
+  af_buf_append_flags_sep_format_ex(buf, 0, NULL, format, __VA_ARGS__)
+
+/* A buffer that threads can append to concurrently. Its members are
+   internal. */
+#define AF_SHARED_MAX_CHUNKS 32
+typedef struct af_shared {
+  size_t len;         /* reserved length, and whether it's sealed */
+  size_t committed;   /* the number of reserved bytes written */
+  size_t failed;      /* the number of appends that failed after reserving */
+  size_t chunk_size;  /* the size of the first chunk */
+  char *chunks[AF_SHARED_MAX_CHUNKS];  /* each is twice the size of the last */
+} af_shared;
+
+#define AF_SHARED_DEFAULT_CHUNK_SIZE 4096
+
+/* initialize a shared buffer.
+   Documented in the comment block above the function definition. */
+void af_shared_init(af_shared *shared, size_t chunk_size);
+
+/* append a separator (sep) and formatted data to a shared buffer.
+   Documented in the comment block above the function definition. */
+int af_shared_append_flags_sep_format(af_shared *shared, int flags,
+                                      const char *sep, const char *format,
+                                      ...);
+
+/* same as af_shared_append_flags_sep_format but takes a va_list */
+int af_shared_vappend_flags_sep_format(af_shared *shared, int flags,
+                                       const char *sep, const char *format,
+                                       va_list args);
+
+/* same as af_shared_append_flags_sep_format but no flags */
+#define af_shared_append_sep_format(shared, sep, format, ...) \
+  af_shared_append_flags_sep_format(shared, 0, sep, format, __VA_ARGS__)
+
+/* same as af_shared_append_flags_sep_format but no flags or separator */
+#define af_shared_append_format(shared, format, ...) \
+  af_shared_append_flags_sep_format(shared, 0, NULL, format, __VA_ARGS__)
+
+/* seal a shared buffer and append its string to buf.
+   Documented in the comment block above the function definition. */
+int af_shared_seal(af_shared *shared, af_buf *buf);
+
+/* free the chunks of a shared buffer and make it empty and unsealed */
+void af_shared_free(af_shared *shared);
+
+/* return the calling thread's reusable buffer, emptied.
+   Documented in the comment block above the function definition. */
+af_buf *af_thread_buf(void);
+
+/* set the largest capacity an af_thread_buf keeps between messages */
+void af_thread_buf_set_max(size_t max_cap);
+
+/* release the memory of the calling thread's af_thread_buf */
+void af_thread_buf_trim(void);
+
+/* default af_thread_buf maximum capacity: 1 MB */
+#define AF_THREAD_BUF_DEFAULT_MAX   (1024 * 1024)
+
+/* A string stored in fixed size segments that are never moved.
+   Documented in the comment block above af_rope_init. */
+typedef struct af_rope {
+  char **segs;      /* the segments */
+  size_t nsegs;     /* the number of segments allocated */
+  size_t segs_cap;  /* the number of elements segs can hold */
+  size_t seg_size;  /* the size of each segment */
+  size_t len;       /* the length of the string */
+} af_rope;
+
+/* the segment size of a rope if 0 is passed to af_rope_init */
+#define AF_ROPE_DEFAULT_SEGMENT_SIZE 65536
+
+/* initialize an empty rope */
+void af_rope_init(af_rope *rope, size_t seg_size);
+
+/* free the segments of a rope and make it empty */
+void af_rope_free(af_rope *rope);
+
+/* append a separator (sep) and formatted data to a rope.
+   Documented in the comment block above the function definition. */
+int af_rope_append_flags_sep_format(af_rope *rope, int flags,
+                                    const char *sep, const char *format, ...);
+
+/* same as af_rope_append_flags_sep_format but takes a va_list */
+int af_rope_vappend_flags_sep_format(af_rope *rope, int flags,
+                                     const char *sep, const char *format,
+                                     va_list args);
+
+/* same as af_rope_append_flags_sep_format but no flags */
+#define af_rope_append_sep_format(rope, sep, format, ...) \
+  af_rope_append_flags_sep_format(rope, 0, sep, format, __VA_ARGS__)
+
+/* same as af_rope_append_flags_sep_format but no flags or separator */
+#define af_rope_append_format(rope, format, ...) \
+  af_rope_append_flags_sep_format(rope, 0, NULL, format, __VA_ARGS__)
+
+/* return segment i of a rope and set *len to the length of the string in it.
+   Documented in the comment block above the function definition. */
+const char *af_rope_segment(const af_rope *rope, size_t i, size_t *len);
+
+/* append the string of a rope to buf as one contiguous string */
+int af_rope_flatten(const af_rope *rope, af_buf *buf);
+
+/* Writes len bytes of data. Returns 0 on success or -1 on failure. */
+typedef int (*af_sink_writer)(void *ctx, const char *data, size_t len);
+
+/* the size of the output buffer of a sink */
+#define AF_SINK_BUFFER_SIZE 8192
+
+/* A string that's written to a callback, FILE * or file descriptor as it's
+   appended to. Documented in the comment block above af_sink_init_callback.
+   len is the length of the string so far, the other members are internal. */
+typedef struct af_sink {
+  size_t len;             /* the length of the string */
+  int type;               /* the destination */
+  af_sink_writer writer;  /* callback destination */
+  void *ctx;
+  FILE *fp;               /* FILE * destination */
+  int fd;                 /* file descriptor destination */
+  char *crlf;             /* the trailing CR and LF that are held back */
+  size_t crlflen;
+  size_t crlfcap;
+  char *spill;            /* reused for appends that don't fit buf */
+  size_t spillcap;
+  int error;              /* -1 after a write error */
+  size_t buflen;          /* the output buffered in buf */
+  char buf[AF_SINK_BUFFER_SIZE];
+} af_sink;
+
+/* initialize a sink that writes to a callback.
+   Documented in the comment block above the function definition. */
+void af_sink_init_callback(af_sink *sink, af_sink_writer writer, void *ctx);
+
+/* initialize a sink that writes to fp */
+void af_sink_init_file(af_sink *sink, FILE *fp);
+
+/* initialize a sink that writes to the file descriptor fd */
+void af_sink_init_fd(af_sink *sink, int fd);
+
+/* append a separator (sep) and formatted data to a sink.
+   Documented in the comment block above the function definition. */
+int af_sink_append_flags_sep_format(af_sink *sink, int flags,
+                                    const char *sep, const char *format, ...);
+
+/* same as af_sink_append_flags_sep_format but takes a va_list */
+int af_sink_vappend_flags_sep_format(af_sink *sink, int flags,
+                                     const char *sep, const char *format,
+                                     va_list args);
+
+/* same as af_sink_append_flags_sep_format but no flags */
+#define af_sink_append_sep_format(sink, sep, format, ...) \
+  af_sink_append_flags_sep_format(sink, 0, sep, format, __VA_ARGS__)
+
+/* same as af_sink_append_flags_sep_format but no flags or separator */
+#define af_sink_append_format(sink, format, ...) \
+  af_sink_append_flags_sep_format(sink, 0, NULL, format, __VA_ARGS__)
+
+/* write the output buffered by a sink, except trailing CR and LF */
+int af_sink_flush(af_sink *sink);
+
+/* write all output of a sink and free its memory */
+int af_sink_finish(af_sink *sink);
+
+/* An iovec for writev and sendmsg. On Windows it's the same layout. */
+#ifdef _WIN32
+typedef struct af_iovec {
+  void *iov_base;
+  size_t iov_len;
+} af_iovec;
+#else
+typedef struct iovec af_iovec;
+#endif
+
+/* A string stored as an array of iovecs, with long separators and %s
+   arguments referenced instead of copied. Its members are internal.
+   Documented in the comment block above af_iov_init. */
+typedef struct af_iov {
+  af_iovec *vec;    /* the string */
+  size_t count;     /* the number of iovecs in vec */
+  size_t cap;       /* the number of iovecs vec can hold */
+  size_t len;       /* the length of the string */
+  size_t min_ref;   /* the minimum length of a reference */
+  size_t tail_cap;  /* the allocation size of the last iovec if it's a copy */
+  af_arena arena;   /* the memory of the copies */
+} af_iov;
+
+/* the minimum length of a reference if 0 is passed to af_iov_init */
+#define AF_IOV_DEFAULT_MIN_REF 256
+
+/* initialize an empty iovec builder.
+   Documented in the comment block above the function definition. */
+void af_iov_init(af_iov *iov, size_t min_ref);
+
+/* free the memory of an af_iov and make it empty */
+void af_iov_free(af_iov *iov);
+
+/* append a separator (sep) and formatted data to an af_iov.
+   Documented in the comment block above the function definition. */
+int af_iov_append_flags_sep_format(af_iov *iov, int flags, const char *sep,
+                                   const char *format, ...);
+
+/* same as af_iov_append_flags_sep_format but takes a va_list */
+int af_iov_vappend_flags_sep_format(af_iov *iov, int flags, const char *sep,
+                                    const char *format, va_list args);
+
+/* same as af_iov_append_flags_sep_format but no flags */
+#define af_iov_append_sep_format(iov, sep, format, ...) \
+  af_iov_append_flags_sep_format(iov, 0, sep, format, __VA_ARGS__)
+
+/* same as af_iov_append_flags_sep_format but no flags or separator */
+#define af_iov_append_format(iov, format, ...) \
+  af_iov_append_flags_sep_format(iov, 0, NULL, format, __VA_ARGS__)
+
+/* return the iovecs of an af_iov and set *count to the number of them */
+const af_iovec *af_iov_vec(const af_iov *iov, size_t *count);
+
+/* write the string of an af_iov to the file descriptor fd with writev */
+int af_iov_writev(const af_iov *iov, int fd);
+
+/* append the string of an af_iov to buf as one contiguous string */
+int af_iov_flatten(const af_iov *iov, af_buf *buf);
+
+/* The ring of a producer thread of an af_defer. It's internal. */
+typedef struct af_defer_ring af_defer_ring;
+
+/* A queue of appends whose formatting is deferred to a consumer thread. Its
+   members are internal. Documented in the comment block above af_defer_init.
+   */
+typedef struct af_defer {
+  af_defer_ring *rings;   /* the rings of the producers */
+  size_t ring_size;       /* the size of a ring */
+  size_t failed;          /* the number of appends that failed to render */
+  af_buf scratch;         /* where the consumer formats an append */
+} af_defer;
+
+/* the size of a ring if 0 is passed to af_defer_init: 64 KB */
+#define AF_DEFER_DEFAULT_RING_SIZE  (64 * 1024)
+
+/* initialize a deferred formatting queue.
+   Documented in the comment block above the function definition. */
+void af_defer_init(af_defer *defer, size_t ring_size);
+
+/* free the rings of an af_defer and make it empty */
+void af_defer_free(af_defer *defer);
+
+/* return a ring for the calling producer thread.
+   Documented in the comment block above the function definition. */
+af_defer_ring *af_defer_attach(af_defer *defer);
+
+/* give up a ring so that another producer thread can attach it */
+void af_defer_detach(af_defer_ring *ring);
+
+/* record a separator (sep) and formatted data to append later.
+   Documented in the comment block above the function definition. */
+int af_defer_append_flags_sep_format(af_defer_ring *ring, int flags,
+                                     const char *sep, const char *format,
+                                     ...);
+
+/* same as af_defer_append_flags_sep_format but takes a va_list */
+int af_defer_vappend_flags_sep_format(af_defer_ring *ring, int flags,
+                                      const char *sep, const char *format,
+                                      va_list args);
+
+/* same as af_defer_append_flags_sep_format but no flags */
+#define af_defer_append_sep_format(ring, sep, format, ...) \
+  af_defer_append_flags_sep_format(ring, 0, sep, format, __VA_ARGS__)
+
+/* same as af_defer_append_flags_sep_format but no flags or separator */
+#define af_defer_append_format(ring, format, ...) \
+  af_defer_append_flags_sep_format(ring, 0, NULL, format, __VA_ARGS__)
+
+/* format the recorded appends and append them to buf.
+   Documented in the comment block above the function definition. */
+int af_defer_drain(af_defer *defer, af_buf *buf);
+
+/* wait until the appends recorded so far have been drained.
+   Documented in the comment block above the function definition. */
+int af_defer_flush(af_defer *defer);
+
+/* A format string compiled by af_compile. It's opaque. */
+typedef struct af_program af_program;
+
+/* compile a format string into a reusable program.
+   Documented in the comment block above the function definition. */
+af_program *af_compile(const char *format);
+
+/* free a program compiled by af_compile */
+void af_program_free(af_program *prog);
+
+/* return an upper bound of the length of the output of a program.
+   Documented in the comment block above the function definition. */
+size_t af_program_max_length(const af_program *prog);
+
+/* append a separator (sep) and the output of a compiled program to *str.
+   Documented in the comment block above the function definition. */
+int af_append_compiled(char **str, int flags, const char *sep,
+                       const af_program *prog, ...);
+
+/* same as af_append_compiled but takes a va_list */
+int af_vappend_compiled(char **str, int flags, const char *sep,
+                        const af_program *prog, va_list args);
+
+/* append a separator (sep) and the output of a compiled program to buf.
+   Documented in the comment block above the function definition. */
+int af_buf_append_compiled(af_buf *buf, int flags, const char *sep,
+                           const af_program *prog, ...);
+
+/* same as af_buf_append_compiled but takes a va_list */
+int af_buf_vappend_compiled(af_buf *buf, int flags, const char *sep,
+                            const af_program *prog, va_list args);
+
+/* the number of buckets of af_stats.fragment_sizes */
+#define AF_STATS_BUCKETS 16
+
+/* Instrumentation counters. Only kept if append_format.c is compiled with
+   AF_ENABLE_STATS. Documented in the comment block above af_stats_snapshot. */
+typedef struct af_stats {
+  size_t calls;
+  size_t bytes_formatted;
+  size_t reallocs;
+  size_t realloc_bytes;
+  size_t double_formats;
+  size_t crlf_trimmed;
+  size_t errors;
+  size_t flag_errors;
+  size_t fragment_sizes[AF_STATS_BUCKETS];
+} af_stats;
+
+/* get the instrumentation counters totaled over all threads.
+   Documented in the comment block above the function definition. */
+int af_stats_snapshot(af_stats *stats, int reset);
+
 #ifdef __cplusplus
 }
 #endif
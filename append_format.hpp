@@ -0,0 +1,1288 @@
+/* append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/* C++20 layer for append_format with format strings parsed at compile time.
+
+af::append_flags_sep<"%s=%d">(&str, flags, "; ", key, value);
+af::append_sep<"%s=%d">(&buf, "; ", key, value);
+af::append<"%s">(&str, "foo");
+
+The format string is a template argument. It's parsed at compile time and the
+arguments are type-checked against it, so a mismatch is a compile error
+instead of undefined behavior. The writer that is generated computes an upper
+bound of the size of the output from the arguments without a measuring pass,
+and then writes the output directly into the string. %s also accepts
+std::string and std::string_view.
+
+The outcome is the same as append_flags_sep_format with the same format and
+arguments: the separator rules, AF_* flags and return codes are the same, and
+both char ** and af_buf strings are supported. The exception is the flags of
+the built-in formatter, AF_ESCAPE_JSON, AF_ESCAPE_C and AF_SHORTEST_FLOAT,
+which return -2 like an unrecognized flag. The append_flags_sep_format
+overloads below accept them.
+
+Simple conversions (%d %i %u %o %x %X with no flags, width or precision, and
+%c %s %% with optional '-' and width and, for %s, precision) are written
+directly. Other conversions are written by snprintf one at a time. Wide
+conversions (%lc %ls), %n and positional arguments aren't supported.
+
+The string can also be an af::small_string, which keeps short strings in an
+inline buffer and frees its allocation when it's destroyed, or a std::string,
+std::pmr::string or std::vector<char> (any allocator), which are appended to
+directly with their own growth policy. For those types there are also
+overloads of append_flags_sep_format for format strings that are only known
+at runtime, so the append_format macros work with them:
+
+af::small_string<> msg;
+append_sep_format(&msg, "; ", "%s=%d", key, value);
+std::string line;
+af::append_sep<"%s=%d">(&line, "; ", key, value);
+*/
+
+#ifndef APPEND_FORMAT_HPP
+#define APPEND_FORMAT_HPP
+
+#if !(__cplusplus >= 202002L || \
+      (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#error "append_format.hpp requires C++20"
+#endif
+
+#include "append_format.h"
+
+#include <array>
+#include <climits>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace af {
+
+/* A string literal that can be used as a template argument */
+template<std::size_t N>
+struct fixed_string {
+  char data[N] {};
+
+  constexpr fixed_string(const char (&s)[N])
+  {
+    for(std::size_t i = 0; i < N; ++i)
+      data[i] = s[i];
+  }
+
+  constexpr std::size_t size() const { return N - 1; }
+};
+
+namespace detail {
+
+/* Calling this in a constant expression is a compile error that shows msg */
+inline void invalid_format(const char *msg) { (void)msg; }
+
+enum class op_kind {
+  literal,  /* text from the format string */
+  percent,  /* %% */
+  sint,     /* %d %i without flags, width or precision */
+  uint,     /* %u %o %x %X without flags, width or precision */
+  chr,      /* %c with optional '-' and width */
+  str,      /* %s with optional '-', width and precision */
+  other     /* any other conversion, written by snprintf */
+};
+
+/* a literal or a conversion parsed from a format string */
+struct op {
+  op_kind kind = op_kind::literal;
+  std::size_t begin = 0;  /* offset of the text or conversion in the format */
+  std::size_t len = 0;    /* length of the text or conversion */
+  bool minus = false;     /* '-' flag */
+  int width = -1;         /* -1 if none, -2 if *, otherwise the width */
+  int precision = -1;     /* -1 if none, -2 if *, otherwise the precision */
+  char length = 0;        /* 0 or one of H(hh) h l q(ll) j z t L */
+  char conv = 0;          /* conversion specifier */
+  std::size_t arg = 0;    /* index of the argument of the conversion */
+};
+
+constexpr bool is_digit(char c) { return '0' <= c && c <= '9'; }
+
+/* parse the conversion at format[i], which is a %, into o. return the offset
+   after it. nargs is incremented by the number of arguments it uses. */
+constexpr std::size_t parse_conversion(const char *format, std::size_t i,
+                                       op &o, std::size_t &nargs)
+{
+  std::size_t start = i++;
+  bool other_flags = false;
+
+  o = op();
+  o.begin = start;
+
+  for(;; ++i) {
+    if(format[i] == '-')
+      o.minus = true;
+    else if(format[i] == '+' || format[i] == ' ' || format[i] == '#' ||
+            format[i] == '0')
+      other_flags = true;
+    else
+      break;
+  }
+
+  if(format[i] == '*') {
+    o.width = -2;
+    ++nargs;
+    ++i;
+  }
+  else if(is_digit(format[i])) {
+    o.width = 0;
+    for(; is_digit(format[i]); ++i) {
+      if(o.width > 100000000)
+        invalid_format("width is too large");
+      o.width = o.width * 10 + (format[i] - '0');
+    }
+    if(format[i] == '$')
+      invalid_format("positional arguments aren't supported");
+  }
+
+  if(format[i] == '.') {
+    ++i;
+    if(format[i] == '*') {
+      o.precision = -2;
+      ++nargs;
+      ++i;
+    }
+    else {
+      o.precision = 0;
+      for(; is_digit(format[i]); ++i) {
+        if(o.precision > 100000000)
+          invalid_format("precision is too large");
+        o.precision = o.precision * 10 + (format[i] - '0');
+      }
+    }
+  }
+
+  switch(format[i]) {
+  case 'h':
+    o.length = (format[i + 1] == 'h') ? 'H' : 'h';
+    i += (o.length == 'H') ? 2 : 1;
+    break;
+  case 'l':
+    o.length = (format[i + 1] == 'l') ? 'q' : 'l';
+    i += (o.length == 'q') ? 2 : 1;
+    break;
+  case 'j':
+  case 'z':
+  case 't':
+  case 'L':
+    o.length = format[i++];
+    break;
+  default:
+    break;
+  }
+
+  o.conv = format[i];
+  bool simple = !o.minus && !other_flags && o.width == -1 &&
+                o.precision == -1;
+
+  switch(o.conv) {
+  case 'd':
+  case 'i':
+  case 'u':
+  case 'o':
+  case 'x':
+  case 'X':
+    if(o.length == 'L')
+      invalid_format("invalid length modifier for an integer conversion");
+    if(!simple)
+      o.kind = op_kind::other;
+    else if(o.conv == 'd' || o.conv == 'i')
+      o.kind = op_kind::sint;
+    else
+      o.kind = op_kind::uint;
+    break;
+  case 'c':
+  case 's':
+    if(o.length == 'l')
+      invalid_format("wide conversions aren't supported");
+    if(o.length)
+      invalid_format("invalid length modifier for %c or %s");
+    if(other_flags)
+      invalid_format("only the '-' flag can be used with %c or %s");
+    if(o.conv == 'c' && o.precision != -1)
+      invalid_format("precision can't be used with %c");
+    o.kind = (o.conv == 'c') ? op_kind::chr : op_kind::str;
+    break;
+  case 'p':
+    if(o.length)
+      invalid_format("invalid length modifier for %p");
+    o.kind = op_kind::other;
+    break;
+  case 'f':
+  case 'F':
+  case 'e':
+  case 'E':
+  case 'g':
+  case 'G':
+  case 'a':
+  case 'A':
+    if(o.length && o.length != 'l' && o.length != 'L')
+      invalid_format("invalid length modifier for a floating point "
+                     "conversion");
+    o.kind = op_kind::other;
+    break;
+  case '%':
+    if(i != start + 1)
+      invalid_format("%% can't have flags, width, precision or length");
+    o.kind = op_kind::percent;
+    break;
+  case 'n':
+    invalid_format("%n isn't supported");
+    break;
+  case '\0':
+    invalid_format("the format string ends in the middle of a conversion");
+    break;
+  default:
+    invalid_format("unknown conversion");
+    break;
+  }
+
+  if(o.kind != op_kind::percent)
+    o.arg = nargs++;
+
+  o.len = i + 1 - start;
+  return i + 1;
+}
+
+/* a format string parsed into ops */
+template<std::size_t N>
+struct program {
+  op ops[N ? N : 1] {};
+  std::size_t nops = 0;
+  std::size_t nargs = 0;
+};
+
+/* return the number of ops in format */
+template<fixed_string F>
+consteval std::size_t count_ops()
+{
+  std::size_t n = 0, nargs = 0;
+  op o;
+
+  for(std::size_t i = 0; i < F.size();) {
+    if(F.data[i] == '%')
+      i = parse_conversion(F.data, i, o, nargs);
+    else {
+      while(i < F.size() && F.data[i] != '%')
+        ++i;
+    }
+    ++n;
+  }
+
+  return n;
+}
+
+template<fixed_string F>
+consteval auto parse()
+{
+  program<count_ops<F>()> prog;
+
+  for(std::size_t i = 0; i < F.size();) {
+    op &o = prog.ops[prog.nops++];
+    if(F.data[i] == '%')
+      i = parse_conversion(F.data, i, o, prog.nargs);
+    else {
+      o.kind = op_kind::literal;
+      o.begin = i;
+      while(i < F.size() && F.data[i] != '%')
+        ++i;
+      o.len = i - o.begin;
+    }
+  }
+
+  return prog;
+}
+
+/* the conversion of an op as a null terminated format string for snprintf */
+template<fixed_string F, op O>
+struct conversion_format {
+  static constexpr auto make()
+  {
+    std::array<char, O.len + 1> s {};
+    for(std::size_t i = 0; i < O.len; ++i)
+      s[i] = F.data[O.begin + i];
+    return s;
+  }
+
+  static constexpr auto value = make();
+};
+
+template<typename T>
+using bare = std::remove_cv_t<std::remove_reference_t<T>>;
+
+template<typename T>
+constexpr bool is_integer =
+  std::is_integral_v<bare<T>> && !std::is_same_v<bare<T>, bool>;
+
+template<typename T>
+constexpr bool is_string =
+  std::is_same_v<std::decay_t<T>, const char *> ||
+  std::is_same_v<std::decay_t<T>, char *> ||
+  std::is_same_v<bare<T>, std::string> ||
+  std::is_same_v<bare<T>, std::string_view>;
+
+/* the signed type printf expects for a length modifier */
+template<char Length>
+struct signed_type { using type = int; };
+template<> struct signed_type<'H'> { using type = signed char; };
+template<> struct signed_type<'h'> { using type = short; };
+template<> struct signed_type<'l'> { using type = long; };
+template<> struct signed_type<'q'> { using type = long long; };
+template<> struct signed_type<'j'> { using type = std::intmax_t; };
+template<> struct signed_type<'z'> { using type = std::ptrdiff_t; };
+template<> struct signed_type<'t'> { using type = std::ptrdiff_t; };
+
+/* the unsigned type printf expects for a length modifier */
+template<char Length>
+struct unsigned_type { using type = unsigned; };
+template<> struct unsigned_type<'H'> { using type = unsigned char; };
+template<> struct unsigned_type<'h'> { using type = unsigned short; };
+template<> struct unsigned_type<'l'> { using type = unsigned long; };
+template<> struct unsigned_type<'q'> { using type = unsigned long long; };
+template<> struct unsigned_type<'j'> { using type = std::uintmax_t; };
+template<> struct unsigned_type<'z'> { using type = std::size_t; };
+template<> struct unsigned_type<'t'> { using type = std::size_t; };
+
+/* the type an integer argument is passed to snprintf as. short types are
+   passed as int like a variadic argument would be. */
+template<op O>
+using int_arg_type = std::conditional_t<
+  O.conv == 'd' || O.conv == 'i',
+  std::conditional_t<O.length == 'H' || O.length == 'h', int,
+                     typename signed_type<O.length>::type>,
+  std::conditional_t<O.length == 'H' || O.length == 'h', unsigned,
+                     typename unsigned_type<O.length>::type>>;
+
+/* check at compile time that T can be the argument of O */
+template<op O, typename T>
+constexpr void check_arg()
+{
+  if constexpr(O.kind == op_kind::sint || O.kind == op_kind::uint ||
+               (O.kind == op_kind::other &&
+                (O.conv == 'd' || O.conv == 'i' || O.conv == 'u' ||
+                 O.conv == 'o' || O.conv == 'x' || O.conv == 'X'))) {
+    static_assert(is_integer<T>,
+                  "af: an integer conversion needs an integer argument");
+    static_assert(sizeof(bare<T>) <= sizeof(int_arg_type<O>),
+                  "af: integer argument is too large for the length modifier "
+                  "of the conversion");
+  }
+  else if constexpr(O.kind == op_kind::chr) {
+    static_assert(is_integer<T>, "af: %c needs a character argument");
+  }
+  else if constexpr(O.kind == op_kind::str) {
+    static_assert(is_string<T>, "af: %s needs a string argument");
+  }
+  else if constexpr(O.conv == 'p') {
+    static_assert(std::is_pointer_v<std::decay_t<T>> ||
+                  std::is_null_pointer_v<bare<T>>,
+                  "af: %p needs a pointer argument");
+  }
+  else if constexpr(O.length == 'L') {
+    static_assert(std::is_same_v<bare<T>, long double>,
+                  "af: %L conversion needs a long double argument");
+  }
+  else {
+    static_assert(std::is_floating_point_v<bare<T>> &&
+                  !std::is_same_v<bare<T>, long double>,
+                  "af: floating point conversion needs a float or double "
+                  "argument");
+  }
+}
+
+/* check at compile time that T can be the argument of a * width or
+   precision */
+template<typename T>
+constexpr void check_star_arg()
+{
+  static_assert(is_integer<T> && sizeof(bare<T>) <= sizeof(int),
+                "af: * width or precision needs an int argument");
+}
+
+/* write the digits of v in base 10 backwards from end. return the number of
+   digits. */
+inline std::size_t utoa_dec(char *end, std::uintmax_t v)
+{
+  static const char pairs[] =
+    "00010203040506070809" "10111213141516171819" "20212223242526272829"
+    "30313233343536373839" "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879" "80818283848586878889"
+    "90919293949596979899";
+  char *p = end;
+
+  while(v >= 100) {
+    unsigned i = static_cast<unsigned>(v % 100) * 2;
+    v /= 100;
+    *--p = pairs[i + 1];
+    *--p = pairs[i];
+  }
+
+  if(v >= 10) {
+    unsigned i = static_cast<unsigned>(v) * 2;
+    *--p = pairs[i + 1];
+    *--p = pairs[i];
+  }
+  else
+    *--p = static_cast<char>('0' + v);
+
+  return static_cast<std::size_t>(end - p);
+}
+
+/* write the digits of v in base 8 or 16 backwards from end. return the number
+   of digits. */
+inline std::size_t utoa_pow2(char *end, std::uintmax_t v, unsigned shift,
+                             const char *digits)
+{
+  char *p = end;
+  unsigned mask = (1u << shift) - 1;
+
+  do {
+    *--p = digits[v & mask];
+    v >>= shift;
+  } while(v);
+
+  return static_cast<std::size_t>(end - p);
+}
+
+/* get the part of a string argument that's written, given its precision or
+   -1. like printf at most precision bytes of s are read. s isn't a null
+   pointer, that's written by snprintf. std::string and std::string_view are
+   written in full. */
+inline std::string_view string_arg(const char *s, int precision)
+{
+  if(precision < 0)
+    return s;
+  const void *nul = std::memchr(s, '\0', static_cast<std::size_t>(precision));
+  return std::string_view(s, nul ? static_cast<std::size_t>(
+                                     static_cast<const char *>(nul) - s) :
+                                   static_cast<std::size_t>(precision));
+}
+
+inline std::string_view string_arg(std::string_view s, int precision)
+{
+  if(precision >= 0 && static_cast<std::size_t>(precision) < s.size())
+    s = s.substr(0, static_cast<std::size_t>(precision));
+  return s;
+}
+
+inline std::string_view string_arg(const std::string &s, int precision)
+{
+  return string_arg(std::string_view(s), precision);
+}
+
+/* the upper bound of the size of the output of a conversion written by
+   snprintf, given its width and precision */
+template<op O>
+constexpr std::size_t other_bound(int width, int precision)
+{
+  std::size_t n = 0;
+
+  if constexpr(O.conv == 'f' || O.conv == 'F')
+    /* the integer part of the largest value, a sign and a point */
+    n = (O.length == 'L') ? 4934 + 2 : 309 + 2;
+  else if constexpr(O.conv == 'p')
+    /* (nil) or 0x and the hex digits */
+    n = 2 + 2 * sizeof(void *) + 5;
+  else if constexpr(O.conv == 'c')
+    n = 1;
+  else
+    /* the digits of an integer or the exponent notation of a float */
+    n = 48;
+
+  /* %f %e %g and %a have 6 digits after the point by default */
+  n += (precision >= 0) ? static_cast<std::size_t>(precision) : 6;
+
+  if(width > 0 && static_cast<std::size_t>(width) > n)
+    n = static_cast<std::size_t>(width);
+
+  return n;
+}
+
+/* Writes the output of a format string and its arguments. */
+template<fixed_string F, typename... Args>
+class writer {
+public:
+  static constexpr auto prog = parse<F>();
+
+  static_assert(sizeof...(Args) == prog.nargs,
+                "af: the number of arguments doesn't match the format string");
+
+  explicit writer(const Args &...args) : args_(args...)
+  {
+    check_args(std::make_index_sequence<prog.nops>());
+  }
+
+  /* compute an upper bound of the size of the output. this also computes the
+     size of each op. */
+  std::size_t bound()
+  {
+    return bound_all(std::make_index_sequence<prog.nops>());
+  }
+
+  /* the af_writer callback */
+  static std::size_t write(char *dest, std::size_t maxlen, void *ctx)
+  {
+    return static_cast<writer *>(ctx)->write_all(
+      dest, maxlen, std::make_index_sequence<prog.nops>());
+  }
+
+private:
+  template<std::size_t... I>
+  static constexpr void check_args(std::index_sequence<I...>)
+  {
+    (check_op<I>(), ...);
+  }
+
+  template<std::size_t I>
+  static constexpr void check_op()
+  {
+    constexpr op o = prog.ops[I];
+    if constexpr(o.kind != op_kind::literal && o.kind != op_kind::percent) {
+      if constexpr(o.width == -2)
+        check_star_arg<arg_type<o.arg - 1 - (o.precision == -2)>>();
+      if constexpr(o.precision == -2)
+        check_star_arg<arg_type<o.arg - 1>>();
+      check_arg<o, arg_type<o.arg>>();
+    }
+  }
+
+  template<std::size_t I>
+  using arg_type = std::tuple_element_t<I, std::tuple<Args...>>;
+
+  template<std::size_t I>
+  const auto &arg() const { return std::get<I>(args_); }
+
+  /* the width of op o, or -1 */
+  template<op O>
+  int width() const
+  {
+    if constexpr(O.width == -2) {
+      int w = static_cast<int>(arg<O.arg - 1 - (O.precision == -2)>());
+      /* a negative width is the '-' flag and a positive width */
+      return (w < 0) ? ((w == INT_MIN) ? INT_MAX : -w) : w;
+    }
+    else
+      return O.width;
+  }
+
+  template<op O>
+  bool minus() const
+  {
+    if constexpr(O.width == -2)
+      return O.minus ||
+             static_cast<int>(arg<O.arg - 1 - (O.precision == -2)>()) < 0;
+    else
+      return O.minus;
+  }
+
+  /* the precision of op o, or -1 */
+  template<op O>
+  int precision() const
+  {
+    if constexpr(O.precision == -2) {
+      int p = static_cast<int>(arg<O.arg - 1>());
+      return (p < 0) ? -1 : p;
+    }
+    else
+      return O.precision;
+  }
+
+  template<std::size_t... I>
+  std::size_t bound_all(std::index_sequence<I...>)
+  {
+    std::size_t total = 0;
+    bool overflow = false;
+    ((overflow |= add(total, bound_op<I>())), ...);
+    return overflow ? static_cast<std::size_t>(-1) : total;
+  }
+
+  static bool add(std::size_t &total, std::size_t n)
+  {
+    total += n;
+    return total < n;
+  }
+
+  template<std::size_t I>
+  std::size_t bound_op()
+  {
+    constexpr op o = prog.ops[I];
+
+    if constexpr(o.kind == op_kind::literal)
+      return o.len;
+    else if constexpr(o.kind == op_kind::percent)
+      return 1;
+    else if constexpr(o.kind == op_kind::sint || o.kind == op_kind::uint)
+      /* the octal digits of a 64-bit integer, or a sign and its decimal
+         digits */
+      return 22;
+    else if constexpr(o.kind == op_kind::chr) {
+      int w = width<o>();
+      return (w > 1) ? static_cast<std::size_t>(w) : 1;
+    }
+    else if constexpr(o.kind == op_kind::str) {
+      int w = width<o>();
+      if(is_null_str<o>(arg<o.arg>()))
+        return (w > 0 && static_cast<std::size_t>(w) > null_str_max) ?
+               static_cast<std::size_t>(w) : null_str_max;
+      std::string_view s = string_arg(arg<o.arg>(), precision<o>());
+      strs_[I] = s;
+      return (w > 0 && static_cast<std::size_t>(w) > s.size()) ?
+             static_cast<std::size_t>(w) : s.size();
+    }
+    else
+      return other_bound<o>(width<o>(), precision<o>());
+  }
+
+  template<std::size_t... I>
+  std::size_t write_all(char *dest, std::size_t maxlen,
+                        std::index_sequence<I...>)
+  {
+    char *p = dest;
+    [[maybe_unused]] char *end = dest + maxlen;
+    bool failed = false;
+    ((failed = failed || !write_op<I>(p, end)), ...);
+    return failed ? static_cast<std::size_t>(-1) :
+                    static_cast<std::size_t>(p - dest);
+  }
+
+  /* write op I at p and advance p. end is the end of the destination.
+     return false on failure. */
+  template<std::size_t I>
+  bool write_op(char *&p, char *end)
+  {
+    constexpr op o = prog.ops[I];
+
+    if constexpr(o.kind == op_kind::literal) {
+      std::memcpy(p, F.data + o.begin, o.len);
+      p += o.len;
+    }
+    else if constexpr(o.kind == op_kind::percent)
+      *p++ = '%';
+    else if constexpr(o.kind == op_kind::sint) {
+      using T = typename signed_type<o.length>::type;
+      std::intmax_t v = static_cast<T>(arg<o.arg>());
+      char digits[24];
+      std::uintmax_t u = (v < 0) ? std::uintmax_t(0) - std::uintmax_t(v) :
+                                   std::uintmax_t(v);
+      std::size_t n = utoa_dec(digits + sizeof(digits), u);
+      if(v < 0)
+        *p++ = '-';
+      std::memcpy(p, digits + sizeof(digits) - n, n);
+      p += n;
+    }
+    else if constexpr(o.kind == op_kind::uint) {
+      using T = typename unsigned_type<o.length>::type;
+      std::uintmax_t v = static_cast<T>(arg<o.arg>());
+      char digits[24];
+      std::size_t n;
+      if constexpr(o.conv == 'o')
+        n = utoa_pow2(digits + sizeof(digits), v, 3, "01234567");
+      else if constexpr(o.conv == 'x')
+        n = utoa_pow2(digits + sizeof(digits), v, 4, "0123456789abcdef");
+      else if constexpr(o.conv == 'X')
+        n = utoa_pow2(digits + sizeof(digits), v, 4, "0123456789ABCDEF");
+      else
+        n = utoa_dec(digits + sizeof(digits), v);
+      std::memcpy(p, digits + sizeof(digits) - n, n);
+      p += n;
+    }
+    else if constexpr(o.kind == op_kind::chr) {
+      char c = static_cast<char>(static_cast<unsigned char>(arg<o.arg>()));
+      write_padded(p, std::string_view(&c, 1), width<o>(), minus<o>());
+    }
+    else if constexpr(o.kind == op_kind::str) {
+      if constexpr(std::is_pointer_v<std::remove_cv_t<arg_type<o.arg>>>) {
+        if(!arg<o.arg>())
+          return write_null_str<o>(p, end);
+      }
+      write_padded(p, strs_[I], width<o>(), minus<o>());
+    }
+    else
+      return write_other<o>(p, end);
+
+    return true;
+  }
+
+  static void write_padded(char *&p, std::string_view s, int width,
+                           bool minus)
+  {
+    std::size_t padding = 0;
+    if(width > 0 && static_cast<std::size_t>(width) > s.size())
+      padding = static_cast<std::size_t>(width) - s.size();
+    if(!minus) {
+      std::memset(p, ' ', padding);
+      p += padding;
+    }
+    std::memcpy(p, s.data(), s.size());
+    p += s.size();
+    if(minus) {
+      std::memset(p, ' ', padding);
+      p += padding;
+    }
+  }
+
+  /* the longest a null pointer for %s is written as by the C library, like
+     (null) */
+  static constexpr std::size_t null_str_max = 16;
+
+  /* whether the argument of a %s op is a null pointer. how that's written is
+     up to the C library, like the C functions. */
+  template<op O, typename T>
+  static bool is_null_str(const T &v)
+  {
+    if constexpr(std::is_pointer_v<T>)
+      return !v;
+    else
+      return false;
+  }
+
+  /* snprintf by way of vsnprintf, since compilers warn about a null pointer
+     for %s they can see though the C library writes it */
+  static int null_str_snprintf(char *buf, std::size_t size,
+                               const char *format, ...)
+  {
+    va_list args;
+    int n;
+
+    va_start(args, format);
+    n = std::vsnprintf(buf, size, format, args);
+    va_end(args);
+    return n;
+  }
+
+  /* write a null pointer for %s op o with snprintf */
+  template<op O>
+  bool write_null_str(char *&p, char *end)
+  {
+    const char *s = arg<O.arg>();
+    std::size_t size = static_cast<std::size_t>(end - p) + 1;
+    int w = width<O>();
+    int n = null_str_snprintf(p, size, minus<O>() ? "%-*.*s" : "%*.*s",
+                              (w > 0) ? w : 0, precision<O>(), s);
+
+    if(n < 0 || static_cast<std::size_t>(n) >= size)
+      return false;
+
+    p += n;
+    return true;
+  }
+
+  /* the argument of op o as the type snprintf expects */
+  template<op O>
+  auto snprintf_arg() const
+  {
+    const auto &v = arg<O.arg>();
+    if constexpr(O.conv == 'p')
+      return static_cast<const void *>(v);
+    else if constexpr(O.conv == 'c')
+      return static_cast<int>(v);
+    else if constexpr(is_integer<decltype(v)>)
+      return static_cast<int_arg_type<O>>(v);
+    else if constexpr(O.length == 'L')
+      return static_cast<long double>(v);
+    else
+      return static_cast<double>(v);
+  }
+
+  /* write an op with snprintf */
+  template<op O>
+  bool write_other(char *&p, char *end)
+  {
+    const char *format = conversion_format<F, O>::value.data();
+    std::size_t size = static_cast<std::size_t>(end - p) + 1;
+    int n;
+
+    if constexpr(O.width == -2 && O.precision == -2)
+      n = std::snprintf(p, size, format, static_cast<int>(arg<O.arg - 2>()),
+                        static_cast<int>(arg<O.arg - 1>()),
+                        snprintf_arg<O>());
+    else if constexpr(O.width == -2 || O.precision == -2)
+      n = std::snprintf(p, size, format, static_cast<int>(arg<O.arg - 1>()),
+                        snprintf_arg<O>());
+    else
+      n = std::snprintf(p, size, format, snprintf_arg<O>());
+
+    if(n < 0 || static_cast<std::size_t>(n) >= size)
+      return false;
+
+    p += n;
+    return true;
+  }
+
+  std::tuple<const Args &...> args_;
+
+  /* the string of each %s op, computed by bound() */
+  std::string_view strs_[prog.nops ? prog.nops : 1];
+};
+
+template<typename C>
+struct is_vector : std::false_type {};
+template<typename Alloc>
+struct is_vector<std::vector<char, Alloc>> : std::true_type {};
+
+/* An af_buf that is a view of a std::basic_string or std::vector<char> for the
+   duration of an append. The size of the container covers the capacity of the
+   af_buf, including the null terminator of a vector, and its allocator resizes
+   the container, so the append is written directly into the container and
+   reallocates only when the container's own growth policy does. The appends
+   use AF_EXACT_FIT so the container isn't resized past what's written.
+
+   The spare capacity of the container is exposed to the append by resizing
+   the container to it, so a fragment that fits is formatted once directly
+   into it. Resizing zero-fills the new bytes unless the string has
+   resize_and_overwrite (C++23), so without it at most spare_max bytes of the
+   spare capacity are exposed and a longer fragment grows the container. */
+template<typename C>
+class container_buf {
+public:
+  explicit container_buf(C &c) : c_(c)
+  {
+    alloc_.resize = resize;
+    alloc_.release = release;
+    alloc_.ctx = &c;
+
+    buf_.str = nullptr;
+    buf_.len = c.size();
+    buf_.cap = 0;
+    buf_.alloc = &alloc_;
+
+    /* a string already has a null terminator after its content */
+    if constexpr(is_vector<C>::value) {
+      try {
+        c.push_back('\0');
+      }
+      catch(...) {
+        return;
+      }
+    }
+
+    /* this is within the capacity so it doesn't allocate */
+    std::size_t spare = c.capacity() - c.size();
+    set_size(c, c.size() + ((spare < spare_max) ? spare : spare_max));
+
+    buf_.str = c.data();
+    buf_.cap = is_vector<C>::value ? c.size() : c.size() + 1;
+  }
+
+  /* shrink the container to the length of the string. if the append failed
+     that's the length it had before. */
+  ~container_buf()
+  {
+    if(buf_.str)
+      c_.resize(buf_.len);
+  }
+
+  container_buf(const container_buf &) = delete;
+  container_buf &operator=(const container_buf &) = delete;
+
+  /* the af_buf, or NULL if the container couldn't make room for the null
+     terminator */
+  af_buf *get() { return buf_.str ? &buf_ : nullptr; }
+
+private:
+#ifdef __cpp_lib_string_resize_and_overwrite
+  static constexpr bool overwrite = !is_vector<C>::value;
+#else
+  static constexpr bool overwrite = false;
+#endif
+
+  /* the most spare capacity that's exposed, see above */
+  static constexpr std::size_t spare_max =
+    overwrite ? static_cast<std::size_t>(-1) : 1024;
+
+  /* resize the container to n without filling the new bytes if it can */
+  static void set_size(C &c, std::size_t n)
+  {
+#ifdef __cpp_lib_string_resize_and_overwrite
+    if constexpr(overwrite) {
+      c.resize_and_overwrite(n, [](char *, std::size_t m) { return m; });
+      return;
+    }
+#endif
+    c.resize(n);
+  }
+
+  static void *resize(void *ctx, void *, std::size_t, std::size_t newsize)
+  {
+    C &c = *static_cast<C *>(ctx);
+    /* exceptions can't be thrown through the C functions */
+    try {
+      set_size(c, is_vector<C>::value ? newsize : newsize - 1);
+    }
+    catch(...) {
+      return nullptr;
+    }
+    return c.data();
+  }
+
+  /* the storage belongs to the container */
+  static void release(void *, void *, std::size_t) {}
+
+  C &c_;
+  af_allocator alloc_;
+  af_buf buf_;
+};
+
+/* append the output of a writer to a container. the outcome is the same as
+   af_buf_append_flags_sep_writer. */
+template<typename C>
+int append_writer(C *c, int flags, const char *sep, std::size_t maxlen,
+                  af_writer writer, void *ctx)
+{
+  /* Unrecognized flags are checked before the container is changed */
+  if((flags & ~AF_ALL_FLAGS))
+    return -2;
+  if(!c)
+    return af_buf_append_flags_sep_writer(nullptr, flags, sep, maxlen, writer,
+                                          ctx);
+  container_buf<C> buf(*c);
+  if(!buf.get())
+    return -1;
+  return af_buf_append_flags_sep_writer(buf.get(), flags | AF_EXACT_FIT, sep,
+                                        maxlen, writer, ctx);
+}
+
+/* append formatted data to a container. the outcome is the same as
+   af_buf_vappend_flags_sep_format. */
+template<typename C>
+int vappend_format(C *c, int flags, const char *sep, const char *format,
+                   va_list args)
+{
+  /* Unrecognized flags are checked before the container is changed. The
+     escape flags are checked by the C function. */
+  if((flags & ~(AF_ALL_FLAGS | AF_ESCAPE_JSON | AF_ESCAPE_C |
+                AF_SHORTEST_FLOAT)))
+    return -2;
+  if(!c)
+    return af_buf_vappend_flags_sep_format(nullptr, flags, sep, format, args);
+  container_buf<C> buf(*c);
+  if(!buf.get())
+    return -1;
+  return af_buf_vappend_flags_sep_format(buf.get(), flags | AF_EXACT_FIT, sep,
+                                         format, args);
+}
+
+} /* namespace detail */
+
+/* A string that is appended to like an af_buf, with an inline buffer of N
+   bytes (including the null terminator) for short strings. A longer string is
+   allocated by the C runtime and freed by the destructor. Moving it moves the
+   allocation; only an inline string is copied.
+
+   The af_buf can be passed to the C functions with buf(). Its capacity is
+   grown by the growth policy of af_buf, and af_buf_shrink_to_fit moves a
+   string that fits back into the inline buffer. */
+template<std::size_t N = 128>
+class small_string {
+  static_assert(N >= 1, "af: the inline buffer needs room for a terminator");
+
+public:
+  small_string() noexcept { init(); }
+
+  small_string(std::string_view s) : small_string() { assign(s); }
+
+  small_string(const small_string &other) : small_string()
+  {
+    assign(other.view());
+  }
+
+  small_string(small_string &&other) noexcept : small_string()
+  {
+    take(other);
+  }
+
+  ~small_string() { af_buf_free(&buf_); }
+
+  small_string &operator=(const small_string &other)
+  {
+    if(this != &other) {
+      clear();
+      assign(other.view());
+    }
+    return *this;
+  }
+
+  small_string &operator=(small_string &&other) noexcept
+  {
+    if(this != &other) {
+      af_buf_free(&buf_);
+      init();
+      take(other);
+    }
+    return *this;
+  }
+
+  const char *c_str() const noexcept { return buf_.str; }
+  const char *data() const noexcept { return buf_.str; }
+  std::size_t size() const noexcept { return buf_.len; }
+  std::size_t length() const noexcept { return buf_.len; }
+  std::size_t capacity() const noexcept { return buf_.cap - 1; }
+  bool empty() const noexcept { return !buf_.len; }
+  bool is_inline() const noexcept { return buf_.str == inline_; }
+
+  std::string_view view() const noexcept
+  {
+    return std::string_view(buf_.str, buf_.len);
+  }
+
+  operator std::string_view() const noexcept { return view(); }
+
+  /* make the string empty. the capacity is kept. */
+  void clear() noexcept
+  {
+    buf_.len = 0;
+    buf_.str[0] = '\0';
+  }
+
+  /* the af_buf of the string, for the C functions. it must not be freed or
+     given another allocator. */
+  af_buf *buf() noexcept { return &buf_; }
+
+private:
+  void init() noexcept
+  {
+    alloc_.resize = resize;
+    alloc_.release = release;
+    alloc_.ctx = this;
+    inline_[0] = '\0';
+    buf_.str = inline_;
+    buf_.len = 0;
+    buf_.cap = N;
+    buf_.alloc = &alloc_;
+  }
+
+  /* replace the content of an empty string with s */
+  void assign(std::string_view s)
+  {
+    if(s.size() >= buf_.cap) {
+      char *p = static_cast<char *>(resize(this, buf_.str, buf_.cap,
+                                           s.size() + 1));
+      if(!p)
+        throw std::bad_alloc();
+      buf_.str = p;
+      buf_.cap = s.size() + 1;
+    }
+    if(!s.empty())
+      std::memcpy(buf_.str, s.data(), s.size());
+    buf_.str[s.size()] = '\0';
+    buf_.len = s.size();
+  }
+
+  /* take the string of other, which is left empty. this string is empty and
+     inline. */
+  void take(small_string &other) noexcept
+  {
+    buf_.len = other.buf_.len;
+    if(other.is_inline())
+      std::memcpy(inline_, other.inline_, other.buf_.len + 1);
+    else {
+      buf_.str = other.buf_.str;
+      buf_.cap = other.buf_.cap;
+      other.init();
+    }
+    other.clear();
+  }
+
+  static void *resize(void *ctx, void *ptr, std::size_t oldsize,
+                      std::size_t newsize)
+  {
+    small_string *self = static_cast<small_string *>(ctx);
+
+    if(ptr && ptr != self->inline_) {
+      if(newsize > N)
+        return std::realloc(ptr, newsize);
+      /* it fits back in the inline buffer */
+      std::memcpy(self->inline_, ptr, newsize);
+      std::free(ptr);
+      return self->inline_;
+    }
+
+    if(newsize <= N)
+      return self->inline_;
+
+    void *p = std::malloc(newsize);
+    if(p && ptr)
+      std::memcpy(p, ptr, (oldsize < newsize) ? oldsize : newsize);
+    return p;
+  }
+
+  static void release(void *ctx, void *ptr, std::size_t)
+  {
+    if(ptr != static_cast<small_string *>(ctx)->inline_)
+      std::free(ptr);
+  }
+
+  af_allocator alloc_;
+  af_buf buf_;
+  char inline_[N];
+};
+
+/* append a separator (sep) and formatted data to *str. the outcome is the
+   same as append_flags_sep_format(str, flags, sep, Format, args...). */
+template<fixed_string Format, typename... Args>
+int append_flags_sep(char **str, int flags, const char *sep,
+                     const Args &...args)
+{
+  detail::writer<Format, Args...> w(args...);
+  std::size_t maxlen = w.bound();
+  if(maxlen == static_cast<std::size_t>(-1))
+    return ((flags & ~AF_ALL_FLAGS)) ? -2 : -1;
+  return append_flags_sep_writer(str, flags, sep, maxlen,
+                                 &detail::writer<Format, Args...>::write, &w);
+}
+
+/* append a separator (sep) and formatted data to buf. the outcome is the
+   same as af_buf_append_flags_sep_format(buf, flags, sep, Format, args...). */
+template<fixed_string Format, typename... Args>
+int append_flags_sep(af_buf *buf, int flags, const char *sep,
+                     const Args &...args)
+{
+  detail::writer<Format, Args...> w(args...);
+  std::size_t maxlen = w.bound();
+  if(maxlen == static_cast<std::size_t>(-1))
+    return ((flags & ~AF_ALL_FLAGS)) ? -2 : -1;
+  return af_buf_append_flags_sep_writer(
+    buf, flags, sep, maxlen, &detail::writer<Format, Args...>::write, &w);
+}
+
+/* append a separator (sep) and formatted data to a std::basic_string, like a
+   std::string or std::pmr::string. the outcome is the same as
+   af_buf_append_flags_sep_format with the string as the af_buf. */
+template<fixed_string Format, typename Traits, typename Alloc,
+         typename... Args>
+int append_flags_sep(std::basic_string<char, Traits, Alloc> *str, int flags,
+                     const char *sep, const Args &...args)
+{
+  detail::writer<Format, Args...> w(args...);
+  std::size_t maxlen = w.bound();
+  if(maxlen == static_cast<std::size_t>(-1))
+    return ((flags & ~AF_ALL_FLAGS)) ? -2 : -1;
+  return detail::append_writer(str, flags, sep, maxlen,
+                               &detail::writer<Format, Args...>::write, &w);
+}
+
+/* append a separator (sep) and formatted data to a std::vector<char>. the
+   vector holds the string without a null terminator. */
+template<fixed_string Format, typename Alloc, typename... Args>
+int append_flags_sep(std::vector<char, Alloc> *str, int flags,
+                     const char *sep, const Args &...args)
+{
+  detail::writer<Format, Args...> w(args...);
+  std::size_t maxlen = w.bound();
+  if(maxlen == static_cast<std::size_t>(-1))
+    return ((flags & ~AF_ALL_FLAGS)) ? -2 : -1;
+  return detail::append_writer(str, flags, sep, maxlen,
+                               &detail::writer<Format, Args...>::write, &w);
+}
+
+/* append a separator (sep) and formatted data to an af::small_string */
+template<fixed_string Format, std::size_t N, typename... Args>
+int append_flags_sep(small_string<N> *str, int flags, const char *sep,
+                     const Args &...args)
+{
+  return append_flags_sep<Format>(str ? str->buf() : nullptr, flags, sep,
+                                  args...);
+}
+
+/* same as append_flags_sep but no flags */
+template<fixed_string Format, typename S, typename... Args>
+int append_sep(S str, const char *sep, const Args &...args)
+{
+  return append_flags_sep<Format>(str, 0, sep, args...);
+}
+
+/* same as append_sep but remove all trailing CR and LF from the string before
+   and after appending to it */
+template<fixed_string Format, typename S, typename... Args>
+int append_rmCRLFs_sep(S str, const char *sep, const Args &...args)
+{
+  return append_flags_sep<Format>(str, AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND,
+                                  sep, args...);
+}
+
+/* same as append_flags_sep but no flags or separator */
+template<fixed_string Format, typename S, typename... Args>
+int append(S str, const Args &...args)
+{
+  return append_flags_sep<Format>(str, 0, nullptr, args...);
+}
+
+/* same as append but remove all trailing CR and LF from the string before and
+   after appending to it */
+template<fixed_string Format, typename S, typename... Args>
+int append_rmCRLFs(S str, const Args &...args)
+{
+  return append_flags_sep<Format>(str, AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND,
+                                  nullptr, args...);
+}
+
+} /* namespace af */
+
+/* Overloads of append_flags_sep_format for the C++ string types, so that the
+   append_format macros can be used with them. The outcome is the same as
+   af_buf_append_flags_sep_format with the string as the af_buf, and a
+   std::vector<char> holds the string without a null terminator. */
+template<typename Traits, typename Alloc>
+int append_flags_sep_format(std::basic_string<char, Traits, Alloc> *str,
+                            int flags, const char *sep, const char *format,
+                            ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af::detail::vappend_format(str, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+template<typename Alloc>
+int append_flags_sep_format(std::vector<char, Alloc> *str, int flags,
+                            const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af::detail::vappend_format(str, flags, sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+template<std::size_t N>
+int append_flags_sep_format(af::small_string<N> *str, int flags,
+                            const char *sep, const char *format, ...)
+{
+  int retcode;
+  va_list args;
+
+  va_start(args, format);
+  retcode = af_buf_vappend_flags_sep_format(str ? str->buf() : nullptr, flags,
+                                            sep, format, args);
+  va_end(args);
+
+  return retcode;
+}
+
+#endif /* APPEND_FORMAT_HPP */
@@ -0,0 +1,329 @@
+/* Throughput benchmark for append_format.
+
+append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/*
+Measure appends/sec, bytes/sec and allocations per append while a string is
+accumulated to various lengths, for various fragment sizes and separator/flag
+combinations. The results are written to stdout as JSON so they can be
+compared between versions.
+
+make bench
+or:
+gcc -O2 -I.. -o bench_append_format bench_append_format.c ../append_format.c
+cl /O2 /I.. bench_append_format.c ../append_format.c
+
+Usage: bench_append_format [--quick] [--max-length BYTES] [--min-time SECONDS]
+                           [--version STRING]
+
+--quick             Accumulate at most 1 MB and measure each case briefly.
+--max-length BYTES  The largest accumulated length to measure. Default 100 MB.
+--min-time SECONDS  Repeat each case for at least this long. Default 0.2.
+--version STRING    The version recorded in the results, eg git describe.
+
+Appending to a char * with append_flags_sep_format rescans the string each
+time, so that API is only measured up to 64 KB. af_buf and af_rope are
+measured up to the max length, and af_buf with the af_mmap allocator from
+1 MB. Allocations and the bytes copied by them are only counted for af_buf.
+
+The bytes copied are an upper bound for realloc: it's counted as a copy
+whenever the block moves, although glibc moves blocks it mapped itself with
+mremap. For af_mmap only the move across its threshold is a copy.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "append_format.h"
+
+#ifndef AF_BENCH_VERSION
+#define AF_BENCH_VERSION "unknown"
+#endif
+
+/* the char * API is quadratic in the accumulated length */
+#define STR_API_MAX_LENGTH (64 * 1024)
+
+/* af_mmap is the same as af_buf below its threshold */
+#define MMAP_API_MIN_LENGTH (1024 * 1024)
+
+/* return a monotonic time in seconds */
+static double now(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+struct counting {
+  unsigned long allocs;
+  double copied;
+  const af_mmap *mm;    /* the allocator, or NULL for the C runtime */
+};
+
+/* An af_allocator that counts the allocations made through it and the bytes
+   they copied */
+static void *counting_resize(void *ctx, void *ptr, size_t oldsize,
+                             size_t newsize)
+{
+  struct counting *c = (struct counting *)ctx;
+  void *p;
+
+  ++c->allocs;
+  if(c->mm) {
+    p = c->mm->allocator.resize(c->mm->allocator.ctx, ptr, oldsize, newsize);
+    if(p && ptr && p != ptr && oldsize < c->mm->threshold)
+      c->copied += (double)oldsize;
+  }
+  else {
+    p = realloc(ptr, newsize);
+    if(p && ptr && p != ptr)
+      c->copied += (double)oldsize;
+  }
+  return p;
+}
+
+static void counting_release(void *ctx, void *ptr, size_t size)
+{
+  struct counting *c = (struct counting *)ctx;
+  if(c->mm)
+    c->mm->allocator.release(c->mm->allocator.ctx, ptr, size);
+  else
+    free(ptr);
+}
+
+struct bench_case {
+  const char *api;      /* "af_buf", "af_buf_mmap", "af_rope" or "str" */
+  size_t fragment;      /* the length of the data appended */
+  const char *sep;      /* the separator, or NULL */
+  int flags;
+  const char *flags_name;
+  size_t length;        /* the length the string is accumulated to */
+};
+
+struct bench_result {
+  unsigned long appends;
+  unsigned long allocs;   /* only counted for af_buf */
+  double copied;          /* the bytes copied by allocations, same */
+  double bytes;           /* the bytes appended, including separators */
+  double seconds;
+};
+
+/* accumulate a string to c->length once and add the outcome to r.
+   fragment is the data appended, c->fragment bytes long and ending in CR LF
+   for the flags that remove them. return 0 on success. */
+static int run_once(const struct bench_case *c, const char *fragment,
+                    struct bench_result *r)
+{
+  unsigned long appends = 0;
+  struct counting counted;
+  af_allocator counting;
+  af_mmap mm;
+  af_buf buf;
+  af_rope rope;
+  char *str = NULL;
+  int len = 0;
+  double start, end;
+
+  af_mmap_init(&mm, 0, 0);
+  counted.allocs = 0;
+  counted.copied = 0;
+  counted.mm = !strcmp(c->api, "af_buf_mmap") ? &mm : NULL;
+  counting.resize = counting_resize;
+  counting.release = counting_release;
+  counting.ctx = &counted;
+  af_buf_init_allocator(&buf, &counting);
+  af_rope_init(&rope, 0);
+
+  start = now();
+  if(!strncmp(c->api, "af_buf", 6)) {
+    while((size_t)len < c->length) {
+      len = af_buf_append_flags_sep_format(&buf, c->flags, c->sep, "%s",
+                                           fragment);
+      if(len < 0)
+        break;
+      ++appends;
+    }
+  }
+  else if(!strcmp(c->api, "af_rope")) {
+    while((size_t)len < c->length) {
+      len = af_rope_append_flags_sep_format(&rope, c->flags, c->sep, "%s",
+                                            fragment);
+      if(len < 0)
+        break;
+      ++appends;
+    }
+  }
+  else {
+    while((size_t)len < c->length) {
+      len = append_flags_sep_format(&str, c->flags, c->sep, "%s", fragment);
+      if(len < 0)
+        break;
+      ++appends;
+    }
+  }
+  end = now();
+
+  af_buf_free(&buf);
+  af_rope_free(&rope);
+  free(str);
+
+  if(len < 0)
+    return -1;
+
+  r->appends += appends;
+  r->allocs += counted.allocs;
+  r->copied += counted.copied;
+  r->bytes += (double)len;
+  r->seconds += end - start;
+  return 0;
+}
+
+/* write the result of c as a JSON object */
+static void print_result(const struct bench_case *c,
+                         const struct bench_result *r, int first)
+{
+  printf("%s\n    {\"api\": \"%s\", \"fragment\": %lu, ", first ? "" : ",",
+         c->api, (unsigned long)c->fragment);
+  if(c->sep)
+    printf("\"sep\": \"%s\", ", c->sep);
+  else
+    printf("\"sep\": null, ");
+  printf("\"flags\": \"%s\", \"length\": %lu, ", c->flags_name,
+         (unsigned long)c->length);
+  printf("\"appends\": %lu, \"seconds\": %.6f, ", r->appends, r->seconds);
+  printf("\"appends_per_sec\": %.0f, \"bytes_per_sec\": %.0f, ",
+         r->appends / r->seconds, r->bytes / r->seconds);
+  if(!strncmp(c->api, "af_buf", 6))
+    printf("\"allocs_per_append\": %.6f, \"copied_per_byte\": %.6f}",
+           (double)r->allocs / (double)r->appends, r->copied / r->bytes);
+  else
+    printf("\"allocs_per_append\": null, \"copied_per_byte\": null}");
+}
+
+int main(int argc, char *argv[])
+{
+  static const size_t fragments[] = { 8, 64, 512, 4096 };
+  static const size_t lengths[] = { 1024, 64 * 1024, 1024 * 1024,
+                                    16 * 1024 * 1024, 100 * 1024 * 1024 };
+  static const struct {
+    const char *sep;
+    int flags;
+    const char *name;
+  } modes[] = {
+    { NULL, 0, "0" },
+    { "; ", 0, "0" },
+    { "; ", AF_APPEND_SEP_ALWAYS, "AF_APPEND_SEP_ALWAYS" },
+    { "; ", AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND,
+      "AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND" }
+  };
+  static const char *apis[] = { "af_buf", "af_buf_mmap", "af_rope", "str" };
+  size_t max_length = 100 * 1024 * 1024;
+  double min_time = 0.2;
+  const char *version = AF_BENCH_VERSION;
+  int first = 1;
+  size_t a, f, m, l;
+  int i;
+
+  for(i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--quick")) {
+      max_length = 1024 * 1024;
+      min_time = 0.02;
+    }
+    else if(!strcmp(argv[i], "--max-length") && i + 1 < argc)
+      max_length = (size_t)strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--min-time") && i + 1 < argc)
+      min_time = strtod(argv[++i], NULL);
+    else if(!strcmp(argv[i], "--version") && i + 1 < argc)
+      version = argv[++i];
+    else {
+      fprintf(stderr, "Usage: %s [--quick] [--max-length BYTES] "
+              "[--min-time SECONDS] [--version STRING]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("{\n  \"benchmark\": \"append_format\",\n");
+  printf("  \"version\": \"%s\",\n", version);
+  printf("  \"min_time\": %g,\n", min_time);
+  printf("  \"results\": [");
+
+  for(a = 0; a < sizeof(apis) / sizeof(apis[0]); ++a) {
+    for(f = 0; f < sizeof(fragments) / sizeof(fragments[0]); ++f) {
+      for(m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        for(l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+          struct bench_case c;
+          struct bench_result r;
+          char *fragment;
+          size_t j;
+
+          if(lengths[l] > max_length ||
+             (!strcmp(apis[a], "str") && lengths[l] > STR_API_MAX_LENGTH) ||
+             (!strcmp(apis[a], "af_buf_mmap") &&
+              lengths[l] < MMAP_API_MIN_LENGTH))
+            continue;
+
+          c.api = apis[a];
+          c.fragment = fragments[f];
+          c.sep = modes[m].sep;
+          c.flags = modes[m].flags;
+          c.flags_name = modes[m].name;
+          c.length = lengths[l];
+
+          fragment = (char *)malloc(c.fragment + 1);
+          if(!fragment) {
+            fprintf(stderr, "out of memory\n");
+            return EXIT_FAILURE;
+          }
+          for(j = 0; j < c.fragment; ++j)
+            fragment[j] = (char)('a' + j % 26);
+          fragment[c.fragment] = '\0';
+          if((c.flags & AF_REMOVE_CR_LF_AFTER_APPEND))
+            memcpy(&fragment[c.fragment - 2], "\r\n", 2);
+
+          memset(&r, 0, sizeof(r));
+          do {
+            if(run_once(&c, fragment, &r)) {
+              fprintf(stderr, "append failed: %s fragment %lu length %lu\n",
+                      c.api, (unsigned long)c.fragment,
+                      (unsigned long)c.length);
+              return EXIT_FAILURE;
+            }
+          } while(r.seconds < min_time);
+
+          print_result(&c, &r, first);
+          first = 0;
+          fflush(stdout);
+          free(fragment);
+        }
+      }
+    }
+  }
+
+  printf("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
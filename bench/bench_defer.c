@@ -0,0 +1,310 @@
+/* Caller latency benchmark for af_defer.
+
+append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/*
+Measure how long the calling thread spends in an append, when it formats the
+data itself with af_buf_append_sep_format and when it only records it with
+af_defer_append_sep_format for a consumer thread to format. The results are
+written to stdout as JSON so they can be compared between versions.
+
+make bench-defer
+or:
+gcc -O2 -pthread -I.. -o bench_defer bench_defer.c ../append_format.c
+cl /O2 /I.. bench_defer.c ../append_format.c
+
+Usage: bench_defer [--quick] [--min-time SECONDS] [--version STRING]
+
+--quick             Measure each case briefly.
+--min-time SECONDS  Measure each case for at least this long. Default 0.5.
+--version STRING    The version recorded in the results, eg git describe.
+
+The appends are made in bursts of BURST_SIZE, and between bursts the caller
+waits for the consumer with af_defer_flush so the ring never fills. The time of
+every GROUP_SIZE appends is taken as a sample, and the mean and percentiles
+are of the samples divided by GROUP_SIZE. Only the caller's time is measured,
+not the consumer's.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "append_format.h"
+
+#ifndef AF_BENCH_VERSION
+#define AF_BENCH_VERSION "unknown"
+#endif
+
+#define BURST_SIZE 256
+#define GROUP_SIZE 16
+#define MAX_SAMPLES (1024 * 1024)
+
+/* the consumer empties the string it drains to when it gets this long */
+#define CONSUMER_MAX_LENGTH (1024 * 1024)
+
+/* return a monotonic time in seconds */
+static double now(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* the formats measured. each has its own arguments in append. */
+static const char *formats[] = { "int", "mixed", "double", "string" };
+
+static const char *long_arg =
+  "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+  "0123456789abcdefghijklmnopqrstuvwxyz";
+
+/* append with format f for the nth time, to buf if it's not NULL or else to
+   ring. return 0 on success. */
+static int append(size_t f, int n, af_buf *buf, af_defer_ring *ring)
+{
+#define APPEND(...) \
+  (buf ? (af_buf_append_sep_format(buf, "; ", __VA_ARGS__) < 0) : \
+   (af_defer_append_sep_format(ring, "; ", __VA_ARGS__) != 0))
+
+  switch(f) {
+  case 0:
+    return APPEND("%s=%d", "key", n);
+  case 1:
+    return APPEND("%s=%d %u %x %ld", "key", n, (unsigned)n * 7u,
+                  (unsigned)n, (long)n * 1000L);
+  case 2:
+    return APPEND("%s=%.3f", "key", n * 0.001);
+  default:
+    return APPEND("%s=%s", "key", long_arg);
+  }
+
+#undef APPEND
+}
+
+struct consumer {
+  af_defer *defer;
+  volatile int stop;
+  int failed;
+};
+
+/* drain the appends until stop is set */
+#ifdef _WIN32
+static DWORD WINAPI consume(LPVOID param)
+#else
+static void *consume(void *param)
+#endif
+{
+  struct consumer *c = (struct consumer *)param;
+  af_buf buf = AF_BUF_INIT;
+
+  for(;;) {
+    int stop = c->stop;
+    int count = af_defer_drain(c->defer, &buf);
+    if(count < 0)
+      c->failed = 1;
+    if(buf.len > CONSUMER_MAX_LENGTH) {
+      buf.len = 0;
+      buf.str[0] = '\0';
+    }
+    if(stop)
+      break;
+    if(!count) {
+#ifdef _WIN32
+      SwitchToThread();
+#else
+      sched_yield();
+#endif
+    }
+  }
+
+  af_buf_free(&buf);
+#ifdef _WIN32
+  return 0;
+#else
+  return NULL;
+#endif
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* measure format f with the api and write the result as a JSON object.
+   return 0 on success. */
+static int run(const char *api, size_t f, af_defer *defer, double min_time,
+               double *samples, int first)
+{
+  af_buf buf = AF_BUF_INIT;
+  af_defer_ring *ring = NULL;
+  int deferred = !strcmp(api, "defer");
+  size_t nsamples = 0;
+  double total = 0, mean;
+  int n = 0;
+
+  if(deferred) {
+    ring = af_defer_attach(defer);
+    if(!ring)
+      return -1;
+  }
+
+  while(total < min_time && nsamples + BURST_SIZE / GROUP_SIZE <= MAX_SAMPLES) {
+    int b, g;
+
+    for(b = 0; b < BURST_SIZE / GROUP_SIZE; ++b) {
+      double start = now(), elapsed;
+      for(g = 0; g < GROUP_SIZE; ++g, ++n) {
+        if(append(f, n, deferred ? NULL : &buf, ring))
+          return -1;
+      }
+      elapsed = now() - start;
+      samples[nsamples++] = elapsed;
+      total += elapsed;
+    }
+
+    if(deferred) {
+      if(af_defer_flush(defer))
+        return -1;
+    }
+    else {
+      buf.len = 0;
+      buf.str[0] = '\0';
+    }
+  }
+
+  if(ring)
+    af_defer_detach(ring);
+  af_buf_free(&buf);
+
+  qsort(samples, nsamples, sizeof(samples[0]), compare_double);
+  mean = total / (double)nsamples;
+
+  printf("%s\n    {\"api\": \"%s\", \"format\": \"%s\", ", first ? "" : ",",
+         api, formats[f]);
+  printf("\"appends\": %lu, \"seconds\": %.6f, ",
+         (unsigned long)nsamples * GROUP_SIZE, total);
+  printf("\"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, "
+         "\"p999_ns\": %.1f}",
+         mean * 1e9 / GROUP_SIZE,
+         samples[nsamples / 2] * 1e9 / GROUP_SIZE,
+         samples[nsamples * 99 / 100] * 1e9 / GROUP_SIZE,
+         samples[nsamples * 999 / 1000] * 1e9 / GROUP_SIZE);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *apis[] = { "sync", "defer" };
+  double min_time = 0.5;
+  const char *version = AF_BENCH_VERSION;
+  struct consumer consumer;
+  af_defer defer;
+  double *samples;
+  int first = 1, failed = 0;
+  size_t a, f;
+  int i;
+#ifdef _WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+
+  for(i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--quick"))
+      min_time = 0.05;
+    else if(!strcmp(argv[i], "--min-time") && i + 1 < argc)
+      min_time = strtod(argv[++i], NULL);
+    else if(!strcmp(argv[i], "--version") && i + 1 < argc)
+      version = argv[++i];
+    else {
+      fprintf(stderr, "Usage: %s [--quick] [--min-time SECONDS] "
+              "[--version STRING]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  samples = (double *)malloc(MAX_SAMPLES * sizeof(*samples));
+  if(!samples) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  af_defer_init(&defer, 1024 * 1024);
+  consumer.defer = &defer;
+  consumer.stop = 0;
+  consumer.failed = 0;
+
+#ifdef _WIN32
+  thread = CreateThread(NULL, 0, consume, &consumer, 0, NULL);
+  if(!thread) {
+#else
+  if(pthread_create(&thread, NULL, consume, &consumer)) {
+#endif
+    fprintf(stderr, "failed to start the consumer thread\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("{\n  \"benchmark\": \"defer\",\n");
+  printf("  \"version\": \"%s\",\n", version);
+  printf("  \"min_time\": %g,\n", min_time);
+  printf("  \"burst_size\": %d,\n", BURST_SIZE);
+  printf("  \"group_size\": %d,\n", GROUP_SIZE);
+  printf("  \"results\": [");
+
+  for(f = 0; f < sizeof(formats) / sizeof(formats[0]) && !failed; ++f) {
+    for(a = 0; a < sizeof(apis) / sizeof(apis[0]); ++a) {
+      if(run(apis[a], f, &defer, min_time, samples, first)) {
+        fprintf(stderr, "append failed: %s %s\n", apis[a], formats[f]);
+        failed = 1;
+        break;
+      }
+      first = 0;
+      fflush(stdout);
+    }
+  }
+
+  consumer.stop = 1;
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+
+  af_defer_free(&defer);
+  free(samples);
+
+  if(failed || consumer.failed)
+    return EXIT_FAILURE;
+
+  printf("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+/* Floating point formatting benchmark for append_format.
+
+append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/*
+Measure the appends/sec of doubles formatted by the C library, which is what
+af_buf_append_flags_sep_format does without flags, and with AF_SHORTEST_FLOAT.
+The results are written to stdout as JSON so they can be compared between
+versions.
+
+make bench-float
+or:
+gcc -O2 -I.. -o bench_float bench_float.c ../append_format.c
+cl /O2 /I.. bench_float.c ../append_format.c
+
+Usage: bench_float [--quick] [--min-time SECONDS] [--version STRING]
+
+--quick             Measure each case briefly.
+--min-time SECONDS  Repeat each case for at least this long. Default 0.5.
+--version STRING    The version recorded in the results, eg git describe.
+
+The doubles are random: "random" has random bit patterns, so mostly 16 or 17
+significant digits and large exponents, and "short" has values like 12.34 that
+have few digits. Note %g of the C library is only 6 significant digits, so it
+doesn't round trip, while with AF_SHORTEST_FLOAT it's as many as needed. Most
+of the "random" values are too large for the built-in %f, so those are
+formatted by the C library either way.
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "append_format.h"
+
+#ifndef AF_BENCH_VERSION
+#define AF_BENCH_VERSION "unknown"
+#endif
+
+#define VALUE_COUNT 4096
+
+/* the string appended to is emptied when it gets this long */
+#define MAX_LENGTH (1024 * 1024)
+
+/* return a monotonic time in seconds */
+static double now(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/* return the next number of a xorshift generator, so the values are the same
+   each run */
+static uint64_t next_random(uint64_t *x)
+{
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+/* fill values with VALUE_COUNT doubles of the kind */
+static void make_values(double *values, const char *kind)
+{
+  uint64_t x = UINT64_C(0x9E3779B97F4A7C15);
+  int i;
+
+  for(i = 0; i < VALUE_COUNT; ++i) {
+    if(!strcmp(kind, "random")) {
+      uint64_t bits;
+      do {
+        bits = next_random(&x);
+        /* not infinity or NaN */
+      } while(((bits >> 52) & 0x7FF) == 0x7FF);
+      memcpy(&values[i], &bits, sizeof(values[i]));
+    }
+    else
+      values[i] = (double)(int)(next_random(&x) % 1000000) / 100;
+  }
+}
+
+/* measure the format of the values with the flags and write the result as a
+   JSON object. return 0 on success. */
+static int run(const char *api, int flags, const char *kind,
+               const char *format, const double *values, double min_time,
+               int first)
+{
+  af_buf buf = AF_BUF_INIT;
+  double start = now(), elapsed;
+  unsigned long appends = 0;
+  double bytes = 0;
+
+  do {
+    int i;
+    for(i = 0; i < VALUE_COUNT; ++i) {
+      size_t len = buf.len;
+      if(af_buf_append_flags_sep_format(&buf, flags, " ", format,
+                                        values[i]) < 0) {
+        af_buf_free(&buf);
+        return -1;
+      }
+      bytes += (double)(buf.len - len);
+      if(buf.len > MAX_LENGTH) {
+        buf.len = 0;
+        buf.str[0] = '\0';
+      }
+    }
+    appends += VALUE_COUNT;
+    elapsed = now() - start;
+  } while(elapsed < min_time);
+
+  af_buf_free(&buf);
+
+  printf("%s\n    {\"api\": \"%s\", \"values\": \"%s\", \"format\": \"%s\", ",
+         first ? "" : ",", api, kind, format);
+  printf("\"appends\": %lu, \"seconds\": %.6f, ", appends, elapsed);
+  printf("\"appends_per_sec\": %.0f, \"ns_per_append\": %.1f, "
+         "\"bytes_per_append\": %.2f}",
+         (double)appends / elapsed, elapsed * 1e9 / (double)appends,
+         bytes / (double)appends);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  static const char *kinds[] = { "random", "short" };
+  static const char *formats[] = { "%g", "%f", "%.3f" };
+  static const struct {
+    const char *name;
+    int flags;
+  } apis[] = {
+    { "libc", 0 },
+    { "shortest", AF_SHORTEST_FLOAT }
+  };
+  double min_time = 0.5;
+  const char *version = AF_BENCH_VERSION;
+  double *values;
+  int first = 1;
+  size_t k, f, a;
+  int i;
+
+  for(i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--quick"))
+      min_time = 0.05;
+    else if(!strcmp(argv[i], "--min-time") && i + 1 < argc)
+      min_time = strtod(argv[++i], NULL);
+    else if(!strcmp(argv[i], "--version") && i + 1 < argc)
+      version = argv[++i];
+    else {
+      fprintf(stderr, "Usage: %s [--quick] [--min-time SECONDS] "
+              "[--version STRING]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  values = (double *)malloc(VALUE_COUNT * sizeof(*values));
+  if(!values) {
+    fprintf(stderr, "out of memory\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("{\n  \"benchmark\": \"float\",\n");
+  printf("  \"version\": \"%s\",\n", version);
+  printf("  \"min_time\": %g,\n", min_time);
+  printf("  \"value_count\": %d,\n", VALUE_COUNT);
+  printf("  \"results\": [");
+
+  for(k = 0; k < sizeof(kinds) / sizeof(kinds[0]); ++k) {
+    make_values(values, kinds[k]);
+    for(f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+      for(a = 0; a < sizeof(apis) / sizeof(apis[0]); ++a) {
+        if(run(apis[a].name, apis[a].flags, kinds[k], formats[f], values,
+               min_time, first)) {
+          fprintf(stderr, "append failed: %s %s %s\n", apis[a].name,
+                  kinds[k], formats[f]);
+          free(values);
+          return EXIT_FAILURE;
+        }
+        first = 0;
+        fflush(stdout);
+      }
+    }
+  }
+
+  free(values);
+  printf("\n  ]\n}\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+/* Microbenchmark for af_count_trailing_crlf.
+
+append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/*
+Compare af_count_trailing_crlf to the byte at a time loop it replaced, for
+strings that end in runs of CR and LF of various lengths:
+gcc -O2 -I.. -o bench_trailing_crlf bench_trailing_crlf.c ../append_format.c
+cl /O2 /I.. bench_trailing_crlf.c ../append_format.c
+*/
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "append_format.h"
+
+/* the loop af_count_trailing_crlf used before it was vectorized */
+static size_t scalar_count_trailing_crlf(const char *s, size_t len)
+{
+  const char *p = s + len;
+
+  while(p != s && (p[-1] == '\r' || p[-1] == '\n'))
+    --p;
+
+  return (size_t)(s + len - p);
+}
+
+/* return the number of nanoseconds per call of fn on s */
+static double measure(size_t (*fn)(const char *, size_t), const char *s,
+                      size_t len, size_t runlen)
+{
+  /* about the same number of bytes are scanned for every run length */
+  long iterations = (long)(200000000 / (runlen + 16));
+  volatile size_t sink = 0;
+  clock_t start, end;
+  long i;
+
+  start = clock();
+  for(i = 0; i < iterations; ++i)
+    sink += fn(s, len);
+  end = clock();
+
+  if(sink != (size_t)iterations * runlen) {
+    fprintf(stderr, "wrong count for run length %lu\n", (unsigned long)runlen);
+    exit(EXIT_FAILURE);
+  }
+
+  return (double)(end - start) * 1e9 / CLOCKS_PER_SEC / (double)iterations;
+}
+
+int main(void)
+{
+  static const size_t runlens[] = { 0, 1, 2, 16, 64, 256, 4096, 65536,
+                                    1048576 };
+  size_t i;
+
+  printf("%10s %14s %14s %8s\n", "run length", "scalar ns", "af ns",
+         "speedup");
+
+  for(i = 0; i < sizeof(runlens) / sizeof(runlens[0]); ++i) {
+    size_t runlen = runlens[i];
+    size_t len = runlen + 1;
+    double scalar, simd;
+    char *s = (char *)malloc(len + 1);
+    if(!s) {
+      fprintf(stderr, "out of memory\n");
+      return EXIT_FAILURE;
+    }
+
+    /* "x" followed by blank lines */
+    s[0] = 'x';
+    for(len = 1; len <= runlen; ++len)
+      s[len] = (len & 1) ? '\r' : '\n';
+    s[len] = '\0';
+
+    scalar = measure(scalar_count_trailing_crlf, s, len, runlen);
+    simd = measure(af_count_trailing_crlf, s, len, runlen);
+    printf("%10lu %14.2f %14.2f %7.1fx\n", (unsigned long)runlen, scalar,
+           simd, simd > 0 ? scalar / simd : 0.0);
+
+    free(s);
+  }
+
+  return EXIT_SUCCESS;
+}
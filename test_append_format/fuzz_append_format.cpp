@@ -0,0 +1,399 @@
+/* Fuzz harness for append_format.
+
+append_format - Append a separator and formatted data to a string.
+
+https://github.com/jay/append_format
+
+LICENSE: FreeBSD license
+Copyright (C) 2016 Jay Satiro <raysatiro@yahoo.com>
+See LICENSE.txt for full license text.
+*/
+
+/*
+Each input is decoded into a string, a separator, flags, one of several formats
+with its arguments, and runs of CR and LF appended to the string, the
+separator and the format. The append is made with each of the APIs (char *,
+af_buf with various spare capacities, _ex, af_rope, af_sink, af_iov, af_defer
+and the format compiled by af_compile) and the outcome is compared to a simple
+reference implementation that uses snprintf. A mismatch prints the input and
+aborts.
+
+make fuzz
+or:
+g++ -std=c++20 -O1 -g -fsanitize=address,undefined -I.. -o fuzz_append_format fuzz_append_format.cpp ../append_format.c
+
+Usage: fuzz_append_format [--runs N] [--seed N] [FILE...]
+
+Without files random inputs are generated and mutated for N runs (default
+100000). With files each file is one input, which is how afl-fuzz runs it
+(afl-fuzz -i in -o out -- ./fuzz_append_format @@).
+
+For libFuzzer define AF_FUZZ_LIBFUZZER and build with clang:
+clang++ -std=c++20 -g -fsanitize=fuzzer,address,undefined -DAF_FUZZ_LIBFUZZER -I.. -o fuzz_append_format fuzz_append_format.cpp ../append_format.c
+*/
+
+#define _CRT_NONSTDC_NO_DEPRECATE
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "append_format.h"
+
+using namespace std;
+
+/* reads the fields of an input. past the end it reads zeros. */
+struct reader {
+  const uint8_t *data;
+  size_t size;
+  size_t pos;
+
+  unsigned byte()
+  {
+    return (pos < size) ? data[pos++] : 0;
+  }
+
+  unsigned word()
+  {
+    unsigned hi = byte();
+    return (hi << 8) | byte();
+  }
+
+  /* a string of at most maxlen bytes, without null bytes */
+  string text(size_t maxlen)
+  {
+    size_t len = word() % (maxlen + 1);
+    string s;
+    for(size_t i = 0; i < len && pos < size; ++i) {
+      char c = (char)data[pos++];
+      s += c ? c : ' ';
+    }
+    return s;
+  }
+
+  /* a run of 0 to 3 CR and LF */
+  string crlf()
+  {
+    unsigned b = byte();
+    string s;
+    for(unsigned i = 0; i < (b & 3); ++i)
+      s += (b & (4 << i)) ? '\r' : '\n';
+    return s;
+  }
+};
+
+/* the decoded input */
+struct input {
+  bool str_null;
+  string str;
+  bool sep_null;
+  string sep;
+  int flags;
+  string format;
+  unsigned spare;   /* the spare capacity of the af_buf */
+};
+
+static void trim_crlf(string &s)
+{
+  while(!s.empty() && (s.back() == '\r' || s.back() == '\n'))
+    s.pop_back();
+}
+
+/* the reference implementation of the separator rules and flags */
+static string reference(const input &in, const string &formatted)
+{
+  string out = in.str_null ? "" : in.str;
+  bool use_sep = !in.sep_null && !in.sep.empty() &&
+                 (!out.empty() || (in.flags & AF_APPEND_SEP_IF_STR_EMPTY)) &&
+                 (!formatted.empty() ||
+                  (in.flags & AF_APPEND_SEP_IF_FORMAT_EMPTY));
+
+  if((in.flags & AF_REMOVE_CR_LF_BEFORE_APPEND))
+    trim_crlf(out);
+  if(use_sep)
+    out += in.sep;
+  out += formatted;
+  if((in.flags & AF_REMOVE_CR_LF_AFTER_APPEND))
+    trim_crlf(out);
+  return out;
+}
+
+static void fail(const input &in, const char *api, const string &expected,
+                 const string &actual)
+{
+  fprintf(stderr, "MISMATCH in %s\n", api);
+  fprintf(stderr, "str: %s\"%s\"\n", in.str_null ? "NULL " : "",
+          in.str.c_str());
+  fprintf(stderr, "sep: %s\"%s\"\n", in.sep_null ? "NULL " : "",
+          in.sep.c_str());
+  fprintf(stderr, "flags: %d, format: \"%s\"\n", in.flags, in.format.c_str());
+  fprintf(stderr, "expected: \"%s\"\nactual:   \"%s\"\n", expected.c_str(),
+          actual.c_str());
+  abort();
+}
+
+static int collect(void *ctx, const char *data, size_t len)
+{
+  ((string *)ctx)->append(data, len);
+  return 0;
+}
+
+/* The af_defer is kept between inputs so that the cache of parsed formats of
+   its ring sees different formats at the same address */
+static af_defer defer;
+static af_defer_ring *defer_ring;
+
+template<typename... Args>
+static void check(const input &in, Args... args)
+{
+  const char *format = in.format.c_str();
+  const char *sep = in.sep_null ? NULL : in.sep.c_str();
+
+  int count = snprintf(NULL, 0, format, args...);
+  if(count < 0)
+    return;
+  vector<char> formatted((size_t)count + 1);
+  snprintf(formatted.data(), formatted.size(), format, args...);
+  string expected = reference(in, string(formatted.data(), (size_t)count));
+
+  /* char * */
+  char *str = in.str_null ? NULL : strdup(in.str.c_str());
+  int ret = append_flags_sep_format(&str, in.flags, sep, format, args...);
+  if(ret != (int)expected.size() || strcmp(str, expected.c_str()))
+    fail(in, "append_flags_sep_format", expected, str ? str : "(null)");
+  free(str);
+
+  /* _ex */
+  str = in.str_null ? NULL : strdup(in.str.c_str());
+  ptrdiff_t ret_ex = append_flags_sep_format_ex(&str, in.flags, sep, format,
+                                                args...);
+  if(ret_ex != (ptrdiff_t)expected.size() || strcmp(str, expected.c_str()))
+    fail(in, "append_flags_sep_format_ex", expected, str ? str : "(null)");
+  free(str);
+
+  /* af_buf with spare capacity */
+  af_buf buf = AF_BUF_INIT;
+  if(!in.str_null || in.spare) {
+    buf.len = in.str.size();
+    buf.cap = buf.len + 1 + in.spare;
+    buf.str = (char *)malloc(buf.cap);
+    memset(buf.str, 0xAA, buf.cap);
+    memcpy(buf.str, in.str.c_str(), buf.len + 1);
+  }
+  ret = af_buf_append_flags_sep_format(&buf, in.flags, sep, format, args...);
+  if(ret != (int)expected.size() || buf.len != expected.size() ||
+     strcmp(buf.str, expected.c_str()))
+    fail(in, "af_buf_append_flags_sep_format", expected,
+         buf.str ? buf.str : "(null)");
+  af_buf_free(&buf);
+
+  /* af_rope with short segments so the CR and LF cross segment boundaries */
+  af_rope rope;
+  af_rope_init(&rope, 7);
+  af_rope_append_format(&rope, "%s", in.str.c_str());
+  ret = af_rope_append_flags_sep_format(&rope, in.flags, sep, format,
+                                        args...);
+  af_buf_init(&buf);
+  af_rope_flatten(&rope, &buf);
+  if(ret != (int)expected.size() || strcmp(buf.str, expected.c_str()))
+    fail(in, "af_rope_append_flags_sep_format", expected, buf.str);
+  af_buf_free(&buf);
+  af_rope_free(&rope);
+
+  /* af_sink */
+  string written;
+  af_sink sink;
+  af_sink_init_callback(&sink, collect, &written);
+  af_sink_append_format(&sink, "%s", in.str.c_str());
+  if(af_sink_append_flags_sep_format(&sink, in.flags, sep, format, args...) ||
+     af_sink_finish(&sink) || written != expected)
+    fail(in, "af_sink_append_flags_sep_format", expected, written);
+
+  /* af_iov with a short minimum reference length */
+  af_iov iov;
+  af_iov_init(&iov, 4);
+  af_iov_append_format(&iov, "%s", in.str.c_str());
+  ret = af_iov_append_flags_sep_format(&iov, in.flags, sep, format, args...);
+  af_buf_init(&buf);
+  af_iov_flatten(&iov, &buf);
+  if(ret != (int)expected.size() || strcmp(buf.str, expected.c_str()))
+    fail(in, "af_iov_append_flags_sep_format", expected, buf.str);
+  af_buf_free(&buf);
+  af_iov_free(&iov);
+
+  /* af_defer */
+  if(!defer_ring) {
+    af_defer_init(&defer, 4096);
+    defer_ring = af_defer_attach(&defer);
+  }
+  af_buf_init(&buf);
+  af_buf_append_format(&buf, "%s", in.str.c_str());
+  if(af_defer_append_flags_sep_format(defer_ring, in.flags, sep, format,
+                                      args...) ||
+     af_defer_drain(&defer, &buf) != 1 || strcmp(buf.str, expected.c_str()))
+    fail(in, "af_defer_append_flags_sep_format", expected,
+         buf.str ? buf.str : "(null)");
+  af_buf_free(&buf);
+
+  /* compiled, to char * and to an af_buf with spare capacity */
+  af_program *prog = af_compile(format);
+  str = in.str_null ? NULL : strdup(in.str.c_str());
+  ret = af_append_compiled(&str, in.flags, sep, prog, args...);
+  if(ret != (int)expected.size() || strcmp(str, expected.c_str()))
+    fail(in, "af_append_compiled", expected, str ? str : "(null)");
+  free(str);
+
+  af_buf_init(&buf);
+  if(!in.str_null || in.spare) {
+    buf.len = in.str.size();
+    buf.cap = buf.len + 1 + in.spare;
+    buf.str = (char *)malloc(buf.cap);
+    memset(buf.str, 0xAA, buf.cap);
+    memcpy(buf.str, in.str.c_str(), buf.len + 1);
+  }
+  ret = af_buf_append_compiled(&buf, in.flags, sep, prog, args...);
+  if(ret != (int)expected.size() || buf.len != expected.size() ||
+     strcmp(buf.str, expected.c_str()))
+    fail(in, "af_buf_append_compiled", expected,
+         buf.str ? buf.str : "(null)");
+  af_buf_free(&buf);
+  af_program_free(prog);
+}
+
+static void run_one(const uint8_t *data, size_t size)
+{
+  static const char *formats[] = {
+    "%s", "%d", "%s=%d", "%.*s", "%-8x|%5.3s", "%c%lu", "%%%s%%", "",
+    "%g", "%08.3f", "%lld|%+5hd", "%#o %#X"
+  };
+  reader r = { data, size, 0 };
+  input in;
+
+  unsigned choice = r.byte();
+  in.flags = (int)(r.byte() & AF_ALL_FLAGS);
+  in.str_null = (choice & 1);
+  in.sep_null = (choice & 2);
+  in.spare = (choice & 4) ? ((choice & 8) ? 300 : 16) : 0;
+  in.str = in.str_null ? "" : r.text(64) + r.crlf();
+  in.sep = in.sep_null ? "" : r.text(8) + r.crlf();
+
+  unsigned f = r.byte() % (sizeof(formats) / sizeof(formats[0]));
+  in.format = string(formats[f]) + r.crlf();
+
+  string arg = r.text(600) + r.crlf();
+  int n = (int)(r.word() | (r.word() << 16));
+  double d = (double)n / 7.0;
+  const char *s = arg.c_str();
+
+  switch(f) {
+  case 0: check(in, s); break;
+  case 1: check(in, n); break;
+  case 2: check(in, s, n); break;
+  case 3: check(in, (int)((unsigned)n % 40), s); break;
+  case 4: check(in, (unsigned)n, s); break;
+  case 5: check(in, 'a' + (int)((unsigned)n % 26), (unsigned long)n); break;
+  case 6: check(in, s); break;
+  case 7: check(in, 0); break;
+  case 8: check(in, d); break;
+  case 9: check(in, d); break;
+  case 10: check(in, (long long)n * 1000003, (int)(short)n); break;
+  case 11: check(in, (unsigned)n, (unsigned)n); break;
+  }
+}
+
+#ifdef AF_FUZZ_LIBFUZZER
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  run_one(data, size);
+  return 0;
+}
+#else
+/* xorshift64 */
+static uint64_t next_random(uint64_t *state)
+{
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long runs = 100000;
+  uint64_t seed = 0x2545F4914F6CDD1DULL;
+  vector<const char *> files;
+
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--runs") && i + 1 < argc)
+      runs = strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--seed") && i + 1 < argc)
+      seed = strtoull(argv[++i], NULL, 10) | 1;
+    else
+      files.push_back(argv[i]);
+  }
+
+  if(!files.empty()) {
+    for(const char *file : files) {
+      ifstream in(file, ios::binary);
+      if(!in) {
+        fprintf(stderr, "can't open %s\n", file);
+        return EXIT_FAILURE;
+      }
+      vector<uint8_t> data((istreambuf_iterator<char>(in)),
+                           istreambuf_iterator<char>());
+      run_one(data.data(), data.size());
+    }
+    fprintf(stderr, "%lu inputs OK\n", (unsigned long)files.size());
+    return EXIT_SUCCESS;
+  }
+
+  /* Each input is either new or the previous one mutated, which keeps some of
+     its structure. Lengths are biased short so the fields line up often. */
+  vector<uint8_t> data;
+  for(unsigned long run = 0; run < runs; ++run) {
+    uint64_t r = next_random(&seed);
+    if(data.empty() || (r & 3) == 0) {
+      data.resize((size_t)(next_random(&seed) % 96));
+      for(uint8_t &b : data) {
+        uint64_t x = next_random(&seed);
+        /* mostly small values, often CR and LF */
+        b = (x & 1) ? (uint8_t)(x >> 8) : (x & 2) ? "\r\n;%ab"[(x >> 8) % 6] :
+            (uint8_t)((x >> 8) % 4);
+      }
+    }
+    else {
+      unsigned mutations = 1 + (unsigned)((r >> 2) % 4);
+      for(unsigned m = 0; m < mutations; ++m) {
+        uint64_t x = next_random(&seed);
+        size_t pos = (size_t)(x % (data.size() + 1));
+        switch((x >> 32) % 3) {
+        case 0:
+          if(pos < data.size())
+            data[pos] ^= (uint8_t)(1 << ((x >> 40) % 8));
+          break;
+        case 1:
+          data.insert(data.begin() + (ptrdiff_t)pos, (uint8_t)(x >> 48));
+          break;
+        case 2:
+          if(pos < data.size())
+            data.erase(data.begin() + (ptrdiff_t)pos);
+          break;
+        }
+      }
+    }
+    run_one(data.data(), data.size());
+  }
+
+  fprintf(stderr, "%lu runs OK\n", runs);
+  return EXIT_SUCCESS;
+}
+#endif
@@ -16,8 +16,13 @@ See LICENSE.txt for full license text.
 
 /*
 To run the tests open append_format.sln and run the 'Debug' configuration, or:
-g++ -Wall -Wextra -ggdb3 -I.. -o test_append_format test_append_format.cpp ../append_format.c
-cl /W4 /MDd /Zi /I.. /D_CRTDBG_MAP_ALLOC test_append_format.cpp ../append_format.c /link /INCREMENTAL:NO
+g++ -std=c++20 -Wall -Wextra -ggdb3 -pthread -I.. -o test_append_format test_append_format.cpp ../append_format.c
+cl /std:c++20 /W4 /MDd /Zi /I.. /D_CRTDBG_MAP_ALLOC test_append_format.cpp ../append_format.c /link /INCREMENTAL:NO
+
+Usage: test_append_format [--threads N] [str.sep.format.flags]
+
+--threads N   Shard the permutation tests across N threads, 0 for one per CPU.
+str.sep.format.flags   Run only that permutation test, eg 4.3.4.15.
 */
 
 #undef NDEBUG   /* always assert */
@@ -35,17 +40,32 @@ cl /W4 /MDd /Zi /I.. /D_CRTDBG_MAP_ALLOC test_append_format.cpp ../append_format
 #else
 #include <malloc.h>
 #endif
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iomanip>
 #include <iostream>
+#include <memory_resource>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "append_format.h"
 
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#define HAVE_APPEND_FORMAT_HPP
+#include "append_format.hpp"
+#endif
+
 using namespace std;
 
 #if defined(_WIN32) && !defined(_MSC_VER)
@@ -223,7 +243,12 @@ struct test_content {
   const char *some_trailing_crlfs;
 };
 
-bool runtests(struct test_content *content, const char *specific_test_to_run)
+/* run the tests for each permutation of the states and flags, or only for
+   specific_test_to_run if it's not NULL. the permutations are split into
+   nshards shards and only the ones of shard are run, so they can be run by
+   several threads at once. */
+bool runtests(struct test_content *content, const char *specific_test_to_run,
+              unsigned shard = 0, unsigned nshards = 1)
 {
   /* this function's return value. set false by ASSERT_BREAK. */
   bool ok = true;
@@ -299,6 +324,12 @@ bool runtests(struct test_content *content, const char *specific_test_to_run)
     if(flags != (flags & AF_ALL_FLAGS))
       continue;
 
+    /* skip this iteration if it's in another shard */
+    if(!specific_test_to_run &&
+       (((str_state * STATE_SEP_LAST + sep_state) * STATE_FORMAT_LAST +
+         format_state) * (AF_ALL_FLAGS + 1) + flags) % nshards != shard)
+      continue;
+
     switch(format_state) {
     default:
       assert(0); /* all states must be implemented */
@@ -453,6 +484,39 @@ bool runtests(struct test_content *content, const char *specific_test_to_run)
 
     size_t expectedlen = strlen(expected);
 
+    /* the same append through an af_buf copy of *str should have the same
+       outcome. the copy is made both with no spare capacity and with enough
+       spare capacity that the data is formatted directly into it. */
+    for(size_t spare = 0; spare <= 1024; spare += 1024) {
+      af_buf buf = AF_BUF_INIT;
+      if(str && (*str || spare)) {
+        buf.len = *str ? strlen(*str) : 0;
+        buf.cap = buf.len + 1 + spare;
+        buf.str = (char *)malloc(buf.cap);
+        ASSERT_BREAK(buf.str, "malloc failed");
+        memset(buf.str, 0xAA, buf.cap);
+        memcpy(buf.str, *str ? *str : "", buf.len + 1);
+      }
+
+      int buf_ret = af_buf_append_flags_sep_format(str ? &buf : NULL, flags,
+                                                   sep, format, format_arg);
+
+      ASSERT_BREAK(buf_ret >= 0, "af_buf_append_flags_sep_format error "
+                                 << buf_ret);
+
+      ASSERT_BREAK(expectedlen == (size_t)buf_ret,
+                   expectedlen << " != " << buf_ret);
+
+      if(str_state != STATE_STR_IS_NULL) {
+        ASSERT_BREAK(buf.str && buf.len == expectedlen && buf.cap > buf.len,
+                     "af_buf length or capacity is wrong");
+        ASSERT_BREAK(!memcmp(buf.str, expected, expectedlen + 1),
+                     "af_buf compare to expected");
+      }
+
+      af_buf_free(&buf);
+    }
+
     int ret = append_flags_sep_format(str, flags, sep, format, format_arg);
 
     ASSERT_BREAK(ret >= 0, "append_flags_sep_format error " << ret);
@@ -476,51 +540,2456 @@ bool runtests(struct test_content *content, const char *specific_test_to_run)
   return ok;
 }
 
-int main(int argc, char *argv[])
+/* run the permutation tests with nthreads threads, each with a shard of the
+   permutations */
+bool runtests_parallel(struct test_content *content,
+                       const char *specific_test_to_run, unsigned nthreads)
 {
-  /* set crtdbg options before anything else */
-#ifdef _CRTDBG_MAP_ALLOC
-  _CrtSetReportMode(_CRT_ERROR, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
-  _CrtSetReportFile(_CRT_ERROR, _CRTDBG_FILE_STDERR);
-  _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
-  _CrtSetReportFile(_CRT_WARN, _CRTDBG_FILE_STDERR);
-  // For now use the default _CRT_ASSERT to get the message box to select debug
-  // https://msdn.microsoft.com/en-us/library/ezb1wyez.aspx
-  //_CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
-  //_CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
-  _CrtSetDbgFlag(
-    _CRTDBG_ALLOC_MEM_DF |       /* Enable debug heap allocations */
-    _CRTDBG_DELAY_FREE_MEM_DF);  /* This flag keeps track of freed memory, but
-                                    as a result the heap keeps growing. Since
-                                    our tests are not memory intensive this is
-                                    fine for now. */
-#endif // _CRTDBG_MAP_ALLOC
+  if(specific_test_to_run || nthreads <= 1)
+    return runtests(content, specific_test_to_run);
+
+  std::vector<char> results(nthreads, false);
+  std::vector<std::thread> threads;
+  for(unsigned i = 0; i < nthreads; ++i) {
+    threads.emplace_back([&, i]() {
+      results[i] = runtests(content, NULL, i, nthreads);
+    });
+  }
 
-  (void)argc;
+  bool ok = true;
+  for(unsigned i = 0; i < nthreads; ++i) {
+    threads[i].join();
+    ok = ok && results[i];
+  }
+  return ok;
+}
 
-  /* If this is NULL then all tests are run */
-  const char *specific_test = argv[1];
+/* test af_count_trailing_crlf against a byte at a time count, for runs of CR
+   and LF of many lengths and at every alignment so that each of the scalar
+   and vector paths and the transitions between them are used */
+bool test_trailing_crlf()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
 
-  /* EXIT_SUCCESS when true. set false by ASSERT_BREAK. */
+  /* the data is copied to the end of the allocation so that a read past the
+     end of the string is caught by ASan */
+  const size_t maxlen = 300;
+  char *mem = (char *)malloc(maxlen + 64);
+  ASSERT_BREAK(mem, "malloc failed");
+
+  for(size_t len = 0; len <= maxlen; len += (len < 140) ? 1 : 7) {
+    for(size_t runlen = 0; runlen <= len; runlen += (runlen < 70) ? 1 : 13) {
+      for(size_t offset = 0; offset < 64; offset += (len < 140) ? 1 : 5) {
+        char *s = mem + maxlen + 64 - len - offset;
+        for(size_t i = 0; i < len; ++i)
+          s[i] = (i < len - runlen) ? 'x' : "\r\n"[(i * 7) % 3 != 0];
+        ASSERT_BREAK(af_count_trailing_crlf(s, len) == runlen,
+                     "len " << len << ", runlen " << runlen << ", offset " <<
+                     offset);
+      }
+    }
+  }
+
+  ASSERT_BREAK(af_count_trailing_crlf("", 0) == 0, "");
+  ASSERT_BREAK(af_count_trailing_crlf(NULL, 0) == 0, "");
+  ASSERT_BREAK(af_count_trailing_crlf("\r\nx\r\n\n", 6) == 3, "");
+  ASSERT_BREAK(af_count_trailing_crlf("\r\nx\r\n\n", 2) == 2, "");
+
+  free(mem);
+  return ok;
+}
+
+/* test that af_buf capacity grows geometrically according to the growth policy
+   and count the number of reallocations over many appends */
+bool test_growth()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
   bool ok = true;
 
-  /* Tests set these NULL or empty when necessary. All content must be != NULL.
-     Also: None except 'some_trailing_crlfs' should have trailing cr or lf
-           because the tests will add that when necessary.
-     Also: The expected outcome should be less than 1024 since a fixed-size
-           buffer is used for testing.
-   */
-  struct test_content content;
+  const int appends = 10000;
+
+  struct {
+    unsigned percent;
+    size_t min_step;
+    size_t max_step;
+    int max_reallocs;   /* upper bound of reallocations over all appends */
+  } policies[] = {
+    /* each append is at most 5 bytes so the final length is < 50000 */
+    { AF_GROWTH_DEFAULT_PERCENT, AF_GROWTH_DEFAULT_MIN_STEP,
+      AF_GROWTH_DEFAULT_MAX_STEP, 12 },  /* 64 * 2^10 > 50000 */
+    { 150, 16, 0, 24 },                  /* 16 * 1.5^20 > 50000 */
+    { 200, 64, 1024, 60 },               /* linear after 1024 */
+    { 100, 0, 0, appends },              /* exact fit */
+  };
+
+  for(size_t i = 0; i < sizeof policies / sizeof policies[0]; ++i) {
+    ASSERT_BREAK(!af_set_growth_policy(policies[i].percent,
+                                       policies[i].min_step,
+                                       policies[i].max_step), "");
+
+    af_buf buf = AF_BUF_INIT;
+    int reallocs = 0;
+    size_t prev_cap = 0;
+
+    for(int n = 0; n < appends; ++n) {
+      int ret = af_buf_append_sep_format(&buf, ",", "%d", n);
+      ASSERT_BREAK(ret >= 0 && (size_t)ret == buf.len, "append error " << ret);
+      ASSERT_BREAK(buf.cap > buf.len, "capacity is too small");
+      ASSERT_BREAK(MALLOC_SIZE(buf.str) >= buf.cap,
+                   "usable size " << MALLOC_SIZE(buf.str) << " < capacity "
+                   << buf.cap);
+      if(buf.cap != prev_cap) {
+        ++reallocs;
+        ASSERT_BREAK(!policies[i].max_step ||
+                     buf.cap - prev_cap <= policies[i].max_step ||
+                     buf.cap == buf.len + 1,
+                     "growth step exceeds max_step");
+        prev_cap = buf.cap;
+      }
+    }
 
-  memset(&content, 0, sizeof content);
-  content.string = "foo";
-  content.sep = "; ";
-  content.format_no_arg = "bar";
-  content.format_with_arg = "_%s_";         /* must contain only one % of %s */
-  content.arg = "qux";
-  content.some_trailing_crlfs = "\r\n\r";   /* must contain 1+ of \r and/or \n
-                                               in any order */
-  ok = ok && runtests(&content, specific_test);
+    ASSERT_BREAK(reallocs <= policies[i].max_reallocs,
+                 "policy " << i << ": " << reallocs << " reallocations");
+
+    ASSERT_BREAK(!af_buf_shrink_to_fit(&buf), "");
+    ASSERT_BREAK(buf.cap == buf.len + 1 && !buf.str[buf.len], "");
+    ASSERT_BREAK(MALLOC_SIZE(buf.str) >= buf.cap, "");
+
+    af_buf_free(&buf);
+  }
+
+  ASSERT_BREAK(af_set_growth_policy(99, 0, 0) == -1, "");
+  ASSERT_BREAK(af_set_growth_policy(200, 64, 32) == -1, "");
+
+  af_set_growth_policy(AF_GROWTH_DEFAULT_PERCENT, AF_GROWTH_DEFAULT_MIN_STEP,
+                       AF_GROWTH_DEFAULT_MAX_STEP);
+  return ok;
+}
+
+/* test that the content of the string is restored when formatting fails,
+   including any trailing CR and LF that would have been removed */
+bool test_format_failure()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+#ifndef _WIN32
+  /* in the C locale a wide character that isn't ASCII can't be converted */
+  const wchar_t bad[] = { 0xE9, 0 };
+  const char *initial = "foo\r\n";
+
+  for(size_t spare = 0; spare <= 1024; spare += 1024) {
+    af_buf buf = AF_BUF_INIT;
+    buf.len = strlen(initial);
+    buf.cap = buf.len + 1 + spare;
+    buf.str = (char *)malloc(buf.cap);
+    ASSERT_BREAK(buf.str, "malloc failed");
+    strcpy(buf.str, initial);
+
+    int ret = af_buf_append_flags_sep_format(&buf, AF_ALL_FLAGS, "; ",
+                                             "%s%ls", "bar", bad);
+    ASSERT_BREAK(ret == -1, "expected -1, got " << ret);
+    ASSERT_BREAK(buf.len == strlen(initial) && !strcmp(buf.str, initial),
+                 "af_buf content was not restored");
+    af_buf_free(&buf);
+
+    char *str = strdup(initial);
+    ASSERT_BREAK(str, "strdup failed");
+    ret = append_rmCRLFs_sep_format(&str, "; ", "%s%ls", "bar", bad);
+    ASSERT_BREAK(ret == -1, "expected -1, got " << ret);
+    ASSERT_BREAK(!strcmp(str, initial), "*str content was not restored");
+    free(str);
+  }
+#endif
+
+  return ok;
+}
+
+/* test reserving capacity in a char * string */
+bool test_reserve()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  char *str = NULL;
+  ASSERT_BREAK(!af_reserve(&str, 4096), "");
+  ASSERT_BREAK(str && !*str && af_reserved_capacity(str) == 4097, "");
+
+  /* the whole message fits in the reservation */
+  char *reserved = str;
+  af_buf expected = AF_BUF_INIT;
+  for(int n = 0; n < 200; ++n) {
+    int flags = n % (AF_ALL_FLAGS + 1);
+    int ret = af_buf_append_flags_sep_format(&expected, flags, "\r\n",
+                                             "%d\r\n", n);
+    ASSERT_BREAK(append_flags_sep_format(&str, flags | AF_RESERVED_CAPACITY,
+                                         "\r\n", "%d\r\n", n) == ret, "");
+  }
+  ASSERT_BREAK(str == reserved, "the reservation was reallocated");
+  ASSERT_BREAK(af_reserved_capacity(str) == 4097, "");
+  ASSERT_BREAK(!strcmp(str, expected.str), "reserved outcome differs");
+
+  /* growing past the reservation keeps the trailer */
+  std::string long_arg(5000, 'x');
+  ASSERT_BREAK(append_flags_sep_format_ex(&str, AF_RESERVED_CAPACITY, "; ",
+                                          "%s", long_arg.c_str()) ==
+               (ptrdiff_t)(expected.len + 2 + long_arg.size()), "");
+  ASSERT_BREAK(af_reserved_capacity(str) > strlen(str), "");
+  ASSERT_BREAK(af_buf_append_sep_format(&expected, "; ", "%s",
+                                        long_arg.c_str()) > 0, "");
+  ASSERT_BREAK(!strcmp(str, expected.str), "");
+
+  /* a failed append keeps the trailer */
+#ifndef _WIN32
+  const wchar_t bad[] = { 0xE9, 0 };
+  ASSERT_BREAK(append_flags_sep_format(&str, AF_RESERVED_CAPACITY, "; ",
+                                       "%s%ls", "bar", bad) == -1, "");
+  ASSERT_BREAK(!strcmp(str, expected.str), "");
+  ASSERT_BREAK(af_reserved_capacity(str) > strlen(str), "");
+#endif
+
+  /* an append without the flag drops the reservation, reserve again */
+  ASSERT_BREAK(append_format(&str, "%s", "!") ==
+               (int)expected.len + 1, "");
+  ASSERT_BREAK(!af_reserve(&str, 10), "");
+  ASSERT_BREAK(af_reserved_capacity(str) == expected.len + 12, "");
+  ASSERT_BREAK(append_flags_sep_format(&str, AF_RESERVED_CAPACITY, NULL,
+                                       "%s", "0123456789") ==
+               (int)expected.len + 11, "");
+  free(str);
+
+  /* the flag with a NULL string, and only the char * API accepts it */
+  str = NULL;
+  ASSERT_BREAK(append_flags_sep_format(&str, AF_RESERVED_CAPACITY, NULL,
+                                       "%s", "abc") == 3, "");
+  ASSERT_BREAK(af_reserved_capacity(str) >= 4, "");
+  ASSERT_BREAK(af_buf_append_flags_sep_format(&expected, AF_RESERVED_CAPACITY,
+                                              NULL, "") == -2, "");
+  free(str);
+  af_buf_free(&expected);
+
+  return ok;
+}
+
+/* test appending in the usable size of a char * string */
+bool test_usable_size()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  char *str = NULL;
+  af_buf expected = AF_BUF_INIT;
+  for(int n = 0; n < 500; ++n) {
+    int flags = n % (AF_ALL_FLAGS + 1);
+    int ret = af_buf_append_flags_sep_format(&expected, flags, "\r\n",
+                                             "%d\r\n", n);
+    ASSERT_BREAK(append_flags_sep_format(&str, flags | AF_USE_USABLE_SIZE,
+                                         "\r\n", "%d\r\n", n) == ret, "");
+    ASSERT_BREAK(MALLOC_SIZE(str) > (size_t)ret, "");
+  }
+  ASSERT_BREAK(!strcmp(str, expected.str), "usable size outcome differs");
+  free(str);
+  af_buf_free(&expected);
+
+  /* an append that fits in the usable size doesn't reallocate */
+  str = (char *)malloc(100);
+  ASSERT_BREAK(str, "malloc failed");
+  strcpy(str, "abc");
+  af_stats stats;
+  bool have_stats = !af_stats_snapshot(&stats, 1);
+  ASSERT_BREAK(append_flags_sep_format(&str, AF_USE_USABLE_SIZE, "; ", "%s",
+                                       "def") == 8, "");
+  ASSERT_BREAK(!strcmp(str, "abc; def"), "");
+  if(have_stats) {
+    ASSERT_BREAK(!af_stats_snapshot(&stats, 1), "");
+    ASSERT_BREAK(stats.calls == 1 && !stats.reallocs, "");
+  }
+  ASSERT_BREAK(af_buf_append_flags_sep_format(NULL, AF_USE_USABLE_SIZE, NULL,
+                                              "") == -2, "");
+  free(str);
+
+  return ok;
+}
+
+/* test the instrumentation counters, if they're compiled in */
+bool test_stats()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  af_stats stats;
+  if(af_stats_snapshot(&stats, 1)) {
+    ASSERT_BREAK(!stats.calls && !stats.fragment_sizes[0], "");
+    return ok;
+  }
+
+  /* the counters of another thread are included */
+  std::thread thread([]() {
+    af_buf buf = AF_BUF_INIT;
+    std::string long_arg(1000, 'x');
+    af_buf_append_format(&buf, "%s", "abc");
+    af_buf_append_flags_sep_format(&buf, 0x80000000, NULL, "");
+    af_buf_append_format(&buf, "%s", long_arg.c_str());
+    af_buf_append_flags_sep_format(&buf, AF_REMOVE_CR_LF_AFTER_APPEND, NULL,
+                                   "%s", "x\r\n");
+#ifndef _WIN32
+    const wchar_t bad[] = { 0xE9, 0 };
+    af_buf_append_format(&buf, "%ls", bad);
+#endif
+    af_buf_free(&buf);
+  });
+  thread.join();
+
+  ASSERT_BREAK(!af_stats_snapshot(&stats, 1), "");
+#ifndef _WIN32
+  ASSERT_BREAK(stats.calls == 4 && stats.errors == 1, "");
+#else
+  ASSERT_BREAK(stats.calls == 3 && !stats.errors, "");
+#endif
+  ASSERT_BREAK(stats.bytes_formatted == 1006, "");
+  ASSERT_BREAK(stats.flag_errors == 1, "");
+  ASSERT_BREAK(stats.double_formats == 1, "");
+  ASSERT_BREAK(stats.crlf_trimmed == 2, "");
+  ASSERT_BREAK(stats.reallocs >= 2, "");
+  ASSERT_BREAK(stats.fragment_sizes[2] == 2 && stats.fragment_sizes[10] == 1,
+               "");
+
+  /* reset */
+  ASSERT_BREAK(!af_stats_snapshot(&stats, 0), "");
+  ASSERT_BREAK(!stats.calls && !stats.reallocs && !stats.fragment_sizes[2],
+               "");
+
+  return ok;
+}
+
+/* test the af_mmap allocator across its threshold */
+bool test_mmap()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  for(int mmap_flags = 0; mmap_flags <= AF_MMAP_HUGEPAGE;
+      mmap_flags += AF_MMAP_HUGEPAGE) {
+    af_mmap mm;
+    af_mmap_init(&mm, 8192, mmap_flags);
+    af_buf buf, expected = AF_BUF_INIT;
+    af_buf_init_allocator(&buf, &mm.allocator);
+
+    for(int n = 0; n < 20000; ++n) {
+      int flags = n % (AF_ALL_FLAGS + 1);
+      int ret = af_buf_append_flags_sep_format(&expected, flags, "\r\n",
+                                               "%d\r\n", n);
+      ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, flags, "\r\n",
+                                                  "%d\r\n", n) == ret, "");
+    }
+    ASSERT_BREAK(buf.cap >= mm.threshold, "");
+    ASSERT_BREAK(!strcmp(buf.str, expected.str), "mmap outcome differs");
+    ASSERT_BREAK(!af_buf_shrink_to_fit(&buf) && buf.cap == buf.len + 1, "");
+    ASSERT_BREAK(!strcmp(buf.str, expected.str), "");
+
+    /* shrinking below the threshold copies the data back to the C runtime */
+    char *p = (char *)mm.allocator.resize(mm.allocator.ctx, buf.str, buf.cap,
+                                          100);
+    ASSERT_BREAK(p, "");
+    buf.str = p;
+    buf.cap = 100;
+    buf.len = 99;
+    buf.str[99] = '\0';
+    ASSERT_BREAK(!strncmp(buf.str, expected.str, 99), "");
+
+    af_buf_free(&buf);
+    af_buf_free(&expected);
+  }
+
+  return ok;
+}
+
+static void *failing_resize(void *, void *, size_t, size_t)
+{
+  return NULL;
+}
+
+static void failing_release(void *, void *ptr, size_t)
+{
+  free(ptr);
+}
+
+/* test the _ex functions, which aren't limited to INT_MAX */
+bool test_ex()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  char *str = NULL;
+  ASSERT_BREAK(append_format_ex(&str, "%s", "foo") == 3, "");
+  ASSERT_BREAK(append_sep_format_ex(&str, "; ", "%d", 12) == 7, "");
+  ASSERT_BREAK(append_flags_sep_format_ex(&str, 0x80000000, NULL, "") ==
+               AF_ERR_FLAGS, "");
+  ASSERT_BREAK(!strcmp(str, "foo; 12"), "");
+  free(str);
+  str = NULL;
+
+#ifndef _WIN32
+  const wchar_t bad[] = { 0xE9, 0 };
+  af_buf buf = AF_BUF_INIT;
+  ASSERT_BREAK(af_buf_append_format_ex(&buf, "%ls", bad) == AF_ERR_FORMAT, "");
+  af_buf_free(&buf);
+#endif
+
+  af_allocator failing = { failing_resize, failing_release, NULL };
+  af_buf nomem;
+  af_buf_init_allocator(&nomem, &failing);
+  ASSERT_BREAK(af_buf_append_sep_format_ex(&nomem, "; ", "%s", "x") ==
+               AF_ERR_MEMORY, "");
+  ASSERT_BREAK(!nomem.str && !nomem.len, "");
+
+  /* a string this long is never touched by an append without flags */
+  char small[] = "x";
+  af_buf huge = { small, (size_t)PTRDIFF_MAX, (size_t)PTRDIFF_MAX + 1, NULL };
+  ASSERT_BREAK(af_buf_append_format_ex(&huge, "%s", "x") == AF_ERR_LENGTH,
+               "");
+  ASSERT_BREAK(huge.len == (size_t)PTRDIFF_MAX && huge.str == small, "");
+
+  /* appending past INT_MAX. the pages of the string aren't written so this
+     doesn't use that much memory. */
+  if(sizeof(size_t) > 4) {
+    size_t len = (size_t)INT_MAX - 4;
+    af_buf big = AF_BUF_INIT;
+    big.str = (char *)malloc(len + 16);
+    if(big.str) {
+      big.len = len;
+      big.cap = len + 16;
+      big.str[len] = '\0';
+      ASSERT_BREAK(af_buf_append_format(&big, "%s", "0123456789") == -1, "");
+      ASSERT_BREAK(big.len == len && !big.str[len], "");
+      ASSERT_BREAK(af_buf_append_format_ex(&big, "%s", "0123456789") ==
+                   (ptrdiff_t)len + 10, "");
+      ASSERT_BREAK(af_buf_append_sep_format_ex(&big, "; ", "%s", "abcdefgh") ==
+                   (ptrdiff_t)len + 20, "");
+      ASSERT_BREAK(big.cap > len + 20, "");
+      ASSERT_BREAK(!strcmp(&big.str[len], "0123456789; abcdefgh"), "");
+      af_buf_free(&big);
+    }
+  }
+
+  return ok;
+}
+
+/* an af_allocator that counts calls and uses the C runtime */
+struct counting_allocator {
+  int resizes;
+  int releases;
+};
+
+static void *counting_resize(void *ctx, void *ptr, size_t oldsize,
+                             size_t newsize)
+{
+  (void)oldsize;
+  ++((struct counting_allocator *)ctx)->resizes;
+  return realloc(ptr, newsize);
+}
+
+static void counting_release(void *ctx, void *ptr, size_t size)
+{
+  (void)size;
+  ++((struct counting_allocator *)ctx)->releases;
+  free(ptr);
+}
+
+/* an af_writer that writes the string ctx */
+static size_t write_string(char *dest, size_t maxlen, void *ctx)
+{
+  size_t len = strlen((const char *)ctx);
+  if(len > maxlen)
+    return (size_t)-1;
+  memcpy(dest, ctx, len);
+  return len;
+}
+
+/* test af_buf with a custom allocator and with an arena */
+bool test_allocators()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  struct counting_allocator counts = { 0, 0 };
+  af_allocator counting = { counting_resize, counting_release, &counts };
+
+  af_buf buf;
+  af_buf_init_allocator(&buf, &counting);
+  for(int n = 0; n < 100; ++n)
+    ASSERT_BREAK(af_buf_append_sep_format(&buf, ",", "%d", n) >= 0, "");
+  ASSERT_BREAK(counts.resizes > 0 && !counts.releases, "");
+  ASSERT_BREAK(!strncmp(buf.str, "0,1,2,", 6), "");
+  af_buf_free(&buf);
+  ASSERT_BREAK(counts.releases == 1 && buf.alloc == &counting, "");
+
+  /* with AF_EXACT_FIT a writer with a short bound grows the string once, not
+     to the bound and back */
+  counts.resizes = 0;
+  af_buf_init_allocator(&buf, &counting);
+  for(int n = 0; n < 10; ++n)
+    ASSERT_BREAK(af_buf_append_flags_sep_writer(&buf, AF_EXACT_FIT, ",", 200,
+                                                write_string,
+                                                (void *)"abc") ==
+                 4 * n + 3, "");
+  ASSERT_BREAK(counts.resizes == 10 && buf.cap == buf.len + 1, "");
+  af_buf_free(&buf);
+
+  af_arena arena;
+  af_arena_init(&arena, 1024);
+
+  for(int request = 0; request < 3; ++request) {
+    af_buf msgs[10];
+    std::string expected[10];
+
+    for(int i = 0; i < 10; ++i)
+      af_buf_init_allocator(&msgs[i], &arena.allocator);
+
+    /* interleave the appends so most can't be resized in place */
+    for(int n = 0; n < 100; ++n) {
+      for(int i = 0; i < 10; ++i) {
+        int flags = (i & 1) ? AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND : 0;
+        int ret = af_buf_append_flags_sep_format(&msgs[i], flags, "; ",
+                                                 "%d:%d\n", i, n);
+        ASSERT_BREAK(ret >= 0 && (size_t)ret == msgs[i].len, "");
+        if(!expected[i].empty())
+          expected[i] += "; ";
+        expected[i] += to_string(i) + ":" + to_string(n) + "\n";
+        if((i & 1))
+          expected[i].erase(expected[i].size() - 1);
+      }
+    }
+
+    for(int i = 0; i < 10; ++i) {
+      ASSERT_BREAK(expected[i] == msgs[i].str, "arena message " << i);
+      ASSERT_BREAK(!af_buf_shrink_to_fit(&msgs[i]), "");
+      ASSERT_BREAK(expected[i] == msgs[i].str, "arena message " << i);
+    }
+
+    /* the last message can be released back to the arena */
+    af_buf_free(&msgs[9]);
+
+    af_arena_reset(&arena);
+    ASSERT_BREAK(arena.head && !arena.head->next && !arena.head->used,
+                 "arena reset should keep one empty block");
+  }
+
+  /* a string that's bigger than the block size */
+  af_buf_init_allocator(&buf, &arena.allocator);
+  std::string big(5000, 'x');
+  ASSERT_BREAK(af_buf_append_format(&buf, "%s", big.c_str()) == 5000, "");
+  ASSERT_BREAK(big == buf.str, "");
+
+  af_arena_free(&arena);
+  ASSERT_BREAK(!arena.head, "");
+
+  return ok;
+}
+
+/* test that a batch of appends has the same outcome as the same appends made
+   one at a time, and that a failed batch is rolled back */
+bool test_batch()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  const char *initial = "foo\r\n";
+
+  for(int hint = 0; hint <= 1000; hint += 1000) {
+    af_buf expected = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&expected, "%s", initial) >= 0, "");
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&buf, "%s", initial) >= 0, "");
+
+    char *str = strdup(initial);
+    ASSERT_BREAK(str, "strdup failed");
+
+    af_batch batch, str_batch;
+    ASSERT_BREAK(!af_batch_begin(&batch, &buf, (size_t)hint), "");
+    ASSERT_BREAK(!af_batch_begin_str(&str_batch, &str, (size_t)hint), "");
+    ASSERT_BREAK(buf.cap > buf.len + (size_t)hint, "size_hint not reserved");
+
+    for(int n = 0; n < 50; ++n) {
+      int flags = n % (AF_ALL_FLAGS + 1);
+      const char *format = (n % 3) ? "%s=%d\n" : "%s=%d";
+      int ret = af_buf_append_flags_sep_format(&expected, flags, "; ",
+                                               format, "key", n);
+      ASSERT_BREAK(ret >= 0, "");
+      ASSERT_BREAK(ret == af_batch_append_flags_sep_format(&batch, flags,
+                                                           "; ", format,
+                                                           "key", n), "");
+      ASSERT_BREAK(ret == af_batch_append_flags_sep_format(&str_batch, flags,
+                                                           "; ", format,
+                                                           "key", n), "");
+    }
+
+    ASSERT_BREAK(af_batch_commit(&batch) == (int)expected.len, "");
+    ASSERT_BREAK(af_batch_commit(&str_batch) == (int)expected.len, "");
+    ASSERT_BREAK(!strcmp(buf.str, expected.str), "batch outcome differs");
+    ASSERT_BREAK(!strcmp(str, expected.str), "batch outcome differs");
+
+    af_buf_free(&buf);
+    af_buf_free(&expected);
+    free(str);
+  }
+
+  /* a failed batch is rolled back, including any trailing CR and LF that were
+     removed and then overwritten */
+  for(int fail = 0; fail < 2; ++fail) {
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&buf, "%s", initial) >= 0, "");
+
+    af_batch batch;
+    af_batch_begin(&batch, &buf, 0);
+    for(int n = 0; n < 100; ++n)
+      ASSERT_BREAK(af_batch_append_flags_sep_format(
+                     &batch, AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND, "; ",
+                     "%d\r\n", n) >= 0, "");
+    if(fail) {
+      ASSERT_BREAK(af_batch_append_flags_sep_format(&batch, 0x80000000, NULL,
+                                                    "") == -2, "");
+      ASSERT_BREAK(af_batch_append_format(&batch, "%s", "x") == -2,
+                   "appends after a failure should be skipped");
+      ASSERT_BREAK(af_batch_commit(&batch) == -2, "");
+    }
+    else {
+      af_batch_abort(&batch);
+    }
+
+    ASSERT_BREAK(buf.len == strlen(initial) && !strcmp(buf.str, initial),
+                 "batch was not rolled back");
+    af_buf_free(&buf);
+  }
+
+  return ok;
+}
+
+/* test that appends to a shared buffer from many threads are all in the sealed
+   string, and that the outcome of appends from one thread is the same as the
+   outcome of the same appends to an af_buf */
+bool test_shared()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  /* small chunks so that fragments cross chunk boundaries */
+  for(size_t chunk_size = 1; chunk_size <= 4096; chunk_size *= 8) {
+    af_shared shared;
+    af_shared_init(&shared, chunk_size);
+
+    af_buf expected = AF_BUF_INIT;
+    for(int n = 0; n < 200; ++n) {
+      int flags = n % (AF_ALL_FLAGS + 1) & ~AF_REMOVE_CR_LF_BEFORE_APPEND;
+      /* the CR and LF flags apply only to the data of a shared append, so
+         the data ends in CR LF only if they're removed */
+      const char *format = (flags & AF_REMOVE_CR_LF_AFTER_APPEND) ?
+                           "%s=%d\r\n" : (n % 3) ? "%s=%d" : "";
+      int ret = af_buf_append_flags_sep_format(&expected, flags, "; ",
+                                               format, "key", n);
+      ASSERT_BREAK(ret >= 0, "");
+      ASSERT_BREAK(ret == af_shared_append_flags_sep_format(&shared, flags,
+                                                            "; ", format,
+                                                            "key", n), "");
+    }
+    std::string long_arg(1000, 'x');
+    ASSERT_BREAK(af_buf_append_sep_format(&expected, "; ", "%s",
+                                          long_arg.c_str()) ==
+                 af_shared_append_sep_format(&shared, "; ", "%s",
+                                             long_arg.c_str()), "");
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&buf, "%s", "prefix:") == 7, "");
+    ASSERT_BREAK(af_shared_seal(&shared, &buf) == (int)(7 + expected.len),
+                 "");
+    ASSERT_BREAK(!strncmp(buf.str, "prefix:", 7) &&
+                 !strcmp(buf.str + 7, expected.str), "shared outcome differs");
+
+    ASSERT_BREAK(af_shared_append_format(&shared, "%s", "x") == -1,
+                 "append after seal should fail");
+    ASSERT_BREAK(af_shared_append_flags_sep_format(
+                   &shared, AF_REMOVE_CR_LF_BEFORE_APPEND, NULL, "") == -2,
+                 "");
+
+    af_buf_free(&buf);
+    af_buf_free(&expected);
+    af_shared_free(&shared);
+  }
+
+  /* the separator depends on the data before CR and LF are removed, so data
+     that's only CR and LF appends just the separator like af_buf */
+  {
+    af_shared shared;
+    af_shared_init(&shared, 0);
+
+    af_buf expected = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&expected, "%s", "foo") == 3, "");
+    ASSERT_BREAK(af_buf_append_flags_sep_format(
+                   &expected, AF_REMOVE_CR_LF_AFTER_APPEND, "; ", "\r\n") == 5,
+                 "");
+    ASSERT_BREAK(af_shared_append_format(&shared, "%s", "foo") == 3, "");
+    ASSERT_BREAK(af_shared_append_flags_sep_format(
+                   &shared, AF_REMOVE_CR_LF_AFTER_APPEND, "; ", "\r\n") == 5,
+                 "");
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_shared_seal(&shared, &buf) == 5, "");
+    ASSERT_BREAK(!strcmp(buf.str, expected.str), "shared outcome differs");
+
+    af_buf_free(&buf);
+    af_buf_free(&expected);
+    af_shared_free(&shared);
+  }
+
+  /* each thread appends numbered fragments. every fragment must be in the
+     string exactly once and each thread's fragments must be in order. */
+  const int nthreads = 8, nappends = 2000;
+  af_shared shared;
+  af_shared_init(&shared, 64);
+
+  std::vector<std::thread> threads;
+  for(int t = 0; t < nthreads; ++t) {
+    threads.push_back(std::thread([&shared, t]() {
+      for(int n = 0; n < nappends; ++n)
+        af_shared_append_sep_format(&shared, ";", "%d.%d%s", t, n,
+                                    (n % 100) ? "" : string(300, 'x').c_str());
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+
+  af_buf buf = AF_BUF_INIT;
+  ASSERT_BREAK(af_shared_seal(&shared, &buf) > 0, "");
+
+  vector<int> next(nthreads, 0);
+  istringstream fragments(buf.str);
+  string fragment;
+  while(getline(fragments, fragment, ';')) {
+    int t, n;
+    ASSERT_BREAK(sscanf(fragment.c_str(), "%d.%d", &t, &n) == 2 &&
+                 t >= 0 && t < nthreads && n == next[t]++,
+                 "fragment out of order: " << fragment);
+  }
+  for(int t = 0; t < nthreads; ++t)
+    ASSERT_BREAK(next[t] == nappends, "missing fragments from thread " << t);
+
+  af_buf_free(&buf);
+  af_shared_free(&shared);
+  return ok;
+}
+
+/* test that af_thread_buf is reused within a thread without reallocating, is
+   different for each thread, and is released when it grows past the max */
+bool test_thread_buf()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  af_buf *buf = af_thread_buf();
+  ASSERT_BREAK(buf && !buf->len, "");
+  ASSERT_BREAK(af_buf_append_sep_format(buf, "; ", "%s", "foo") == 3, "");
+  ASSERT_BREAK(af_buf_append_sep_format(buf, "; ", "%d", 123) == 8, "");
+  ASSERT_BREAK(!strcmp(buf->str, "foo; 123"), "");
+
+  /* in steady state the same allocation is reused */
+  char *str = buf->str;
+  size_t cap = buf->cap;
+  for(int i = 0; i < 100; ++i) {
+    ASSERT_BREAK(af_thread_buf() == buf, "");
+    ASSERT_BREAK(!buf->len && !*buf->str, "thread buf should be empty");
+    ASSERT_BREAK(af_buf_append_format(buf, "%d", i) > 0, "");
+    ASSERT_BREAK(buf->str == str && buf->cap == cap, "unexpected realloc");
+  }
+
+  /* each thread has its own buffer */
+  af_buf *other = NULL;
+  std::thread t([&other]() {
+    other = af_thread_buf();
+    af_buf_append_format(other, "%s", "bar");
+  });
+  t.join();
+  ASSERT_BREAK(other && other != buf, "");
+  ASSERT_BREAK(!strcmp(buf->str, "99"), "");
+
+  /* a buffer that grew past the max is released by the next call */
+  af_thread_buf_set_max(1024);
+  ASSERT_BREAK(af_buf_append_format(buf, "%s", string(2000, 'x').c_str()) ==
+               2002, "");
+  ASSERT_BREAK(af_thread_buf() == buf && !buf->str && !buf->cap, "");
+  ASSERT_BREAK(af_buf_append_format(buf, "%s", "foo") == 3, "");
+  ASSERT_BREAK(af_thread_buf() == buf && buf->str, "");
+  af_thread_buf_set_max(AF_THREAD_BUF_DEFAULT_MAX);
+
+  af_thread_buf_trim();
+  ASSERT_BREAK(!buf->str && !buf->cap, "");
+
+  return ok;
+}
+
+/* test that appends to a rope have the same outcome as the same appends to an
+   af_buf, with segments small enough that separators, data and runs of CR
+   and LF cross segment boundaries */
+bool test_rope()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  for(size_t seg_size = 1; seg_size <= 4096; seg_size *= 4) {
+    af_rope rope;
+    af_rope_init(&rope, seg_size);
+
+    af_buf expected = AF_BUF_INIT;
+    for(int n = 0; n < 300; ++n) {
+      int flags = n % (AF_ALL_FLAGS + 1);
+      const char *format = (n % 7 == 0) ? "\r\n\r\n\r\n%.0s" :
+                           (n % 3) ? "%s=%d\r\n" : (n % 5) ? "%s=%d" : "";
+      int ret = af_buf_append_flags_sep_format(&expected, flags, "; ",
+                                               format, "key", n);
+      ASSERT_BREAK(ret >= 0, "");
+      ASSERT_BREAK(ret == af_rope_append_flags_sep_format(&rope, flags, "; ",
+                                                          format, "key", n),
+                   "rope append " << n);
+    }
+    std::string long_arg(1000, 'x');
+    ASSERT_BREAK(af_buf_append_sep_format(&expected, "; ", "%s\r\n",
+                                          long_arg.c_str()) ==
+                 af_rope_append_sep_format(&rope, "; ", "%s\r\n",
+                                           long_arg.c_str()), "");
+    ASSERT_BREAK(af_buf_append_rmCRLFs_format(&expected, "%s", "") ==
+                 af_rope_append_flags_sep_format(
+                   &rope, AF_REMOVE_CR_LF_BEFORE_AND_AFTER_APPEND, NULL, "%s",
+                   ""), "");
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&buf, "%s", "prefix:") == 7, "");
+    ASSERT_BREAK(af_rope_flatten(&rope, &buf) == (int)(7 + expected.len), "");
+    ASSERT_BREAK(!strncmp(buf.str, "prefix:", 7) &&
+                 !strcmp(buf.str + 7, expected.str), "rope outcome differs");
+
+    /* the segments make up the string */
+    string joined;
+    const char *seg;
+    size_t len;
+    for(size_t i = 0; (seg = af_rope_segment(&rope, i, &len)); ++i) {
+      ASSERT_BREAK(len && len <= seg_size, "");
+      joined.append(seg, len);
+    }
+    ASSERT_BREAK(joined == expected.str, "");
+
+    ASSERT_BREAK(af_rope_append_flags_sep_format(&rope, 0x80000000, NULL,
+                                                 "") == -2, "");
+
+    af_buf_free(&buf);
+    af_buf_free(&expected);
+    af_rope_free(&rope);
+    ASSERT_BREAK(!rope.len && !af_rope_segment(&rope, 0, &len), "");
+  }
+
+  return ok;
+}
+
+/* an af_sink_writer that appends to a std::string */
+int sink_to_string(void *ctx, const char *data, size_t len)
+{
+  ((string *)ctx)->append(data, len);
+  return 0;
+}
+
+/* test that what's written by a sink is the same as the string made by the
+   same appends to an af_buf, for each kind of destination */
+bool test_sink()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  const char *seps[] = { "; ", "\n", ";\r\n", NULL };
+  std::string long_arg(AF_SINK_BUFFER_SIZE + 100, 'x');
+  /* longer than the stack scratch buffer but it fits the sink buffer */
+  std::string medium_arg(300, 'y');
+
+  for(int type = 0; type < 3; ++type) {
+#ifdef _WIN32
+    if(type == 2)
+      continue;
+#endif
+    for(size_t s = 0; s < sizeof(seps) / sizeof(seps[0]); ++s) {
+      string written;
+      FILE *fp = NULL;
+      af_sink sink;
+
+      if(type == 0)
+        af_sink_init_callback(&sink, sink_to_string, &written);
+      else {
+        fp = tmpfile();
+        ASSERT_BREAK(fp, "tmpfile failed");
+        if(type == 1)
+          af_sink_init_file(&sink, fp);
+        else
+          af_sink_init_fd(&sink, fileno(fp));
+      }
+
+      af_buf expected = AF_BUF_INIT;
+      for(int n = 0; n < 500; ++n) {
+        int flags = n % (AF_ALL_FLAGS + 1);
+        const char *format = (n % 7 == 0) ? "\r\n\r\n%.0s%.0d" :
+                             (n % 3) ? "%s=%d\r\n" :
+                             (n % 5) ? "%s=%d" : "";
+        const char *arg = (n % 50 == 0) ? long_arg.c_str() :
+                          (n % 4 == 0) ? medium_arg.c_str() : "key";
+        int ret = af_buf_append_flags_sep_format(&expected, flags, seps[s],
+                                                 format, arg, n);
+        ASSERT_BREAK(ret >= 0, "");
+        ASSERT_BREAK(!af_sink_append_flags_sep_format(&sink, flags, seps[s],
+                                                      format, arg, n), "");
+        ASSERT_BREAK(sink.len == expected.len, "sink append " << n);
+        if(n == 250)
+          ASSERT_BREAK(!af_sink_flush(&sink), "");
+      }
+      ASSERT_BREAK(af_sink_append_flags_sep_format(&sink, 0x80000000, NULL,
+                                                   "") == -2, "");
+      ASSERT_BREAK(!af_sink_finish(&sink), "");
+
+      if(fp) {
+        char buf[4096];
+        size_t n;
+        rewind(fp);
+        while((n = fread(buf, 1, sizeof(buf), fp)))
+          written.append(buf, n);
+        fclose(fp);
+      }
+
+      ASSERT_BREAK(written == expected.str,
+                   "type " << type << ", sep " << s << ": sink outcome " <<
+                   "differs");
+      af_buf_free(&expected);
+    }
+  }
+
+  return ok;
+}
+
+bool test_iov()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  std::string long_sep(300, '-');
+  long_sep += "\r\n";
+  std::string long_arg(AF_IOV_DEFAULT_MIN_REF, 'x');
+  std::string long_crlf = long_arg + "\r\n";
+  const char *seps[] = { "; ", "\n", long_sep.c_str(), NULL };
+
+  for(size_t s = 0; s < sizeof(seps) / sizeof(seps[0]); ++s) {
+    af_iov iov;
+    af_iov_init(&iov, 0);
+    af_buf expected = AF_BUF_INIT;
+
+    for(int n = 0; n < 500; ++n) {
+      int flags = n % (AF_ALL_FLAGS + 1);
+      const char *format = (n % 7 == 0) ? "\r\n\r\n%.0s%.0d" :
+                           (n % 3) ? "%s=%d\r\n" :
+                           (n % 5) ? "%s=%d" : "";
+      const char *arg = (n % 11 == 0) ? long_crlf.c_str() :
+                        (n % 4 == 0) ? long_arg.c_str() : "key";
+      int ret = af_buf_append_flags_sep_format(&expected, flags, seps[s],
+                                               format, arg, n);
+      ASSERT_BREAK(ret >= 0, "");
+      ASSERT_BREAK(af_iov_append_flags_sep_format(&iov, flags, seps[s],
+                                                  format, arg, n) == ret,
+                   "sep " << s << ", iov append " << n);
+    }
+    ASSERT_BREAK(af_iov_append_flags_sep_format(&iov, 0x80000000, NULL,
+                                                "") == -2, "");
+
+    af_buf flat = AF_BUF_INIT;
+    ASSERT_BREAK(af_iov_flatten(&iov, &flat) == (int)expected.len, "");
+    ASSERT_BREAK(!strcmp(flat.str, expected.str),
+                 "sep " << s << ": iov outcome differs");
+    af_buf_free(&flat);
+
+#ifndef _WIN32
+    FILE *fp = tmpfile();
+    ASSERT_BREAK(fp, "tmpfile failed");
+    ASSERT_BREAK(!af_iov_writev(&iov, fileno(fp)), "");
+    string written;
+    char buf[4096];
+    size_t len;
+    rewind(fp);
+    while((len = fread(buf, 1, sizeof(buf), fp)))
+      written.append(buf, len);
+    fclose(fp);
+    ASSERT_BREAK(written == expected.str,
+                 "sep " << s << ": writev outcome differs");
+#endif
+
+    af_iov_free(&iov);
+    af_buf_free(&expected);
+  }
+
+  /* long separators and %s arguments are referenced, short data shares an
+     iovec, and the iovecs aren't written to */
+  {
+    af_iov iov;
+    af_iov_init(&iov, 0);
+    size_t count;
+    const af_iovec *vec;
+
+    ASSERT_BREAK(af_iov_append_format(&iov, "%s", "a") == 1, "");
+    ASSERT_BREAK(af_iov_append_format(&iov, "%d", 2) == 2, "");
+    vec = af_iov_vec(&iov, &count);
+    ASSERT_BREAK(count == 1, "");
+
+    ASSERT_BREAK(af_iov_append_sep_format(&iov, long_sep.c_str(), "<%s>",
+                                          long_crlf.c_str()) ==
+                 (int)(2 + long_sep.size() + long_crlf.size() + 2), "");
+    vec = af_iov_vec(&iov, &count);
+    ASSERT_BREAK(vec[1].iov_base == long_sep.c_str(), "");
+#ifndef AF_NO_FAST_FORMAT
+    /* %s arguments are only referenced by the built-in formatter */
+    ASSERT_BREAK(count == 5, "count " << count);
+    ASSERT_BREAK(vec[3].iov_base == long_crlf.c_str(), "");
+
+    int ret = af_iov_append_flags_sep_format(&iov,
+                AF_REMOVE_CR_LF_BEFORE_APPEND, NULL, "%s", long_crlf.c_str());
+    ASSERT_BREAK(ret == (int)(2 + long_sep.size() + long_crlf.size() + 2 +
+                              long_crlf.size()), "");
+    ret = af_iov_append_flags_sep_format(&iov, AF_REMOVE_CR_LF_AFTER_APPEND,
+                                         NULL, "");
+    ASSERT_BREAK(ret == (int)iov.len && ret == (int)(2 + long_sep.size() +
+                 long_crlf.size() + 2 + long_arg.size()), "");
+    vec = af_iov_vec(&iov, &count);
+    ASSERT_BREAK(count == 6, "count " << count);
+    ASSERT_BREAK(vec[5].iov_base == long_crlf.c_str() &&
+                 vec[5].iov_len == long_arg.size(), "");
+    ASSERT_BREAK(long_crlf == long_arg + "\r\n", "");
+
+    /* a short minimum reference length */
+    af_iov_free(&iov);
+    af_iov_init(&iov, 4);
+    ASSERT_BREAK(af_iov_append_sep_format(&iov, ", ", "%s%-5s", "abcd",
+                                          "efgh") == 9, "");
+    ASSERT_BREAK(af_iov_append_sep_format(&iov, ", ", "%s", "ij") == 13, "");
+    vec = af_iov_vec(&iov, &count);
+    ASSERT_BREAK(count == 2, "count " << count);
+    ASSERT_BREAK(!memcmp(vec[1].iov_base, "efgh , ij", 9), "");
+#endif
+    af_iov_free(&iov);
+  }
+
+  return ok;
+}
+
+/* compare the outcome of appending format and args to the outcome of snprintf.
+   the append is made to an af_buf with various amounts of spare capacity so
+   that the output is formatted into the scratch buffer, directly into the
+   spare capacity, and truncated and formatted again. the same is done with
+   the format compiled by af_compile. */
+template<typename... Args>
+bool check_format(const char *format, Args... args)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  char expected[2048];
+  int expected_ret = snprintf(expected, sizeof expected, format, args...);
+  ASSERT_BREAK(0 <= expected_ret && (size_t)expected_ret < sizeof expected,
+               "snprintf failed: " << format);
+
+  size_t spares[] = { 0, 300, 2048 };
+
+  af_program *prog = af_compile(format);
+  ASSERT_BREAK(prog, "af_compile failed: " << format);
+
+  for(size_t i = 0; i < 2 * sizeof spares / sizeof spares[0]; ++i) {
+    bool compiled = (i % 2);
+    af_buf buf = AF_BUF_INIT;
+    if(spares[i / 2]) {
+      buf.cap = 1 + spares[i / 2];
+      buf.str = (char *)malloc(buf.cap);
+      ASSERT_BREAK(buf.str, "malloc failed");
+      memset(buf.str, 0xAA, buf.cap);
+      *buf.str = '\0';
+    }
+
+    int ret = compiled ?
+              af_buf_append_compiled(&buf, 0, NULL, prog, args...) :
+              af_buf_append_flags_sep_format(&buf, 0, NULL, format, args...);
+
+    if(ret != expected_ret || memcmp(buf.str, expected, (size_t)ret + 1)) {
+      dump("buf.str", stderr, (unsigned char *)buf.str,
+           ret >= 0 ? (size_t)ret + 1 : 0, 0);
+      dump("expected", stderr, (unsigned char *)expected,
+           (size_t)expected_ret + 1, 0);
+      ASSERT_BREAK(0, (compiled ? "compiled " : "") << "format \""
+                      << format << "\" returned " << ret << ", expected "
+                      << expected_ret);
+    }
+
+    af_buf_free(&buf);
+  }
+
+  size_t max_len = af_program_max_length(prog);
+  ASSERT_BREAK(max_len == (size_t)-1 || (size_t)expected_ret <= max_len,
+               "af_program_max_length " << max_len << " < " << expected_ret
+               << ": " << format);
+
+  af_program_free(prog);
+  return ok;
+}
+
+/* test that appends recorded in an af_defer drain to the same outcome as the
+   same appends to an af_buf, that their arguments are copied, and that the
+   appends of each producer thread are drained in order */
+bool test_defer()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  /* a small ring so that records often wrap around its end */
+  af_defer defer;
+  af_defer_init(&defer, 2048);
+  af_defer_ring *ring = af_defer_attach(&defer);
+  ASSERT_BREAK(ring, "");
+
+  af_buf expected = AF_BUF_INIT;
+  af_buf buf = AF_BUF_INIT;
+  char arg[400];
+  /* every format takes a prefix of the same arguments. the last one has
+     positional arguments, so it's formatted when it's recorded. */
+  const char *formats[] = {
+    "%s=%d", "", "%s=%d\r\n", "%.3s|%-*d|%5.2f|%lld|%c|%%|%p",
+    "%-12.5s[%x]%+d", "%1$s|%1$.2s"
+  };
+  const int nformats = (int)(sizeof(formats) / sizeof(formats[0]));
+
+  for(int n = 0; n < 400; ++n) {
+    int flags = n % (AF_ALL_FLAGS + 1);
+    const char *format = formats[n % nformats];
+    const char *sep = (n % 5) ? "; " : NULL;
+    memset(arg, 'a' + n % 26, sizeof(arg));
+    arg[(n * 37) % sizeof(arg)] = '\0';
+
+    int expected_ret = af_buf_append_flags_sep_format(&expected, flags, sep,
+                                                      format, arg, n, n,
+                                                      1.5 * n,
+                                                      (long long)n << 40,
+                                                      'c', (void *)&n);
+    ASSERT_BREAK(expected_ret >= 0, "");
+
+    int ret = af_defer_append_flags_sep_format(ring, flags, sep, format, arg,
+                                               n, n, 1.5 * n,
+                                               (long long)n << 40, 'c',
+                                               (void *)&n);
+    if(ret == -1) {
+      /* the ring is full */
+      ASSERT_BREAK(af_defer_drain(&defer, &buf) > 0, "");
+      ret = af_defer_append_flags_sep_format(ring, flags, sep, format, arg,
+                                             n, n, 1.5 * n,
+                                             (long long)n << 40, 'c',
+                                             (void *)&n);
+    }
+    ASSERT_BREAK(!ret, "append " << n << " failed");
+
+    /* the arguments were copied */
+    memset(arg, '!', sizeof(arg));
+
+    if(!(n % 7))
+      ASSERT_BREAK(af_defer_drain(&defer, &buf) >= 0, "");
+  }
+  ASSERT_BREAK(af_defer_drain(&defer, &buf) >= 0, "");
+  ASSERT_BREAK(buf.len == expected.len && !strcmp(buf.str, expected.str),
+               "deferred outcome differs" << endl <<
+               "expected: " << expected.str << endl <<
+               "deferred: " << buf.str);
+
+  /* wide and long double arguments */
+  af_buf_free(&buf);
+  ASSERT_BREAK(!af_defer_append_format(ring, "%ls|%.1Lf", L"wide", 2.25L), "");
+  ASSERT_BREAK(af_defer_drain(&defer, &buf) == 1 &&
+               !strcmp(buf.str, "wide|2.2"), "");
+
+  /* a record larger than the ring and an unrecognized flag aren't recorded */
+  string long_arg(3000, 'x');
+  ASSERT_BREAK(af_defer_append_format(ring, "%s", long_arg.c_str()) == -1, "");
+  ASSERT_BREAK(af_defer_append_flags_sep_format(ring, AF_RESERVED_CAPACITY,
+                                                NULL, "%s", "x") == -2, "");
+  ASSERT_BREAK(af_defer_drain(&defer, &buf) == 0, "");
+
+  /* a detached ring is reused */
+  af_defer_detach(ring);
+  ASSERT_BREAK(af_defer_attach(&defer) == ring, "");
+  ASSERT_BREAK(af_defer_attach(&defer) != ring, "");
+
+  af_buf_free(&buf);
+  af_buf_free(&expected);
+  af_defer_free(&defer);
+
+  /* each producer records numbered fragments while a consumer drains them.
+     every fragment must be drained exactly once and each producer's fragments
+     must be in order. */
+  const int nthreads = 4, nappends = 5000;
+  af_defer_init(&defer, 4096);
+
+  std::atomic<int> producers(nthreads);
+  std::thread consumer([&defer, &buf, &producers]() {
+    while(producers.load())
+      if(af_defer_drain(&defer, &buf) <= 0)
+        std::this_thread::yield();
+    af_defer_drain(&defer, &buf);
+  });
+
+  std::vector<std::thread> threads;
+  std::atomic<int> failures(0);
+  for(int t = 0; t < nthreads; ++t) {
+    threads.push_back(std::thread([&defer, &producers, &failures, t]() {
+      af_defer_ring *r = af_defer_attach(&defer);
+      if(!r) {
+        ++failures;
+        --producers;
+        return;
+      }
+      for(int n = 0; n < nappends; ++n) {
+        string s((n % 100) ? 0 : 300, 'x');
+        while(af_defer_append_sep_format(r, ";", "%d.%d%s", t, n,
+                                         s.c_str()) == -1)
+          std::this_thread::yield();
+      }
+      if(af_defer_flush(&defer))
+        ++failures;
+      af_defer_detach(r);
+      --producers;
+    }));
+  }
+  for(size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+  consumer.join();
+
+  ASSERT_BREAK(!failures.load(), "");
+  ASSERT_BREAK(buf.str, "");
+
+  vector<int> next(nthreads, 0);
+  istringstream fragments(buf.str);
+  string fragment;
+  while(getline(fragments, fragment, ';')) {
+    int t, n;
+    ASSERT_BREAK(sscanf(fragment.c_str(), "%d.%d", &t, &n) == 2 &&
+                 t >= 0 && t < nthreads && n == next[t]++,
+                 "fragment out of order: " << fragment);
+  }
+  for(int t = 0; t < nthreads; ++t)
+    ASSERT_BREAK(next[t] == nappends, "missing fragments from thread " << t);
+
+  af_buf_free(&buf);
+  af_defer_free(&defer);
+  return ok;
+}
+
+/* test that the built-in formatter's output is byte-identical to snprintf */
+bool test_formatter()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  const char *flag_sets[] = {
+    "", "-", "+", " ", "#", "0", "-0", "+0", " 0", "#0", "-#", "+ ", "-+ #0"
+  };
+  const char *widths[] = { "", "1", "3", "12", "30" };
+  const char *precisions[] = { "", ".", ".0", ".1", ".5", ".25" };
+  const char *lengths[] = { "hh", "h", "", "l", "ll", "j", "z", "t" };
+
+  long long signed_values[] = {
+    0, 1, -1, 7, -42, 127, -128, 255, 32767, -32768, 65535,
+    INT_MAX, INT_MIN, LLONG_MAX, LLONG_MIN
+  };
+  unsigned long long unsigned_values[] = {
+    0, 1, 7, 8, 15, 16, 255, 256, 65535, UINT_MAX, ULLONG_MAX,
+    0x8000000000000000ULL
+  };
+
+  for(const char *f : flag_sets) {
+    for(const char *w : widths) {
+      for(const char *p : precisions) {
+        for(const char *l : lengths) {
+          for(const char *c : { "d", "i", "u", "o", "x", "X" }) {
+            bool is_signed = (*c == 'd' || *c == 'i');
+
+            /* '#' is undefined for decimal conversions */
+            if(strchr(f, '#') && (is_signed || *c == 'u'))
+              continue;
+
+            string format = string("[%") + f + w + p + l + c + "]";
+            const char *fmt = format.c_str();
+
+            if(is_signed) {
+              for(long long v : signed_values) {
+                if(!strcmp(l, "hh") || !strcmp(l, "h") || !*l)
+                  ok = ok && check_format(fmt, (int)v);
+                else if(!strcmp(l, "l"))
+                  ok = ok && check_format(fmt, (long)v);
+                else if(!strcmp(l, "ll"))
+                  ok = ok && check_format(fmt, v);
+                else if(!strcmp(l, "j"))
+                  ok = ok && check_format(fmt, (intmax_t)v);
+                else
+                  ok = ok && check_format(fmt, (ptrdiff_t)v);
+              }
+            }
+            else {
+              for(unsigned long long v : unsigned_values) {
+                if(!strcmp(l, "hh") || !strcmp(l, "h") || !*l)
+                  ok = ok && check_format(fmt, (unsigned)v);
+                else if(!strcmp(l, "l"))
+                  ok = ok && check_format(fmt, (unsigned long)v);
+                else if(!strcmp(l, "ll"))
+                  ok = ok && check_format(fmt, v);
+                else if(!strcmp(l, "j"))
+                  ok = ok && check_format(fmt, (uintmax_t)v);
+                else
+                  ok = ok && check_format(fmt, (size_t)v);
+              }
+            }
+          }
+        }
+
+        /* precision and '#' are undefined for %c */
+        if(!*p && !strchr(f, '#')) {
+          string format = string("[%") + f + w + "c]";
+          ok = ok && check_format(format.c_str(), 'a');
+          ok = ok && check_format(format.c_str(), 0);
+        }
+
+        if(!strchr(f, '#')) {
+          string format = string("[%") + f + w + p + "s]";
+          for(const char *v : { "", "a", "abc", "hello world" })
+            ok = ok && check_format(format.c_str(), v);
+#ifdef __GLIBC__
+          ok = ok && check_format(format.c_str(), (const char *)NULL);
+#endif
+        }
+      }
+    }
+  }
+
+  /* star width and precision */
+  for(int w : { -10, -1, 0, 5 }) {
+    for(int p : { -1, 0, 3 }) {
+      ok = ok && check_format("[%*.*d]", w, p, -42);
+      ok = ok && check_format("[%-*.*x]", w, p, 255u);
+      ok = ok && check_format("[%*.*s]", w, p, "hello");
+      ok = ok && check_format("[%*.*f]", w, p, 3.14159);
+    }
+  }
+
+  /* conversions that are formatted by the C library */
+  ok = ok && check_format("%f %e %g %a %E %G", 1.5, -2.25e10, 1e-5, 0.1,
+                          12345.678, 1e100);
+  ok = ok && check_format("%.3f|%10.2e|%-12g|%+g|% .0f", 3.14159, 2.5, 0.0,
+                          1.0, 2.5);
+  ok = ok && check_format("%Lf %Lg", (long double)1.25, (long double)1e30);
+  ok = ok && check_format("%p %p", (void *)&ok, (void *)NULL);
+  ok = ok && check_format("%ls|%5lc|%-3lc", L"abc", (wint_t)L'x',
+                          (wint_t)L'y');
+  ok = ok && check_format("%05c|%05s", 'x', "ab");
+
+  /* formats that mix all kinds of conversions and text */
+  ok = ok && check_format("100%% of %s is %d (0x%08X) or %.2f%%", "foo", 123,
+                          0xBEEFu, 99.5);
+  ok = ok && check_format("%s=%d; %s=%u; %s=%zu; %s=%x", "a", -1, "b", 2u,
+                          "c", (size_t)3, "d", 4u);
+  ok = ok && check_format("%c%c%c%s", 'a', 'b', 'c', "");
+
+  /* long output and long arguments */
+  string long_arg(1000, 'x');
+  ok = ok && check_format("%s|%s", long_arg.c_str(), long_arg.c_str() + 500);
+  ok = ok && check_format("%1000d|%.1000u", 1, 2u);
+
+  /* formats that the built-in formatter leaves to the C library entirely */
+#ifdef __GLIBC__
+  ok = ok && check_format("%2$s %1$s", "world", "hello");
+  ok = ok && check_format("%'d", 1234567);
+#endif
+
+  return ok;
+}
+
+/* test the compiled appends for each combination of flags and separator, the
+   bound reported by af_program_max_length, and formats that aren't compiled
+   into conversions. the output of the conversions is compared to snprintf by
+   check_format. */
+bool test_compiled()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  const char *initial[] = { NULL, "", "foo", "foo\r\n" };
+  const char *formats[] = { "%s=%d\r\n", "", "\n", "100%%", "%s%.0d" };
+
+  for(const char *format : formats) {
+    af_program *prog = af_compile(format);
+    ASSERT_BREAK(prog, "af_compile failed: " << format);
+
+    for(int flags = 0; flags <= AF_ALL_FLAGS; ++flags) {
+      for(const char *init : initial) {
+        af_buf expected = AF_BUF_INIT, buf = AF_BUF_INIT;
+        char *str = init ? strdup(init) : NULL;
+        if(init) {
+          ASSERT_BREAK(af_buf_append_format(&expected, "%s", init) >= 0, "");
+          ASSERT_BREAK(af_buf_append_format(&buf, "%s", init) >= 0, "");
+        }
+
+        int ret = af_buf_append_flags_sep_format(&expected, flags, "; ",
+                                                 format, "key", 0);
+        ASSERT_BREAK(ret >= 0, "");
+        ASSERT_BREAK(af_buf_append_compiled(&buf, flags, "; ", prog, "key",
+                                            0) == ret, "format: " << format);
+        ASSERT_BREAK(buf.len == (size_t)ret &&
+                     !strcmp(buf.str, expected.str), "format: " << format);
+        ASSERT_BREAK(af_append_compiled(&str, flags, "; ", prog, "key",
+                                        0) == ret, "format: " << format);
+        ASSERT_BREAK(!strcmp(str, expected.str), "format: " << format);
+        ASSERT_BREAK(af_buf_append_compiled(NULL, flags, "; ", prog, "key",
+                                            0) ==
+                     af_buf_append_flags_sep_format(NULL, flags, "; ", format,
+                                                    "key", 0), "");
+
+        free(str);
+        af_buf_free(&expected);
+        af_buf_free(&buf);
+      }
+    }
+
+    af_program_free(prog);
+  }
+
+  /* the bound is of any arguments, unless the length of the output depends
+     on them */
+  struct {
+    const char *format;
+    size_t min, max;
+  } bounds[] = {
+    { "abc", 3, 3 },
+    { "100%%", 4, 4 },
+    { "%d", 20, 40 },
+    { "[%30d]", 32, 32 },
+    { "%c%5c", 6, 6 },
+    { "%.3s", 3, 20 },
+    { "%g", 13, 64 },
+    { "%f", 310 + 7, 400 },
+    { "%s", (size_t)-1, (size_t)-1 },
+    { "%*d", (size_t)-1, (size_t)-1 },
+    { "%ls", (size_t)-1, (size_t)-1 },
+    { "%n", (size_t)-1, (size_t)-1 },
+  };
+  for(size_t i = 0; i < sizeof bounds / sizeof bounds[0]; ++i) {
+    af_program *prog = af_compile(bounds[i].format);
+    ASSERT_BREAK(prog, "");
+    size_t n = af_program_max_length(prog);
+#ifdef AF_NO_FAST_FORMAT
+    ASSERT_BREAK(n == (size_t)-1, "");
+#else
+    ASSERT_BREAK(bounds[i].min <= n && n <= bounds[i].max,
+                 bounds[i].format << ": " << n);
+#endif
+    af_program_free(prog);
+  }
+
+  /* more conversions than fit in the stack */
+  {
+    af_program *prog = af_compile("%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d"
+                                  "%s%c%x%.1f%%");
+    ASSERT_BREAK(prog, "");
+    char *str = NULL;
+    ASSERT_BREAK(af_append_compiled(&str, 0, NULL, prog, 0, 1, 2, 3, 4, 5, 6,
+                                    7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+                                    18, 19, "s", 'c', 255u, 0.25) == 38, "");
+    ASSERT_BREAK(!strcmp(str, "012345678910111213141516171819sc"
+                              "ff0.2%"), str);
+    free(str);
+    af_program_free(prog);
+  }
+
+  /* formats that are appended the usual way */
+#ifdef __GLIBC__
+  {
+    af_program *prog = af_compile("%2$s %1$s");
+    ASSERT_BREAK(prog, "");
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_compiled(&buf, 0, NULL, prog, "world",
+                                        "hello") == 11, "");
+    ASSERT_BREAK(!strcmp(buf.str, "hello world"), "");
+    af_buf_free(&buf);
+    af_program_free(prog);
+  }
+#endif
+
+  /* a string with reserved capacity isn't reallocated */
+  {
+    af_program *prog = af_compile("%s=%d");
+    ASSERT_BREAK(prog, "");
+    char *str = NULL;
+    ASSERT_BREAK(!af_reserve(&str, 100), "");
+    const char *before = str;
+    for(int n = 0; n < 5; ++n)
+      ASSERT_BREAK(af_append_compiled(&str, AF_RESERVED_CAPACITY, ";", prog,
+                                      "k", n) == n * 4 + 3, "");
+    ASSERT_BREAK(str == before && !strcmp(str, "k=0;k=1;k=2;k=3;k=4"), "");
+    ASSERT_BREAK(af_buf_append_compiled(NULL, AF_RESERVED_CAPACITY, NULL,
+                                        prog, "k", 0) == -2, "");
+    free(str);
+    af_program_free(prog);
+  }
+
+  ASSERT_BREAK(!af_compile(NULL), "");
+  ASSERT_BREAK(af_program_max_length(NULL) == (size_t)-1, "");
+  ASSERT_BREAK(af_append_compiled(NULL, 0, NULL, NULL) == -1, "");
+  ASSERT_BREAK(af_append_compiled(NULL, ~AF_ALL_FLAGS, NULL, NULL) == -2, "");
+
+  return ok;
+}
+
+#ifndef AF_NO_FAST_FORMAT
+/* return s escaped as escape (AF_ESCAPE_JSON or AF_ESCAPE_C) */
+static string escape_string(const string &s, int escape)
+{
+  string r;
+
+  for(unsigned char c : s) {
+    const char *e = NULL;
+    switch(c) {
+    case '"':  e = "\\\""; break;
+    case '\\': e = "\\\\"; break;
+    case '\b': e = "\\b"; break;
+    case '\f': e = "\\f"; break;
+    case '\n': e = "\\n"; break;
+    case '\r': e = "\\r"; break;
+    case '\t': e = "\\t"; break;
+    case '\a': e = (escape == AF_ESCAPE_C) ? "\\a" : NULL; break;
+    case '\v': e = (escape == AF_ESCAPE_C) ? "\\v" : NULL; break;
+    }
+    if(e)
+      r += e;
+    else if(c < 0x20 || (c == 0x7F && escape == AF_ESCAPE_C)) {
+      char seq[8];
+      snprintf(seq, sizeof seq, (escape == AF_ESCAPE_JSON) ? "\\u%04x" :
+               "\\%03o", c);
+      r += seq;
+    }
+    else
+      r += (char)c;
+  }
+
+  return r;
+}
+
+/* append s with each escape flag by each of the functions that accept them,
+   and compare to escape_string */
+static bool check_escape(const string &s)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  for(int escape : { AF_ESCAPE_JSON, AF_ESCAPE_C }) {
+    string e = escape_string(s, escape);
+    string expected = "foo; [" + e + "]";
+    int width = (int)e.size() + 3;
+    string padded = string(3, ' ') + e + "|" + e + string(3, ' ');
+    int precision = (int)s.size() / 2;
+    string truncated = escape_string(s.substr(0, (size_t)precision), escape);
+    af_program *prog = af_compile("[%s]");
+    ASSERT_BREAK(prog, "");
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_format(&buf, "%s", "foo") == 3, "");
+    ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, escape, "; ", "[%s]",
+                                                s.c_str()) ==
+                 (int)expected.size(), "");
+    ASSERT_BREAK(buf.str == expected, buf.str);
+    ASSERT_BREAK(af_buf_append_flags_sep_format(NULL, escape, NULL, "%s",
+                                                s.c_str()) ==
+                 (int)e.size(), "");
+    buf.len = 0;
+    ASSERT_BREAK(af_buf_append_flags_sep_format_ex(&buf, escape, NULL,
+                                                   "%*s|%-*s", width,
+                                                   s.c_str(), width,
+                                                   s.c_str()) ==
+                 (ptrdiff_t)padded.size(), "");
+    ASSERT_BREAK(buf.str == padded, buf.str);
+    buf.len = 0;
+    ASSERT_BREAK(af_buf_append_compiled(&buf, escape | AF_APPEND_SEP_ALWAYS,
+                                        "; ", prog, s.c_str()) ==
+                 (int)e.size() + 4, "");
+    ASSERT_BREAK(buf.str == "; [" + e + "]", buf.str);
+    af_buf_free(&buf);
+
+    char *str = strdup("foo");
+    ASSERT_BREAK(str, "out of memory");
+    ASSERT_BREAK(append_flags_sep_format(&str, escape, "; ", "[%s]",
+                                         s.c_str()) ==
+                 (int)expected.size(), "");
+    ASSERT_BREAK(str == expected, str);
+    ASSERT_BREAK(append_flags_sep_format_ex(&str, escape, NULL, "%.*s",
+                                            precision, s.c_str()) ==
+                 (ptrdiff_t)(expected.size() + truncated.size()), "");
+    ASSERT_BREAK(str == expected + truncated, str);
+    free(str);
+
+    str = strdup("foo");
+    ASSERT_BREAK(str, "out of memory");
+    ASSERT_BREAK(af_append_compiled(&str, escape, "; ", prog, s.c_str()) ==
+                 (int)expected.size(), "");
+    ASSERT_BREAK(str == expected, str);
+    free(str);
+
+    af_program_free(prog);
+  }
+
+  return ok;
+}
+#endif
+
+/* test the AF_ESCAPE_JSON and AF_ESCAPE_C flags */
+bool test_escape()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+#ifdef AF_NO_FAST_FORMAT
+  /* escaping needs the built-in formatter */
+  ASSERT_BREAK(af_buf_append_flags_sep_format(NULL, AF_ESCAPE_JSON, NULL,
+                                              "%s", "") == -2, "");
+  ASSERT_BREAK(append_flags_sep_format(NULL, AF_ESCAPE_C, NULL, "%s", "") ==
+               -2, "");
+#else
+  {
+    char *str = NULL;
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_ESCAPE_JSON, NULL, "%s",
+                                         "a\"b\\c\n\x1b\x7f\xc3\xa9") ==
+                 18, "");
+    ASSERT_BREAK(!strcmp(str, "a\\\"b\\\\c\\n\\u001b\x7f\xc3\xa9"), str);
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_ESCAPE_C, " ", "%s",
+                                         "a\"b\\c\n\x1b\x7f") == 36, "");
+    ASSERT_BREAK(!strcmp(str, "a\\\"b\\\\c\\n\\u001b\x7f\xc3\xa9 "
+                              "a\\\"b\\\\c\\n\\033\\177"), str);
+    free(str);
+  }
+
+  /* every byte value, and an escaped byte at each position of strings that
+     are scanned 16 bytes at a time */
+  {
+    string all;
+    for(int c = 1; c < 256; ++c)
+      all += (char)c;
+    ok = ok && check_escape(all);
+    ok = ok && check_escape("");
+
+    for(size_t len = 1; len <= 40 && ok; ++len) {
+      for(size_t i = 0; i < len && ok; ++i) {
+        for(char c : { '"', '\\', '\n', '\x01', '\x1f', '\x7f' }) {
+          string s(len, 'x');
+          s[i] = c;
+          ok = ok && check_escape(s);
+        }
+      }
+    }
+  }
+
+  /* %c is escaped too, including a null character */
+  for(int c = 0; c < 256; ++c) {
+    for(int escape : { AF_ESCAPE_JSON, AF_ESCAPE_C }) {
+      string e = escape_string(string(1, (char)c), escape);
+      af_buf buf = AF_BUF_INIT;
+      ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, escape, NULL,
+                                                  "%c%-8c|", c, c) ==
+                   (int)(e.size() + ((e.size() < 8) ? 8 : e.size()) + 1), "");
+      ASSERT_BREAK(string(buf.str, buf.len) ==
+                   e + e + string(e.size() < 8 ? 8 - e.size() : 0, ' ') + "|",
+                   "");
+      af_buf_free(&buf);
+    }
+  }
+
+  /* %ls and %lc are converted to multibyte and escaped like %s and %c, also
+     when they're longer than the stack buffer the conversion uses */
+  for(int escape : { AF_ESCAPE_JSON, AF_ESCAPE_C }) {
+    string narrow = "a\"b\\c\nd\x1b";
+    std::wstring wide(narrow.begin(), narrow.end());
+    string e = escape_string(narrow, escape);
+    string quote = escape_string("\"", escape);
+    string expected = "{" + e + "|" + string(20 - e.size(), ' ') + e + "|" +
+                      escape_string(narrow.substr(0, 3), escape) + "|" +
+                      quote + string(3 - quote.size(), ' ') + "}";
+    string long_narrow;
+    for(int i = 0; i < 100; ++i)
+      long_narrow += narrow;
+    std::wstring long_wide(long_narrow.begin(), long_narrow.end());
+    string long_e = escape_string(long_narrow, escape);
+    af_program *prog = af_compile("[%ls%lc]");
+    ASSERT_BREAK(prog, "");
+
+    char *str = NULL;
+    ASSERT_BREAK(append_flags_sep_format(&str, escape, NULL,
+                                         "{%ls|%20ls|%.3ls|%-3lc}",
+                                         wide.c_str(), wide.c_str(),
+                                         wide.c_str(), (wint_t)L'"') ==
+                 (int)expected.size(), "");
+    ASSERT_BREAK(str == expected, str);
+    free(str);
+
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, escape, NULL, "%ls",
+                                                long_wide.c_str()) ==
+                 (int)long_e.size(), "");
+    ASSERT_BREAK(buf.str == long_e, "");
+    buf.len = 0;
+    ASSERT_BREAK(af_buf_append_compiled(&buf, escape, NULL, prog,
+                                        wide.c_str(), (wint_t)L'\n') ==
+                 (int)(e.size() + 4), "");
+    ASSERT_BREAK(buf.str == "[" + e + escape_string("\n", escape) + "]",
+                 buf.str);
+    buf.len = 0;
+    ASSERT_BREAK(af_buf_append_compiled(&buf, escape, NULL, prog,
+                                        long_wide.c_str(), (wint_t)L'"') ==
+                 (int)(long_e.size() + 4), "");
+    ASSERT_BREAK(buf.str == "[" + long_e + quote + "]", "");
+    af_buf_free(&buf);
+    af_program_free(prog);
+  }
+
+  /* the other conversions aren't escaped */
+  {
+    af_buf buf = AF_BUF_INIT;
+    ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, AF_ESCAPE_C, NULL,
+                                                "\"%d\" %s\n", 5, "\n") ==
+                 7, "");
+    ASSERT_BREAK(!strcmp(buf.str, "\"5\" \\n\n"), buf.str);
+    af_buf_free(&buf);
+  }
+
+  /* the flags can't be combined */
+  {
+    char *str = NULL;
+    af_program *prog = af_compile("%s");
+    ASSERT_BREAK(prog, "");
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_ESCAPE_JSON | AF_ESCAPE_C,
+                                         NULL, "%s", "") == -2, "");
+    ASSERT_BREAK(af_buf_append_flags_sep_format_ex(NULL,
+                                                   AF_ESCAPE_JSON | AF_ESCAPE_C,
+                                                   NULL, "%s", "") ==
+                 AF_ERR_FLAGS, "");
+    ASSERT_BREAK(af_append_compiled(&str, AF_ESCAPE_JSON | AF_ESCAPE_C, NULL,
+                                    prog, "") == -2, "");
+    ASSERT_BREAK(!str, "");
+    af_program_free(prog);
+  }
+
+#ifdef __GLIBC__
+  /* a format the built-in formatter doesn't support can't be escaped */
+  {
+    char *str = strdup("foo");
+    ASSERT_BREAK(str, "out of memory");
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_ESCAPE_JSON, NULL,
+                                         "%2$s %1$s", "a", "b") == -1, "");
+    ASSERT_BREAK(!strcmp(str, "foo"), "");
+    free(str);
+  }
+#endif
+#endif
+
+  /* the functions that don't accept the flags */
+  ASSERT_BREAK(append_flags_sep_writer(NULL, AF_ESCAPE_JSON, NULL, 0, NULL,
+                                       NULL) == -2, "");
+
+  return ok;
+}
+
+#ifndef AF_NO_FAST_FORMAT
+/* return the shortest number of significant digits in %g that converts back
+   to v */
+static int shortest_precision(double v)
+{
+  char s[64];
+
+  for(int p = 1; p < 17; ++p) {
+    snprintf(s, sizeof s, "%.*g", p, v);
+    if(strtod(s, NULL) == v)
+      return p;
+  }
+
+  return 17;
+}
+
+/* return v, finite, formatted by the C library with precision digits and laid
+   out like %g with AF_SHORTEST_FLOAT */
+static string shortest_string(double v, int precision)
+{
+  char s[64];
+  string digits, r;
+
+  snprintf(s, sizeof s, "%.*e", precision - 1, fabs(v));
+  const char *e = strchr(s, 'e');
+  for(const char *p = s; p < e; ++p) {
+    if(*p != '.')
+      digits += *p;
+  }
+  while(digits.size() > 1 && digits.back() == '0')
+    digits.pop_back();
+
+  int exp10 = atoi(e + 1);
+  int len = (int)digits.size();
+
+  if(signbit(v))
+    r = "-";
+
+  if(exp10 < -4 || exp10 >= 17) {
+    snprintf(s, sizeof s, "e%+03d", exp10);
+    r += digits.substr(0, 1) + (len > 1 ? "." + digits.substr(1) : "") + s;
+  }
+  else if(exp10 >= len - 1)
+    r += digits + string((size_t)(exp10 - len + 1), '0');
+  else if(exp10 >= 0)
+    r += digits.substr(0, (size_t)exp10 + 1) + "." +
+         digits.substr((size_t)exp10 + 1);
+  else
+    r += "0." + string((size_t)(-exp10 - 1), '0') + digits;
+
+  return r;
+}
+
+/* format v with %g and AF_SHORTEST_FLOAT and check that it converts back to v
+   with no more digits than %g needs, and that it's the same as the C library's
+   digits if the number of digits is the same */
+static bool check_shortest(double v)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  af_buf buf = AF_BUF_INIT;
+  ASSERT_BREAK(af_buf_append_flags_sep_format(&buf, AF_SHORTEST_FLOAT, NULL,
+                                              "%g", v) > 0, "");
+  string str = buf.str;
+  const char *dest = str.c_str();
+  af_buf_free(&buf);
+  ASSERT_BREAK(strtod(dest, NULL) == v || (v != v && strstr(dest, "nan")),
+               dest);
+
+  if(v == v && !isinf(v)) {
+    int precision = shortest_precision(v);
+    int len = 0;
+    for(const char *p = dest; *p && *p != 'e'; ++p) {
+      if('0' <= *p && *p <= '9' && (len || *p != '0'))
+        ++len;
+    }
+    /* the zeros of an integer aren't significant */
+    if(!strchr(dest, '.') && !strchr(dest, 'e')) {
+      for(const char *p = dest + strlen(dest) - 1; len > 1 && *p == '0'; --p)
+        --len;
+    }
+    if(v == 0)
+      len = 1;
+    ASSERT_BREAK(len <= precision,
+                 std::setprecision(17) << v << " " << dest);
+    if(len == precision)
+      ASSERT_BREAK(dest == shortest_string(v, precision),
+                   "expected: " << shortest_string(v, precision) <<
+                   "\nactual: " << dest);
+  }
+
+  return ok;
+}
+
+/* format v with %f and each precision AF_SHORTEST_FLOAT formats exactly, and
+   compare to the C library */
+static bool check_fixed(double v)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  for(int precision = 0; precision <= 18; ++precision) {
+    char expected[512];
+    char *str = NULL;
+    int len = snprintf(expected, sizeof expected, "%.*f", precision, v);
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_SHORTEST_FLOAT, NULL,
+                                         "%.*f", precision, v) == len, "");
+    ASSERT_BREAK(!strcmp(str, expected),
+                 "expected: " << expected << "\nactual: " << str);
+    free(str);
+  }
+
+  return ok;
+}
+#endif
+
+/* test the AF_SHORTEST_FLOAT flag */
+bool test_shortest_float()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+#ifdef AF_NO_FAST_FORMAT
+  /* the flag needs the built-in formatter */
+  ASSERT_BREAK(append_flags_sep_format(NULL, AF_SHORTEST_FLOAT, NULL, "%g",
+                                       0.1) == -2, "");
+#else
+  static const struct {
+    const char *format;
+    double v;
+    const char *expected;
+  } tests[] = {
+    { "%g", 0.1, "0.1" },
+    { "%g", 0.3, "0.3" },
+    { "%g", 0.1 + 0.2, "0.30000000000000004" },
+    { "%g", 1.0 / 3, "0.3333333333333333" },
+    { "%g", 100, "100" },
+    { "%g", 1e6, "1000000" },
+    { "%g", 123456.789, "123456.789" },
+    { "%g", 1e16, "10000000000000000" },
+    { "%g", 1e17, "1e+17" },
+    { "%G", 1.5e300, "1.5E+300" },
+    { "%g", 0.0001, "0.0001" },
+    { "%g", 1.5e-5, "1.5e-05" },
+    { "%g", 5e-324, "5e-324" },
+    { "%g", 2.2250738585072014e-308, "2.2250738585072014e-308" },
+    { "%g", 1.7976931348623157e308, "1.7976931348623157e+308" },
+    { "%g", 9007199254740993.0, "9007199254740992" },
+    { "%g", 0.0, "0" },
+    { "%g", -0.0, "-0" },
+    { "%g", -2.5, "-2.5" },
+    { "%g", INFINITY, "inf" },
+    { "%G", -INFINITY, "-INF" },
+    { "%g", NAN, "nan" },
+    { "[%8g]", 0.5, "[     0.5]" },
+    { "[%-8g]", 0.5, "[0.5     ]" },
+    { "[%+g]", 0.5, "[+0.5]" },
+    { "[% g]", 0.5, "[ 0.5]" },
+    { "[%08g]", -0.5, "[-00000.5]" },
+    { "[%08g]", INFINITY, "[     inf]" },
+    { "[%-+6g]", INFINITY, "[+inf  ]" },
+    /* %g with a precision or '#' is formatted by the C library */
+    { "%.3g", 0.1, "0.1" },
+    { "%#g", 0.1, "0.100000" },
+    { "%.17g", 0.1, "0.10000000000000001" },
+    { "%f", 0.1, "0.100000" },
+    { "%.0f", 0.5, "0" },
+    { "%.0f", 1.5, "2" },
+    { "%.0f", 2.5, "2" },
+    { "%.2f", 0.125, "0.12" },
+    { "%.2f", 0.375, "0.38" },
+    { "%.1f", 0.05, "0.1" },
+    { "%.17f", 0.1, "0.10000000000000001" },
+    { "%.3f", -0.0, "-0.000" },
+    { "%.3f", -0.0001, "-0.000" },
+    { "%#.0f", 3.0, "3." },
+    { "[%+10.2f]", 3.14159, "[     +3.14]" },
+    { "[%-10.2f]", 3.14159, "[3.14      ]" },
+    { "[%010.2f]", -3.14159, "[-000003.14]" },
+    { "[% .1f]", 3.14159, "[ 3.1]" },
+    { "%.0f", 18446744073709549568.0, "18446744073709549568" },
+    { "%.2f", 1e300, "100000000000000005250476025520442024870446858110815915491"
+                     "585411551180245798890819578637137508044786404370444383288"
+                     "387817694252323536043057564479218478670698284838720092657"
+                     "580373783023379478809005936895323497079994508111903896764"
+                     "088007465274278014249457925878882005684283811566947219638"
+                     "6865459400540160.00" },
+    { "%.20f", 0.5, "0.50000000000000000000" },
+    { "%F", -INFINITY, "-INF" },
+    { "%f", NAN, "nan" },
+    /* the other floating point conversions are formatted by the C library */
+    { "%e", 0.1, "1.000000e-01" },
+    { "%.1a", 1.0, "0x1.0p+0" },
+  };
+
+  for(size_t i = 0; i < sizeof tests / sizeof tests[0]; ++i) {
+    char *str = NULL;
+    int len = (int)strlen(tests[i].expected);
+    ASSERT_BREAK(append_flags_sep_format(&str, AF_SHORTEST_FLOAT, NULL,
+                                         tests[i].format, tests[i].v) == len,
+                 tests[i].format);
+    ASSERT_BREAK(!strcmp(str, tests[i].expected),
+                 "format: " << tests[i].format << "\nexpected: " <<
+                 tests[i].expected << "\nactual: " << str);
+    free(str);
+  }
+
+  /* the powers of 2 and 10 and their neighbors, and random bit patterns */
+  for(int e = -1074; e <= 1023 && ok; ++e) {
+    double v = ldexp(1, e);
+    ok = ok && check_shortest(v) && check_shortest(nextafter(v, 0)) &&
+         check_shortest(nextafter(v, INFINITY));
+  }
+  for(int e = -323; e <= 308 && ok; ++e) {
+    double v = strtod(("1e" + std::to_string(e)).c_str(), NULL);
+    ok = ok && check_shortest(v) && check_shortest(-v) &&
+         check_shortest(nextafter(v, 0)) &&
+         check_shortest(nextafter(v, INFINITY));
+  }
+  {
+    uint64_t x = UINT64_C(0x9E3779B97F4A7C15);
+    for(int i = 0; i < 20000 && ok; ++i) {
+      double v;
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      memcpy(&v, &x, sizeof v);
+      ok = ok && check_shortest(v);
+      if(i % 10 == 0) {
+        /* the exponents that %f formats exactly */
+        uint64_t bits = (x & UINT64_C(0x800FFFFFFFFFFFFF)) |
+                        ((UINT64_C(1023) - 80 + (x >> 56) % 160) << 52);
+        memcpy(&v, &bits, sizeof v);
+        ok = ok && check_fixed(v);
+      }
+    }
+  }
+
+  /* the flag is accepted with the escape flags and by compiled formats */
+  {
+    af_buf buf = AF_BUF_INIT;
+    af_program *prog = af_compile("[%s=%g]");
+    ASSERT_BREAK(prog, "");
+    ASSERT_BREAK(af_buf_append_compiled(&buf,
+                                        AF_SHORTEST_FLOAT | AF_ESCAPE_JSON,
+                                        NULL, prog, "\"x\"", 0.1) == 11, "");
+    ASSERT_BREAK(!strcmp(buf.str, "[\\\"x\\\"=0.1]"), buf.str);
+    ASSERT_BREAK(af_buf_append_flags_sep_format_ex(&buf, AF_SHORTEST_FLOAT,
+                                                   "; ", "%g", 1e100) ==
+                 19, "");
+    ASSERT_BREAK(!strcmp(buf.str, "[\\\"x\\\"=0.1]; 1e+100"), buf.str);
+    af_buf_free(&buf);
+    af_program_free(prog);
+  }
+#endif
+
+  /* the functions that don't accept the flag */
+  ASSERT_BREAK(append_flags_sep_writer(NULL, AF_SHORTEST_FLOAT, NULL, 0, NULL,
+                                       NULL) == -2, "");
+
+  return ok;
+}
+
+#ifdef HAVE_APPEND_FORMAT_HPP
+/* compare the outcome of af::append_flags_sep<Format> to the outcome of
+   append_flags_sep_format with the same format and args, for each combination
+   of flags and for both char ** and af_buf strings */
+template<af::fixed_string Format, typename... Args>
+bool check_cpp_format(const char *format, const Args &...args)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  const char *initial[] = { NULL, "", "foo", "foo\r\n" };
+
+  for(int flags = 0; flags <= AF_ALL_FLAGS; ++flags) {
+    for(size_t i = 0; i < sizeof(initial) / sizeof(initial[0]); ++i) {
+      char *expected = initial[i] ? strdup(initial[i]) : NULL;
+      char *str = initial[i] ? strdup(initial[i]) : NULL;
+      af_buf buf = AF_BUF_INIT;
+      if(initial[i])
+        ASSERT_BREAK(af_buf_append_format(&buf, "%s", initial[i]) >= 0, "");
+
+      int ret = append_flags_sep_format(&expected, flags, "; ", format,
+                                        args...);
+      ASSERT_BREAK(ret >= 0, "append_flags_sep_format failed: " << format);
+      ASSERT_BREAK(ret == af::append_flags_sep<Format>(&str, flags, "; ",
+                                                       args...),
+                   "return value differs: " << format);
+      ASSERT_BREAK(!strcmp(str, expected),
+                   "format: " << format << "\nexpected: " << expected <<
+                   "\nactual: " << str);
+      ASSERT_BREAK(ret == af::append_flags_sep<Format>(&buf, flags, "; ",
+                                                       args...),
+                   "return value differs: " << format);
+      ASSERT_BREAK(!strcmp(buf.str, expected),
+                   "format: " << format << "\nexpected: " << expected <<
+                   "\nactual: " << buf.str);
+
+      free(expected);
+      free(str);
+      af_buf_free(&buf);
+    }
+  }
+
+  return ok;
+}
+
+#define CHECK_CPP_FORMAT(format, ...) \
+  check_cpp_format<format>(format, __VA_ARGS__)
+
+/* test the C++ layer in append_format.hpp */
+bool test_cpp_format()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  ok = ok && CHECK_CPP_FORMAT("%s=%d", "key", -42);
+  ok = ok && CHECK_CPP_FORMAT("%d|%i|%u|%o|%x|%X", INT_MIN, INT_MAX,
+                              UINT_MAX, 8u, 255u, 0xABCu);
+  ok = ok && CHECK_CPP_FORMAT("%hhd|%hd|%ld|%lld|%jd|%zd|%td", (char)-1,
+                              (short)-2, LONG_MIN, LLONG_MIN, INTMAX_MAX,
+                              (ptrdiff_t)-5, (ptrdiff_t)6);
+  ok = ok && CHECK_CPP_FORMAT("%hhu|%hu|%lu|%llu|%ju|%zu|%llx", 300,
+                              70000, ULONG_MAX, ULLONG_MAX, UINTMAX_MAX,
+                              (size_t)7, 0ull);
+  ok = ok && CHECK_CPP_FORMAT("[%c][%5c][%-5c]", 'a', 'b', 'c');
+  ok = ok && CHECK_CPP_FORMAT("[%s][%8s][%-8s][%.2s][%8.2s][%-8.2s]",
+                              "abc", "abc", "abc", "abc", "abc", "abc");
+  ok = ok && CHECK_CPP_FORMAT("[%*s][%-*s][%.*s][%*.*s]", 6, "ab", 6, "ab",
+                              1, "ab", -6, -1, "ab");
+  ok = ok && CHECK_CPP_FORMAT("[%+d][% d][%05d][%-5d][%.3d][%#x][%#o]", 1, 2,
+                              -3, 4, 5, 6u, 7u);
+  ok = ok && CHECK_CPP_FORMAT("[%*d][%-*.*d]", -8, 1, 8, 4, 2);
+  ok = ok && CHECK_CPP_FORMAT("%f %e %g %a %E %G", 1.5, -2.25e10, 1e-5, 0.1,
+                              1e300, 1e-300);
+  ok = ok && CHECK_CPP_FORMAT("%.3f|%10.2e|%-12g|%+g|% .0f|%*.*f", 3.14159,
+                              2.5, 0.0, 1.0, 2.5, 12, 3, -1e300);
+  ok = ok && CHECK_CPP_FORMAT("%f|%Lf|%Lg", -1.7976931348623157e308,
+                              (long double)1.25, (long double)1e30);
+  ok = ok && CHECK_CPP_FORMAT("%p %p", (void *)&ok, (void *)NULL);
+  /* a null pointer for %s is written by the C library, like (null) */
+  const char *null_str = NULL;
+  ok = ok && CHECK_CPP_FORMAT("[%s][%.3s][%10s][%-8.7s][%*.*s]", null_str,
+                              null_str, null_str, null_str, 9, 2, null_str);
+  ok = ok && CHECK_CPP_FORMAT("100%% of %s is %d (0x%08X) or %.2f%%", "foo",
+                              123, 123u, 100.0);
+  ok = ok && CHECK_CPP_FORMAT("\r\n%s\r\n", "");
+  ok = ok && CHECK_CPP_FORMAT("%s", "");
+
+  std::string long_arg(1000, 'x');
+  ok = ok && CHECK_CPP_FORMAT("%s|%s", long_arg.c_str(),
+                              long_arg.c_str() + 500);
+  ok = ok && CHECK_CPP_FORMAT("%1000d|%.1000u|%-1000c", 1, 2u, 'x');
+
+  /* a precision limits how much of a string is read */
+  char unterminated[3] = { 'a', 'b', 'c' };
+  ok = ok && CHECK_CPP_FORMAT("%.3s", unterminated);
+
+  /* std::string and std::string_view are accepted for %s */
+  {
+    char *str = NULL;
+    std::string key = "key";
+    std::string_view value = "value";
+    ASSERT_BREAK(af::append_sep<"%s=%.3s">(&str, "; ", key, value) == 7, "");
+    ASSERT_BREAK(af::append_sep<"%-4s=%s">(&str, "; ", key, value) == 19,
+                 "");
+    ASSERT_BREAK(!strcmp(str, "key=val; key =value"), "");
+    ASSERT_BREAK(af::append_rmCRLFs<"%s\r\n">(&str, std::string("!")) ==
+                 20, "");
+    ASSERT_BREAK(!strcmp(str, "key=val; key =value!"), "");
+    ASSERT_BREAK(af::append<"">(&str) == 20, "");
+    ASSERT_BREAK(af::append_flags_sep<"%d">(&str, 0x80000000, NULL, 1) == -2,
+                 "");
+    /* the flags of the built-in formatter aren't supported */
+    for(int flag : { AF_ESCAPE_JSON, AF_ESCAPE_C, AF_SHORTEST_FLOAT })
+      ASSERT_BREAK(af::append_flags_sep<"%s">(&str, flag, NULL, "x") == -2,
+                   "");
+    ASSERT_BREAK(!strcmp(str, "key=val; key =value!"), "");
+    free(str);
+  }
+
+  return ok;
+}
+
+/* append to each C++ string type and check that the outcome is the same as
+   appending to a char * string */
+template<typename... Args>
+bool check_cpp_containers(const char *initial, int flags, const char *sep,
+                          const char *format, Args... args)
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  char *expected = initial ? strdup(initial) : NULL;
+  ASSERT_BREAK(!initial || expected, "out of memory");
+  int expected_retcode = append_flags_sep_format(&expected, flags, sep, format,
+                                                 args...);
+  std::string expected_str = expected ? expected : "";
+  free(expected);
+
+  std::string str = initial ? initial : "";
+  ASSERT_BREAK(append_flags_sep_format(&str, flags, sep, format, args...) ==
+               expected_retcode, "");
+  ASSERT_BREAK(str == expected_str, "");
+  ASSERT_BREAK(strlen(str.c_str()) == str.size(), "");
+
+  char pool[4096];
+  std::pmr::monotonic_buffer_resource resource(pool, sizeof pool);
+  std::pmr::string pmr_str(initial ? initial : "", &resource);
+  ASSERT_BREAK(append_flags_sep_format(&pmr_str, flags, sep, format,
+                                       args...) == expected_retcode, "");
+  ASSERT_BREAK(std::string_view(pmr_str) == expected_str, "");
+
+  std::vector<char> vec;
+  if(initial)
+    vec.assign(initial, initial + strlen(initial));
+  ASSERT_BREAK(append_flags_sep_format(&vec, flags, sep, format, args...) ==
+               expected_retcode, "");
+  ASSERT_BREAK(std::string(vec.begin(), vec.end()) == expected_str, "");
+
+  /* an inline buffer that's too small for some of the strings */
+  af::small_string<16> small(initial ? initial : "");
+  ASSERT_BREAK(append_flags_sep_format(&small, flags, sep, format, args...) ==
+               expected_retcode, "");
+  ASSERT_BREAK(small.view() == expected_str, "");
+  ASSERT_BREAK(small.is_inline() == (small.size() < 16), "");
+
+  /* the measure is the same as for a char * string */
+  ASSERT_BREAK(append_flags_sep_format((std::string *)NULL, flags, sep, format,
+                                       args...) ==
+               append_flags_sep_format((char **)NULL, flags, sep, format,
+                                       args...), "");
+
+  return ok;
+}
+
+/* test the C++ string types accepted by append_format.hpp */
+bool test_cpp_containers()
+{
+  /* this function's return value. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  static const char *const initials[] = {
+    NULL, "", "foo", "foo\r\n", "0123456789abcdef0123456789abcdef"
+  };
+
+  for(const char *initial : initials) {
+    for(int flags = 0; flags <= AF_ALL_FLAGS; ++flags) {
+      ok = ok && check_cpp_containers(initial, flags, "; ", "%s=%d", "key",
+                                      -42);
+      ok = ok && check_cpp_containers(initial, flags, "; ", "\r\n%s\n",
+                                      "bar");
+      ok = ok && check_cpp_containers(initial, flags, NULL, "%s", "");
+      ok = ok && check_cpp_containers(initial, flags, ", ", "%.3f %500d",
+                                      3.14159, 1);
+    }
+  }
+
+  /* the compile-time formats */
+  {
+    std::string str = "key=1";
+    ASSERT_BREAK(af::append_sep<"%s=%d">(&str, "; ", "key", 2) == 12, "");
+    ASSERT_BREAK(af::append_rmCRLFs<"%s\r\n">(&str, std::string("!")) == 13,
+                 "");
+    ASSERT_BREAK(str == "key=1; key=2!", "");
+
+    std::vector<char> vec;
+    ASSERT_BREAK(af::append_sep<"%d">(&vec, "; ", 1) == 1, "");
+    ASSERT_BREAK(af::append_sep<"%d">(&vec, "; ", 2) == 4, "");
+    ASSERT_BREAK(std::string(vec.begin(), vec.end()) == "1; 2", "");
+
+    af::small_string<8> small;
+    ASSERT_BREAK(af::append_sep<"%s">(&small, "; ", "abc") == 3, "");
+    ASSERT_BREAK(small.is_inline(), "");
+    ASSERT_BREAK(af::append_sep<"%s">(&small, "; ", "defgh") == 10, "");
+    ASSERT_BREAK(!small.is_inline(), "");
+    ASSERT_BREAK(!strcmp(small.c_str(), "abc; defgh"), "");
+    ASSERT_BREAK(af::append<"%d">((af::small_string<8> *)NULL, 123) == 3, "");
+  }
+
+  /* the spare capacity of a container is formatted into directly */
+  {
+    af_stats stats;
+    bool have_stats = !af_stats_snapshot(&stats, 1);
+    std::string str = "foo";
+    str.reserve(4096);
+    const char *data = str.data();
+    std::vector<char> vec(str.begin(), str.end());
+    vec.reserve(4096);
+    ASSERT_BREAK(append_flags_sep_format(&str, 0, "; ", "%600d", 1) == 605,
+                 "");
+    ASSERT_BREAK(append_flags_sep_format(&vec, 0, "; ", "%600d", 1) == 605,
+                 "");
+    ASSERT_BREAK(af::append_sep<"%f">(&str, "; ", 1.5) == 615, "");
+    ASSERT_BREAK(str.data() == data && str.capacity() >= 4096, "");
+    ASSERT_BREAK(str == "foo; " + string(599, ' ') + "1; 1.500000", "");
+    ASSERT_BREAK(std::string(vec.begin(), vec.end()) ==
+                 "foo; " + string(599, ' ') + "1", "");
+    if(have_stats) {
+      ASSERT_BREAK(!af_stats_snapshot(&stats, 1), "");
+      ASSERT_BREAK(stats.calls == 3 && !stats.double_formats &&
+                   !stats.reallocs, "");
+    }
+  }
+
+  /* unrecognized flags leave the string unchanged */
+  {
+    std::string str = "foo";
+    std::vector<char> vec(str.begin(), str.end());
+    ASSERT_BREAK(append_flags_sep_format(&str, 0x80000000, NULL, "%d", 1) ==
+                 -2, "");
+    ASSERT_BREAK(af::append_flags_sep<"%d">(&str, AF_EXACT_FIT, NULL, 1) ==
+                 -2, "");
+    ASSERT_BREAK(append_flags_sep_format(&vec, AF_USE_USABLE_SIZE, NULL, "%d",
+                                         1) == -2, "");
+    ASSERT_BREAK(str == "foo" && vec.size() == 3, "");
+  }
+
+#ifndef AF_NO_FAST_FORMAT
+  /* the escape flags are accepted */
+  {
+    std::vector<char> vec;
+    ASSERT_BREAK(append_flags_sep_format(&vec, AF_ESCAPE_JSON, NULL, "%s",
+                                         "\"\n") == 4, "");
+    ASSERT_BREAK(std::string(vec.begin(), vec.end()) == "\\\"\\n", "");
+  }
+#endif
+
+  /* a small_string moves its allocation and copies only an inline string */
+  {
+    af::small_string<8> a, b("abc");
+    ASSERT_BREAK(append_sep_format(&a, "; ", "%s", "0123456789") == 10, "");
+    const char *heap = a.c_str();
+    af::small_string<8> c(std::move(a));
+    ASSERT_BREAK(c.c_str() == heap && a.empty() && a.is_inline(), "");
+    ASSERT_BREAK(!strcmp(a.c_str(), ""), "");
+    a = std::move(b);
+    ASSERT_BREAK(a.is_inline() && a.view() == "abc" && b.empty(), "");
+    b = c;
+    ASSERT_BREAK(b.view() == c.view() && b.c_str() != c.c_str(), "");
+    a = b;
+    ASSERT_BREAK(a.view() == "0123456789", "");
+    a.clear();
+    ASSERT_BREAK(a.empty() && a.capacity() >= 10, "");
+    ASSERT_BREAK(append_format(&a, "%d", 42) == 2, "");
+    ASSERT_BREAK(!af_buf_shrink_to_fit(a.buf()) && a.is_inline(), "");
+    ASSERT_BREAK(a.view() == "42", "");
+  }
+
+  return ok;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  /* set crtdbg options before anything else */
+#ifdef _CRTDBG_MAP_ALLOC
+  _CrtSetReportMode(_CRT_ERROR, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
+  _CrtSetReportFile(_CRT_ERROR, _CRTDBG_FILE_STDERR);
+  _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
+  _CrtSetReportFile(_CRT_WARN, _CRTDBG_FILE_STDERR);
+  // For now use the default _CRT_ASSERT to get the message box to select debug
+  // https://msdn.microsoft.com/en-us/library/ezb1wyez.aspx
+  //_CrtSetReportMode(_CRT_ASSERT, _CRTDBG_MODE_DEBUG | _CRTDBG_MODE_FILE);
+  //_CrtSetReportFile(_CRT_ASSERT, _CRTDBG_FILE_STDERR);
+  _CrtSetDbgFlag(
+    _CRTDBG_ALLOC_MEM_DF |       /* Enable debug heap allocations */
+    _CRTDBG_DELAY_FREE_MEM_DF);  /* This flag keeps track of freed memory, but
+                                    as a result the heap keeps growing. Since
+                                    our tests are not memory intensive this is
+                                    fine for now. */
+#endif // _CRTDBG_MAP_ALLOC
+
+  /* If this is NULL then all tests are run */
+  const char *specific_test = NULL;
+
+  /* The number of threads the permutation tests are sharded across, 0 for one
+     per CPU */
+  unsigned nthreads = 1;
+
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      nthreads = (unsigned)strtoul(argv[++i], NULL, 10);
+      if(!nthreads)
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    else
+      specific_test = argv[i];
+  }
+
+  /* EXIT_SUCCESS when true. set false by ASSERT_BREAK. */
+  bool ok = true;
+
+  /* Tests set these NULL or empty when necessary. All content must be != NULL.
+     Also: None except 'some_trailing_crlfs' should have trailing cr or lf
+           because the tests will add that when necessary.
+     Also: The expected outcome should be less than 1024 since a fixed-size
+           buffer is used for testing.
+   */
+  struct test_content content;
+
+  memset(&content, 0, sizeof content);
+  content.string = "foo";
+  content.sep = "; ";
+  content.format_no_arg = "bar";
+  content.format_with_arg = "_%s_";         /* must contain only one % of %s */
+  content.arg = "qux";
+  content.some_trailing_crlfs = "\r\n\r";   /* must contain 1+ of \r and/or \n
+                                               in any order */
+  ok = ok && runtests_parallel(&content, specific_test, nthreads);
+
+  /* an argument longer than the scratch buffer used for the first formatting
+     pass, so that the data has to be formatted again */
+  std::string long_arg(300, 'x');
+  content.arg = long_arg.c_str();
+  ok = ok && runtests_parallel(&content, specific_test, nthreads);
+
+  if(!specific_test)
+    ok = ok && test_trailing_crlf();
+
+  if(!specific_test)
+    ok = ok && test_growth();
+
+  if(!specific_test)
+    ok = ok && test_format_failure();
+
+  if(!specific_test)
+    ok = ok && test_allocators();
+
+  if(!specific_test)
+    ok = ok && test_batch();
+
+  if(!specific_test)
+    ok = ok && test_shared();
+
+  if(!specific_test)
+    ok = ok && test_thread_buf();
+
+  if(!specific_test)
+    ok = ok && test_rope();
+
+  if(!specific_test)
+    ok = ok && test_sink();
+
+  if(!specific_test)
+    ok = ok && test_iov();
+
+  if(!specific_test)
+    ok = ok && test_ex();
+
+  if(!specific_test)
+    ok = ok && test_mmap();
+
+  if(!specific_test)
+    ok = ok && test_stats();
+
+  if(!specific_test)
+    ok = ok && test_reserve();
+
+  if(!specific_test)
+    ok = ok && test_usable_size();
+
+  if(!specific_test)
+    ok = ok && test_defer();
+
+  if(!specific_test)
+    ok = ok && test_formatter();
+
+  if(!specific_test)
+    ok = ok && test_compiled();
+
+  if(!specific_test)
+    ok = ok && test_escape();
+
+  if(!specific_test)
+    ok = ok && test_shortest_float();
+
+#ifdef HAVE_APPEND_FORMAT_HPP
+  if(!specific_test)
+    ok = ok && test_cpp_format();
+
+  if(!specific_test)
+    ok = ok && test_cpp_containers();
+#endif
 
 #ifdef _CRTDBG_MAP_ALLOC
   ASSERT_BREAK(_CrtCheckMemory(), "heap corruption");